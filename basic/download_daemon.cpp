@@ -0,0 +1,311 @@
+/** @file download_daemon.cpp
+ *
+ * @author marco corvi
+ * @date oct 2026
+ *
+ * @brief download the data from many DistoX at once
+ *
+ * One process drives a Protocol per device from a single epoll loop:
+ * the packets are acknowledged as they arrive and the shots of each
+ * device are written to its own data and calib files, in the format of
+ * dump_data. A device is done when it has been silent for the idle time.
+ * --------------------------------------------------------
+ *  Copyright This sowftare is distributed under GPL-3.0 or later
+ *  See the file COPYING.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <signal.h>
+
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#include "defaults.h"
+#include "Protocol.h"
+#include "ShotBatch.h"
+
+#define MAX_DEVICES   64
+#define MAX_EVENTS    MAX_DEVICES
+#define DEFAULT_IDLE  10 /* seconds */
+
+static volatile sig_atomic_t running = 1;
+
+static void
+on_signal( int )
+{
+  running = 0;
+}
+
+/** a device being downloaded
+ */
+struct Device
+{
+  const char * name;
+  Protocol * proto;
+  FILE * fpd;                //!< data file
+  FILE * fpc;                //!< calib file
+  bool open;
+  unsigned long n_packet;    //!< packets received
+  unsigned long n_data;      //!< shots written
+  unsigned long n_calib;     //!< calib G-M pairs written
+  unsigned long n_error;     //!< read errors
+  unsigned long long t_start;
+  unsigned long long t_last; //!< time of the last packet
+};
+
+void usage()
+{
+  static bool usaged = false;
+  if ( usaged ) return;
+  usaged = true;
+  fprintf(stderr, "Usage: tlx_download_daemon [options] device ...\n");
+  fprintf(stderr, "  download the data from many DistoX at once\n");
+  fprintf(stderr, "  the data of device /dev/XXX go to <dir>/XXX.data and <dir>/XXX.calib\n");
+  fprintf(stderr, "  (unix:/path/XXX as /dev/XXX, tcp:host:port as host_port)\n");
+  fprintf(stderr, "Options:\n");
+  fprintf(stderr, "  -o dir      output directory [default .]\n");
+  fprintf(stderr, "  -x          DistoX2 (data and vector packets)\n");
+  fprintf(stderr, "  -t sec      idle time after which a device is done [default %d]\n", DEFAULT_IDLE );
+  fprintf(stderr, "  -i sec      print the counters every sec seconds [default 0: at the end]\n");
+  fprintf(stderr, "  -s file     write the counters to file as well\n");
+  fprintf(stderr, "  -v          verbose\n");
+  fprintf(stderr, "  -h          this help\n");
+}
+
+/** print the counters of the devices
+ * @param fp    output file
+ * @param dev   devices
+ * @param n     number of devices
+ * @param now   current time [usec]
+ */
+void
+print_counters( FILE * fp, Device * dev, int n, unsigned long long now )
+{
+  for ( int k=0; k<n; ++k ) {
+    Device & d = dev[k];
+    unsigned long long t = ( d.open ? now : d.t_last ) - d.t_start;
+    double rate = ( t > 0 )? d.n_packet * 1.0e6 / t : 0.0;
+    fprintf(fp, "%s %s packets %lu data %lu calib %lu errors %lu skipped %u duplicates %u orphans %u overflows %u rate %.1f/s\n",
+            d.name, d.open ? "open" : "done",
+            d.n_packet, d.n_data, d.n_calib, d.n_error, d.proto->Skipped(),
+            d.proto->Duplicates(), d.proto->Orphans(), d.proto->Overflows(), rate );
+  }
+  fflush( fp );
+}
+
+/** write the complete shots on the device queues to its files
+ * @param d     device
+ * @param x2    whether the device is a DistoX2
+ */
+void
+write_shots( Device & d, bool x2 )
+{
+  static ShotBatch batch;
+  unsigned char pkts[ 2*SHOT_BATCH_SIZE ][8];
+  unsigned char b1[8], b2[8];
+  for ( ; ; ) { // the packets are gathered and decoded a batch at a time
+    unsigned int n = 0;
+    if ( x2 ) {
+      while ( n < SHOT_BATCH_SIZE && d.proto->DataSize() >= 2 && d.proto->NextData( pkts[2*n], pkts[2*n+1] ) ) ++ n;
+      if ( n == 0 ) break;
+      batch.Clear();
+      decodeBatch( pkts, n, batch );
+    } else {
+      while ( n < SHOT_BATCH_SIZE && d.proto->DataSize() > 0 ) {
+        if ( d.proto->NextData( pkts[n] ) ) ++ n; // skip non-data packets
+      }
+      if ( n == 0 ) break;
+      batch.Clear();
+      decodeBatchX1( pkts, n, batch );
+    }
+    for ( unsigned int k = 0; k < batch.size; ++k ) {
+      fprintf(d.fpd, x2 ? "0x%05x 0x%04x 0x%04x 0x%04x " : "0x%05x 0x%04x 0x%04x 0x%02x ",
+              batch.raw_distance[k], batch.raw_azimuth[k], batch.raw_clino[k], batch.raw_roll[k] );
+      fprintf(d.fpd, "%.2f %.2f %.2f %.2f \n", batch.distance[k], batch.azimuth[k], batch.clino[k], batch.roll[k] );
+    }
+    d.n_data += batch.size;
+  }
+  while ( d.proto->CalibSize() >= 2 && d.proto->NextCalib( b1, b2 ) ) {
+    // group -1, ignore 0
+    fprintf(d.fpc, "0x%04x 0x%04x 0x%04x 0x%04x 0x%04x 0x%04x -1 0\n",
+            (uint16_t)CALIB_2_X( b1 ), (uint16_t)CALIB_2_Y( b1 ), (uint16_t)CALIB_2_Z( b1 ),
+            (uint16_t)CALIB_2_X( b2 ), (uint16_t)CALIB_2_Y( b2 ), (uint16_t)CALIB_2_Z( b2 ) );
+    ++ d.n_calib;
+  }
+}
+
+/** close a device
+ * @param ep    epoll file descriptor
+ * @param d     device
+ * @param x2    whether the device is a DistoX2
+ */
+void
+close_device( int ep, Device & d, bool x2 )
+{
+  if ( ! d.open ) return;
+  write_shots( d, x2 );
+  epoll_ctl( ep, EPOLL_CTL_DEL, d.proto->Fd(), NULL );
+  d.proto->Close();
+  fclose( d.fpd );
+  fclose( d.fpc );
+  d.open = false;
+}
+
+int main( int argc, char ** argv )
+{
+  const char * dir = ".";
+  const char * status_file = NULL;
+  bool x2 = false;
+  bool verbose = false;
+  unsigned long idle = DEFAULT_IDLE;
+  unsigned long interval = 0;
+
+  int ac = 1;
+  while ( ac < argc && argv[ac][0] == '-' ) {
+    switch ( argv[ac][1] ) {
+      case 'o': dir = argv[++ac]; break;
+      case 'x': x2 = true; break;
+      case 't': idle = atol( argv[++ac] ); break;
+      case 'i': interval = atol( argv[++ac] ); break;
+      case 's': status_file = argv[++ac]; break;
+      case 'v': verbose = true; break;
+      case 'h':
+      default:
+        usage();
+        return 0;
+    }
+    ++ac;
+  }
+  int n_dev = argc - ac;
+  if ( n_dev <= 0 ) {
+    usage();
+    return 0;
+  }
+  if ( n_dev > MAX_DEVICES ) {
+    fprintf(stderr, "ERROR: at most %d devices\n", MAX_DEVICES );
+    return 1;
+  }
+
+  int ep = epoll_create1( 0 );
+  if ( ep < 0 ) {
+    fprintf(stderr, "ERROR: epoll: %s\n", strerror( errno ) );
+    return 1;
+  }
+
+  Device * dev = new Device[ n_dev ];
+  unsigned long long now = Serial::Now();
+  int n_open = 0;
+  for ( int k=0; k<n_dev; ++k ) {
+    Device & d = dev[k];
+    memset( &d, 0, sizeof(Device) );
+    d.name  = argv[ac+k];
+    d.proto = new Protocol( d.name );
+    d.t_start = d.t_last = now;
+    if ( ! d.proto->Open() || d.proto->Fd() < 0 ) {
+      fprintf(stderr, "ERROR: failed to open device %s\n", d.name );
+      continue;
+    }
+    const char * base = strrchr( d.name, '/' );
+    base = ( base != NULL )? base + 1 : d.name;
+    char name[128]; // tcp:host:port becomes host_port
+    if ( strncmp( base, SERIAL_TCP_PREFIX, strlen( SERIAL_TCP_PREFIX ) ) == 0 ) base += strlen( SERIAL_TCP_PREFIX );
+    strncpy( name, base, sizeof(name) - 1 );
+    name[ sizeof(name) - 1 ] = 0;
+    for ( char * ch = name; *ch; ++ch ) if ( *ch == ':' ) *ch = '_';
+    base = name;
+    char filename[512];
+    snprintf( filename, sizeof(filename), "%s/%s.data", dir, base );
+    d.fpd = fopen( filename, "w" );
+    snprintf( filename, sizeof(filename), "%s/%s.calib", dir, base );
+    d.fpc = fopen( filename, "w" );
+    if ( d.fpd == NULL || d.fpc == NULL ) {
+      fprintf(stderr, "ERROR: cannot open the output files of %s in %s\n", d.name, dir );
+      if ( d.fpd ) fclose( d.fpd );
+      if ( d.fpc ) fclose( d.fpc );
+      d.proto->Close();
+      continue;
+    }
+    struct epoll_event ev;
+    ev.events   = EPOLLIN;
+    ev.data.u32 = k;
+    if ( epoll_ctl( ep, EPOLL_CTL_ADD, d.proto->Fd(), &ev ) != 0 ) {
+      fprintf(stderr, "ERROR: cannot watch device %s: %s\n", d.name, strerror( errno ) );
+      fclose( d.fpd );
+      fclose( d.fpc );
+      d.proto->Close();
+      continue;
+    }
+    d.open = true;
+    ++ n_open;
+    if ( verbose ) fprintf(stderr, "downloading from %s\n", d.name );
+  }
+
+  signal( SIGINT,  on_signal );
+  signal( SIGTERM, on_signal );
+
+  struct epoll_event events[ MAX_EVENTS ];
+  unsigned long long t_print = now + interval * 1000000ULL;
+  while ( running && n_open > 0 ) {
+    int ne = epoll_wait( ep, events, MAX_EVENTS, 1000 );
+    if ( ne < 0 && errno != EINTR ) {
+      fprintf(stderr, "ERROR: epoll: %s\n", strerror( errno ) );
+      break;
+    }
+    now = Serial::Now();
+    for ( int j=0; j<ne; ++j ) {
+      Device & d = dev[ events[j].data.u32 ];
+      if ( ! d.open ) continue;
+      unsigned int np = 0;
+      ProtoError err = d.proto->Pump( &np );
+      if ( np > 0 ) {
+        d.n_packet += np;
+        d.t_last = now;
+        write_shots( d, x2 );
+      }
+      if ( err != PROTO_OK || ( events[j].events & ( EPOLLERR | EPOLLHUP ) ) ) {
+        ++ d.n_error;
+        fprintf(stderr, "ERROR: device %s: %s\n", d.name, ( err != PROTO_OK )? ProtoErrorStr( err ) : "hangup" );
+        close_device( ep, d, x2 );
+        -- n_open;
+      }
+    }
+    for ( int k=0; k<n_dev; ++k ) {
+      Device & d = dev[k];
+      if ( d.open && now - d.t_last > idle * 1000000ULL ) {
+        if ( verbose ) fprintf(stderr, "%s done: %lu data %lu calib\n", d.name, d.n_data, d.n_calib );
+        close_device( ep, d, x2 );
+        -- n_open;
+      }
+    }
+    if ( interval > 0 && now >= t_print ) {
+      print_counters( stderr, dev, n_dev, now );
+      if ( status_file ) {
+        FILE * fp = fopen( status_file, "w" );
+        if ( fp ) {
+          print_counters( fp, dev, n_dev, now );
+          fclose( fp );
+        }
+      }
+      t_print = now + interval * 1000000ULL;
+    }
+  }
+
+  now = Serial::Now();
+  for ( int k=0; k<n_dev; ++k ) close_device( ep, dev[k], x2 );
+  print_counters( stderr, dev, n_dev, now );
+  if ( status_file ) {
+    FILE * fp = fopen( status_file, "w" );
+    if ( fp ) {
+      print_counters( fp, dev, n_dev, now );
+      fclose( fp );
+    }
+  }
+  for ( int k=0; k<n_dev; ++k ) delete dev[k].proto;
+  delete[] dev;
+  close( ep );
+  return 0;
+}
+
@@ -15,6 +15,7 @@
 #include <assert.h>
 
 // #include <sys/types.h>
+#include "DumpFile.h"
 
 // taken from Protocol.h
 #define DATA_2_DISTANCE( b ) \
@@ -52,6 +53,7 @@
 void usage()
 {
   printf("Usage: tlx_dump2data [options] <memory-dump> \n");
+  printf("the memory-dump is either a text dump or a binary dump (%s)\n", DUMP_FILE_EXT );
   printf("options: \n");
   printf("  -a            show all data [by default only hot data are shown]\n");
   printf("  -b            show measurements/calibration boundaries [default no]\n");
@@ -81,27 +83,147 @@ void usage()
 const char * type_str[] = { "end", "used", "free", "hot", "start" };
 const char * data_str[] = { "none", "data", "calib", "vector", "unknown" };
 
-int main( int argc, char ** argv )
+int show_hot = 0;
+int show_all = 0;
+int show_trans = 0;
+int only_calib = 0;
+int only_meas  = 0;
+int show_bounds = 0;
+int extract = 0;
+int addresses = 0;
+unsigned long addr_start = 0;
+unsigned long addr_end = 0;
+
+int prev_type;
+int curr_type = START;
+int prev_data;
+int data_type = TYPE_NONE;
+
+/** process a memory packet
+ * @param a     packet address
+ * @param addr  packet address, as written in the output ("AAAA:")
+ * @param bb    eight bytes of the packet
+ * @return 0 to go on, 1 to stop
+ */
+int process( unsigned long a, const char * addr, const unsigned char * bb )
 {
-  int show_hot = 0;
-  int show_all = 0;
-  int show_trans = 0;
-  int only_calib = 0;
-  int only_meas  = 0;
-  int show_bounds = 0;
-  int extract = 0;
-  int addresses = 0;
+  int lo = bb[0] & 0x0f; // packet type
+  int hi = bb[0] >> 4;
+  prev_type = curr_type;
+  prev_data = data_type;
+  if ( bb[0] == 0x00 ) { 
+    curr_type = END;
+    data_type = TYPE_NONE;
+  } else if ( bb[0] == 0xff ) {
+    curr_type = FREE; 
+    data_type = TYPE_NONE;
+  } else {
+    if ( bb[0] > 0x00 && bb[0] < 0x80 ) { 
+      curr_type = USED; 
+    } else { 
+      curr_type = HOT;
+    }
+   
+    if ( lo == 1 ) {
+      data_type = TYPE_DATA;
+    } else if ( lo == 2 ) {
+      data_type = TYPE_CALIB;
+    } else if ( lo == 3 ) {
+      data_type = TYPE_CALIB;
+    } else if ( lo == 4 ) {
+      data_type = TYPE_VECTOR;
+    } else {
+      data_type = TYPE_UNKNOWN;
+    }
+  }
+
+  if ( extract ) {
+    if ( a < addr_start ) return 0;
+    if ( a >= addr_end ) return 1;
+    printf("%s %02x %02x %02x %02x %02x %02x %02x %02x", addr,
+      bb[0], bb[1], bb[2], bb[3], bb[4], bb[5], bb[6], bb[7] );
+    if ( data_type == TYPE_DATA && only_meas == 1 ) {
+      unsigned int id = DATA_2_DISTANCE( bb );
+      unsigned int ib = DATA_2_COMPASS( bb );
+      unsigned int ic = DATA_2_CLINO( bb );
+      unsigned int ir = DATA_2_ROLL( bb );
+      printf(" %6.2f  %6.2f %6.2f %6.2f", 
+        DISTANCE_METERS( id ),
+        COMPASS_DEGREES( ib ),
+        CLINO_DEGREES( ic ),
+        ROLL_DEGREES( ir ) 
+      );
+    } else if ( data_type == TYPE_CALIB && only_calib == 1 ) {
+      int16_t ix = CALIB_2_X( bb );
+      int16_t iy = CALIB_2_Y( bb );
+      int16_t iz = CALIB_2_Z( bb );
+      printf( " 0x%04x 0x%04x 0x%04x ", ix, iy, iz );
+    }
+    printf("\n");
+  } else if ( show_bounds ) {
+    if ( data_type != prev_data ) {
+      printf("%s %s --> %s \n", addr, data_str[prev_data], data_str[data_type] );
+    }
+  } else if ( show_trans ) {
+    if ( prev_type != curr_type ) {
+      printf("%s %02x %s --> %s \n", addr, bb[0], type_str[prev_type], type_str[curr_type] );
+    }
+  } else if ( show_all == 1 || hi == 8 ) {
+    if ( lo == 1 && (only_calib == 0) ) { 
+      unsigned int id = DATA_2_DISTANCE( bb );
+      unsigned int ib = DATA_2_COMPASS( bb );
+      unsigned int ic = DATA_2_CLINO( bb );
+      unsigned int ir = DATA_2_ROLL( bb );
+      if ( show_hot ) printf( "%02x ", bb[0] );
+      if ( addresses ) printf( "%s ", addr );
+      printf( "0x%05x 0x%04x 0x%04x 0x%02x ", id, ib, ic, ir );
+      printf( "%.2f %.2f %.2f %.2f\n", 
+        DISTANCE_METERS( id ),
+        COMPASS_DEGREES( ib ),
+        CLINO_DEGREES( ic ),
+        ROLL_DEGREES( ir )
+      );
+    } else if ( lo == 2 && (only_meas == 0) ) {
+      int16_t ix = CALIB_2_X( bb );
+      int16_t iy = CALIB_2_Y( bb );
+      int16_t iz = CALIB_2_Z( bb );
+      if ( show_hot ) printf( "%02x ", bb[0] );
+      if ( addresses ) printf( "%s ", addr );
+      printf( "0x%04x 0x%04x 0x%04x ", ix, iy, iz );
+    } else if ( lo == 3 && (only_meas == 0) ) {
+      int16_t ix = CALIB_2_X( bb );
+      int16_t iy = CALIB_2_Y( bb );
+      int16_t iz = CALIB_2_Z( bb );
+      printf( "0x%04x 0x%04x 0x%04x \n", ix, iy, iz );
+    }
+  }
+  return 0;
+}
+
+/** process a binary dump: the packets are read in place from the mapped file
+ * @param m  mapped dump
+ */
+void process_dump( const struct DumpMap * m )
+{
+  char addr[16];
+  unsigned int n = dump_packets( m );
+  unsigned int k;
+  for ( k=0; k<n; ++k ) {
+    unsigned long a;
+    const unsigned char * bb = dump_packet( m, k, &a );
+    sprintf( addr, "%04lx:", a );
+    if ( process( a, addr, bb ) ) break;
+  }
+}
 
+int main( int argc, char ** argv )
+{
   FILE * fp = NULL;
   char addr[16];
   char b[8][3];  // eight bytes
   unsigned char bb[8];
-  int prev_type;
-  int curr_type = START;
-  int prev_data;
-  int data_type = TYPE_NONE;
-  char * addr_start = NULL;
-  char * addr_end = NULL; 
+  struct DumpMap dump;
+  int ret;
 
   if ( argc <= 1 ) {
     usage();
@@ -127,7 +249,7 @@ int main( int argc, char ** argv )
         extract = 1;
         argv ++; argc --;
         if ( argv[1][0] == '0' && argv[1][1] == 'x' ) {
-          addr_start = argv[1]+2;
+          addr_start = strtoul( argv[1]+2, NULL, 16 );
         } else {
           usage();
           printf("\nInvalid start address %s\n", argv[1] );
@@ -135,7 +257,7 @@ int main( int argc, char ** argv )
         }
         argv ++; argc --;
         if ( argv[1][0] == '0' && argv[1][1] == 'x' ) {
-          addr_end = argv[1]+2;
+          addr_end = strtoul( argv[1]+2, NULL, 16 );
         } else {
           usage();
           printf("\nInvalid end address %s\n", argv[1] );
@@ -150,15 +272,22 @@ int main( int argc, char ** argv )
     }
   }
 
-  if ( (fp = fopen( argv[1], "r" ) ) == NULL ) { 
+  // if ( extract ) {
+  //   printf("Extract from %04lx to %04lx\n", addr_start, addr_end );
+  // }
+
+  ret = dump_map( argv[1], &dump );
+  if ( ret == 0 ) {
+    process_dump( &dump );
+    dump_unmap( &dump );
+    return 0;
+  }
+
+  if ( ret < 0 || (fp = fopen( argv[1], "r" ) ) == NULL ) { 
     printf("Unable to open memory-dump file \"%s\"\n", argv[1] );
     return 2;
   }
 
-  // if ( extract ) {
-  //   printf("Extract from %s to %s\n", addr_start, addr_end );
-  // }
-
   for ( ; ; ) {
     int k;
     char * line = NULL;
@@ -167,8 +296,6 @@ int main( int argc, char ** argv )
     if ( sscanf( line, "%s %s %s %s %s %s %s %s %s", addr,
       b[0], b[1], b[2], b[3], b[4], b[5], b[6], b[7] ) != 9 ) break;
     free( line );
-    prev_type = curr_type;
-    prev_data = data_type;
     for ( k=0; k<8; ++k ) {
       bb[k] = 0;
       if ( b[k][0] <= '9' && b[k][0] >= '0' ) { bb[k] += 16 * (b[k][0]-'0'); }
@@ -180,92 +307,7 @@ int main( int argc, char ** argv )
       else if ( b[k][1] <= 'F' && b[k][1] >= 'A' ) { bb[k] += (10 + (b[k][1]-'A')); }
       else { assert( 0 ); }
     }
-    if ( bb[0] == 0x00 ) { 
-      curr_type = END;
-      data_type = TYPE_NONE;
-    } else if ( bb[0] == 0xff ) {
-      curr_type = FREE; 
-      data_type = TYPE_NONE;
-    } else {
-      if ( bb[0] > 0x00 && bb[0] < 0x80 ) { 
-        curr_type = USED; 
-      } else { 
-        curr_type = HOT;
-      }
-     
-      if ( b[0][1] == '1' ) {
-        data_type = TYPE_DATA;
-      } else if ( b[0][1] == '2' ) {
-        data_type = TYPE_CALIB;
-      } else if ( b[0][1] == '3' ) {
-        data_type = TYPE_CALIB;
-      } else if ( b[0][1] == '4' ) {
-        data_type = TYPE_VECTOR;
-      } else {
-        data_type = TYPE_UNKNOWN;
-      }
-    }
-
-    if ( extract ) {
-      if (strncmp(addr_start, addr, 4) > 0 ) continue;
-      if ( strncmp(addr_end, addr, 4) <= 0 ) break;
-      printf("%s %s %s %s %s %s %s %s %s", addr,
-        b[0], b[1], b[2], b[3], b[4], b[5], b[6], b[7] );
-      if ( data_type == TYPE_DATA && only_meas == 1 ) {
-        unsigned int id = DATA_2_DISTANCE( bb );
-        unsigned int ib = DATA_2_COMPASS( bb );
-        unsigned int ic = DATA_2_CLINO( bb );
-        unsigned int ir = DATA_2_ROLL( bb );
-        printf(" %6.2f  %6.2f %6.2f %6.2f", 
-          DISTANCE_METERS( id ),
-          COMPASS_DEGREES( ib ),
-          CLINO_DEGREES( ic ),
-          ROLL_DEGREES( ir ) 
-        );
-      } else if ( data_type == TYPE_CALIB && only_calib == 1 ) {
-        int16_t ix = CALIB_2_X( bb );
-        int16_t iy = CALIB_2_Y( bb );
-        int16_t iz = CALIB_2_Z( bb );
-        printf( " 0x%04x 0x%04x 0x%04x ", ix, iy, iz );
-      }
-      printf("\n");
-    } else if ( show_bounds ) {
-      if ( data_type != prev_data ) {
-        printf("%s %s --> %s \n", addr, data_str[prev_data], data_str[data_type] );
-      }
-    } else if ( show_trans ) {
-      if ( prev_type != curr_type ) {
-        printf("%s %02x %s --> %s \n", addr, bb[0], type_str[prev_type], type_str[curr_type] );
-      }
-    } else if ( show_all == 1 || b[0][0] == '8' ) {
-      if ( b[0][1] == '1' && (only_calib == 0) ) { 
-        unsigned int id = DATA_2_DISTANCE( bb );
-        unsigned int ib = DATA_2_COMPASS( bb );
-        unsigned int ic = DATA_2_CLINO( bb );
-        unsigned int ir = DATA_2_ROLL( bb );
-        if ( show_hot ) printf( "%02x ", bb[0] );
-        if ( addresses ) printf( "%s ", addr );
-        printf( "0x%05x 0x%04x 0x%04x 0x%02x ", id, ib, ic, ir );
-        printf( "%.2f %.2f %.2f %.2f\n", 
-          DISTANCE_METERS( id ),
-          COMPASS_DEGREES( ib ),
-          CLINO_DEGREES( ic ),
-          ROLL_DEGREES( ir )
-        );
-      } else if ( b[0][1] == '2' && (only_meas == 0) ) {
-        int16_t ix = CALIB_2_X( bb );
-        int16_t iy = CALIB_2_Y( bb );
-        int16_t iz = CALIB_2_Z( bb );
-        if ( show_hot ) printf( "%02x ", bb[0] );
-        if ( addresses ) printf( "%s ", addr );
-        printf( "0x%04x 0x%04x 0x%04x ", ix, iy, iz );
-      } else if ( b[0][1] == '3' && (only_meas == 0) ) {
-        int16_t ix = CALIB_2_X( bb );
-        int16_t iy = CALIB_2_Y( bb );
-        int16_t iz = CALIB_2_Z( bb );
-        printf( "0x%04x 0x%04x 0x%04x \n", ix, iy, iz );
-      }
-    }
+    if ( process( strtoul( addr, NULL, 16 ), addr, bb ) ) break;
   }
   fclose( fp );
   return 0;
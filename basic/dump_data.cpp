@@ -16,6 +16,7 @@
 
 #include "defaults.h"
 #include "Protocol.h"
+#include "ShotBatch.h"
 
 void usage()
 {
@@ -99,21 +100,29 @@ int main( int argc, char ** argv )
 */
 
   int cnt = 0;
+  unsigned int np = 0;
   // fprintf(stderr, "Reading: ");
-  while ( ( err = proto.ReadData() ) == PROTO_OK ) {
-    cnt ++;
-    if ( verbose ) {
-      if ( ( cnt % 10 ) == 0 ) {
-        fprintf(stderr, "*");
-      } else {
-        fprintf(stderr, ".");
+  while ( ( err = proto.ReadDataBulk( &np ) ) == PROTO_OK ) {
+    for ( unsigned int k=0; k<np; ++k ) {
+      cnt ++;
+      if ( verbose ) {
+        if ( ( cnt % 10 ) == 0 ) {
+          fprintf(stderr, "*");
+        } else {
+          fprintf(stderr, ".");
+        }
+        if ( ( cnt % 50 ) == 0 ) fprintf(stderr, "\n");
       }
-      if ( ( cnt % 50 ) == 0 ) fprintf(stderr, "\n");
     }
-    number --;
-    if ( number == 0 ) break;
+    if ( number > 0 ) {
+      number -= np;
+      if ( number <= 0 ) break;
+    }
   }
   fprintf(stderr, "Read %d data\n", cnt );
+  if ( proto.Duplicates() > 0 ) {
+    fprintf(stderr, "Dropped %u retransmitted packets\n", proto.Duplicates() );
+  }
   if ( err != PROTO_OK && err != PROTO_TIMEOUT ) {
     fprintf(stderr, "ERROR: Read failed: %s\n", ProtoErrorStr(err) );
   }
@@ -132,25 +141,20 @@ int main( int argc, char ** argv )
       FILE * fpd = fopen( data_file, "w");
       if ( fpd ) {
         fprintf(stderr, "Writing measurement data to \"%s\"\n", data_file );
+        unsigned char (*pkts)[8] = new unsigned char[ kd ][8];
+        unsigned int n = 0;
         for (unsigned int k=0; k<kd; ++k ) {
-          if ( ! proto.NextData( b ) ) break;
-          unsigned int id = DATA_2_DISTANCE( b );
-          unsigned int ib = DATA_2_COMPASS( b );
-          unsigned int ic = DATA_2_CLINO( b );
-          unsigned int ir = DATA_2_ROLL( b );
-          // printf("%2d Data %.2f %.2f %.2f %.2f\n", k,
-          //   DISTANCE_METERS( id ), COMPASS_DEGREES( ib ),
-          //   CLINO_DEGREES( ic ), ROLL_DEGREES( ir )  );
-          if ( fpd != NULL ) {
-            fprintf(fpd, "0x%05x 0x%04x 0x%04x 0x%02x ", id, ib, ic, ir );
-            fprintf(fpd, "%.2f %.2f %.2f %.2f \n", 
-              DISTANCE_METERS( id ),
-              COMPASS_DEGREES( ib ),
-              CLINO_DEGREES( ic ),
-              ROLL_DEGREES( ir )
-            );
-          }
+          if ( proto.NextData( pkts[n] ) ) ++ n; // skip non-data packets
+        }
+        ShotBatch batch( n );
+        decodeBatchX1( pkts, n, batch );
+        for (unsigned int k=0; k<batch.size; ++k ) {
+          fprintf(fpd, "0x%05x 0x%04x 0x%04x 0x%02x ",
+            batch.raw_distance[k], batch.raw_azimuth[k], batch.raw_clino[k], batch.raw_roll[k] );
+          fprintf(fpd, "%.2f %.2f %.2f %.2f \n", 
+            batch.distance[k], batch.azimuth[k], batch.clino[k], batch.roll[k] );
         }
+        delete[] pkts;
         fclose( fpd );
       } else {
         fprintf(stderr, "Cannot open data file \"%s\"\n", data_file );
@@ -166,17 +170,15 @@ int main( int argc, char ** argv )
       FILE * fpc = fopen( calib_file, "w");
       if ( fpc ) {
         fprintf(stderr, "Writing calibration data to \"%s\"\n", calib_file );
-        int nl = 0;
-        for (unsigned int k=0; k<kc; ++k ) {
-          if ( ! proto.NextCalib( b ) ) break;
-          int16_t ix = CALIB_2_X( b );
-          int16_t iy = CALIB_2_Y( b );
-          int16_t iz = CALIB_2_Z( b );
-          // printf("%2d Data 0x%04x 0x%04x 0x%04x \n", k, ix, iy, iz );
-          fprintf(fpc, "0x%04x 0x%04x 0x%04x ", ix, iy, iz );
-          nl ++;
+        unsigned char b2[8];
+        while ( proto.NextCalib( b, b2 ) ) {
+          // printf("Data 0x%04x 0x%04x 0x%04x \n", ix, iy, iz );
+          fprintf(fpc, "0x%04x 0x%04x 0x%04x ",
+            (uint16_t)CALIB_2_X( b ), (uint16_t)CALIB_2_Y( b ), (uint16_t)CALIB_2_Z( b ) );
+          fprintf(fpc, "0x%04x 0x%04x 0x%04x ",
+            (uint16_t)CALIB_2_X( b2 ), (uint16_t)CALIB_2_Y( b2 ), (uint16_t)CALIB_2_Z( b2 ) );
           // group -1, ignore 0, no error
-          if ( (nl % 2) == 0 ) fprintf(fpc,"-1 0\n"); 
+          fprintf(fpc,"-1 0\n"); 
         }
         fclose( fpc );
       } else {
@@ -187,6 +189,9 @@ int main( int argc, char ** argv )
     }
   }
 
+  if ( proto.Orphans() > 0 ) {
+    fprintf(stderr, "Dropped %u unpaired packets\n", proto.Orphans() );
+  }
   return 0;
 }
 
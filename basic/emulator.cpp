@@ -0,0 +1,713 @@
+/** @file emulator.cpp
+ *
+ * @author marco corvi
+ * @date oct 2026
+ *
+ * @brief DistoX A3/X310 device emulator on a pseudo-terminal or a socket
+ *
+ * The emulator opens a pseudo-terminal and answers on the master side
+ * as the DistoX does, so that the tools can be pointed at the slave.
+ * It can listen on a UNIX-domain or TCP socket instead, one connection
+ * at a time, or serve an inherited socket (eg, one end of a socketpair),
+ * for the socket transports of the tools (see Transport.h):
+ *   - data/G/M/vector packets from the data queue, with the sequence bit,
+ *     sent again until they are acknowledged
+ *   - 0x38 memory read, 0x39 memory write (4 bytes)
+ *   - 0x3a flash page read, 0x3b flash page write (256 bytes)
+ *   - 0x30-0x33 calib/silent mode commands
+ * The A3 queue holds 8-byte packets in 0x0000-0x8000, head and tail
+ * (byte addresses) are at HEAD_TAIL_X1.
+ * The X310 memory holds 18-byte records, 56 per 1 KiB block: data (or G)
+ * packet, vector (or M) packet, two status bytes; head and tail (record
+ * indices) are at HEAD_TAIL_X2.
+ * The link has a latency, a bandwidth and a probability to lose a reply.
+ * --------------------------------------------------------
+ *  Copyright This sowftare is distributed under GPL-3.0 or later
+ *  See the file COPYING.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "Protocol.h"
+#include "MemoryLayout.h"
+
+// memory layout, as in DistoX.h
+#define STATUS_ADDR_X1   0x8000
+#define HEAD_TAIL_X1     0xc020
+#define HEAD_TAIL_X2     0xe008
+#define QUEUE_SIZE_A3    MEMORY_SIZE_A3      /* bytes of the A3 data queue */
+#define MAX_INDEX_X310   MEMORY_RECORDS_X310 /* records in the X310 memory */
+
+#define STATUS_CALIB     0x08
+#define STATUS_SILENT    0x10
+
+#define EMU_ACK_TIMEOUT  500000 /* usec before a packet is sent again */
+#define EMU_OUT_SIZE     256    /* replies waiting on the link */
+#define EMU_IN_SIZE      4096
+
+static volatile sig_atomic_t running = 1;
+
+static void
+on_signal( int )
+{
+  running = 0;
+}
+
+static unsigned long long
+now_usec()
+{
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+class Emulator
+{
+  private:
+    struct Reply
+    {
+      unsigned long long at; //!< time the reply is fully on the link
+      unsigned int len;
+      unsigned int pos;      //!< bytes already written
+      unsigned char b[264];
+    };
+
+    int fd;                       //!< pty master, or socket connection (-1: none)
+    int slave;                    //!< pty slave (kept open, -1 with a socket)
+    int listener;                 //!< listening socket (-1: none)
+    bool x310;                    //!< X310 memory layout
+    unsigned char mem[0x10000];   //!< memory (0x38/0x39)
+    unsigned char flash[0x10000]; //!< flash pages (0x3a/0x3b)
+    unsigned char mode;           //!< STATUS_CALIB, STATUS_SILENT
+
+    unsigned long latency;        //!< one-way latency [usec]
+    unsigned long bandwidth;      //!< link bandwidth [bytes/s, 0: unlimited]
+    double loss;                  //!< probability to lose a reply
+    double ack_loss;              //!< probability to lose an ack
+    unsigned long long busy;      //!< time the link is busy until [usec]
+    Reply out[ EMU_OUT_SIZE ];
+    unsigned int out0, nout;      //!< head and size of the reply queue
+
+    unsigned char in[ EMU_IN_SIZE ];
+    size_t nin;                   //!< bytes in the input buffer
+
+    unsigned long to_take;        //!< shots still to be taken
+    unsigned long n_shot;         //!< shots taken
+    unsigned char seq;            //!< sequence bit of the next packet
+    int sub;                      //!< X310: packet of the record being sent (0, 1)
+    bool waiting;                 //!< a packet waits for the ack
+    unsigned long long resend_at; //!< time to send the packet again
+
+  public:
+    unsigned long n_packet;       //!< packets sent (resent included)
+    unsigned long n_resent;
+    unsigned long n_acked;
+    unsigned long n_lost;         //!< replies lost on the link
+    unsigned long n_ack_lost;     //!< acks lost on the link
+    unsigned long n_request;      //!< 0x38-0x3b requests
+
+  public:
+    Emulator( int f, int s, bool x, unsigned long lat, unsigned long bw, double p, double pa )
+      : fd( f )
+      , slave( s )
+      , listener( -1 )
+      , x310( x )
+      , mode( 0 )
+      , latency( lat )
+      , bandwidth( bw )
+      , loss( p )
+      , ack_loss( pa )
+      , busy( 0 )
+      , out0( 0 )
+      , nout( 0 )
+      , nin( 0 )
+      , to_take( 0 )
+      , n_shot( 0 )
+      , seq( 0 )
+      , sub( 0 )
+      , waiting( false )
+      , resend_at( 0 )
+      , n_packet( 0 )
+      , n_resent( 0 )
+      , n_acked( 0 )
+      , n_lost( 0 )
+      , n_ack_lost( 0 )
+      , n_request( 0 )
+    {
+      memset( mem, 0xff, sizeof(mem) );
+      for ( unsigned int k=0; k<sizeof(flash); ++k ) flash[k] = (unsigned char)( (k>>8) + k );
+      SetHeadTail( 0, 0 );
+      mem[ STATUS_ADDR_X1 ] = STATUS_BT_X1;
+    }
+
+    /** set the mode and the number of shots to take
+     * @param m      mode bits
+     * @param shots  number of shots
+     */
+    void Start( unsigned char m, unsigned long shots )
+    {
+      mode = m;
+      mem[ STATUS_ADDR_X1 ] = STATUS_BT_X1 | mode;
+      to_take = shots;
+      TakeShots();
+    }
+
+    bool Busy() const { return to_take > 0 || QueueSize() > 0 || nout > 0; }
+
+    ~Emulator()
+    {
+      if ( slave < 0 && fd >= 0 ) close( fd ); // socket connection
+    }
+
+    /** serve the connections of a listening socket, one at a time
+     * @param l  listening socket
+     */
+    void SetListener( int l ) { listener = l; }
+
+    /** run one step of the event loop
+     * @param max_wait  max time to wait for input [usec]
+     * @return false on i/o error
+     */
+    bool Step( unsigned long long max_wait );
+
+  private:
+    static const unsigned char STATUS_BT_X1 = 0x02;
+
+    unsigned int Head() const { return Word( x310 ? HEAD_TAIL_X2 : HEAD_TAIL_X1 ); }
+    unsigned int Tail() const { return Word( x310 ? HEAD_TAIL_X2+2 : HEAD_TAIL_X1+2 ); }
+    unsigned int Word( unsigned int a ) const { return mem[a] | ( mem[a+1] << 8 ); }
+
+    void SetHeadTail( unsigned int h, unsigned int t )
+    {
+      unsigned int a = x310 ? HEAD_TAIL_X2 : HEAD_TAIL_X1;
+      mem[a]   = h & 0xff;
+      mem[a+1] = (h>>8) & 0xff;
+      mem[a+2] = t & 0xff;
+      mem[a+3] = (t>>8) & 0xff;
+    }
+
+    /** number of items on the queue: packets (A3) or records (X310)
+     */
+    unsigned int QueueSize() const
+    {
+      if ( x310 ) return ( Head() + MAX_INDEX_X310 - Tail() ) % MAX_INDEX_X310;
+      return ( ( Head() + QUEUE_SIZE_A3 - Tail() ) % QUEUE_SIZE_A3 ) / 8;
+    }
+
+    unsigned int QueueCapacity() const
+    {
+      return x310 ? MAX_INDEX_X310 - 1 : QUEUE_SIZE_A3 / 8 - 1;
+    }
+
+    /** wait for a connection on the listening socket
+     * @param max_wait  max time to wait [usec]
+     * @return false on error
+     */
+    bool Accept( unsigned long long max_wait );
+
+    /** the host has closed the socket connection
+     * @return false on error
+     */
+    bool Hangup();
+
+    void MakeShot( unsigned long n, unsigned char * b1, unsigned char * b2 );
+    void TakeShots();
+    void Download( unsigned long long now );
+    void Acknowledge( unsigned char byte );
+    size_t Parse();
+    void Send( const unsigned char * b, unsigned int len );
+    bool Flush( unsigned long long now );
+};
+
+/** make the packets of the n-th shot: deterministic values
+ * @param n    shot number
+ * @param b1   data (or G) packet [output]
+ * @param b2   vector (or M) packet [output]
+ */
+void
+Emulator::MakeShot( unsigned long n, unsigned char * b1, unsigned char * b2 )
+{
+  if ( mode & STATUS_CALIB ) {
+    b1[0] = PACKET_G;
+    b2[0] = PACKET_M;
+    for ( int k=1; k<7; ++k ) {
+      b1[k] = (unsigned char)( n * (2*k+1) );
+      b2[k] = (unsigned char)( n * (2*k+3) );
+    }
+    b1[7] = b2[7] = 0;
+    return;
+  }
+  unsigned int dist    = 500 + ( n * 137 ) % 100000; // mm
+  unsigned int compass = ( n * 2731 ) & 0xffff;
+  unsigned int clino   = ( n * 1223 ) & 0xffff;
+  unsigned int roll    = ( n * 331 ) & 0xffff;
+  b1[0] = PACKET_DATA | ( ( dist >> 10 ) & 0x40 );
+  b1[1] = dist & 0xff;
+  b1[2] = ( dist >> 8 ) & 0xff;
+  b1[3] = compass & 0xff;
+  b1[4] = ( compass >> 8 ) & 0xff;
+  b1[5] = clino & 0xff;
+  b1[6] = ( clino >> 8 ) & 0xff;
+  b1[7] = x310 ? ( roll >> 8 ) & 0xff : roll & 0xff;
+  b2[0] = PACKET_VECTOR;
+  for ( int k=1; k<7; ++k ) b2[k] = (unsigned char)( n * (k+5) );
+  b2[7] = roll & 0xff;
+}
+
+/** put new shots on the queue while there is room
+ */
+void
+Emulator::TakeShots()
+{
+  unsigned char b1[8], b2[8];
+  unsigned int per_shot = ( x310 || ( mode & STATUS_CALIB ) )? 2 : 1; // A3 packets
+  while ( to_take > 0 ) {
+    unsigned int h = Head();
+    if ( x310 ) {
+      if ( QueueSize() + 1 > QueueCapacity() ) break;
+      MakeShot( n_shot, b1, b2 );
+      unsigned int a = index2addr_x310( h );
+      memcpy( mem + a, b1, 8 );
+      memcpy( mem + a + 8, b2, 8 );
+      mem[a+16] = mem[a+17] = 0xff;
+      h = ( h + 1 ) % MAX_INDEX_X310;
+    } else {
+      if ( QueueSize() + per_shot > QueueCapacity() ) break;
+      MakeShot( n_shot, b1, b2 );
+      memcpy( mem + h, b1, 8 );
+      h = ( h + 8 ) % QUEUE_SIZE_A3;
+      if ( per_shot == 2 ) {
+        memcpy( mem + h, b2, 8 );
+        h = ( h + 8 ) % QUEUE_SIZE_A3;
+      }
+    }
+    SetHeadTail( h, Tail() );
+    ++ n_shot;
+    -- to_take;
+  }
+}
+
+/** send the packet at the tail of the queue, or send it again
+ */
+void
+Emulator::Download( unsigned long long now )
+{
+  if ( mode & STATUS_SILENT ) return;
+  if ( waiting && now < resend_at ) return;
+  if ( QueueSize() == 0 || fd < 0 ) return;
+  int unread = 0;
+  if ( slave >= 0 && ioctl( slave, FIONREAD, &unread ) == 0 && unread > 0 ) { // no host is reading
+    resend_at = now + EMU_ACK_TIMEOUT;
+    return;
+  }
+  unsigned char b[8];
+  unsigned int t = Tail();
+  if ( x310 ) {
+    memcpy( b, mem + index2addr_x310( t ) + 8*sub, 8 );
+  } else {
+    memcpy( b, mem + t, 8 );
+  }
+  b[0] = ( b[0] & 0x7f ) | seq;
+  if ( waiting ) ++ n_resent;
+  ++ n_packet;
+  Send( b, 8 );
+  waiting   = true;
+  resend_at = now + 2 * latency + EMU_ACK_TIMEOUT;
+}
+
+/** the host acknowledged a packet
+ * @param byte   ack byte: 0x55 with the sequence bit
+ */
+void
+Emulator::Acknowledge( unsigned char byte )
+{
+  if ( ! waiting || ( byte & 0x80 ) != seq ) return; // duplicate ack
+  if ( ack_loss > 0 && drand48() < ack_loss ) { // the packet will be sent again
+    ++ n_ack_lost;
+    return;
+  }
+  waiting = false;
+  seq ^= 0x80;
+  ++ n_acked;
+  unsigned int t = Tail();
+  if ( x310 ) {
+    if ( ++ sub < 2 ) return;
+    sub = 0;
+    t = ( t + 1 ) % MAX_INDEX_X310;
+  } else {
+    t = ( t + 8 ) % QUEUE_SIZE_A3;
+  }
+  SetHeadTail( Head(), t );
+  TakeShots();
+}
+
+/** handle the requests in the input buffer
+ * @return number of bytes consumed
+ */
+size_t
+Emulator::Parse()
+{
+  size_t k = 0;
+  unsigned char r[264];
+  while ( k < nin ) {
+    unsigned char * b = in + k;
+    size_t avail = nin - k;
+    unsigned int addr;
+    switch ( b[0] ) {
+      case 0x38: // memory read
+      case 0x39: // memory write
+        if ( avail < ( b[0] == 0x38 ? 3u : 7u ) ) return k;
+        ++ n_request;
+        addr = ( b[1] | ( b[2] << 8 ) ) & 0xfffc;
+        if ( b[0] == 0x39 ) {
+          memcpy( mem + addr, b + 3, 4 );
+          if ( addr == ( x310 ? HEAD_TAIL_X2 : HEAD_TAIL_X1 ) ) waiting = false;
+        }
+        r[0] = 0x38;
+        r[1] = b[1];
+        r[2] = b[2];
+        memcpy( r + 3, mem + addr, 4 );
+        r[7] = 0;
+        Send( r, 8 );
+        k += ( b[0] == 0x38 )? 3 : 7;
+        break;
+      case 0x3a: // flash page read
+        if ( avail < 3 ) return k;
+        ++ n_request;
+        addr = b[1];
+        memset( r, 0, 8 );
+        r[0] = 0x3a;
+        r[1] = b[1];
+        r[2] = b[2];
+        memcpy( r + 8, flash + 256*addr, 256 );
+        Send( r, 264 );
+        k += 3;
+        break;
+      case 0x3b: // flash page write
+        if ( avail < 259 ) return k;
+        ++ n_request;
+        addr = b[1];
+        memcpy( flash + 256*addr, b + 3, 256 );
+        memset( r, 0, 8 );
+        r[0] = 0x3b;
+        r[1] = b[1];
+        r[2] = b[2];
+        Send( r, 8 );
+        k += 259;
+        break;
+      case 0x30: mode &= ~STATUS_CALIB;  ++k; break;
+      case 0x31: mode |=  STATUS_CALIB;  ++k; break;
+      case 0x32: mode &= ~STATUS_SILENT; ++k; break;
+      case 0x33: mode |=  STATUS_SILENT; ++k; break;
+      case 0x55:
+      case 0xd5:
+        Acknowledge( b[0] );
+        ++k;
+        break;
+      default: // stray byte
+        ++k;
+        break;
+    }
+    mem[ STATUS_ADDR_X1 ] = STATUS_BT_X1 | mode;
+  }
+  return k;
+}
+
+/** queue a reply on the link
+ * @param b    reply bytes
+ * @param len  number of bytes
+ */
+void
+Emulator::Send( const unsigned char * b, unsigned int len )
+{
+  if ( loss > 0 && drand48() < loss ) {
+    ++ n_lost;
+    return;
+  }
+  if ( nout == EMU_OUT_SIZE ) {
+    fprintf(stderr, "WARNING. emulator reply queue full\n");
+    return;
+  }
+  unsigned long long now = now_usec();
+  unsigned long long at = now + latency;
+  if ( bandwidth > 0 ) { // the reply waits for the link to be free
+    busy = ( ( busy > now )? busy : now ) + ( 1000000ULL * len ) / bandwidth;
+    at = busy + latency;
+  }
+  Reply & rep = out[ ( out0 + nout ) % EMU_OUT_SIZE ];
+  rep.at  = at;
+  rep.len = len;
+  rep.pos = 0;
+  memcpy( rep.b, b, len );
+  ++ nout;
+}
+
+/** write the replies that are due
+ * @return false on write error
+ */
+bool
+Emulator::Flush( unsigned long long now )
+{
+  while ( nout > 0 && out[ out0 ].at <= now ) {
+    Reply & rep = out[ out0 ];
+    ssize_t nw = write( fd, rep.b + rep.pos, rep.len - rep.pos );
+    if ( nw < 0 ) {
+      if ( errno == EAGAIN || errno == EINTR ) return true;
+      if ( slave < 0 ) return Hangup();
+      return false;
+    }
+    rep.pos += nw;
+    if ( rep.pos < rep.len ) return true;
+    out0 = ( out0 + 1 ) % EMU_OUT_SIZE;
+    -- nout;
+  }
+  return true;
+}
+
+bool
+Emulator::Accept( unsigned long long max_wait )
+{
+  struct pollfd pfd;
+  pfd.fd      = listener;
+  pfd.events  = POLLIN;
+  pfd.revents = 0;
+  int ret = poll( &pfd, 1, (int)( max_wait / 1000 ) );
+  if ( ret < 0 ) return errno == EINTR;
+  if ( ret == 0 ) return true;
+  int c = accept( listener, NULL, NULL );
+  if ( c < 0 ) return errno == EINTR || errno == EAGAIN || errno == ECONNABORTED;
+  fcntl( c, F_SETFL, fcntl( c, F_GETFL ) | O_NONBLOCK );
+  fd = c;
+  return true;
+}
+
+bool
+Emulator::Hangup()
+{
+  close( fd );
+  fd = -1;
+  // the replies and the packet in flight are lost with the connection
+  nin  = 0;
+  nout = 0;
+  waiting = false;
+  if ( listener < 0 ) running = 0; // no more connections to serve
+  return true;
+}
+
+bool
+Emulator::Step( unsigned long long max_wait )
+{
+  if ( fd < 0 ) return Accept( max_wait );
+  unsigned long long now = now_usec();
+  if ( ! Flush( now ) ) return false;
+  if ( fd < 0 ) return true;
+  Download( now );
+
+  unsigned long long until = now + max_wait;
+  if ( nout > 0 && out[ out0 ].at < until ) until = out[ out0 ].at;
+  if ( waiting && ! ( mode & STATUS_SILENT ) && resend_at < until ) until = resend_at;
+  unsigned long long dt = ( until > now )? until - now : 0;
+  struct timespec ts;
+  ts.tv_sec  = dt / 1000000;
+  ts.tv_nsec = ( dt % 1000000 ) * 1000;
+  struct pollfd pfd;
+  pfd.fd      = fd;
+  pfd.events  = POLLIN;
+  pfd.revents = 0;
+  int ret = ppoll( &pfd, 1, &ts, NULL );
+  if ( ret < 0 ) return errno == EINTR;
+  if ( ret > 0 && ( pfd.revents & POLLIN ) ) {
+    ssize_t nr = read( fd, in + nin, EMU_IN_SIZE - nin );
+    if ( nr > 0 ) {
+      nin += nr;
+      size_t k = Parse();
+      memmove( in, in + k, nin - k );
+      nin -= k;
+    } else if ( slave < 0 && ( nr == 0 || ( errno != EAGAIN && errno != EINTR ) ) ) {
+      return Hangup();
+    }
+  } else if ( ret > 0 && slave < 0 ) { // POLLHUP POLLERR
+    return Hangup();
+  }
+  return true;
+}
+
+// ----------------------------------------------------------------
+
+void usage()
+{
+  static bool usaged = false;
+  if ( usaged ) return;
+  usaged = true;
+  fprintf(stderr, "Usage: tlx_emulator [options]\n");
+  fprintf(stderr, "  emulate a DistoX on a pseudo-terminal: point the tools at the printed device\n");
+  fprintf(stderr, "Options:\n");
+  fprintf(stderr, "  -x          X310 memory layout [default A3]\n");
+  fprintf(stderr, "  -L link     make a symbolic link to the device\n");
+  fprintf(stderr, "  -U path     listen on a UNIX-domain socket instead of a pseudo-terminal\n");
+  fprintf(stderr, "  -T port     listen on a TCP port instead of a pseudo-terminal\n");
+  fprintf(stderr, "  -F fd       serve an inherited connected socket, eg, of a socketpair\n");
+  fprintf(stderr, "  -n shots    number of shots to take [default 0]\n");
+  fprintf(stderr, "  -c          calibration mode (G/M packets)\n");
+  fprintf(stderr, "  -s          silent mode (the shots stay in memory)\n");
+  fprintf(stderr, "  -l usec     link latency [default 0]\n");
+  fprintf(stderr, "  -b bytes/s  link bandwidth [default 0: unlimited]\n");
+  fprintf(stderr, "  -p prob     probability to lose a reply [default 0]\n");
+  fprintf(stderr, "  -P prob     probability to lose an ack [default 0]\n");
+  fprintf(stderr, "  -S seed     random seed for the losses\n");
+  fprintf(stderr, "  -e          exit when every shot has been downloaded\n");
+  fprintf(stderr, "  -v          verbose\n");
+  fprintf(stderr, "  -h          this help\n");
+}
+
+int main( int argc, char ** argv )
+{
+  const char * link = NULL;
+  const char * unix_path = NULL;
+  int tcp_port = -1;
+  int inherited = -1;
+  bool x310 = false;
+  bool verbose = false;
+  bool exit_done = false;
+  unsigned char mode = 0;
+  unsigned long shots = 0;
+  unsigned long latency = 0;
+  unsigned long bandwidth = 0;
+  double loss = 0.0;
+  double ack_loss = 0.0;
+  long seed = 1;
+
+  int ac = 1;
+  while ( ac < argc && argv[ac][0] == '-' ) {
+    switch ( argv[ac][1] ) {
+      case 'x': x310 = true; break;
+      case 'L': link = argv[++ac]; break;
+      case 'U': unix_path = argv[++ac]; break;
+      case 'T': tcp_port = atoi( argv[++ac] ); break;
+      case 'F': inherited = atoi( argv[++ac] ); break;
+      case 'n': shots = strtoul( argv[++ac], NULL, 0 ); break;
+      case 'c': mode |= STATUS_CALIB; break;
+      case 's': mode |= STATUS_SILENT; break;
+      case 'l': latency = strtoul( argv[++ac], NULL, 0 ); break;
+      case 'b': bandwidth = strtoul( argv[++ac], NULL, 0 ); break;
+      case 'p': loss = atof( argv[++ac] ); break;
+      case 'P': ack_loss = atof( argv[++ac] ); break;
+      case 'S': seed = atol( argv[++ac] ); break;
+      case 'e': exit_done = true; break;
+      case 'v': verbose = true; break;
+      case 'h':
+      default:
+        usage();
+        return 0;
+    }
+    ++ac;
+  }
+  srand48( seed );
+
+  int fd = -1;
+  int slave = -1;
+  int listener = -1;
+  if ( inherited >= 0 ) {
+    fd = inherited;
+    fcntl( fd, F_SETFL, fcntl( fd, F_GETFL ) | O_NONBLOCK );
+    printf("fd:%d\n", fd );
+  } else if ( unix_path != NULL || tcp_port >= 0 ) {
+    if ( unix_path != NULL ) {
+      struct sockaddr_un sa;
+      memset( &sa, 0, sizeof(sa) );
+      sa.sun_family = AF_UNIX;
+      strncpy( sa.sun_path, unix_path, sizeof(sa.sun_path) - 1 );
+      unlink( unix_path );
+      listener = socket( AF_UNIX, SOCK_STREAM, 0 );
+      if ( listener < 0 || bind( listener, (struct sockaddr *)&sa, sizeof(sa) ) != 0 ) listener = -1;
+    } else {
+      struct sockaddr_in sa;
+      memset( &sa, 0, sizeof(sa) );
+      sa.sin_family = AF_INET;
+      sa.sin_port   = htons( tcp_port );
+      sa.sin_addr.s_addr = htonl( INADDR_ANY );
+      int one = 1;
+      listener = socket( AF_INET, SOCK_STREAM, 0 );
+      if ( listener >= 0 ) setsockopt( listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one) );
+      if ( listener < 0 || bind( listener, (struct sockaddr *)&sa, sizeof(sa) ) != 0 ) listener = -1;
+    }
+    if ( listener < 0 || listen( listener, 1 ) != 0 ) {
+      fprintf(stderr, "ERROR: cannot listen on the socket: %s\n", strerror( errno ) );
+      return 1;
+    }
+    if ( unix_path != NULL ) {
+      printf("unix:%s\n", unix_path );
+    } else {
+      printf("tcp:localhost:%d\n", tcp_port );
+    }
+  } else {
+    fd = posix_openpt( O_RDWR | O_NOCTTY | O_NONBLOCK );
+    if ( fd < 0 || grantpt( fd ) != 0 || unlockpt( fd ) != 0 ) {
+      fprintf(stderr, "ERROR: cannot open a pseudo-terminal: %s\n", strerror( errno ) );
+      return 1;
+    }
+    const char * device = ptsname( fd );
+    // keep the slave open (in raw mode) so that the master does not hang up
+    // between the connections of the tools
+    slave = open( device, O_RDWR | O_NOCTTY );
+    struct termios tio;
+    if ( slave < 0 || tcgetattr( slave, &tio ) != 0 ) {
+      fprintf(stderr, "ERROR: cannot open %s: %s\n", device, strerror( errno ) );
+      return 1;
+    }
+    cfmakeraw( &tio );
+    tcsetattr( slave, TCSANOW, &tio );
+    if ( link ) {
+      unlink( link );
+      if ( symlink( device, link ) != 0 ) {
+        fprintf(stderr, "WARNING: cannot link %s: %s\n", link, strerror( errno ) );
+        link = NULL;
+      }
+    }
+    printf("%s\n", link ? link : device );
+  }
+  fflush( stdout );
+  signal( SIGPIPE, SIG_IGN ); // a host that goes away is a hangup
+
+  signal( SIGINT,  on_signal );
+  signal( SIGTERM, on_signal );
+
+  Emulator * emu = new Emulator( fd, slave, x310, latency, bandwidth, loss, ack_loss );
+  if ( listener >= 0 ) emu->SetListener( listener );
+  emu->Start( mode, shots );
+  while ( running ) {
+    if ( ! emu->Step( 100000 ) ) {
+      fprintf(stderr, "ERROR: emulator i/o error: %s\n", strerror( errno ) );
+      break;
+    }
+    if ( exit_done && ! emu->Busy() ) break;
+  }
+  if ( verbose ) {
+    fprintf(stderr, "packets %lu (resent %lu) acked %lu (lost %lu) requests %lu lost replies %lu\n",
+            emu->n_packet, emu->n_resent, emu->n_acked, emu->n_ack_lost, emu->n_request, emu->n_lost );
+  }
+  delete emu;
+  if ( link ) unlink( link );
+  if ( slave >= 0 ) {
+    close( slave );
+    close( fd );
+  }
+  if ( listener >= 0 ) close( listener );
+  if ( unix_path != NULL ) unlink( unix_path );
+  return 0;
+}
+
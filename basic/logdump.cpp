@@ -0,0 +1,99 @@
+/** @file logdump.cpp
+ *
+ * @author marco corvi
+ * @date oct 2026
+ *
+ * @brief print a serial traffic capture file (distox.cap) in hex
+ * --------------------------------------------------------
+ *  Copyright This sowftare is distributed under GPL-3.0 or later
+ *  See the file COPYING.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "Serial.h" // SERIAL_CAPTURE_FILE
+#include "TrafficLog.h"
+
+#define BYTES_PER_LINE 16
+
+void usage()
+{
+  static bool usaged = false;
+  if ( usaged ) return;
+  usaged = true;
+  fprintf(stderr, "Usage: tlx_logdump [options] [capture_file]\n");
+  fprintf(stderr, "  print the records of a traffic capture [default %s]\n", SERIAL_CAPTURE_FILE );
+  fprintf(stderr, "  each line has time [s], delay from previous record [ms], R/W, length, bytes\n");
+  fprintf(stderr, "Options:\n");
+  fprintf(stderr, "  -r          print only the bytes read\n");
+  fprintf(stderr, "  -w          print only the bytes written\n");
+  fprintf(stderr, "  -s          print only a summary\n");
+  fprintf(stderr, "  -h          this help\n");
+}
+
+int main( int argc, char ** argv )
+{
+  const char * filename = SERIAL_CAPTURE_FILE;
+  unsigned char dir = 0; // 0: both directions
+  bool summary = false;
+
+  int ac = 1;
+  while ( ac < argc && argv[ac][0] == '-' ) {
+    switch ( argv[ac][1] ) {
+      case 'r':
+        dir = TRAFFIC_READ;
+        break;
+      case 'w':
+        dir = TRAFFIC_WRITE;
+        break;
+      case 's':
+        summary = true;
+        break;
+      case 'h':
+      default:
+        usage();
+        return 0;
+    }
+    ++ac;
+  }
+  if ( ac < argc ) filename = argv[ac];
+
+  TrafficReader reader;
+  if ( ! reader.Open( filename ) ) return 1;
+
+  unsigned char * buf = new unsigned char[ TRAFFIC_MAX_LEN ];
+  TrafficRecord rec;
+  uint64_t t0 = 0;
+  uint64_t tp = 0; // time of the previous printed record
+  uint64_t t1 = 0; // time of the last record
+  unsigned long n_rec[2]  = { 0, 0 }; // read, write
+  unsigned long n_byte[2] = { 0, 0 };
+  bool first = true;
+  while ( reader.Next( rec, buf ) ) {
+    if ( first ) {
+      t0 = tp = rec.usec;
+      first = false;
+    }
+    t1 = rec.usec;
+    int k = ( rec.dir == TRAFFIC_READ )? 0 : 1;
+    ++ n_rec[k];
+    n_byte[k] += rec.len;
+    if ( summary || ( dir != 0 && rec.dir != dir ) ) continue;
+    printf("%10.6f %8.3f %c %4u:", (rec.usec - t0)/1.0e6, (rec.usec - tp)/1.0e3, rec.dir, rec.len );
+    for ( unsigned int j = 0; j < rec.len; ++j ) {
+      if ( j > 0 && ( j % BYTES_PER_LINE ) == 0 ) printf("\n%27s", "");
+      printf(" %02x", buf[j] );
+    }
+    printf("\n");
+    tp = rec.usec;
+  }
+  if ( summary || first ) {
+    printf("read:  %lu records %lu bytes\n", n_rec[0], n_byte[0] );
+    printf("write: %lu records %lu bytes\n", n_rec[1], n_byte[1] );
+    if ( ! first ) printf("time:  %.6f s\n", (t1 - t0)/1.0e6 );
+  }
+  delete[] buf;
+  return 0;
+}
+
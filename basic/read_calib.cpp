@@ -22,6 +22,7 @@
 
 #include "defaults.h"
 #include "Serial.h"
+#include "MemoryPipeline.h"
 #include "Factors.h"
 
 #define N_COEFF 48
@@ -55,52 +56,21 @@
 #define COEFF2AMZZ( c ) ( C_2_D( c, 46) / FM )
 
 
-/** write to memory 4 bytes at a time the eight bytes at given address
+/** read the calibration coefficients with pipelined 0x38 requests
  * @param serial serial line (communication channel)
- * @param addr address (should be multiple of 4)
- * @param byte eight-byte array to write at (addr,addr+4)
+ * @param byte   coefficient array [output]
  *
- * @return true if memory has been changed, false otherwise
- * @note the previous content of the memory is written in byte[]
+ * @return true if all the coefficients have been read
  */
 bool
 read_coeffs( Serial * serial, unsigned char byte[N_COEFF] )
 {
   unsigned long addr = 0x8010;
-  unsigned long reply_addr;
-  unsigned char buf[8];
-  int i;
-  ssize_t nr;
-
-  for (int k=0; k<N_COEFF/4; ++k) {
-    buf[0] = 0x38;
-    buf[1] = (unsigned char)( addr & 0xff );
-    buf[2] = (unsigned char)( (addr>>8) & 0xff );
-    nr = serial->Write( buf, 3 ); // read data
-    nr = serial->Read( buf, 8 );
-    if ( nr > 0 ) {
-      if ( buf[0] != 0x38 ) {
-        fprintf(stderr, 
-                "ERROR: read() wrong reply packet at addr %04lx\n", addr);
-        return false;
-      }
-      reply_addr = ((unsigned long)(buf[2]))<<8 | buf[1];
-      if ( reply_addr != addr ) {
-        fprintf(stderr,
-                "ERROR: read() wrong reply addr %04lx at addr %04lx\n",
-                reply_addr, addr);
-        return false;
-      }
-      // for (i=3; i<7; ++i) fprintf(stderr, "%02x ", buf[i] );
-      for (i=0; i<4; ++i) byte[4*k+i] = buf[3+i];
-    } else if ( nr < 0 ) {
-      fprintf(stderr, "ERROR: read() error\n");
-      return false;
-    } else {
-      fprintf(stderr, "ERROR: read() read returns 0 bytes\n");
-      return false;
-    }
-    addr += 4;
+  MemoryPipeline pipeline( serial, N_COEFF/4 );
+  unsigned int nr = pipeline.ReadRange( addr, addr + N_COEFF, byte );
+  if ( nr != N_COEFF/4 ) {
+    fprintf(stderr, "ERROR: read %u of %d coeff words\n", nr, N_COEFF/4 );
+    return false;
   }
   return true;
 }
@@ -21,92 +21,12 @@
 
 #include "defaults.h"
 #include "Serial.h"
+#include "MemoryPipeline.h"
 
-#define N_COEFF 48
+#define N_COEFF    48
+#define N_COEFF_NL 52 /* with the G non-linearity (bytes 48-50, and 0xff) */
 
 
-/** write to memory 4 bytes at a time the eight bytes at given address
- * @param serial serial line (communication channel)
- * @param addr address (should be multiple of 4)
- * @param byte eight-byte array to write at (addr,addr+4)
- *
- * @return true if memory has been changed, false otherwise
- * @note the previous content of the memory is written in byte[]
- */
-bool
-write_memory( Serial * serial, unsigned long addr, unsigned char byte[8] )
-{
-  unsigned long reply_addr;
-  unsigned char buf[8];
-  unsigned char old_byte[8];
-  int i;
-  ssize_t nr;
-
-  addr = addr - (addr % 8);
-  assert( addr >= 0x8010 && addr < 0x8010+ N_COEFF  );
-  for (int k=0; k<2; ++k) {
-    buf[0] = 0x38;
-    buf[1] = (unsigned char)( addr & 0xff );
-    buf[2] = (unsigned char)( (addr>>8) & 0xff );
-    nr = serial->Write( buf, 3 ); // read data
-    nr = serial->Read( buf, 8 );
-    if ( nr > 0 ) {
-      if ( buf[0] != 0x38 ) {
-        fprintf(stderr, 
-                "ERROR: read() wrong reply packet at addr %04lx\n", addr);
-        return false;
-      }
-      reply_addr = ((unsigned long)(buf[2]))<<8 | buf[1];
-      if ( reply_addr != addr ) {
-        fprintf(stderr,
-                "ERROR: read() wrong reply addr %04lx at addr %04lx\n",
-                reply_addr, addr);
-        return false;
-      }
-      // for (i=3; i<7; ++i) fprintf(stderr, "%02x ", buf[i] );
-      for (i=0; i<4; ++i) old_byte[4*k+i] = buf[3+i];
-    } else if ( nr < 0 ) {
-      fprintf(stderr, "ERROR: read() error \n");
-      return false;
-    } else {
-      fprintf(stderr, "WARNING: read() read returns 0 bytes\n");
-      return false;
-    }
-
-    buf[0] = 0x39;
-    // buf[1] = (unsigned char)( addr & 0xff );
-    // buf[2] = (unsigned char)( (addr>>8) & 0xff );
-    for (i=0; i<4; ++i) buf[3+i] = byte[4*k+i];
-    nr = serial->Write( buf, 7 ); // write data
-    nr = serial->Read( buf, 8 );
-    if ( nr > 0 ) {
-      if ( buf[0] != 0x38 ) {
-        fprintf(stderr, 
-                "ERROR: write() wrong reply packet at addr %04lx\n", addr);
-        return false;
-      }
-      reply_addr = ((unsigned long)(buf[2]))<<8 | buf[1];
-      if ( reply_addr != addr ) {
-        fprintf(stderr,
-                "ERROR: write() wrong reply addr %04lx at addr %04lx\n",
-                reply_addr, addr);
-        return false;
-      }
-      // fprintf(stderr, "%04lx: ", addr );
-      // for (i=3; i<7; ++i) fprintf(stderr, "%02x ", buf[i] );
-      // fprintf(stderr, "\n");
-    } else if ( nr < 0 ) {
-      fprintf(stderr, "ERROR: write() error \n");
-      return false;
-    } else {
-      fprintf(stderr, "WARNING: write() read returns 0 bytes\n");
-      return false;
-    }
-    addr += 4;
-  }
-  return true;
-}
-
 void usage()
 {
   static bool printed_usage = false;
@@ -116,6 +36,8 @@ void usage()
     fprintf(stderr, "  -d device serail device [%s]\n", DEFAULT_DEVICE );
     fprintf(stderr, "  -z        default calibration coeffs\n");
     fprintf(stderr, "  -h        help\n");
+    fprintf(stderr, "The coeff_file has %d coeff bytes, or %d if the G non-linearity\n", N_COEFF, N_COEFF_NL );
+    fprintf(stderr, "has been fitted (tlx_calib -n)\n");
   }
   printed_usage = true;
 }
@@ -126,14 +48,16 @@ int main( int argc, char ** argv )
   const char * device = DEFAULT_DEVICE;
   unsigned long addr = 0x8010;
   char * coeff_file = NULL;
-  unsigned char coeff[ N_COEFF ] = {
+  unsigned char coeff[ N_COEFF_NL ] = {
     0x00, 0x00, 0x00, 0x40, 0x00, 0x00, 0x00, 0x00,
     0x00, 0x00, 0x00, 0x00, 0x00, 0x40, 0x00, 0x00,
     0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x40,
     0x00, 0x00, 0x00, 0x40, 0x00, 0x00, 0x00, 0x00,
     0x00, 0x00, 0x00, 0x00, 0x00, 0x40, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x40
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x40,
+    0xff, 0xff, 0xff, 0xff
   };
+  int nc = N_COEFF;
     
   bool zero_calib = false;
 
@@ -181,10 +105,23 @@ int main( int argc, char ** argv )
       }
       coeff[k] = (unsigned char)(tmp);
     }
+    // the non-linearity bytes, if any, are hex "0x" words before the text
+    char tok[16];
+    int k = N_COEFF;
+    while ( k < N_COEFF_NL && fscanf(fp, "%15s", tok ) == 1 && strncmp( tok, "0x", 2 ) == 0 ) {
+      coeff[k++] = (unsigned char)strtoul( tok, NULL, 16 );
+    }
+    if ( k == N_COEFF_NL ) {
+      nc = N_COEFF_NL;
+    } else if ( k > N_COEFF ) {
+      fprintf(stderr, "ERROR: Failed to read coeff (index %d)\n", k );
+      fclose( fp );
+      return 0;
+    }
     fclose( fp );
   }
 
-  unsigned long end = addr +  N_COEFF ;
+  unsigned long end = addr + nc;
   Serial serial( device );
 
   if ( ! serial.Open( ) ) {
@@ -192,17 +129,22 @@ int main( int argc, char ** argv )
     return 1;
   }
 
+  // write every word in one burst, then read them back in one burst
+  MemoryPipeline pipeline( &serial, nc/4 );
+  unsigned int nv = pipeline.WriteVerify( addr, end, coeff );
+  serial.Close();
+  if ( nv != (unsigned int)nc/4 ) {
+    fprintf(stderr, "ERROR: verified %u of %d coeff words\n", nv, nc/4 );
+    return 1;
+  }
   unsigned char * buf = &(coeff[0]);
   while ( addr < end ) {
-    if ( ! write_memory( &serial, addr, buf ) ) break;
     fprintf(stdout, "%04lx: ", addr );
-    for (int i=0; i<8; ++i) fprintf(stdout, "0x%02x ", buf[i] );
+    for (int i=0; i<8 && addr+i < end; ++i) fprintf(stdout, "0x%02x ", buf[i] );
     fprintf(stdout, "\n");
     addr += 8;
     buf += 8;
   }
-
-  serial.Close();
   return 0;
 }
 
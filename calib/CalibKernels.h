@@ -0,0 +1,408 @@
+/** @file CalibKernels.h
+ *
+ * @author marco corvi
+ * @date oct 2026
+ *
+ * @brief column store of calibration vectors and the vector kernels of the optimization
+ *
+ * At each iteration the optimization transforms every G and M sample with
+ * the affine map b + a * v, and sums the outer products of the optimal
+ * vectors with the inputs. CalibColumns keeps n vectors as three arrays,
+ * x, y, z (structure of arrays), padded with zero vectors to a multiple of
+ * CALIB_LANES, and the kernels process CALIB_LANES samples at a time:
+ * with AVX2 on x86-64, with NEON on aarch64, and with plain loops on the
+ * other targets. The AVX2 kernels are compiled for the avx2 target only,
+ * so the binary runs on every x86-64 CPU: they are used when the CPU has
+ * AVX2 (always, if the whole build is -mavx2), the plain loops otherwise.
+ *
+ * The result does not depend on the kernel. calib_affine() computes each
+ * component with the same operations, in the same order, as the Matrix
+ * and Vector operators. calib_outer_sum() keeps CALIB_LANES partial sums
+ * (lane l sums the samples l, l+CALIB_LANES, ...) and adds them in a
+ * fixed order at the end. The kernels multiply and add separately: do not
+ * let the compiler fuse them (-ffp-contract=off) if the same bits are
+ * needed on targets with and without FMA.
+ * --------------------------------------------------------
+ *  Copyright This sowftare is distributed under GPL-3.0 or later
+ *  See the file COPYING.
+ */
+#ifndef CALIB_KERNELS_H
+#define CALIB_KERNELS_H
+
+#include <string.h>
+
+#include "Vector.h"
+#include "Matrix.h"
+
+#if defined( __x86_64__ ) && defined( __GNUC__ )
+  #include <immintrin.h>
+  #define CALIB_AVX2
+  #if defined( __AVX2__ )
+    #define CALIB_AVX2_TARGET
+  #else
+    #define CALIB_AVX2_TARGET __attribute__(( target( "avx2" ) ))
+  #endif
+#elif defined( __aarch64__ ) && defined( __ARM_NEON )
+  #include <arm_neon.h>
+  #define CALIB_NEON
+#endif
+
+#define CALIB_LANES 4 /* samples per kernel step */
+
+/** array of vectors, stored by components
+ */
+class CalibColumns
+{
+  public:
+    unsigned int size;      //!< number of vectors
+    unsigned int capacity;  //!< size of the arrays (multiple of CALIB_LANES)
+    double * x;             //!< X components
+    double * y;             //!< Y components
+    double * z;             //!< Z components
+
+  public:
+    /** cstr
+     */
+    CalibColumns()
+      : size( 0 )
+      , capacity( 0 )
+      , x( NULL )
+      , y( NULL )
+      , z( NULL )
+    { }
+
+    ~CalibColumns() { Free(); }
+
+    /** set the number of vectors: all the vectors are set to zero
+     * @param n   number of vectors
+     */
+    void Resize( unsigned int n )
+    {
+      unsigned int cap = Padded( n );
+      if ( cap > capacity ) {
+        Free();
+        x = new double[ cap ];
+        y = new double[ cap ];
+        z = new double[ cap ];
+        capacity = cap;
+      }
+      size = n;
+      Zero();
+    }
+
+    /** set all the vectors to zero
+     */
+    void Zero()
+    {
+      if ( capacity == 0 ) return;
+      memset( x, 0, capacity * sizeof(double) );
+      memset( y, 0, capacity * sizeof(double) );
+      memset( z, 0, capacity * sizeof(double) );
+    }
+
+    /** get a vector
+     * @param k   vector index
+     */
+    Vector Get( unsigned int k ) const { return Vector( x[k], y[k], z[k] ); }
+
+    /** set a vector
+     * @param k   vector index
+     * @param v   vector
+     */
+    void Set( unsigned int k, const Vector & v )
+    {
+      x[k] = v.X();
+      y[k] = v.Y();
+      z[k] = v.Z();
+    }
+
+    /** number of vectors rounded up to a multiple of CALIB_LANES
+     * @param n   number of vectors
+     */
+    static unsigned int Padded( unsigned int n )
+    {
+      return ( n + CALIB_LANES - 1 ) / CALIB_LANES * CALIB_LANES;
+    }
+
+  private:
+    void Free()
+    {
+      delete[] x;
+      delete[] y;
+      delete[] z;
+      x = y = z = NULL;
+      capacity = 0;
+    }
+
+    CalibColumns( const CalibColumns & );
+    CalibColumns & operator=( const CalibColumns & );
+};
+
+/** add the lanes of a partial sum
+ * @param l   partial sums
+ */
+inline double
+calib_lanes_sum( const double l[ CALIB_LANES ] )
+{
+  return ( l[0] + l[1] ) + ( l[2] + l[3] );
+}
+
+/** @return true if the AVX2 kernels can run on this CPU
+ */
+inline bool
+calib_has_avx2()
+{
+#if defined( __AVX2__ )
+  return true;
+#elif defined( CALIB_AVX2 )
+  return __builtin_cpu_supports( "avx2" );
+#else
+  return false;
+#endif
+}
+
+/** @return the name of the kernels in use
+ */
+inline const char *
+calib_kernel()
+{
+#if defined( CALIB_NEON )
+  return "neon";
+#else
+  return calib_has_avx2() ? "avx2" : "c++";
+#endif
+}
+
+#if defined( CALIB_AVX2 )
+/** affine transform, AVX2 kernel (@see calib_affine)
+ */
+CALIB_AVX2_TARGET inline void
+calib_affine_avx2( const Matrix & a, const Vector & b, const CalibColumns & in, CalibColumns & out )
+{
+  const unsigned int n = CalibColumns::Padded( in.size );
+  const double * x = in.x;
+  const double * y = in.y;
+  const double * z = in.z;
+  const __m256d bx  = _mm256_set1_pd( b.X() );
+  const __m256d by  = _mm256_set1_pd( b.Y() );
+  const __m256d bz  = _mm256_set1_pd( b.Z() );
+  const __m256d axx = _mm256_set1_pd( a.X().X() );
+  const __m256d axy = _mm256_set1_pd( a.X().Y() );
+  const __m256d axz = _mm256_set1_pd( a.X().Z() );
+  const __m256d ayx = _mm256_set1_pd( a.Y().X() );
+  const __m256d ayy = _mm256_set1_pd( a.Y().Y() );
+  const __m256d ayz = _mm256_set1_pd( a.Y().Z() );
+  const __m256d azx = _mm256_set1_pd( a.Z().X() );
+  const __m256d azy = _mm256_set1_pd( a.Z().Y() );
+  const __m256d azz = _mm256_set1_pd( a.Z().Z() );
+  for ( unsigned int k = 0; k < n; k += CALIB_LANES ) {
+    __m256d vx = _mm256_loadu_pd( x + k );
+    __m256d vy = _mm256_loadu_pd( y + k );
+    __m256d vz = _mm256_loadu_pd( z + k );
+    _mm256_storeu_pd( out.x + k, _mm256_add_pd( bx, _mm256_add_pd( _mm256_add_pd(
+        _mm256_mul_pd( axx, vx ), _mm256_mul_pd( axy, vy ) ), _mm256_mul_pd( axz, vz ) ) ) );
+    _mm256_storeu_pd( out.y + k, _mm256_add_pd( by, _mm256_add_pd( _mm256_add_pd(
+        _mm256_mul_pd( ayx, vx ), _mm256_mul_pd( ayy, vy ) ), _mm256_mul_pd( ayz, vz ) ) ) );
+    _mm256_storeu_pd( out.z + k, _mm256_add_pd( bz, _mm256_add_pd( _mm256_add_pd(
+        _mm256_mul_pd( azx, vx ), _mm256_mul_pd( azy, vy ) ), _mm256_mul_pd( azz, vz ) ) ) );
+  }
+}
+#endif
+
+/** affine transform, NEON or plain kernel (@see calib_affine)
+ */
+inline void
+calib_affine_lanes( const Matrix & a, const Vector & b, const CalibColumns & in, CalibColumns & out )
+{
+  const unsigned int n = CalibColumns::Padded( in.size );
+  const double * x = in.x;
+  const double * y = in.y;
+  const double * z = in.z;
+#if defined( CALIB_NEON )
+  const float64x2_t bx  = vdupq_n_f64( b.X() );
+  const float64x2_t by  = vdupq_n_f64( b.Y() );
+  const float64x2_t bz  = vdupq_n_f64( b.Z() );
+  const float64x2_t axx = vdupq_n_f64( a.X().X() );
+  const float64x2_t axy = vdupq_n_f64( a.X().Y() );
+  const float64x2_t axz = vdupq_n_f64( a.X().Z() );
+  const float64x2_t ayx = vdupq_n_f64( a.Y().X() );
+  const float64x2_t ayy = vdupq_n_f64( a.Y().Y() );
+  const float64x2_t ayz = vdupq_n_f64( a.Y().Z() );
+  const float64x2_t azx = vdupq_n_f64( a.Z().X() );
+  const float64x2_t azy = vdupq_n_f64( a.Z().Y() );
+  const float64x2_t azz = vdupq_n_f64( a.Z().Z() );
+  for ( unsigned int k = 0; k < n; k += 2 ) {
+    float64x2_t vx = vld1q_f64( x + k );
+    float64x2_t vy = vld1q_f64( y + k );
+    float64x2_t vz = vld1q_f64( z + k );
+    vst1q_f64( out.x + k, vaddq_f64( bx, vaddq_f64( vaddq_f64(
+        vmulq_f64( axx, vx ), vmulq_f64( axy, vy ) ), vmulq_f64( axz, vz ) ) ) );
+    vst1q_f64( out.y + k, vaddq_f64( by, vaddq_f64( vaddq_f64(
+        vmulq_f64( ayx, vx ), vmulq_f64( ayy, vy ) ), vmulq_f64( ayz, vz ) ) ) );
+    vst1q_f64( out.z + k, vaddq_f64( bz, vaddq_f64( vaddq_f64(
+        vmulq_f64( azx, vx ), vmulq_f64( azy, vy ) ), vmulq_f64( azz, vz ) ) ) );
+  }
+#else
+  const Vector & ax = a.X();
+  const Vector & ay = a.Y();
+  const Vector & az = a.Z();
+  for ( unsigned int k = 0; k < n; ++k ) {
+    double vx = x[k];
+    double vy = y[k];
+    double vz = z[k];
+    out.x[k] = b.X() + ( ax.X() * vx + ax.Y() * vy + ax.Z() * vz );
+    out.y[k] = b.Y() + ( ay.X() * vx + ay.Y() * vy + ay.Z() * vz );
+    out.z[k] = b.Z() + ( az.X() * vx + az.Y() * vy + az.Z() * vz );
+  }
+#endif
+}
+
+/** affine transform of an array of vectors: out[k] = b + a * in[k]
+ * @param a    matrix
+ * @param b    offset
+ * @param in   input vectors
+ * @param out  output vectors (same size as the input)
+ * @note the padding vectors are transformed too
+ */
+inline void
+calib_affine( const Matrix & a, const Vector & b, const CalibColumns & in, CalibColumns & out )
+{
+#if defined( CALIB_AVX2 )
+  if ( calib_has_avx2() ) {
+    calib_affine_avx2( a, b, in, out );
+    return;
+  }
+#endif
+  calib_affine_lanes( a, b, in, out );
+}
+
+#if defined( CALIB_AVX2 )
+/** lane sums of calib_outer_sum(), AVX2 kernel
+ * @param l   partial sums: su (3), suv by rows (9) [output]
+ */
+CALIB_AVX2_TARGET inline void
+calib_outer_lanes_avx2( const CalibColumns & u, const CalibColumns & v, const double * w,
+                        double l[12][ CALIB_LANES ] )
+{
+  const unsigned int n = CalibColumns::Padded( u.size );
+  __m256d s[12];
+  for ( int j = 0; j < 12; ++j ) s[j] = _mm256_setzero_pd();
+  for ( unsigned int k = 0; k < n; k += CALIB_LANES ) {
+    __m256d wk = _mm256_loadu_pd( w + k );
+    __m256d ux = _mm256_mul_pd( wk, _mm256_loadu_pd( u.x + k ) );
+    __m256d uy = _mm256_mul_pd( wk, _mm256_loadu_pd( u.y + k ) );
+    __m256d uz = _mm256_mul_pd( wk, _mm256_loadu_pd( u.z + k ) );
+    __m256d vx = _mm256_loadu_pd( v.x + k );
+    __m256d vy = _mm256_loadu_pd( v.y + k );
+    __m256d vz = _mm256_loadu_pd( v.z + k );
+    s[ 0] = _mm256_add_pd( s[ 0], ux );
+    s[ 1] = _mm256_add_pd( s[ 1], uy );
+    s[ 2] = _mm256_add_pd( s[ 2], uz );
+    s[ 3] = _mm256_add_pd( s[ 3], _mm256_mul_pd( vx, ux ) );
+    s[ 4] = _mm256_add_pd( s[ 4], _mm256_mul_pd( vy, ux ) );
+    s[ 5] = _mm256_add_pd( s[ 5], _mm256_mul_pd( vz, ux ) );
+    s[ 6] = _mm256_add_pd( s[ 6], _mm256_mul_pd( vx, uy ) );
+    s[ 7] = _mm256_add_pd( s[ 7], _mm256_mul_pd( vy, uy ) );
+    s[ 8] = _mm256_add_pd( s[ 8], _mm256_mul_pd( vz, uy ) );
+    s[ 9] = _mm256_add_pd( s[ 9], _mm256_mul_pd( vx, uz ) );
+    s[10] = _mm256_add_pd( s[10], _mm256_mul_pd( vy, uz ) );
+    s[11] = _mm256_add_pd( s[11], _mm256_mul_pd( vz, uz ) );
+  }
+  for ( int j = 0; j < 12; ++j ) _mm256_storeu_pd( l[j], s[j] );
+}
+#endif
+
+/** lane sums of calib_outer_sum(), NEON or plain kernel
+ * @param l   partial sums: su (3), suv by rows (9) [output]
+ */
+inline void
+calib_outer_lanes( const CalibColumns & u, const CalibColumns & v, const double * w,
+                   double l[12][ CALIB_LANES ] )
+{
+  const unsigned int n = CalibColumns::Padded( u.size );
+#if defined( CALIB_NEON )
+  float64x2_t s[12][2]; // lanes 0-1 and 2-3
+  for ( int j = 0; j < 12; ++j ) s[j][0] = s[j][1] = vdupq_n_f64( 0.0 );
+  for ( unsigned int k = 0; k < n; k += 2 ) {
+    int h = ( k / 2 ) % 2;
+    float64x2_t wk = vld1q_f64( w + k );
+    float64x2_t ux = vmulq_f64( wk, vld1q_f64( u.x + k ) );
+    float64x2_t uy = vmulq_f64( wk, vld1q_f64( u.y + k ) );
+    float64x2_t uz = vmulq_f64( wk, vld1q_f64( u.z + k ) );
+    float64x2_t vx = vld1q_f64( v.x + k );
+    float64x2_t vy = vld1q_f64( v.y + k );
+    float64x2_t vz = vld1q_f64( v.z + k );
+    s[ 0][h] = vaddq_f64( s[ 0][h], ux );
+    s[ 1][h] = vaddq_f64( s[ 1][h], uy );
+    s[ 2][h] = vaddq_f64( s[ 2][h], uz );
+    s[ 3][h] = vaddq_f64( s[ 3][h], vmulq_f64( vx, ux ) );
+    s[ 4][h] = vaddq_f64( s[ 4][h], vmulq_f64( vy, ux ) );
+    s[ 5][h] = vaddq_f64( s[ 5][h], vmulq_f64( vz, ux ) );
+    s[ 6][h] = vaddq_f64( s[ 6][h], vmulq_f64( vx, uy ) );
+    s[ 7][h] = vaddq_f64( s[ 7][h], vmulq_f64( vy, uy ) );
+    s[ 8][h] = vaddq_f64( s[ 8][h], vmulq_f64( vz, uy ) );
+    s[ 9][h] = vaddq_f64( s[ 9][h], vmulq_f64( vx, uz ) );
+    s[10][h] = vaddq_f64( s[10][h], vmulq_f64( vy, uz ) );
+    s[11][h] = vaddq_f64( s[11][h], vmulq_f64( vz, uz ) );
+  }
+  for ( int j = 0; j < 12; ++j ) {
+    vst1q_f64( l[j],     s[j][0] );
+    vst1q_f64( l[j] + 2, s[j][1] );
+  }
+#else
+  memset( l, 0, 12 * CALIB_LANES * sizeof(double) );
+  for ( unsigned int k = 0; k < n; k += CALIB_LANES ) {
+    for ( int i = 0; i < CALIB_LANES; ++i ) {
+      double ux = w[k+i] * u.x[k+i];
+      double uy = w[k+i] * u.y[k+i];
+      double uz = w[k+i] * u.z[k+i];
+      double vx = v.x[k+i];
+      double vy = v.y[k+i];
+      double vz = v.z[k+i];
+      l[ 0][i] += ux;
+      l[ 1][i] += uy;
+      l[ 2][i] += uz;
+      l[ 3][i] += vx * ux;
+      l[ 4][i] += vy * ux;
+      l[ 5][i] += vz * ux;
+      l[ 6][i] += vx * uy;
+      l[ 7][i] += vy * uy;
+      l[ 8][i] += vz * uy;
+      l[ 9][i] += vx * uz;
+      l[10][i] += vy * uz;
+      l[11][i] += vz * uz;
+    }
+  }
+#endif
+}
+
+/** weighted sums of an array of vectors and of its outer products with another array:
+ *    su  = sum_k w[k] * u[k]
+ *    suv = sum_k ( w[k] * u[k] ) & v[k]
+ * @param u    first vectors
+ * @param v    second vectors (same size as u)
+ * @param w    weights, usually 1 or 0 (padded to a multiple of CALIB_LANES)
+ * @param su   sum of the first vectors [output]
+ * @param suv  sum of the outer products [output]
+ */
+inline void
+calib_outer_sum( const CalibColumns & u, const CalibColumns & v, const double * w,
+                 Vector & su, Matrix & suv )
+{
+  double l[12][ CALIB_LANES ]; // partial sums: su (3), suv by rows (9)
+#if defined( CALIB_AVX2 )
+  if ( calib_has_avx2() ) {
+    calib_outer_lanes_avx2( u, v, w, l );
+  } else {
+    calib_outer_lanes( u, v, w, l );
+  }
+#else
+  calib_outer_lanes( u, v, w, l );
+#endif
+  su = Vector( calib_lanes_sum( l[0] ), calib_lanes_sum( l[1] ), calib_lanes_sum( l[2] ) );
+  suv = Matrix( Vector( calib_lanes_sum( l[3] ), calib_lanes_sum( l[ 4] ), calib_lanes_sum( l[ 5] ) ),
+                Vector( calib_lanes_sum( l[6] ), calib_lanes_sum( l[ 7] ), calib_lanes_sum( l[ 8] ) ),
+                Vector( calib_lanes_sum( l[9] ), calib_lanes_sum( l[10] ), calib_lanes_sum( l[11] ) ) );
+}
+
+#endif // CALIB_KERNELS_H
@@ -0,0 +1,273 @@
+/** @file CalibOnline.cpp
+ *
+ * @author marco corvi
+ * @date oct 2026
+ *
+ * @brief calibration while the calibration shots come in
+ *
+ * --------------------------------------------------------
+ *  Copyright This sowftare is distributed under GPL-3.0 or later
+ *  See the file COPYING.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include "Factors.h"
+#include "CalibOnline.h"
+#include "DistoX.h"
+
+// angle of a vector with the plane normal to the X axis [degrees]: for G
+// and M it does not depend on the roll, only on the direction of the shot
+//
+static double
+direction_angle( int16_t x, int16_t y, int16_t z )
+{
+  double n = sqrt( (double)x * x + (double)y * y + (double)z * z );
+  return ( n > 0.0 )? asin( x / n ) * RAD2GRAD : 0.0;
+}
+
+// a pair off the direction of its group closes the group short: the
+// group is solved as it is, before the pair starts the next one. The
+// index of the pair is dense (the lost shots have none)
+//
+bool
+CalibOnline::Add( int16_t gx, int16_t gy, int16_t gz, int16_t mx, int16_t my, int16_t mz )
+{
+  bool ret = false;
+  double ag = direction_angle( gx, gy, gz );
+  double am = direction_angle( mx, my, mz );
+  if ( groups == 0 || shots >= ONLINE_GROUP ) {
+    NewGroup();
+  } else if ( has_ref && ( fabs( ag - ref_g ) > ONLINE_GROUP_ANGLE
+                        || fabs( am - ref_m ) > ONLINE_GROUP_ANGLE ) ) {
+    lost  += ONLINE_GROUP - shots; // the rest of the group was not seen
+    count += ONLINE_GROUP - shots;
+    ret = Next();
+    NewGroup();
+  }
+  if ( ! has_ref ) {
+    has_ref = true;
+    ref_g = ag;
+    ref_m = am;
+  }
+  calib.AddValues( gx, gy, gz, mx, my, mz, pairs, groups - 1 );
+  ++ pairs;
+  ++ count;
+  ++ shots;
+  if ( shots == ONLINE_GROUP && Next() ) ret = true;
+  return ret;
+}
+
+bool
+CalibOnline::Add( const unsigned char g[8], const unsigned char m[8] )
+{
+  return Add( CALIB_2_X( g ), CALIB_2_Y( g ), CALIB_2_Z( g ),
+              CALIB_2_X( m ), CALIB_2_Y( m ), CALIB_2_Z( m ) );
+}
+
+bool
+CalibOnline::AddLost()
+{
+  if ( groups == 0 || shots >= ONLINE_GROUP ) NewGroup();
+  ++ lost;
+  ++ count;
+  ++ shots;
+  return shots == ONLINE_GROUP && Next();
+}
+
+void
+CalibOnline::Reset()
+{
+  calib.Clear();
+  calib.PrepareOptimize();
+  count  = 0;
+  pairs  = 0;
+  lost   = 0;
+  groups = 0;
+  shots  = 0;
+  has_ref = false;
+  solves = 0;
+  warm   = false;
+  valid  = false;
+  iter   = 0;
+  delta  = 0.0;
+  error  = 0.0;
+  dip    = 0.0;
+}
+
+void
+CalibOnline::NewGroup()
+{
+  ++ groups;
+  shots   = 0;
+  has_ref = false;
+}
+
+bool
+CalibOnline::Next()
+{
+  if ( pairs < ONLINE_MIN ) return false;
+  Solve();
+  return true;
+}
+
+// the first solve, and one after a failed solve, is the least squares fit:
+// it gets the handedness of the G frame right also with few groups, where
+// the iteration from the identity may end far off. The next ones are the
+// iteration from the last coefficients, with the running input sums:
+// a new group changes them little. A warm solve that ends degenerate, or
+// far from the last dip, is done again from scratch: otherwise each next
+// warm solve would start from it, and stop there.
+//
+void
+CalibOnline::Solve()
+{
+  iter = 0;
+  if ( warm ) {
+    delta = 0.5; // convergence threshold, as tlx_calib
+    iter = calib.OptimizeWarm( delta, error, max_it );
+    valid = Check( true );
+  }
+  if ( ! warm || ! valid ) {
+    delta = 0.5;
+    iter += calib.OptimizeLM( delta, error, max_it );
+    valid = Check( false );
+  }
+  warm = valid;
+  if ( valid ) dip = calib.GetDipAngle();
+  ++ solves;
+}
+
+bool
+CalibOnline::Check( bool check_dip ) const
+{
+  if ( ! ( delta >= 0.0 && delta < 90.0 ) ) return false; // the solve failed (nan)
+  if ( ! calib.CheckCoeffs() ) return false;
+  return ! check_dip || fabs( calib.GetDipAngle() - dip ) <= ONLINE_DIP_STEP;
+}
+
+// -----------------------------------------------------
+#ifdef TEST
+
+#define TEST_DIRS  14
+#define TEST_SHOTS ( TEST_DIRS * ONLINE_GROUP )
+
+static unsigned int test_seed;
+
+// deterministic noise, uniform in [-1,1)
+static double
+test_noise()
+{
+  test_seed = test_seed * 1103515245u + 12345u;
+  return ( ( test_seed >> 8 ) & 0xffff ) / 32768.0 - 1.0;
+}
+
+// reading of a sensor with matrix a and offset b for the unit vector v
+static void
+test_read( const Matrix & a, const Vector & b, const Vector & v, int16_t r[3] )
+{
+  Vector w = a * v + b;
+  r[0] = (int16_t)floor( w.X() * FV + 8.0 * test_noise() + 0.5 );
+  r[1] = (int16_t)floor( w.Y() * FV + 8.0 * test_noise() + 0.5 );
+  r[2] = (int16_t)floor( w.Z() * FV + 8.0 * test_noise() + 0.5 );
+}
+
+// G and M readings of the shot k: direction k / ONLINE_GROUP, roll
+// k % ONLINE_GROUP. The world frame is east, north, up, the device X axis
+// is the laser.
+static void
+test_shot( int k, int16_t g[3], int16_t m[3] )
+{
+  static const double clino[ TEST_DIRS ] = { 0, 40, -40, 70, -20, 20, -60, 50, -10, 30, -50, 10, 60, -30 };
+  static const Matrix aG( Vector( 1.02, 0.01, -0.02 ), Vector( -0.01, 0.98, 0.03 ), Vector( 0.02, -0.01, 1.01 ) );
+  static const Vector bG( 0.01, -0.02, 0.015 );
+  static const Matrix aM( Vector( 0.97, -0.02, 0.01 ), Vector( 0.03, 1.03, -0.01 ), Vector( -0.01, 0.02, 0.99 ) );
+  static const Vector bM( -0.03, 0.02, 0.01 );
+  double az = ( k / ONLINE_GROUP ) * 3 * 360.0 / TEST_DIRS * GRAD2RAD;
+  double cl = clino[ k / ONLINE_GROUP ] * GRAD2RAD;
+  double rl = ( ( k % ONLINE_GROUP ) * 90.0 + 10.0 ) * GRAD2RAD;
+  Vector x( cos(cl) * sin(az), cos(cl) * cos(az), sin(cl) );
+  Vector y0( cos(az), -sin(az), 0.0 );
+  Vector z0 = x % y0;
+  Vector y = y0 * cos(rl) + z0 * sin(rl);
+  Vector z = z0 * cos(rl) - y0 * sin(rl);
+  double dip = 60.0 * GRAD2RAD;
+  Vector up( 0.0, 0.0, 1.0 );
+  Vector mag( 0.0, cos(dip), -sin(dip) );
+  test_read( aG, bG, Vector( up * x, up * y, up * z ), g );
+  test_read( aM, bM, Vector( mag * x, mag * y, mag * z ), m );
+}
+
+// feed the shots, but for the lost ones (lost[k] = 1: both packets,
+// reported with AddLost; lost[k] = 2: both packets, not seen)
+// @return number of failed checks
+static int
+test_run( const char * name, const int lost[ TEST_SHOTS ], unsigned int n_lost )
+{
+  int fail = 0;
+  int dir[ TEST_SHOTS ]; // direction of each pair
+  unsigned int np = 0;
+  test_seed = 1;
+  CalibOnline online;
+  for ( int k = 0; k < TEST_SHOTS; ++k ) {
+    int16_t g[3], m[3];
+    test_shot( k, g, m );
+    if ( lost[k] == 1 ) {
+      online.AddLost();
+    } else if ( lost[k] == 0 ) {
+      online.Add( g[0], g[1], g[2], m[0], m[1], m[2] );
+      dir[ np ++ ] = k / ONLINE_GROUP;
+    }
+  }
+  Calibration & calib = online.GetCalibration();
+  for ( unsigned int j = 0; j < np; ++j ) {
+    if ( calib.GetGroup( j ) != dir[j] ) {
+      fprintf(stderr, "%s: pair %d in group %d, not %d\n", name, j, calib.GetGroup( j ), dir[j] );
+      ++ fail;
+    }
+  }
+  if ( online.Groups() != TEST_DIRS || online.Size() != TEST_SHOTS || online.Lost() != n_lost ) {
+    fprintf(stderr, "%s: groups %d shots %d lost %d\n", name, online.Groups(), online.Size(), online.Lost() );
+    ++ fail;
+  }
+  if ( ! online.Valid() || online.Delta() > 0.1 ) {
+    fprintf(stderr, "%s: delta %.4f %s\n", name, online.Delta(), online.Valid() ? "" : "not valid" );
+    ++ fail;
+  }
+  printf("%-24s groups %2d lost %d delta %.4f max error %.4f dip %.2f: %s\n", name,
+    online.Groups(), online.Lost(), online.Delta(), online.Error(), online.Dip(), fail ? "FAIL" : "ok" );
+  return fail;
+}
+
+int main()
+{
+  int fail = 0;
+  int lost[ TEST_SHOTS ];
+
+  memset( lost, 0, sizeof(lost) );
+  fail += test_run( "no loss", lost, 0 );
+
+  lost[21] = 1;
+  fail += test_run( "shot 21 reported", lost, 1 );
+
+  for ( int k = 20; k < 24; ++k ) {
+    memset( lost, 0, sizeof(lost) );
+    lost[k] = 2;
+    char name[32];
+    sprintf( name, "shot %d not seen", k );
+    fail += test_run( name, lost, 1 );
+  }
+
+  memset( lost, 0, sizeof(lost) );
+  lost[9] = 2;
+  lost[30] = 1;
+  lost[31] = 2;
+  lost[44] = 2;
+  lost[45] = 2;
+  fail += test_run( "shots 9 30-31 44-45", lost, 5 );
+
+  return fail ? 1 : 0;
+}
+
+#endif
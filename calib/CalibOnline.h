@@ -0,0 +1,178 @@
+/** @file CalibOnline.h
+ *
+ * @author marco corvi
+ * @date oct 2026
+ *
+ * @brief calibration while the calibration shots come in
+ *
+ * The G-M pairs are added as they are taken off the calibration queue
+ * of the Protocol. The shots of the calibration procedure come in groups
+ * of ONLINE_GROUP, at the same direction with different rolls. A pair
+ * goes to the group of the previous one, unless that group is full or
+ * the direction of the pair is off by more than ONLINE_GROUP_ANGLE from
+ * that of the first pair of the group. The direction is given by the
+ * angles of G and of M with the plane normal to the laser (X) axis: they
+ * do not depend on the roll. After each group (from the ONLINE_MIN-th
+ * pair on) the coefficients are computed again: the first
+ * time by Calibration::OptimizeLM(), then by Calibration::OptimizeWarm()
+ * from the last coefficients, so that the operator sees the error and the
+ * dip angle after each direction and can stop as soon as they are good.
+ * A warm solve is accepted only if the coefficients are not degenerate
+ * (Calibration::CheckCoeffs) and the dip angle moves by less than
+ * ONLINE_DIP_STEP; otherwise the coefficients are computed from scratch.
+ *
+ * A shot that the Protocol drops (an orphan packet) should be reported
+ * with AddLost(): it takes its place in the group. A shot lost with both
+ * its packets is not seen: its group is closed short by the first pair
+ * of the next direction, and the missing shots are counted as lost.
+ * --------------------------------------------------------
+ *  Copyright This sowftare is distributed under GPL-3.0 or later
+ *  See the file COPYING.
+ */
+#ifndef CALIB_ONLINE_H
+#define CALIB_ONLINE_H
+
+#include <stdint.h>
+
+#include "Calibration.h"
+
+#define ONLINE_GROUP  4   /* shots per group */
+#define ONLINE_MIN   16   /* number of shots of the first solve */
+#define ONLINE_DIP_STEP 5.0 /* max change of the dip angle of a warm solve [degrees] */
+#define ONLINE_GROUP_ANGLE 10.0 /* max change of direction within a group [degrees] */
+
+class CalibOnline
+{
+  private:
+    Calibration calib;     //!< calibration
+    unsigned int count;    //!< number of shots (pairs and lost shots)
+    unsigned int pairs;    //!< number of pairs
+    unsigned int lost;     //!< number of lost shots
+    unsigned int groups;   //!< number of groups
+    unsigned int shots;    //!< number of shots of the last group (pairs and lost shots)
+    bool has_ref;          //!< whether the last group has a pair
+    double ref_g;          //!< direction of the first pair of the last group, G angle [degrees]
+    double ref_m;          //!< direction of the first pair of the last group, M angle [degrees]
+    unsigned int max_it;   //!< max number of iterations of a solve
+    unsigned int solves;   //!< number of solves
+    bool warm;             //!< whether the next solve starts from the coefficients
+    bool valid;            //!< whether the last solve is not degenerate
+    unsigned int iter;     //!< iterations of the last solve
+    double delta;          //!< average error of the last solve [degrees]
+    double error;          //!< max error of the last solve [degrees]
+    double dip;            //!< dip angle of the last valid solve [degrees]
+
+  public:
+    /** cstr
+     * @param it   max number of iterations of a solve
+     */
+    CalibOnline( unsigned int it = 200 )
+      : count( 0 )
+      , pairs( 0 )
+      , lost( 0 )
+      , groups( 0 )
+      , shots( 0 )
+      , has_ref( false )
+      , ref_g( 0.0 )
+      , ref_m( 0.0 )
+      , max_it( it )
+      , solves( 0 )
+      , warm( false )
+      , valid( false )
+      , iter( 0 )
+      , delta( 0.0 )
+      , error( 0.0 )
+      , dip( 0.0 )
+    { }
+
+    /** add a G-M pair
+     * @param gx   X component of G
+     * @param gy   Y component of G
+     * @param gz   Z component of G
+     * @param mx   X component of M
+     * @param my   Y component of M
+     * @param mz   Z component of M
+     * @return true if the coefficients have been computed again
+     */
+    bool Add( int16_t gx, int16_t gy, int16_t gz, int16_t mx, int16_t my, int16_t mz );
+
+    /** add a G-M pair of packets
+     * @param g   G packet
+     * @param m   M packet
+     * @return true if the coefficients have been computed again
+     * @see Protocol::NextCalib
+     */
+    bool Add( const unsigned char g[8], const unsigned char m[8] );
+
+    /** skip a lost shot: it takes the next place in the group
+     * @return true if the coefficients have been computed again
+     * @see Protocol::Orphans
+     */
+    bool AddLost();
+
+    /** clear the pairs and the coefficients
+     */
+    void Reset();
+
+    /** number of shots, including the lost ones
+     */
+    unsigned int Size() const { return count; }
+
+    /** number of lost shots
+     */
+    unsigned int Lost() const { return lost; }
+
+    /** number of groups, the last one included
+     */
+    unsigned int Groups() const { return groups; }
+
+    /** whether the coefficients have been computed
+     */
+    bool Solved() const { return solves > 0; }
+
+    /** whether the coefficients of the last solve are not degenerate
+     */
+    bool Valid() const { return valid; }
+
+    /** iterations of the last solve
+     */
+    unsigned int Iterations() const { return iter; }
+
+    /** average error of the last solve [degrees]
+     */
+    double Delta() const { return delta; }
+
+    /** max error of the last solve [degrees]
+     */
+    double Error() const { return error; }
+
+    /** M dip angle of the last solve [degrees]
+     */
+    double Dip() const { return calib.GetDipAngle(); }
+
+    /** calibration, eg, to write the coefficients
+     */
+    Calibration & GetCalibration() { return calib; }
+
+  private:
+    /** start a new group
+     */
+    void NewGroup();
+
+    /** compute the coefficients at the end of a group, if there are enough pairs
+     * @return true if the coefficients have been computed again
+     */
+    bool Next();
+
+    /** compute the coefficients
+     */
+    void Solve();
+
+    /** check the coefficients of a solve
+     * @param check_dip  whether to check the change of the dip angle
+     * @return true if the coefficients are not degenerate
+     */
+    bool Check( bool check_dip ) const;
+};
+
+#endif // CALIB_ONLINE_H
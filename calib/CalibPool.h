@@ -0,0 +1,166 @@
+/** @file CalibPool.h
+ *
+ * @author marco corvi
+ * @date oct 2026
+ *
+ * @brief pool of threads that run the parts of a task together
+ *
+ * Run( task, arg ) calls task( arg, part, parts ) once for each part,
+ * part 0 in the calling thread and the others in the pool threads, and
+ * returns when all the parts are done. The threads wait for the next
+ * task between two Run()'s, so a pool can serve every iteration of a
+ * loop. A pool of size 1 has no threads, nor has it on WIN32: the parts
+ * are run one after the other.
+ * --------------------------------------------------------
+ *  Copyright This sowftare is distributed under GPL-3.0 or later
+ *  See the file COPYING.
+ */
+#ifndef CALIB_POOL_H
+#define CALIB_POOL_H
+
+#include <stdio.h>
+
+#ifndef WIN32
+  #include <pthread.h>
+#endif
+
+#define CALIB_POOL_MAX 64 /* max number of threads */
+
+class CalibPool
+{
+  public:
+    /** part of a task
+     * @param arg    task argument
+     * @param part   part number (0 .. parts-1)
+     * @param parts  number of parts
+     */
+    typedef void (*Task)( void * arg, unsigned int part, unsigned int parts );
+
+  private:
+    unsigned int size;          //!< number of parts (threads, including the caller)
+    Task task;                  //!< current task
+    void * task_arg;            //!< current task argument
+    unsigned int generation;    //!< task counter
+    unsigned int pending;       //!< parts of the current task not done yet
+    bool quit;                  //!< request to the threads to exit
+    #ifndef WIN32
+      unsigned int started;     //!< number of threads started
+      unsigned int joined;      //!< number of threads that got their part number
+      pthread_t threads[ CALIB_POOL_MAX ];
+      pthread_mutex_t lock;
+      pthread_cond_t  start_cond; //!< a new task or quit
+      pthread_cond_t  done_cond;  //!< the last part is done
+    #endif
+
+  public:
+    /** cstr
+     * @param n   number of threads, including the caller
+     */
+    CalibPool( unsigned int n )
+      : size( 1 )
+      , task( NULL )
+      , task_arg( NULL )
+      , generation( 0 )
+      , pending( 0 )
+      , quit( false )
+    {
+    #ifndef WIN32
+      started = 0;
+      joined  = 0;
+      pthread_mutex_init( &lock, NULL );
+      pthread_cond_init( &start_cond, NULL );
+      pthread_cond_init( &done_cond, NULL );
+      if ( n > CALIB_POOL_MAX ) n = CALIB_POOL_MAX;
+      for ( ; started + 1 < n; ++started ) {
+        if ( pthread_create( &threads[started], NULL, Worker, this ) != 0 ) {
+          fprintf(stderr, "WARNING. Cannot start calibration thread %u\n", started + 1 );
+          break;
+        }
+      }
+      size = started + 1;
+    #else
+      n = n;
+    #endif
+    }
+
+    /** dstr - stop the threads
+     */
+    ~CalibPool()
+    {
+    #ifndef WIN32
+      pthread_mutex_lock( &lock );
+      quit = true;
+      pthread_cond_broadcast( &start_cond );
+      pthread_mutex_unlock( &lock );
+      for ( unsigned int k = 0; k < started; ++k ) pthread_join( threads[k], NULL );
+      pthread_cond_destroy( &done_cond );
+      pthread_cond_destroy( &start_cond );
+      pthread_mutex_destroy( &lock );
+    #endif
+    }
+
+    /** number of parts of a task
+     */
+    unsigned int Size() const { return size; }
+
+    /** run a task and wait for all its parts
+     * @param t     task
+     * @param arg   task argument
+     */
+    void Run( Task t, void * arg )
+    {
+    #ifndef WIN32
+      if ( size > 1 ) {
+        pthread_mutex_lock( &lock );
+        task = t;
+        task_arg = arg;
+        pending = size - 1;
+        ++ generation;
+        pthread_cond_broadcast( &start_cond );
+        pthread_mutex_unlock( &lock );
+
+        t( arg, 0, size );
+
+        pthread_mutex_lock( &lock );
+        while ( pending > 0 ) pthread_cond_wait( &done_cond, &lock );
+        pthread_mutex_unlock( &lock );
+        return;
+      }
+    #endif
+      for ( unsigned int part = 0; part < size; ++part ) t( arg, part, size );
+    }
+
+  private:
+  #ifndef WIN32
+    static void * Worker( void * arg )
+    {
+      CalibPool * pool = (CalibPool *)arg;
+      pthread_mutex_lock( &pool->lock );
+      unsigned int part = ++ pool->joined;
+      unsigned int seen = 0; // no task is run before the cstr returns
+      for ( ; ; ) {
+        while ( ! pool->quit && pool->generation == seen ) {
+          pthread_cond_wait( &pool->start_cond, &pool->lock );
+        }
+        if ( pool->quit ) break;
+        seen = pool->generation;
+        Task t = pool->task;
+        void * t_arg = pool->task_arg;
+        unsigned int parts = pool->size;
+        pthread_mutex_unlock( &pool->lock );
+
+        t( t_arg, part, parts );
+
+        pthread_mutex_lock( &pool->lock );
+        if ( -- pool->pending == 0 ) pthread_cond_signal( &pool->done_cond );
+      }
+      pthread_mutex_unlock( &pool->lock );
+      return NULL;
+    }
+  #endif
+
+    CalibPool( const CalibPool & );
+    CalibPool & operator=( const CalibPool & );
+};
+
+#endif // CALIB_POOL_H
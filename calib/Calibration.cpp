@@ -12,11 +12,13 @@
  *  See the file COPYING.
  */
 #include <stdio.h>
+#include <string.h>
 #include <math.h>
 #include <assert.h>
 
 #include "Calibration.h"
 #include "Factors.h"
+#include "DistoX.h"
 
 #ifdef WIN32
   int round( double x ) 
@@ -51,6 +53,7 @@ Calibration::Clear()
   // clear the vector of groups
   vGroups.clear();
   vD.clear();
+  fit.Clear();
 }
 
 void 
@@ -83,6 +86,14 @@ Calibration::GetCoeff( unsigned char coeff[ 48 ] )
   PutCoeff( coeff+46, aM.Z().Z() * FM );
 }
 
+void
+Calibration::GetNLCoeff( unsigned char coeff[ 3 ] )
+{
+  coeff[0] = double2NL( nL.X() );
+  coeff[1] = double2NL( nL.Y() );
+  coeff[2] = double2NL( nL.Z() );
+}
+
 void 
 Calibration::SetCoeff( const unsigned char coeff[ 48 ] )
 {
@@ -175,6 +186,9 @@ Calibration::AddValues(
     }
     vGroups[ group ].Add( idx );
   }
+  if ( ignore != 1 && group != NOT_USED ) { // running input sums
+    fit.Add( vG[idx], vM[idx] );
+  }
 }
 
 void 
@@ -202,6 +216,12 @@ Calibration::PrintCalibrationFile( const char * name )
     fprintf(fp, "0x%02x ", coeff[k] );
     if ( ( k % 8 ) == 7 ) fprintf(fp, "\n");
   }
+  // the coefficients fitted with the G non-linearity are valid only with it
+  if ( use_nl ) {
+    unsigned char nl[3];
+    GetNLCoeff( nl );
+    fprintf(fp, "0x%02x 0x%02x 0x%02x 0xff \n", nl[0], nl[1], nl[2] );
+  }
 
   // write calibration input data in decimal notation
   fprintf(fp, "Calibration input data.\n");
@@ -222,11 +242,30 @@ Calibration::PrintCalibrationFile( const char * name )
   fprintf(fp, "aMx: %.4f %.4f %.4f \n", aM.X().X(), aM.X().Y(), aM.X().Z() );
   fprintf(fp, "  y: %.4f %.4f %.4f \n", aM.Y().X(), aM.Y().Y(), aM.Y().Z() );
   fprintf(fp, "  z: %.4f %.4f %.4f \n", aM.Z().X(), aM.Z().Y(), aM.Z().Z() );
+  if ( use_nl ) {
+    fprintf(fp, "nL:  %.4f %.4f %.4f \n", nL.X(), nL.Y(), nL.Z() );
+  }
 
   fclose(fp);
 }
 
 
+// shape factor of a matrix (see CheckCoeffs)
+//
+static double
+coeff_shape( const Matrix & a )
+{
+  double f = ( a.X() * a.X() + a.Y() * a.Y() + a.Z() * a.Z() ) / 3.0; // squared norm / 3
+  if ( f <= 0.0 ) return 0.0;
+  return fabs( a.determinant() ) / ( f * sqrt( f ) );
+}
+
+bool
+Calibration::CheckCoeffs() const
+{
+  return coeff_shape( aG ) >= MIN_SHAPE && coeff_shape( aM ) >= MIN_SHAPE;
+}
+
 bool
 Calibration::CheckGroups()
 {
@@ -266,6 +305,12 @@ Calibration::PrintCoeffs()
   fprintf(stderr, "aM: %.4f %.4f %.4f \n", aM.X().X(), aM.X().Y(), aM.X().Z() );
   fprintf(stderr, "    %.4f %.4f %.4f \n", aM.Y().X(), aM.Y().Y(), aM.Y().Z() );
   fprintf(stderr, "    %.4f %.4f %.4f \n", aM.Z().X(), aM.Z().Y(), aM.Z().Z() );
+  if ( use_nl ) {
+    unsigned char nl[3];
+    GetNLCoeff( nl );
+    fprintf(stderr, "nL: %.4f %.4f %.4f (0x%02x 0x%02x 0x%02x)\n",
+      nL.X(), nL.Y(), nL.Z(), nl[0], nl[1], nl[2] );
+  }
 }
 
 void
@@ -358,6 +403,122 @@ Calibration::TurnVectors(
   return acos( nr * nx )*180.0/M_PI;
 }
 
+// part of the group solve run by a thread of the pool
+void
+Calibration::SolveTask( void * arg, unsigned int part, unsigned int parts )
+{
+  SolveJob * job = (SolveJob *)arg;
+  size_t ng = job->calib->vGroups.size();
+  job->calib->SolveGroups( ng * part / parts, ng * (part+1) / parts, job->sin_alpha, job->cos_alpha );
+}
+
+// optimal (gx,mx) of the samples of the groups [kg0,kg1), and the
+// group terms of the new alpha in (vGroupS,vGroupC)
+//
+void
+Calibration::SolveGroups( size_t kg0, size_t kg1, double sin_alpha, double cos_alpha )
+{
+  for ( size_t kg = kg0; kg<kg1; ++kg ) {
+    vGroupS[kg] = vGroupC[kg] = 0.0;
+    if ( vGroups[kg].Size() == 0 ) continue;
+    Vector grp; // average: zero initialized
+    Vector mrp;
+    // int cnt = 0;
+    double ca_max = 0.0;
+    unsigned int first = (unsigned int)(-1);
+    int grp_nr = 0; // items in the group
+    for (unsigned int k1=0; k1<vGroups[kg].Size(); ++k1) {
+      unsigned int k = vGroups[kg].Index(k1);
+      if ( vIgnore[k] != 1 ) {
+        ++ grp_nr;
+        if ( first == (unsigned int)(-1) ) {
+          first = k;
+        }
+      }
+    }
+    if ( grp_nr > 1 ) {
+      Vector gr0 = cGr.Get( first );
+      Vector mr0 = cMr.Get( first );
+      for (unsigned int k1=0; k1<vGroups[kg].Size(); ++k1) {
+        unsigned int k = vGroups[kg].Index(k1);
+        if ( vIgnore[k] == 1 ) continue;
+        Vector gt;
+        Vector mt;
+        double ca = 0.0;
+	  ca = TurnVectors( cGr.Get( k ), cMr.Get( k ), gr0, mr0, gt, mt, (k<4) );
+        if ( ca > ca_max ) ca_max = ca;
+        #ifdef DEBUG
+           if ( k < 4 ) {
+             printf("GR[%d] %.5f %.5f %.5f\n", k, cGr.x[k], cGr.y[k], cGr.z[k] );
+             printf("MR[%d] %.5f %.5f %.5f\n", k, cMr.x[k], cMr.y[k], cMr.z[k] );
+             printf("GT[%d] %.5f %.5f %.5f\n", k, gt.X(), gt.Y(), gt.Z() );
+             printf("MT[%d] %.5f %.5f %.5f\n", k, mt.X(), mt.Y(), mt.Z() );
+           }
+        #endif
+        grp += gt;
+        mrp += mt;
+      }
+      #ifdef DEBUG
+        if ( kg == 1 ) {
+          printf("GRP %.5f %.5f %.5f\n",  grp.X(), grp.Y(), grp.Z() );
+          printf("MRP %.5f %.5f %.5f\n",  mrp.X(), mrp.Y(), mrp.Z() );
+        }
+      #endif
+      Vector gxp; // optimal mean vector pair (gx,mx)
+      Vector mxp;
+      OptVectors( grp, mrp, sin_alpha, cos_alpha, gxp, mxp );
+      #ifdef DEBUG
+        if ( kg == 1 ) {
+          printf("GXP %.5f %.5f %.5f\n",  gxp.X(), gxp.Y(), gxp.Z() );
+          printf("MXP %.5f %.5f %.5f\n",  mxp.X(), mxp.Y(), mxp.Z() );
+        }
+      #endif
+      // new alpha calculation
+      double s = (mrp % gxp).length(); // original
+      double c = mrp * gxp;
+      vGroupS[kg] = s;
+      vGroupC[kg] = c;
+      // printf("group %2d items %2d max alpha %8.4f \n", kg, grp_nr, ca_max );
+      // sa += (mxp % gxp).length();
+      // ca += mxp * gxp;
+
+      for (unsigned int k1=0; k1<vGroups[kg].Size(); ++k1) {
+        unsigned int k = vGroups[kg].Index(k1);
+        if ( vIgnore[k] == 1 ) continue;
+        // get optimal gx, mx from matched (gxp, mxp)
+        Vector gx;
+        Vector mx;
+        TurnVectors( gxp, mxp, cGr.Get( k ), cMr.Get( k ), gx, mx, (k<4) );
+        cGx.Set( k, gx );
+        cMx.Set( k, mx );
+        #ifdef DEBUG
+           if ( k < 4 ) {
+             printf("GR[%d] %.5f %.5f %.5f\n", k, cGr.x[k], cGr.y[k], cGr.z[k] );
+             printf("MR[%d] %.5f %.5f %.5f\n", k, cMr.x[k], cMr.y[k], cMr.z[k] );
+             printf("GX[%d] %.5f %.5f %.5f\n", k, gx.X(), gx.Y(), gx.Z() );
+             printf("MX[%d] %.5f %.5f %.5f\n", k, mx.X(), mx.Y(), mx.Z() );
+           }
+        #endif
+  
+      }
+    } else if ( grp_nr == 1 ) { // individual sample
+      assert( first != (unsigned int)(-1) );
+      unsigned int k = first;
+      Vector gx;
+      Vector mx;
+      Vector mr = cMr.Get( k );
+      OptVectors( cGr.Get( k ), mr, sin_alpha, cos_alpha, gx, mx );
+      cGx.Set( k, gx );
+      cMx.Set( k, mx );
+      double s = (mr % gx).length(); // original
+      double c = mr * gx;
+      vGroupS[kg] = s;
+      vGroupC[kg] = c;
+      // printf("group %2d items %2d alpha %8.4f \n", kg, grp_nr, atan2(s,c)*180.0/M_PI);
+    }
+  }
+}
+
 unsigned int 
 Calibration::Optimize( double & delta, double & error, unsigned int max_it )
 {
@@ -370,91 +531,163 @@ Calibration::Optimize( double & delta, double & error, unsigned int max_it )
 
   assert( CheckGroups() );
 
-  Vector * gr = new Vector[ num ];
-  Vector * mr = new Vector[ num ];
-  Vector * gx = new Vector[ num ];
-  Vector * mx = new Vector[ num ];
-
   optimize_eps = EPS * delta;
-  max_it = 200; // FIXME
-  it = OptimizeCore( gr, mr, gx, mx, max_it, &sin_alpha, &cos_alpha );
+  it = OptimizeCore( max_it, &sin_alpha, &cos_alpha );
 
   int jmax;
   delta = ComputeDelta( /* gx, mx, */ error, jmax, sin_alpha, cos_alpha, false /*true*/ );
 
-  delete[] gr;
-  delete[] mr;
-  delete[] gx;
-  delete[] mx;
+  return it;
+}
+
+unsigned int 
+Calibration::OptimizeWarm( double & delta, double & error, unsigned int max_it )
+{
+  unsigned int it;
+  double sin_alpha;
+  double cos_alpha;
+  if ( num < 16 ) 
+    return (unsigned int)(-1);
+
+  assert( CheckGroups() );
+
+  optimize_eps = EPS * delta;
+  it = OptimizeCore( max_it, &sin_alpha, &cos_alpha, true );
+
+  int jmax;
+  delta = ComputeDelta( error, jmax, sin_alpha, cos_alpha, false );
 
   return it;
 }
 
+unsigned int 
+Calibration::OptimizeAccelerated( double & delta, double & error, unsigned int max_it )
+{
+  unsigned int it;
+  double sin_alpha;
+  double cos_alpha;
+  if ( num < 16 ) 
+    return (unsigned int)(-1);
+
+  assert( CheckGroups() );
 
+  optimize_eps = EPS * delta;
+  it = OptimizeAnderson( max_it, &sin_alpha, &cos_alpha );
 
-// (gr,mr) are work vectors where the transformed (G,M) are written
-// (gx,mx) are vector where the optimal transformed (G,M) are written
-//
-int 
-Calibration::OptimizeCore( Vector * gr, Vector * mr, Vector * gx, Vector * mx,
-                           unsigned int max_it, double * sin_alpha0, double *cos_alpha0 )
+  int jmax;
+  delta = ComputeDelta( error, jmax, sin_alpha, cos_alpha, false );
+
+  return it;
+}
+
+unsigned int 
+Calibration::OptimizeLM( double & delta, double & error, unsigned int max_it, bool nl )
 {
-  Matrix aG0;
-  Matrix aM0;
-  
-  Vector sumG; //  = Vector::zero;
-  Vector sumM;
-  Matrix sumG2;
-  Matrix sumM2;
+  unsigned int it;
+  double sin_alpha;
+  double cos_alpha;
+  if ( num < 16 ) 
+    return (unsigned int)(-1);
 
-  double sa = 0.0;
-  double ca = 0.0;
-  int sum0 = 0;
+  assert( CheckGroups() );
+  if ( max_it < 2 ) max_it = 2; // the start takes two steps
+
+  optimize_eps = EPS * delta;
+  // start from the first step of Optimize(), the linear fit of the
+  // coefficients to the group directions, from aG = identity or from
+  // the mirrored G frame, whichever is better: the descent does not
+  // change the handedness of the G frame
+  int jmax;
+  StartCore( sin_alpha, cos_alpha );
+  double sin_alpha0 = sin_alpha;
+  double cos_alpha0 = cos_alpha;
+  StepCore( NULL, sin_alpha, cos_alpha );
+  double delta1 = ComputeDelta( error, jmax, sin_alpha, cos_alpha, false );
+  Matrix aG1 = aG;
+  Vector bG1 = bG;
+  Matrix aM1 = aM;
+  Vector bM1 = bM;
+  double sin_alpha1 = sin_alpha;
+  double cos_alpha1 = cos_alpha;
+
+  PrepareOptimize();
+  aG.Z().Z() = -1.0;
+  sin_alpha = sin_alpha0;
+  cos_alpha = cos_alpha0;
+  StepCore( NULL, sin_alpha, cos_alpha );
+  if ( delta1 <= ComputeDelta( error, jmax, sin_alpha, cos_alpha, false ) ) {
+    aG = aG1;
+    bG = bG1;
+    aM = aM1;
+    bM = bM1;
+    sin_alpha = sin_alpha1;
+    cos_alpha = cos_alpha1;
+  }
+  use_nl = nl;
+  lm_fallbacks = 0;
+  it = 2 + OptimizeLMCore( max_it - 2, &sin_alpha, &cos_alpha );
+  if ( ! CheckCoeffs() ) { // degenerate fit: the result of Optimize() instead
+    ++ lm_fallbacks;
+    it += OptimizeCore( max_it - it, &sin_alpha, &cos_alpha );
+  }
+
+  delta = ComputeDelta( error, jmax, sin_alpha, cos_alpha, false );
+
+  return it;
+}
+
+int
+Calibration::LoadColumns()
+{
+  cG.Resize( num );
+  cM.Resize( num );
+  cGr.Resize( num );
+  cMr.Resize( num );
+  cGx.Resize( num );
+  cMx.Resize( num );
+  vWeight.assign( CalibColumns::Padded( num ), 0.0 );
+  int used = 0;
   for (unsigned int k=0; k<num; ++k) {
+    cG.Set( k, vG[k] );
+    cM.Set( k, vM[k] );
     if ( vIgnore[k] == 1 ) continue;
     if ( vGroup[k] == NOT_USED ) continue;
-    sa += (vG[k] % vM[k]).length(); // cross product (abs value)
-    ca += vG[k] * vM[k];            // dot product
-    sumG += vG[k];
-    sumM += vM[k];
-    sumG2 += vG[k] & vG[k];
-    sumM2 += vM[k] & vM[k];
-    sum0 ++;
-  }
-  double invNum = 1.0 / sum0;
-  double da = sqrt( sa*sa + ca*ca );
-  double sin_alpha = sa/da;
-  double cos_alpha = ca/da;
-  #ifdef DEBUG
-    double alpha = atan2( sa, ca );
-    printf("Alpha %.4f s %.4f c %.4f\n", alpha*180.0/M_PI, sa, ca );
-  #endif
-
-  Vector avG = sumG * invNum;
-  Vector avM = sumM * invNum;
-
-  Matrix iG = (sumG2 - (sumG & avG));
-  Matrix iM = (sumM2 - (sumM & avM));
-  Matrix invG = iG.inverse();
-  Matrix invM = iM.inverse();
+    vWeight[k] = 1.0;
+    ++ used;
+  }
+  return used;
+}
 
+// input sums of the fit and initial alpha; columns and coefficients reset
+//
+void
+Calibration::StartCore( double & sin_alpha, double & cos_alpha )
+{
+  fit.Clear();
+  for (unsigned int k=0; k<num; ++k) {
+    if ( vIgnore[k] == 1 ) continue;
+    if ( vGroup[k] == NOT_USED ) continue;
+    fit.Add( vG[k], vM[k] );
+  }
+  int s0 = LoadColumns();
+  assert( s0 == fit.n );
+  fit.Finish();
+  double da = sqrt( fit.sa*fit.sa + fit.ca*fit.ca );
+  sin_alpha = fit.sa/da;
+  cos_alpha = fit.ca/da;
   #ifdef DEBUG
-    printf("AvG %.4f %.4f %.4f \n", avG.X(), avG.Y(), avG.Z() );
-    printf("iG: %.4f %.4f %.4f \n", iG.X().X(), iG.X().Y(), iG.X().Z() );
-    printf("    %.4f %.4f %.4f \n", iG.Y().X(), iG.Y().Y(), iG.Y().Z() );
-    printf("    %.4f %.4f %.4f \n", iG.Z().X(), iG.Z().Y(), iG.Z().Z() );
+    double alpha = atan2( fit.sa, fit.ca );
+    printf("Alpha %.4f s %.4f c %.4f\n", alpha*180.0/M_PI, fit.sa, fit.ca );
+    printf("AvG %.4f %.4f %.4f \n", fit.avG.X(), fit.avG.Y(), fit.avG.Z() );
   #endif
 
   #if 0 // def DEBUG
   {
-    Matrix cG = iG * invG;
+    Matrix iG = fit.invG.inverse();
+    Matrix cG = iG * fit.invG;
     if ( cG.max_diff( Matrix::one ) > EPS ) {
       fprintf(stderr, "WARNING approximate inverse G matrix: diff %f\n", cG.max_diff( Matrix::one ) );
     } 
-    Matrix cM = iM * invM;
-    if ( cM.max_diff( Matrix::one ) > EPS ) {
-      fprintf(stderr, "WARNING approximate inverse M matrix: diff %f\n", cM.max_diff( Matrix::one ) );
-    }
   }
   #endif
 
@@ -462,6 +695,158 @@ Calibration::OptimizeCore( Vector * gr, Vector * mr, Vector * gx, Vector * mx,
   // bG = bM = 0-vector
   PrepareOptimize();
 
+  vGroupS.assign( vGroups.size(), 0.0 );
+  vGroupC.assign( vGroups.size(), 0.0 );
+}
+
+// input sums kept by AddValues(), columns reloaded, initial alpha of the
+// vectors calibrated with the current coefficients
+//
+void
+Calibration::WarmCore( double & sin_alpha, double & cos_alpha )
+{
+  int s0 = LoadColumns();
+  assert( s0 == fit.n );
+  fit.Finish();
+  nL = Vector::zero; // the iteration does not fit the non-linearity
+  use_nl = false;
+  double sa = 0.0;
+  double ca = 0.0;
+  for (unsigned int k=0; k<num; ++k) {
+    if ( vIgnore[k] == 1 ) continue;
+    if ( vGroup[k] == NOT_USED ) continue;
+    Vector g = bG + aG * vG[k];
+    Vector m = bM + aM * vM[k];
+    g.normalize();
+    m.normalize();
+    sa += (g % m).length();
+    ca += g * m;
+  }
+  double da = sqrt( sa*sa + ca*ca );
+  sin_alpha = sa/da;
+  cos_alpha = ca/da;
+
+  vGroupS.assign( vGroups.size(), 0.0 );
+  vGroupC.assign( vGroups.size(), 0.0 );
+}
+
+// one iteration: new coefficients and alpha from the current ones
+// the transformed (G,M) are written in (cGr,cMr)
+// the optimal transformed (G,M) are written in (cGx,cMx)
+//
+void
+Calibration::StepCore( CalibPool * pool, double & sin_alpha, double & cos_alpha )
+{
+  // transform the input values by the calibration coeffs
+  // (all the samples: the unused ones are not read)
+  calib_affine( aG, bG, cG, cGr );
+  calib_affine( aM, bM, cM, cMr );
+  #ifdef DEBUG
+    for (unsigned int k=0; k<num && k<4; ++k) {
+      printf("GR[%d] %.5f %.5f %.5f\n", k, cGr.x[k], cGr.y[k], cGr.z[k] );
+      printf("MR[%d] %.5f %.5f %.5f\n", k, cMr.x[k], cMr.y[k], cMr.z[k] );
+    }
+  #endif
+
+  // groups, in parallel, then their terms of the new alpha in group order
+  // (the same sums whatever the number of threads)
+  SolveJob job = { this, sin_alpha, cos_alpha };
+  if ( pool ) {
+    pool->Run( SolveTask, &job );
+  } else {
+    SolveGroups( 0, vGroups.size(), sin_alpha, cos_alpha );
+  }
+  double sa = 0.0;
+  double ca = 0.0;
+  for ( size_t kg = 0; kg<vGroups.size(); ++kg ) {
+    sa += vGroupS[kg];
+    ca += vGroupC[kg];
+  }
+  // assert( k == 16 );
+  for (unsigned int k=0; k<num; ++k ) { // additional individual samples
+    if ( vGroup[k] == NO_GROUP ) {
+      Vector gx;
+      Vector mx;
+      Vector mr = cMr.Get( k );
+      OptVectors( cGr.Get( k ), mr, sin_alpha, cos_alpha, gx, mx );
+      cGx.Set( k, gx );
+      cMx.Set( k, mx );
+      double s = (mr % gx).length(); // original
+      double c = mr * gx;
+      sa += s;
+      ca += c;
+      // printf("group -- item  %2d alpha %8.4f \n", k, atan2(s,c)*180.0/M_PI);
+      // sa += (mx[k] % gx[k]).length();
+      // ca += mx[k] * gx[k];
+    }
+  }
+
+  double da = sqrt( sa*sa + ca*ca );
+  sin_alpha = sa/da;
+  cos_alpha = ca/da;
+  #ifdef DEBUG
+    double alpha = atan2( sa, ca );
+    printf("Alpha %.2f s %.4f c %.4f \n", alpha*180.0/M_PI, sa, ca );
+  #endif
+
+  // get aG, aM from g, m, gx, mx
+  Vector avGx;
+  Vector avMx;
+  Matrix sumGxG;
+  Matrix sumMxM;
+  calib_outer_sum( cGx, cG, &vWeight[0], avGx, sumGxG );
+  calib_outer_sum( cMx, cM, &vWeight[0], avMx, sumMxM );
+  #ifdef DEBUG
+    printf("AvGx %.4f %.4f %.4f \n", avGx.X(), avGx.Y(), avGx.Z() );
+    printf("sGxG %.4f %.4f %.4f \n", sumGxG.X().X(), sumGxG.X().Y(), sumGxG.X().Z() );
+    printf("     %.4f %.4f %.4f \n", sumGxG.Y().X(), sumGxG.Y().Y(), sumGxG.Y().Z() );
+    printf("     %.4f %.4f %.4f \n", sumGxG.Z().X(), sumGxG.Z().Y(), sumGxG.Z().Z() );
+    printf("AvMx %.4f %.4f %.4f \n", avMx.X(), avMx.Y(), avMx.Z() );
+    printf("sMxM %.4f %.4f %.4f \n", sumMxM.X().X(), sumMxM.X().Y(), sumMxM.X().Z() );
+    printf("     %.4f %.4f %.4f \n", sumMxM.Y().X(), sumMxM.Y().Y(), sumMxM.Y().Z() );
+    printf("     %.4f %.4f %.4f \n", sumMxM.Z().X(), sumMxM.Z().Y(), sumMxM.Z().Z() );
+  #endif
+
+  avGx *= fit.invNum;
+  avMx *= fit.invNum;
+  aG = (sumGxG - (avGx & fit.sumG) ) * fit.invG;
+  aM = (sumMxM - (avMx & fit.sumM) ) * fit.invM;
+  // enforce symmetric aG(y,z)
+  aG.Y().Z() = aG.Z().Y() = ( aG.Y().Z() + aG.Z().Y()) * 0.5;
+
+  // new bG, bM
+  bG = avGx - ( aG * fit.avG );
+  bM = avMx - ( aM * fit.avM );
+  #ifdef DEBUG
+    printf("bG %.4f %.4f %.4f \n", bG.X(), bG.Y(), bG.Z() );
+    printf("aG %.4f %.4f %.4f \n", aG.X().X(), aG.X().Y(), aG.X().Z() );
+    printf("   %.4f %.4f %.4f \n", aG.Y().X(), aG.Y().Y(), aG.Y().Z() );
+    printf("   %.4f %.4f %.4f \n", aG.Z().X(), aG.Z().Y(), aG.Z().Z() );
+    printf("bM %.4f %.4f %.4f \n", bM.X(), bM.Y(), bM.Z() );
+    printf("aM %.4f %.4f %.4f \n", aM.X().X(), aM.X().Y(), aM.X().Z() );
+    printf("   %.4f %.4f %.4f \n", aM.Y().X(), aM.Y().Y(), aM.Y().Z() );
+    printf("   %.4f %.4f %.4f \n", aM.Z().X(), aM.Z().Y(), aM.Z().Z() );
+  #endif
+}
+
+int 
+Calibration::OptimizeCore( unsigned int max_it, double * sin_alpha0, double *cos_alpha0, bool warm )
+{
+  Matrix aG0;
+  Matrix aM0;
+  double sin_alpha;
+  double cos_alpha;
+  if ( warm ) {
+    WarmCore( sin_alpha, cos_alpha );
+  } else {
+    StartCore( sin_alpha, cos_alpha );
+  }
+
+  CalibPool * pool = NULL;
+  if ( num_threads > 1 && vGroups.size() > 1 ) {
+    pool = new CalibPool( num_threads );
+  }
+
   #ifdef USE_GUI
     CalibrationGui * gui = NULL;
     if ( show_gui ) gui = new CalibrationGui( this, num );
@@ -470,186 +855,24 @@ Calibration::OptimizeCore( Vector * gr, Vector * mr, Vector * gx, Vector * mx,
   unsigned int it = 0; // iteration number
   double mdG, mdM;
   do {
-    // transform the input values by the calibration coeffs
-    for (unsigned int k=0; k<num; ++k) {
-      if ( vIgnore[k] == 1 ) continue;
-      if ( vGroup[k] == NOT_USED ) continue;
-      gr[k] = bG + aG * vG[k];
-      mr[k] = bM + aM * vM[k];
-      #ifdef DEBUG
-        if ( k < 4 ) {
-          printf("GR[%d] %.5f %.5f %.5f\n", k, gr[k].X(), gr[k].Y(), gr[k].Z() );
-          printf("MR[%d] %.5f %.5f %.5f\n", k, mr[k].X(), mr[k].Y(), mr[k].Z() );
-        }
-      #endif
-    }
+    aG0 = aG;
+    aM0 = aM;
+    StepCore( pool, sin_alpha, cos_alpha );
     #ifdef USE_GUI
       if ( gui ) {
+        Vector * gr = new Vector[ num ];
+        Vector * mr = new Vector[ num ];
+        for (unsigned int k=0; k<num; ++k) {
+          gr[k] = cGr.Get( k );
+          mr[k] = cMr.Get( k );
+        }
         // gui->DisplayGM( gr, mr );
         gui->DisplayCompassClino( gr, mr );
+        delete[] gr;
+        delete[] mr;
       }
     #endif
 
-    sa = ca = 0.0;
-    for ( size_t kg = 0; kg<vGroups.size(); ++kg ) {
-      if ( vGroups[kg].Size() == 0 ) continue;
-      Vector grp; // average: zero initialized
-      Vector mrp;
-      // int cnt = 0;
-      double ca_max = 0.0;
-      unsigned int first = (unsigned int)(-1);
-      int grp_nr = 0; // items in the group
-      for (unsigned int k1=0; k1<vGroups[kg].Size(); ++k1) {
-        unsigned int k = vGroups[kg].Index(k1);
-        if ( vIgnore[k] != 1 ) {
-          ++ grp_nr;
-          if ( first == (unsigned int)(-1) ) {
-            first = k;
-          }
-        }
-      }
-      if ( grp_nr > 1 ) {
-        for (unsigned int k1=0; k1<vGroups[kg].Size(); ++k1) {
-          unsigned int k = vGroups[kg].Index(k1);
-          if ( vIgnore[k] == 1 ) continue;
-          Vector gt;
-          Vector mt;
-          double ca = 0.0;
-	  ca = TurnVectors( gr[k], mr[k], gr[first], mr[first], gt, mt, (k<4) );
-          if ( ca > ca_max ) ca_max = ca;
-          #ifdef DEBUG
-             if ( k < 4 ) {
-               printf("GR[%d] %.5f %.5f %.5f\n", k, gr[k].X(), gr[k].Y(), gr[k].Z() );
-               printf("MR[%d] %.5f %.5f %.5f\n", k, mr[k].X(), mr[k].Y(), mr[k].Z() );
-               printf("GT[%d] %.5f %.5f %.5f\n", k, gt.X(), gt.Y(), gt.Z() );
-               printf("MT[%d] %.5f %.5f %.5f\n", k, mt.X(), mt.Y(), mt.Z() );
-             }
-          #endif
-          grp += gt;
-          mrp += mt;
-        }
-        #ifdef DEBUG
-          if ( kg == 1 ) {
-            printf("GRP %.5f %.5f %.5f\n",  grp.X(), grp.Y(), grp.Z() );
-            printf("MRP %.5f %.5f %.5f\n",  mrp.X(), mrp.Y(), mrp.Z() );
-          }
-        #endif
-        Vector gxp; // optimal mean vector pair (gx,mx)
-        Vector mxp;
-        OptVectors( grp, mrp, sin_alpha, cos_alpha, gxp, mxp );
-        #ifdef DEBUG
-          if ( kg == 1 ) {
-            printf("GXP %.5f %.5f %.5f\n",  gxp.X(), gxp.Y(), gxp.Z() );
-            printf("MXP %.5f %.5f %.5f\n",  mxp.X(), mxp.Y(), mxp.Z() );
-          }
-        #endif
-        // new alpha calculation
-        double s = (mrp % gxp).length(); // original
-        double c = mrp * gxp;
-        sa += s;
-        ca += c;
-        // printf("group %2d items %2d max alpha %8.4f \n", kg, grp_nr, ca_max );
-        // sa += (mxp % gxp).length();
-        // ca += mxp * gxp;
-
-        for (unsigned int k1=0; k1<vGroups[kg].Size(); ++k1) {
-          unsigned int k = vGroups[kg].Index(k1);
-          if ( vIgnore[k] == 1 ) continue;
-          // get optimal gx, mx from matched (gxp, mxp)
-          TurnVectors( gxp, mxp, gr[k], mr[k], gx[k], mx[k], (k<4) );
-          #ifdef DEBUG
-             if ( k < 4 ) {
-               printf("GR[%d] %.5f %.5f %.5f\n", k, gr[k].X(), gr[k].Y(), gr[k].Z() );
-               printf("MR[%d] %.5f %.5f %.5f\n", k, mr[k].X(), mr[k].Y(), mr[k].Z() );
-               printf("GX[%d] %.5f %.5f %.5f\n", k, gx[k].X(), gx[k].Y(), gx[k].Z() );
-               printf("MX[%d] %.5f %.5f %.5f\n", k, mx[k].X(), mx[k].Y(), mx[k].Z() );
-             }
-          #endif
-    
-        }
-      } else if ( grp_nr == 1 ) { // individual sample
-        assert( first != (unsigned int)(-1) );
-        unsigned int k = first;
-        OptVectors( gr[k], mr[k], sin_alpha, cos_alpha, gx[k], mx[k] );
-        double s = (mr[k] % gx[k]).length(); // original
-        double c = mr[k] * gx[k];
-        sa += s;
-        ca += c;
-        // printf("group %2d items %2d alpha %8.4f \n", kg, grp_nr, atan2(s,c)*180.0/M_PI);
-      }
-    }
-    // assert( k == 16 );
-    for (unsigned int k=0; k<num; ++k ) { // additional individual samples
-      if ( vGroup[k] == NO_GROUP ) {
-        OptVectors( gr[k], mr[k], sin_alpha, cos_alpha, gx[k], mx[k] );
-        double s = (mr[k] % gx[k]).length(); // original
-        double c = mr[k] * gx[k];
-        sa += s;
-        ca += c;
-        // printf("group -- item  %2d alpha %8.4f \n", k, atan2(s,c)*180.0/M_PI);
-        // sa += (mx[k] % gx[k]).length();
-        // ca += mx[k] * gx[k];
-      }
-    }
-
-    da = sqrt( sa*sa + ca*ca );
-    sin_alpha = sa/da;
-    cos_alpha = ca/da;
-    #ifdef DEBUG
-      alpha = atan2( sa, ca );
-      printf("Alpha %.2f s %.4f c %.4f \n", alpha*180.0/M_PI, sa, ca );
-    #endif
-
-    // get aG, aM from g, m, gx, mx
-    Vector avGx;
-    Vector avMx;
-    Matrix sumGxG;
-    Matrix sumMxM;
-    int s0 = 0;
-    for (unsigned int k=0; k<num; ++k) {
-      if ( vIgnore[k] == 1 ) continue;
-      if ( vGroup[k] == NOT_USED ) continue;
-      avGx += gx[k];
-      avMx += mx[k];
-      sumGxG += (gx[k] & vG[k]);
-      sumMxM += (mx[k] & vM[k]);
-      s0 ++;
-    }
-    #ifdef DEBUG
-      printf("AvGx %.4f %.4f %.4f \n", avGx.X(), avGx.Y(), avGx.Z() );
-      printf("sGxG %.4f %.4f %.4f \n", sumGxG.X().X(), sumGxG.X().Y(), sumGxG.X().Z() );
-      printf("     %.4f %.4f %.4f \n", sumGxG.Y().X(), sumGxG.Y().Y(), sumGxG.Y().Z() );
-      printf("     %.4f %.4f %.4f \n", sumGxG.Z().X(), sumGxG.Z().Y(), sumGxG.Z().Z() );
-      printf("AvMx %.4f %.4f %.4f \n", avMx.X(), avMx.Y(), avMx.Z() );
-      printf("sMxM %.4f %.4f %.4f \n", sumMxM.X().X(), sumMxM.X().Y(), sumMxM.X().Z() );
-      printf("     %.4f %.4f %.4f \n", sumMxM.Y().X(), sumMxM.Y().Y(), sumMxM.Y().Z() );
-      printf("     %.4f %.4f %.4f \n", sumMxM.Z().X(), sumMxM.Z().Y(), sumMxM.Z().Z() );
-    #endif
-
-    assert( s0 == sum0 );
-    aG0 = aG;
-    aM0 = aM;
-    avGx *= invNum;
-    avMx *= invNum;
-    aG = (sumGxG - (avGx & sumG) ) * invG;
-    aM = (sumMxM - (avMx & sumM) ) * invM;
-    // enforce symmetric aG(y,z)
-    aG.Y().Z() = aG.Z().Y() = ( aG.Y().Z() + aG.Z().Y()) * 0.5;
-
-    // new bG, bM
-    bG = avGx - ( aG * avG );
-    bM = avMx - ( aM * avM );
-    #ifdef DEBUG
-      printf("bG %.4f %.4f %.4f \n", bG.X(), bG.Y(), bG.Z() );
-      printf("aG %.4f %.4f %.4f \n", aG.X().X(), aG.X().Y(), aG.X().Z() );
-      printf("   %.4f %.4f %.4f \n", aG.Y().X(), aG.Y().Y(), aG.Y().Z() );
-      printf("   %.4f %.4f %.4f \n", aG.Z().X(), aG.Z().Y(), aG.Z().Z() );
-      printf("bM %.4f %.4f %.4f \n", bM.X(), bM.Y(), bM.Z() );
-      printf("aM %.4f %.4f %.4f \n", aM.X().X(), aM.X().Y(), aM.X().Z() );
-      printf("   %.4f %.4f %.4f \n", aM.Y().X(), aM.Y().Y(), aM.Y().Z() );
-      printf("   %.4f %.4f %.4f \n", aM.Z().X(), aM.Z().Y(), aM.Z().Z() );
-    #endif
-
     mdG = aG.max_diff( aG0 );
     mdM = aM.max_diff( aM0 );
     #if 0
@@ -669,6 +892,7 @@ Calibration::OptimizeCore( Vector * gr, Vector * mr, Vector * gx, Vector * mx,
 
   *sin_alpha0 = sin_alpha;
   *cos_alpha0 = cos_alpha;
+  delete pool;
 
   #ifdef USE_GUI
     if ( gui ) {
@@ -680,6 +904,463 @@ Calibration::OptimizeCore( Vector * gr, Vector * mr, Vector * gx, Vector * mx,
   return it;
 }
 
+void
+Calibration::PackCoeffs( double * x ) const
+{
+  const Vector * v[8] = { &bG, &aG.X(), &aG.Y(), &aG.Z(), &bM, &aM.X(), &aM.Y(), &aM.Z() };
+  for ( int j=0; j<8; ++j ) {
+    x[3*j+0] = v[j]->X();
+    x[3*j+1] = v[j]->Y();
+    x[3*j+2] = v[j]->Z();
+  }
+}
+
+void
+Calibration::UnpackCoeffs( const double * x )
+{
+  Vector * v[8] = { &bG, &aG.X(), &aG.Y(), &aG.Z(), &bM, &aM.X(), &aM.Y(), &aM.Z() };
+  for ( int j=0; j<8; ++j ) {
+    *v[j] = Vector( x[3*j+0], x[3*j+1], x[3*j+2] );
+  }
+}
+
+// Anderson acceleration of the fixed-point iteration x -> g(x) = StepCore(x)
+// over the 24 coefficients x, with residual f = g(x) - x.
+// The next point is the combination of the last AA_DEPTH+1 steps g(x)
+// whose residuals combine to the least norm:
+//   x' = g(x) - sum_j gamma_j ( dX_j + dF_j )
+//   gamma = argmin | f - sum_j gamma_j dF_j |
+// where dX_j, dF_j are the differences of successive points and residuals.
+// If the residual at x' is not less than at x, x' is dropped and the
+// iteration restarts from the plain step g(x).
+//
+int
+Calibration::OptimizeAnderson( unsigned int max_it, double * sin_alpha0, double * cos_alpha0 )
+{
+  double sin_alpha;
+  double cos_alpha;
+  StartCore( sin_alpha, cos_alpha );
+
+  CalibPool * pool = NULL;
+  if ( num_threads > 1 && vGroups.size() > 1 ) {
+    pool = new CalibPool( num_threads );
+  }
+
+  double x[24];       // current point
+  double g[24];       // step from the current point
+  double f[24];       // residual at the current point
+  double x0[24];      // previous point
+  double g0[24];      // step from the previous point
+  double f0[24];      // residual at the previous point
+  double dX[AA_DEPTH][24]; // differences of the points (ring)
+  double dF[AA_DEPTH][24]; // differences of the residuals (ring)
+  double sin0 = 0.0;  // alpha after the step from the previous point
+  double cos0 = 0.0;
+  double norm0 = 0.0; // residual norm at the previous point
+  int nh = 0;         // number of differences in the ring
+  int kh = 0;         // next ring slot
+  bool have0 = false; // whether there is a previous point
+  bool extrapolated = false; // whether the current point is an extrapolation
+
+  aa_fallbacks = 0;
+  PackCoeffs( x );
+  unsigned int it = 0;
+  while ( it < max_it ) {
+    UnpackCoeffs( x );
+    StepCore( pool, sin_alpha, cos_alpha );
+    ++ it;
+    PackCoeffs( g );
+    double norm = 0.0;
+    double md = 0.0; // max change of aG, aM (as the plain iteration)
+    for ( int j=0; j<24; ++j ) {
+      f[j] = g[j] - x[j];
+      norm += f[j] * f[j];
+      if ( ( j % 12 ) >= 3 && fabs( f[j] ) > md ) md = fabs( f[j] );
+    }
+    if ( md <= optimize_eps ) break; // the coefficients are g
+
+    if ( extrapolated && norm >= norm0 ) { // safeguard: back to the plain step
+      // the coefficients are those of the last accepted step, also if
+      // max_it is reached here
+      memcpy( x, g0, sizeof(x) );
+      UnpackCoeffs( x );
+      sin_alpha = sin0;
+      cos_alpha = cos0;
+      nh = kh = 0;
+      have0 = false;
+      extrapolated = false;
+      ++ aa_fallbacks;
+      continue;
+    }
+
+    if ( have0 ) {
+      for ( int j=0; j<24; ++j ) {
+        dX[kh][j] = x[j] - x0[j];
+        dF[kh][j] = f[j] - f0[j];
+      }
+      kh = ( kh + 1 ) % AA_DEPTH;
+      if ( nh < AA_DEPTH ) ++ nh;
+    }
+    memcpy( x0, x, sizeof(x) );
+    memcpy( g0, g, sizeof(g) );
+    memcpy( f0, f, sizeof(f) );
+    sin0 = sin_alpha;
+    cos0 = cos_alpha;
+    norm0 = norm;
+    have0 = true;
+
+    // least squares: ( dF^t dF ) gamma = dF^t f, by gaussian elimination
+    double a[AA_DEPTH][AA_DEPTH+1];
+    for ( int i=0; i<nh; ++i ) {
+      for ( int k=0; k<nh; ++k ) {
+        double d = 0.0;
+        for ( int j=0; j<24; ++j ) d += dF[i][j] * dF[k][j];
+        a[i][k] = d;
+      }
+      double d = 0.0;
+      for ( int j=0; j<24; ++j ) d += dF[i][j] * f[j];
+      a[i][nh] = d;
+    }
+    bool ok = ( nh > 0 );
+    for ( int i=0; ok && i<nh; ++i ) {
+      int p = i;
+      for ( int k=i+1; k<nh; ++k ) if ( fabs( a[k][i] ) > fabs( a[p][i] ) ) p = k;
+      if ( fabs( a[p][i] ) <= 1.0e-14 * fabs( a[0][0] ) || a[p][i] == 0.0 ) { ok = false; break; }
+      if ( p != i ) {
+        for ( int k=0; k<=nh; ++k ) { double t = a[i][k]; a[i][k] = a[p][k]; a[p][k] = t; }
+      }
+      for ( int k=i+1; k<nh; ++k ) {
+        double r = a[k][i] / a[i][i];
+        for ( int l=i; l<=nh; ++l ) a[k][l] -= r * a[i][l];
+      }
+    }
+    if ( ok ) {
+      double gamma[AA_DEPTH];
+      for ( int i=nh-1; i>=0; --i ) {
+        double d = a[i][nh];
+        for ( int k=i+1; k<nh; ++k ) d -= a[i][k] * gamma[k];
+        gamma[i] = d / a[i][i];
+      }
+      for ( int j=0; j<24; ++j ) {
+        double d = g[j];
+        for ( int i=0; i<nh; ++i ) d -= gamma[i] * ( dX[i][j] + dF[i][j] );
+        x[j] = d;
+      }
+      extrapolated = true;
+    } else { // plain step, and forget the history
+      memcpy( x, g, sizeof(x) );
+      nh = kh = 0;
+      extrapolated = false;
+    }
+  }
+
+  *sin_alpha0 = sin_alpha;
+  *cos_alpha0 = cos_alpha;
+  delete pool;
+  return it;
+}
+
+// solve a x = b, with a symmetric positive definite (n x n, by rows),
+// by Cholesky decomposition (in place); x is written in b
+//
+static bool
+cholesky_solve( double * a, double * b, int n )
+{
+  for ( int i=0; i<n; ++i ) {
+    for ( int j=0; j<=i; ++j ) {
+      double d = a[i*n+j];
+      for ( int k=0; k<j; ++k ) d -= a[i*n+k] * a[j*n+k];
+      if ( i == j ) {
+        if ( d <= 0.0 ) return false;
+        a[i*n+i] = sqrt( d );
+      } else {
+        a[i*n+j] = d / a[j*n+j];
+      }
+    }
+  }
+  for ( int i=0; i<n; ++i ) { // L y = b
+    double d = b[i];
+    for ( int k=0; k<i; ++k ) d -= a[i*n+k] * b[k];
+    b[i] = d / a[i*n+i];
+  }
+  for ( int i=n-1; i>=0; --i ) { // L^t x = y
+    double d = b[i];
+    for ( int k=i+1; k<n; ++k ) d -= a[k*n+i] * b[k];
+    b[i] = d / a[i*n+i];
+  }
+  return true;
+}
+
+// add a residual r with Jacobian row to the normal equations (upper half)
+//
+static void
+lm_add( const double * row, double r, int np, double * a, double * b )
+{
+  for ( int i=0; i<np; ++i ) {
+    if ( row[i] == 0.0 ) continue;
+    for ( int j=i; j<np; ++j ) a[i*np+j] += row[i] * row[j];
+    b[i] += row[i] * r;
+  }
+}
+
+// derivatives of f(g,m) with respect to the coefficients, given the
+// gradients u = df/dg, v = df/dm, and g = bG + aG * gn, m = bM + aM * m0
+//   df/dbG = u    df/daG(i,j) = u_i gn_j    df/dnL_j = (u * aG_j) g0_j |g0_j|
+//   df/dbM = v    df/daM(i,j) = v_i m0_j
+// where aG_j is the j-th column of aG
+//
+void
+Calibration::LMRow( const Vector & u, const Vector & v,
+                    const Vector & g0, const Vector & gn, const Vector & m0,
+                    int np, double * row ) const
+{
+  const double uu[3] = { u.X(),  u.Y(),  u.Z() };
+  const double vv[3] = { v.X(),  v.Y(),  v.Z() };
+  const double gg[3] = { gn.X(), gn.Y(), gn.Z() };
+  const double mm[3] = { m0.X(), m0.Y(), m0.Z() };
+  for ( int i=0; i<3; ++i ) {
+    row[i]    = uu[i];
+    row[12+i] = vv[i];
+    for ( int j=0; j<3; ++j ) {
+      row[ 3+3*i+j] = uu[i] * gg[j];
+      row[15+3*i+j] = vv[i] * mm[j];
+    }
+  }
+  if ( np > 24 ) {
+    Vector ua = aG.X() * uu[0] + aG.Y() * uu[1] + aG.Z() * uu[2]; // u^t aG
+    row[24] = ua.X() * g0.X() * fabs( g0.X() );
+    row[25] = ua.Y() * g0.Y() * fabs( g0.Y() );
+    row[26] = ua.Z() * g0.Z() * fabs( g0.Z() );
+  }
+  // aG(z,y) = lm_sym aG(y,z): the parameter aG(z,y) follows aG(y,z)
+  row[8] += lm_sym * row[10];
+  row[10] = 0.0;
+}
+
+// residuals (see OptimizeLM) at the current coefficients:
+//   group:  g_x/|g| - <g_x/|g|>_group,  m_x/|m| - <m_x/|m|>_group
+//   dip:    angle(g,m) - <angle(g,m)>
+//   size:   (|g|^2 - 1)/2,  (|m|^2 - 1)/2
+//   det:    log( det(a) / (LM_DET_MIN det(a) at the start) ) for a = aG, aM,
+//           only where negative
+// the Jacobian row of a deviation from the mean is the deviation of the
+// row from the mean row.
+// All but the det residuals vanish at aG = aM = 0 with |bG| = |bM| = 1,
+// whatever the input: the det residuals are a barrier that keeps the fit
+// off this minimum (the cost is infinite if a det changes sign).
+//
+double
+Calibration::LMSystem( int np, double * a, double * b )
+{
+  const Vector ex( 1.0, 0.0, 0.0 );
+  size_t ng = vGroups.size();
+  size_t nr = 3 * num;           // first row of the sums: G_x, M_x by group, then the dip
+  vLMRow.assign( ( nr + 2 * ng + 1 ) * LM_NP, 0.0 );
+  std::vector< double > q( nr + 2 * ng + 1, 0.0 ); // values (sums)
+  std::vector< int > cnt( ng, 0 );
+  int n = 0;
+
+  for ( int i=0; i<np*np; ++i ) a[i] = 0.0;
+  for ( int i=0; i<np; ++i ) b[i] = 0.0;
+  double cost = 0.0;
+  double row[ LM_NP ];
+
+  for (unsigned int k=0; k<num; ++k) {
+    if ( vIgnore[k] == 1 ) continue;
+    if ( vGroup[k] == NOT_USED ) continue;
+    const Vector & g0 = vG[k];
+    const Vector & m0 = vM[k];
+    Vector gn = GNonLinear( g0 );
+    Vector g = bG + aG * gn;
+    Vector m = bM + aM * m0;
+    double ig = 1.0 / g.length();
+    double im = 1.0 / m.length();
+    Vector gh = g * ig;
+    Vector mh = m * im;
+    double c = gh * mh;
+    double s = (gh % mh).length();
+    double d = atan2( s, c );
+    double is = -1.0 / s; // d(acos c)/dc
+    double * rk = &vLMRow[ 3 * k * LM_NP ];
+    q[3*k+0] = gh.X();
+    q[3*k+1] = mh.X();
+    q[3*k+2] = d;
+    LMRow( (ex - gh * gh.X()) * ig, Vector::zero, g0, gn, m0, np, rk );
+    LMRow( Vector::zero, (ex - mh * mh.X()) * im, g0, gn, m0, np, rk + LM_NP );
+    LMRow( (mh - gh * c) * (ig * is), (gh - mh * c) * (im * is), g0, gn, m0, np, rk + 2*LM_NP );
+
+    int grp = vGroup[k];
+    if ( grp >= 0 ) {
+      size_t kq = nr + 2 * grp;
+      double * rs = &vLMRow[ kq * LM_NP ];
+      q[kq]   += q[3*k+0];
+      q[kq+1] += q[3*k+1];
+      for ( int j=0; j<np; ++j ) {
+        rs[j]       += rk[j];
+        rs[LM_NP+j] += rk[LM_NP+j];
+      }
+      ++ cnt[grp];
+    }
+    size_t kd = nr + 2 * ng;
+    double * rd = &vLMRow[ kd * LM_NP ];
+    q[kd] += d;
+    for ( int j=0; j<np; ++j ) rd[j] += rk[2*LM_NP+j];
+    ++ n;
+
+    // size residuals: the gradient of (|v|^2-1)/2 is v
+    double r = ( g * g - 1.0 ) * 0.5;
+    LMRow( g, Vector::zero, g0, gn, m0, np, row );
+    lm_add( row, r, np, a, b );
+    cost += r * r;
+    r = ( m * m - 1.0 ) * 0.5;
+    LMRow( Vector::zero, m, g0, gn, m0, np, row );
+    lm_add( row, r, np, a, b );
+    cost += r * r;
+  }
+
+  size_t kd = nr + 2 * ng;
+  const double * rd = &vLMRow[ kd * LM_NP ];
+  double id = ( n > 0 )? 1.0 / n : 0.0;
+  for (unsigned int k=0; k<num; ++k) {
+    if ( vIgnore[k] == 1 ) continue;
+    if ( vGroup[k] == NOT_USED ) continue;
+    const double * rk = &vLMRow[ 3 * k * LM_NP ];
+    int grp = vGroup[k];
+    if ( grp >= 0 && cnt[grp] > 1 ) {
+      size_t kq = nr + 2 * grp;
+      const double * rs = &vLMRow[ kq * LM_NP ];
+      double ic = 1.0 / cnt[grp];
+      for ( int h=0; h<2; ++h ) {
+        double r = q[3*k+h] - q[kq+h] * ic;
+        for ( int j=0; j<np; ++j ) row[j] = rk[h*LM_NP+j] - rs[h*LM_NP+j] * ic;
+        lm_add( row, r, np, a, b );
+        cost += r * r;
+      }
+    }
+    double r = q[3*k+2] - q[kd] * id;
+    for ( int j=0; j<np; ++j ) row[j] = rk[2*LM_NP+j] - rd[j] * id;
+    lm_add( row, r, np, a, b );
+    cost += r * r;
+  }
+
+  // det barrier: d det(A) / d A_ij is the cofactor of A_ij
+  for ( int h=0; h<2; ++h ) {
+    const Matrix & am = ( h == 0 )? aG : aM;
+    double det0 = ( h == 0 )? lm_detG : lm_detM;
+    double det  = am.determinant();
+    if ( det * det0 <= 0.0 ) return HUGE_VAL;
+    double r = log( det / ( LM_DET_MIN * det0 ) );
+    if ( r >= 0.0 ) continue;
+    const Vector cof[3] = { am.Y() % am.Z(), am.Z() % am.X(), am.X() % am.Y() };
+    int j0 = ( h == 0 )? 3 : 15;
+    for ( int j=0; j<np; ++j ) row[j] = 0.0;
+    for ( int i=0; i<3; ++i ) {
+      row[j0+3*i+0] = cof[i].X() / det;
+      row[j0+3*i+1] = cof[i].Y() / det;
+      row[j0+3*i+2] = cof[i].Z() / det;
+    }
+    row[8] += lm_sym * row[10];
+    row[10] = 0.0;
+    lm_add( row, r, np, a, b );
+    cost += r * r;
+  }
+
+  for ( int i=0; i<np; ++i ) {
+    for ( int j=0; j<i; ++j ) a[i*np+j] = a[j*np+i];
+  }
+  return cost;
+}
+
+// Levenberg-Marquardt: the step dp solves
+//   ( J^t J + lambda diag(J^t J) ) dp = - J^t r
+// a step that decreases the cost is taken and lambda is decreased,
+// otherwise lambda is increased and the step is computed again.
+// The parameters are the 24 coefficients (as PackCoeffs) and the nL.
+//
+int
+Calibration::OptimizeLMCore( unsigned int max_it, double * sin_alpha0, double * cos_alpha0 )
+{
+  int np = use_nl ? LM_NP : 24;
+  double p[LM_NP];              // current parameters
+  double pn[LM_NP];             // trial parameters
+  double dp[LM_NP];             // step
+  double a[LM_NP*LM_NP];        // normal equations at p
+  double b[LM_NP];
+  double an[LM_NP*LM_NP];       // normal equations at pn
+  double bn[LM_NP];
+  double c[LM_NP*LM_NP];        // damped matrix
+  double lambda = 1.0e-3;
+
+  // the YZ block of aG is fixed up to a roll by aG(z,y) = aG(y,z) if it
+  // is a rotation, by aG(z,y) = - aG(y,z) if it is a reflection
+  lm_sym = ( aG.Y().Y() * aG.Z().Z() - aG.Y().Z() * aG.Z().Y() >= 0.0 )? 1.0 : -1.0;
+  PackCoeffs( p );
+  p[8]  = ( p[8] + lm_sym * p[10] ) * 0.5;
+  p[10] = lm_sym * p[8];
+  UnpackCoeffs( p );
+  lm_detG = aG.determinant();
+  lm_detM = aM.determinant();
+  p[24] = nL.X();
+  p[25] = nL.Y();
+  p[26] = nL.Z();
+  double cost = LMSystem( np, a, b );
+
+  unsigned int it = 0;
+  while ( it < max_it ) {
+    ++ it;
+    for ( int i=0; i<np*np; ++i ) c[i] = a[i];
+    for ( int i=0; i<np; ++i ) {
+      c[i*np+i] += lambda * a[i*np+i];
+      dp[i] = - b[i];
+    }
+    c[10*np+10] = 1.0; // aG(z,y) is not a parameter
+    if ( ! cholesky_solve( c, dp, np ) ) {
+      lambda *= 10.0;
+      continue;
+    }
+    for ( int j=0; j<np; ++j ) pn[j] = p[j] + dp[j];
+    pn[10] = lm_sym * pn[8];
+    UnpackCoeffs( pn );
+    if ( use_nl ) nL = Vector( pn[24], pn[25], pn[26] );
+    double cost_n = LMSystem( np, an, bn );
+    if ( cost_n < cost ) {
+      double md = 0.0; // max change of aG, aM (as the plain iteration)
+      for ( int j=0; j<24; ++j ) {
+        if ( ( j % 12 ) >= 3 && fabs( dp[j] ) > md ) md = fabs( dp[j] );
+      }
+      memcpy( p, pn, sizeof(p) );
+      memcpy( a, an, sizeof(a) );
+      memcpy( b, bn, sizeof(b) );
+      cost = cost_n;
+      if ( lambda > 1.0e-12 ) lambda *= 0.1;
+      if ( md <= optimize_eps ) break;
+    } else {
+      lambda *= 10.0;
+      if ( lambda > 1.0e12 ) break; // no decrease in the gradient direction: minimum
+    }
+  }
+  UnpackCoeffs( p );
+  if ( use_nl ) nL = Vector( p[24], p[25], p[26] );
+
+  // dip angle of the calibrated vectors
+  double sa = 0.0;
+  double ca = 0.0;
+  for (unsigned int k=0; k<num; ++k) {
+    if ( vIgnore[k] == 1 ) continue;
+    if ( vGroup[k] == NOT_USED ) continue;
+    Vector g = bG + aG * GNonLinear( vG[k] );
+    Vector m = bM + aM * vM[k];
+    g.normalize();
+    m.normalize();
+    sa += (g % m).length();
+    ca += g * m;
+  }
+  double da = sqrt( sa*sa + ca*ca );
+  *sin_alpha0 = sa/da;
+  *cos_alpha0 = ca/da;
+  return it;
+}
+
 double 
 Calibration::ComputeDelta( // Vector * gx, Vector * mx,
                            double & error, int & jmax, 
@@ -700,7 +1381,7 @@ Calibration::ComputeDelta( // Vector * gx, Vector * mx,
       continue;
     }
     if ( vGroup[k] == NOT_USED ) continue;
-    Vector g = bG + aG * vG[k];
+    Vector g = bG + aG * GNonLinear( vG[k] );
     Vector m = bM + aM * vM[k];
     // Vector dG = gx[k] - g;
     // Vector dM = mx[k] - m;
@@ -739,6 +1420,8 @@ Calibration::PrepareOptimize()
   aM = Matrix::one;
   bG = Vector::zero;
   bM = Vector::zero;
+  nL = Vector::zero;
+  use_nl = false;
 }
 
 
@@ -748,7 +1431,7 @@ Calibration::CheckInput( bool print )
 {
   double diff = 0.0;
   for (unsigned int k=0; k<num; ++k) {
-    Vector g = bG + aG * vG[k];
+    Vector g = bG + aG * GNonLinear( vG[k] );
     Vector m = bM + aM * vM[k];
     Vector e( 1.0, 0.0, 0.0 );
     Vector m0 = g % (m % g);
@@ -778,7 +1461,7 @@ Calibration::Measure(
                     const Vector & g_in, const Vector & m_in,
                     double & compass, double & clino )
 {
-  Vector g = bG + aG * g_in;
+  Vector g = bG + aG * GNonLinear( g_in );
   Vector m = bM + aM * m_in;
   Vector e( 1.0, 0.0, 0.0 );
   Vector m0 = g % (m % g);
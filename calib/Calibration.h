@@ -0,0 +1,605 @@
+/** @file Calibration.h
+ *
+ * @author marco corvi
+ * @date dec 2008
+ * 
+ * @brief Beat Heeb calibration algorithm
+ *
+ * @note after the class CalibAlgorithm.cs by B. Heeb
+ *
+ * --------------------------------------------------------
+ *  Copyright This sowftare is distributed under GPL-3.0 or later
+ *  See the file COPYING.
+ */
+#ifndef CALIBRATION_H
+#define CALIBRATION_H
+
+#include <vector>
+
+#include "Vector.h"
+#include "Matrix.h"
+#include "CalibKernels.h"
+#include "CalibPool.h"
+
+#define  MAX_IT 2000 /** default maximum number of iterations */
+#define  AA_DEPTH 5   /** number of past steps of the Anderson acceleration */
+#define  LM_NP 27     /** max number of parameters of the Levenberg-Marquardt fit */
+#define  LM_DET_MIN 0.1  /** min det(aG), det(aM) of the LM fit, relative to the start */
+#define  MIN_SHAPE 0.05  /** min shape factor of aG, aM (see CheckCoeffs) */
+
+#define NOT_USED (-2)
+#define NO_GROUP (-1)
+
+
+// namespace TopoLinux
+// {
+  /** a calibration measure data
+   */
+  struct MeasureData
+  {
+    int G[3]; //!< G values
+    int M[3]; //!< M values
+    int idx;  //!< index
+    int grp;  //!< group index
+    int ignore;   //!< data is ignored
+    double error; //!< calibration error
+
+    /** default cstr
+     */
+    MeasureData()
+      : idx( -1 )
+      , grp( -1 )
+      , ignore( 0 )
+      , error( -1.0 )
+    {
+      G[0] = G[1] = G[2] = 0;
+      M[0] = M[1] = M[2] = 0;
+    }
+
+    /** cstr
+     */
+    MeasureData( int gx, int gy, int gz, int mx, int my, int mz, int i, int g, int ign)
+      : idx( i )
+      , grp( g )
+      , ignore( ign )
+      , error( -1.0 )
+    {
+      G[0] = gx;
+      G[1] = gy;
+      G[2] = gz;
+      M[0] = mx;
+      M[1] = my;
+      M[2] = mz;
+    }
+  };
+
+  /** group of calibration measures
+   *
+   * a set of measures form a group when they have the same
+   * bearing and inclination, but differ by the roll
+   */
+  struct Group 
+  {
+    std::vector< size_t > idx; //!< indices of the measures in the group
+    
+    /** add an index to the group
+     * @param i  index to add
+     * @return true if the index has been added to the group
+     */
+    bool Add( size_t i ) 
+    {
+      for (size_t k=0; k<idx.size(); ++k) {
+        if ( idx[k] == i ) return false;
+      }
+      idx.push_back( i );
+      return true;
+    }
+
+    /** the number of indices in the group
+     * @return the size of the array of indices
+     */
+    size_t Size() const { return idx.size(); }
+
+    /** get the i-th index
+     * @param i number of the index
+     * @return the i-th index
+     */
+    size_t Index( size_t i ) { return idx[i]; }
+  };
+
+  class Calibration
+  {
+    private:
+      // static const unsigned int MAX_IT;
+      std::vector< MeasureData > vD; //!< array of input measure data
+
+      std::vector< Vector > vG; //!< array of G vectors
+      std::vector< Vector > vM; //!< array of M vectors
+      std::vector< int > vIgnore;    //!< ignore in calibration
+      std::vector< double > vError;  //!< calibration error
+      std::vector< int > vGroup; //!< array of the groups
+      std::vector< double > vCompass;
+      std::vector< double > vClino;
+      unsigned int num;         //!< size of the vectors
+      double optimize_eps;
+      double dip_angle;         //!< M dip angle
+
+      /** calibration coefficients
+       */
+      Matrix aG;  //!< G calibration matrix
+      Matrix aM;  //!< M calibration matrix
+      Vector bG;  //!< G calibration offset
+      Vector bM;  //!< M calibration offset
+      Vector nL;  //!< G non-linearity (zero unless fitted)
+      bool use_nl; //!< whether the G non-linearity is applied
+
+      std::vector< Group > vGroups; //!< set of groups of indices
+
+      /** optimization work arrays, by components (@see CalibKernels.h)
+       */
+      CalibColumns cG;   //!< G inputs
+      CalibColumns cM;   //!< M inputs
+      CalibColumns cGr;  //!< transformed G
+      CalibColumns cMr;  //!< transformed M
+      CalibColumns cGx;  //!< optimal G
+      CalibColumns cMx;  //!< optimal M
+      std::vector< double > vWeight; //!< 1 for the samples used in the fit, 0 otherwise (padded)
+      /** input sums of the fit, and the terms that depend only on them
+       */
+      struct FitSums
+      {
+        Vector sumG;     //!< sum of the G
+        Vector sumM;     //!< sum of the M
+        Matrix sumG2;    //!< sum of the G & G
+        Matrix sumM2;    //!< sum of the M & M
+        double sa;       //!< sum of the |G % M|
+        double ca;       //!< sum of the G * M
+        int n;           //!< number of samples
+        double invNum;   //!< 1/n
+        Vector avG;      //!< average G
+        Vector avM;      //!< average M
+        Matrix invG;     //!< inverse of the G covariance (times n)
+        Matrix invM;     //!< inverse of the M covariance (times n)
+
+        void Clear()
+        {
+          sumG = sumM = Vector::zero;
+          sumG2 = sumM2 = Matrix::zero;
+          sa = ca = 0.0;
+          n = 0;
+        }
+
+        void Add( const Vector & g, const Vector & m )
+        {
+          sa += (g % m).length(); // cross product (abs value)
+          ca += g * m;            // dot product
+          sumG += g;
+          sumM += m;
+          sumG2 += g & g;
+          sumM2 += m & m;
+          n ++;
+        }
+
+        /** compute the terms of the sums
+         */
+        void Finish()
+        {
+          invNum = 1.0 / n;
+          avG = sumG * invNum;
+          avM = sumM * invNum;
+          Matrix iG = (sumG2 - (sumG & avG));
+          Matrix iM = (sumM2 - (sumM & avM));
+          invG = iG.inverse();
+          invM = iM.inverse();
+        }
+      };
+      FitSums fit;
+
+      std::vector< double > vGroupS; //!< group terms of the sine of the new alpha
+      std::vector< double > vGroupC; //!< group terms of the cosine of the new alpha
+      unsigned int num_threads; //!< threads of the group solve
+      unsigned int aa_fallbacks; //!< Anderson steps dropped in the last optimization
+      std::vector< double > vLMRow;  //!< Jacobian rows of the fit, LM_NP per row (see LMSystem)
+      double lm_sym;                 //!< aG(z,y) = lm_sym aG(y,z) in the LM fit
+      double lm_detG;                //!< det(aG) at the start of the LM fit
+      double lm_detM;                //!< det(aM) at the start of the LM fit
+      unsigned int lm_fallbacks;     //!< degenerate LM fits replaced by Optimize() in the last OptimizeLM()
+
+    public:
+      /** cstr
+       */
+      Calibration()
+        : num( 0 )
+        , use_nl( false )
+        , num_threads( 1 )
+        , aa_fallbacks( 0 )
+        , lm_fallbacks( 0 )
+        #ifdef EXPERIMENTAL
+        , show_gui( false )
+        #endif
+      {
+        fit.Clear();
+      }
+
+      void SetGCoeffs( Matrix & a, Vector & b )
+      {
+        aG = a;
+        bG = b;
+      }
+
+      /** set the number of threads of the group solve
+       * @param n  number of threads [default 1]
+       * @note the result does not depend on the number of threads
+       */
+      void SetThreads( unsigned int n ) { num_threads = ( n > 0 )? n : 1; }
+
+      const Matrix & GetAG() const { return aG; }
+      const Vector & GetBG() const { return bG; }
+      const Matrix & GetAM() const { return aM; }
+      const Vector & GetBM() const { return bM; }
+      const Vector & GetNL() const { return nL; }
+
+      /** get the G non-linearity coefficients (bytes 48-50 of the coefficient memory)
+       * @param coeff  output array with the three NL bytes
+       */
+      void GetNLCoeff( unsigned char coeff[ 3 ] );
+
+      /** clear the vectors of G and M
+       */
+      void Clear();
+
+      /** get the calibration coefficients
+       * @param coeff  output array with the calibration coefficients
+       */
+      void GetCoeff( unsigned char coeff[ 48 ] );
+
+      /** set the calibration coefficients
+       * @param coeff  input array with the calibration coefficients
+       */
+      void SetCoeff( const unsigned char coeff[ 48 ] );
+
+      double GetError( size_t k ) const { return vError[k]; }
+
+      int GetGroup( size_t k ) const { return vGroup[k]; }
+
+      int GetIgnore( size_t k ) const { return vIgnore[k]; }
+
+      double GetDipAngle() const { return dip_angle; }
+
+      /** number of Anderson steps dropped by the safeguard in the last OptimizeAccelerated()
+       */
+      unsigned int GetFallbacks() const { return aa_fallbacks; }
+
+      /** number of degenerate fits replaced by the result of Optimize() in the last OptimizeLM()
+       */
+      unsigned int GetLMFallbacks() const { return lm_fallbacks; }
+
+      /** copy a coefficient value in a pair of bytes
+       * @param data array of two bytes
+       * @param value value to write in the array of two bytes
+       */
+      void PutCoeff( unsigned char * data, double value );
+
+      /** copy a pair of bytes into a coefficient value
+       * @param data array of two bytes
+       * @param value value to write from the array of two bytes
+       */
+      void GetCoeff( const unsigned char * data, double & value );
+
+      /** insert a pair of vectors into the arrays
+       * @param gx   X component of vector G
+       * @param gy   Y component of vector G
+       * @param gz   Z component of vector G
+       * @param mx   X component of vector M
+       * @param my   Y component of vector M
+       * @param mz   Z component of vector M
+       * @param idx  index
+       * @param group group of the measure [-i for no group]
+       * @param compass  compass value of the measure [debug]
+       * @param clino    clino value of the measure [debug]
+       * @note the pair is added also to the input sums of OptimizeWarm():
+       *       each index must be given once
+       */
+      void AddValues( int gx, int gy, int gz, int mx, int my, int mz, 
+                      unsigned int idx, 
+                      int group = NO_GROUP,
+                      int ignore = 0,
+                      double compass = 0.0,double clino = 0.0 );
+
+      /** print the input data
+       */
+      void PrintValues();
+
+      /** print the calibration coeffs
+       */
+      void PrintCoeffs();
+
+      /** print the calibration groups
+       */
+      void PrintGroups();
+
+      /** print calibration to a file
+       * @param name output filename
+       * @note with the G non-linearity the 48 coefficient bytes are
+       *       followed by the NL bytes 48-50 and 0xff
+       */
+      void PrintCalibrationFile( const char * name );
+
+      /** print check 
+       * @param print whether to print [default true]
+       * @return the average difference [rads]
+       */
+      double CheckInput( bool print = true );
+ 
+      /** check that the groups indices are aligned
+       * @return fals eif there is a mismatch
+       */
+      bool CheckGroups();
+
+      /** check that the coefficients are not degenerate: the shape factor
+       * |det A| / ( |A|/sqrt(3) )^3 of aG and aM (|A| the Frobenius norm)
+       * is 1 if A is a rotation times a scale, and it goes to 0 as a
+       * singular value of A collapses
+       * @return false if the shape factor of aG or aM is below MIN_SHAPE
+       */
+      bool CheckCoeffs() const;
+
+      /** initialize calibration coeffs
+       */
+      void PrepareOptimize();
+
+      /** carry out a measure
+       * @param g   G vector
+       * @param m   M vector
+       * @param compass (output) compass value
+       * @param clino   (output) clino value
+       */
+      void Measure( const Vector & g, const Vector & m,
+                    double & compass, double & clino );
+
+      /** carry out the calibration optmazation
+       * @param delta (output) average angle error (degrees)
+       *              used to be percent L2 error between input G and M's
+       * @param error (output) final error
+       * @param max_it maximum number of iterations
+       * @param optimize_axis  whether to optimize the rotation axis
+       * @return number of iterations
+       */
+      /**
+       *
+       * FIXME ...
+       */
+      unsigned int Optimize( double & delta, double & error, unsigned int max_it = MAX_IT );
+
+      /** calibration optimization from the current coefficients
+       * @param delta (input) convergence threshold [as Optimize()]
+       *              (output) average angle error (degrees)
+       * @param error (output) final error
+       * @param max_it maximum number of iterations
+       * @return number of iterations
+       *
+       * The iteration of Optimize() starts from the coefficients of the
+       * last optimization instead of the identity, and uses the input sums
+       * kept by AddValues(): after a few more pairs it takes few iterations.
+       */
+      unsigned int OptimizeWarm( double & delta, double & error, unsigned int max_it = MAX_IT );
+
+      /** calibration optimization with Anderson acceleration of the iteration
+       * @param delta (input) convergence threshold [as Optimize()]
+       *              (output) average angle error (degrees)
+       * @param error (output) final error
+       * @param max_it maximum number of iterations
+       * @return number of iterations
+       *
+       * The iteration of Optimize() is extrapolated over the last AA_DEPTH
+       * steps; an extrapolation that does not decrease the change of the
+       * coefficients is dropped for the plain step.
+       */
+      unsigned int OptimizeAccelerated( double & delta, double & error, unsigned int max_it = MAX_IT );
+
+      /** calibration by Levenberg-Marquardt least squares
+       * @param delta (input) convergence threshold [as Optimize()]
+       *              (output) average angle error (degrees)
+       * @param error (output) final error
+       * @param max_it maximum number of iterations (at least 2)
+       * @param nl    whether to fit also the G non-linearity
+       * @return number of iterations
+       *
+       * The residuals are functions of the calibrated vectors g, m:
+       * in each group the deviations from the group mean of g_x/|g| and
+       * m_x/|m| (invariant under the roll), over all the samples the
+       * deviations from the mean of the angle between g and m, and for
+       * each sample (|g|^2-1)/2, (|m|^2-1)/2. They are minimized over the
+       * 24 coefficients, with aG(y,z) = aG(z,y) as Optimize() (or
+       * aG(y,z) = - aG(z,y) if the G frame is mirrored), and the
+       * G non-linearity nL, which turns the input G into G_i + nL_i G_i |G_i|.
+       * The fit starts from the first step of Optimize(), from the
+       * identity or from the mirrored G frame, whichever is better.
+       * The residuals vanish also for aG = aM = 0 and unit bG = bM: a
+       * barrier keeps det(aG) and det(aM) above LM_DET_MIN times their
+       * start values, and if the fit ends degenerate anyway (CheckCoeffs)
+       * the result is that of Optimize(), with the iterations left
+       * (@see GetLMFallbacks).
+       */
+      unsigned int OptimizeLM( double & delta, double & error, unsigned int max_it = MAX_IT, bool nl = false );
+
+#ifdef EXPERIMENTAL
+    private:
+      bool show_gui;
+      #include "../experimental/ExperimentalCalibration.h"
+#endif
+
+    private:
+      /** core of the optimization algo
+       * @param max_it max number of iterations
+       * @param sin_alpha  angle between G and M (output)
+       * @param cos_alpha
+       * @param warm  whether to start from the current coefficients
+       * @return number of iterations
+       */
+      int OptimizeCore( unsigned int max_it, double * sin_alpha, double * cos_alpha, bool warm = false );
+
+      /** argument of the group solve task
+       */
+      struct SolveJob
+      {
+        Calibration * calib;
+        double sin_alpha;
+        double cos_alpha;
+      };
+
+      /** part of the group solve (CalibPool task)
+       * @param arg   group solve job
+       * @param part  part number
+       * @param parts number of parts
+       */
+      static void SolveTask( void * arg, unsigned int part, unsigned int parts );
+
+      /** optimal vectors of the samples of a range of groups
+       * @param kg0   first group
+       * @param kg1   last group (excluded)
+       * @param sin_alpha  angle between G and M
+       * @param cos_alpha
+       */
+      void SolveGroups( size_t kg0, size_t kg1, double sin_alpha, double cos_alpha );
+
+      /** start the optimization: input sums, work arrays, initial coefficients
+       * @param sin_alpha  initial angle between G and M (output)
+       * @param cos_alpha
+       */
+      void StartCore( double & sin_alpha, double & cos_alpha );
+
+      /** start the optimization from the current coefficients: work arrays and alpha
+       * @param sin_alpha  initial angle between G and M (output)
+       * @param cos_alpha
+       */
+      void WarmCore( double & sin_alpha, double & cos_alpha );
+
+      /** one iteration of the optimization: new coefficients from the current ones
+       * @param pool       threads of the group solve (can be NULL)
+       * @param sin_alpha  angle between G and M (input and output)
+       * @param cos_alpha
+       */
+      void StepCore( CalibPool * pool, double & sin_alpha, double & cos_alpha );
+
+      /** Anderson-accelerated core of the optimization
+       * @param max_it max number of iterations
+       * @param sin_alpha  angle between G and M (output)
+       * @param cos_alpha
+       * @return number of iterations
+       */
+      int OptimizeAnderson( unsigned int max_it, double * sin_alpha, double * cos_alpha );
+
+      /** copy the coefficients to/from an array: bG, aG (by rows), bM, aM
+       * @param x  array of 24 values
+       */
+      void PackCoeffs( double * x ) const;
+      void UnpackCoeffs( const double * x );
+
+      /** G input with the non-linearity
+       * @param g   input G vector
+       */
+      Vector GNonLinear( const Vector & g ) const
+      {
+        if ( ! use_nl ) return g;
+        return Vector( g.X() + nL.X() * g.X() * fabs( g.X() ),
+                       g.Y() + nL.Y() * g.Y() * fabs( g.Y() ),
+                       g.Z() + nL.Z() * g.Z() * fabs( g.Z() ) );
+      }
+
+      /** Levenberg-Marquardt core of the optimization
+       * @param max_it max number of iterations
+       * @param sin_alpha  angle between G and M (output)
+       * @param cos_alpha
+       * @return number of iterations
+       */
+      int OptimizeLMCore( unsigned int max_it, double * sin_alpha, double * cos_alpha );
+
+      /** normal equations of the Levenberg-Marquardt fit at the current coefficients
+       * @param np   number of parameters (24, or 27 with nL)
+       * @param a    output J^t J (np x np, by rows)
+       * @param b    output J^t r
+       * @return the sum of the squared residuals
+       */
+      double LMSystem( int np, double * a, double * b );
+
+      /** Jacobian row of a function of the calibrated g, m
+       * @param u    gradient of the function with respect to g
+       * @param v    gradient of the function with respect to m
+       * @param g0   input G
+       * @param gn   input G with the non-linearity
+       * @param m0   input M
+       * @param np   number of parameters
+       * @param row  output row (np values)
+       */
+      void LMRow( const Vector & u, const Vector & v,
+                  const Vector & g0, const Vector & gn, const Vector & m0,
+                  int np, double * row ) const;
+
+      /** load the inputs in the work arrays
+       * @return number of samples used in the fit
+       */
+      int LoadColumns();
+
+      /**
+       * @param gr  G vector
+       * @param mr  M vector
+       * @param alpha rotation angle
+       * @param gx  output G vector
+       * @param mx  output M vector
+       *
+       *         <-------+    (No normal to the page, incoming)
+       *         Mr     /|\   (Mr^No vertical, downwards)
+       *              /  |  x Gr
+       *  rot_a(Mr) x   |     (No^Gx leftwards)
+       *                |
+       *                v Gx = rot_a(Mr) + Gr
+       */
+      void OptVectors( const Vector & gr, const Vector & mr,
+                       double sin_alpha, double cos_alpha, 
+                       Vector & gx, Vector & mx );
+
+      /**
+       * @param gxp  input G vector
+       * @param mxp  input M vector
+       * @param gr   reference G vector
+       * @param mr   reference M vector
+       * @param gx   (output) rotated G vector
+       * @param mx   (output) rotated M vector
+       * @return the rotation angle [degrees]
+       */
+      double TurnVectors( const Vector & gxp, const Vector & mxp,
+                    const Vector & gr,  const Vector & mr,
+                    Vector & gx, Vector & mx, bool print = false );
+
+      /** compute the euclidean distance between the stored (G,M) pair array
+       *  and a given array of pairs
+       * @param gx   array of G vectors
+       * @param mx   array of M vectors
+       * @param error max error
+       * @param jmax  index of max error
+       * @param alpha expected angle between G and M
+       * @param print whether to print out info (verbose)
+       * @return the L2 distance between (gx,mx) and (gr,mr) (percent)
+       */
+      double ComputeDelta( // Vector * gx, Vector * mx, 
+                           double & error, int & jmax, 
+                           double sin_alpha, double cos_alpha, 
+                           bool print=false );
+
+    private:
+      /** set ignore 
+       * @param j index
+       */
+      void SetIgnore( int j ) 
+      {
+        // vIgnore.at(j) = 1;
+        vIgnore[j] = 1;
+      }
+    };
+
+
+// } // namespace TopoLinux
+
+#endif // CALIBRATION_H
+
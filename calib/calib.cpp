@@ -23,6 +23,8 @@
 
 enum CalinMode {
   MODE_PT = 1,
+  MODE_AA = 2, // the documented modes have fixed numbers, the experimental ones follow
+  MODE_LM = 3,
 #ifdef EXPERIMENTAL
   MODE_GRAD,
   MODE_DELTA,
@@ -40,11 +42,13 @@ void usage()
 {
   static bool printed_usage = false;
   if ( ! printed_usage ) {
-    fprintf(stderr, "Usage: calib [-i max_iter] [-p] [-h] <input_file> [output_file]\n");
+    fprintf(stderr, "Usage: calib [-i max_iter] [-j threads] [-m mode] [-n] [-p] [-h] <input_file> [output_file]\n");
     fprintf(stderr, "Options: \n");
-    fprintf(stderr, "  -i max_iter   max nr. iterations [default 2000]\n");
-#ifdef EXPERIMENTAL
+    fprintf(stderr, "  -i max_iter   max nr. iterations [default 200]\n");
+    fprintf(stderr, "  -j threads    nr. threads of the group solve [default 1]\n");
     fprintf(stderr, "  -m mode       optimization mode\n");
+    fprintf(stderr, "  -n            fit also the G non-linearity (mode %d only)\n", MODE_LM );
+#ifdef EXPERIMENTAL
     fprintf(stderr, "  -d delta      required delta (mode %d ", MODE_DELTA );
     #ifdef USE_GUI 
       fprintf(stderr, "or %d ", MODE_DELTA_DISPLAY );
@@ -58,16 +62,18 @@ void usage()
     fprintf(stderr, "one record per line, in the format: \n");
     fprintf(stderr, "   Gx Gy Gz Mx My Mz group ignore\n");
     fprintf(stderr, "where the G and M are hex, group and ignore are decimal\n");
-#ifdef EXPERIMENTAL
     fprintf(stderr, "The mode is one of:\n");
     fprintf(stderr, "  %d PocketTopo algorithm with angular error instead of rms error\n", MODE_PT);
+    fprintf(stderr, "  %d mode %d with Anderson acceleration (after mode %d, for comparison)\n", MODE_AA, MODE_PT, MODE_PT );
+    fprintf(stderr, "  %d Levenberg-Marquardt least squares (after mode %d, for comparison)\n", MODE_LM, MODE_PT );
+#ifdef EXPERIMENTAL
     fprintf(stderr, "  %d Gradient algorithm \n", MODE_GRAD );
     fprintf(stderr, "  %d PocketTopo algorithm iterated until the error is below delta\n", MODE_DELTA );
     fprintf(stderr, "  %d optimize only M (fixed G)\n", MODE_FIX_G );
     fprintf(stderr, "  %d optimize iteratively (experimental)\n", MODE_ITER );
 #ifdef USE_GUI
-    fprintf(stderr, "  %d mode 1 with graphical display of set planes\n", MODE_PT_DISPLAY );
-    fprintf(stderr, "  %d mode 3 with graphical display of set planes\n", MODE_DELTA_DISPLAY );
+    fprintf(stderr, "  %d mode %d with graphical display of set planes\n", MODE_PT_DISPLAY, MODE_PT );
+    fprintf(stderr, "  %d mode %d with graphical display of set planes\n", MODE_DELTA_DISPLAY, MODE_DELTA );
 #endif
 #endif
     fprintf(stderr, "The calibration coefficients are written to the output_file\n");
@@ -83,14 +89,29 @@ void usage()
  */
 #include <time.h>
 
+/** time [msec], for the comparison of the modes
+ */
+double elapsed_msec()
+{
+#ifdef WIN32
+  return clock() * 1000.0 / CLOCKS_PER_SEC;
+#else
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+#endif
+}
+
 int main( int argc, char ** argv )
 {
   char * in_file = NULL;
   char * out_file = NULL;
 
-  unsigned int max_it = 2000; // Max nr. of iterations
+  unsigned int max_it = 200; // Max nr. of iterations
+  unsigned int threads = 1;   // threads of the group solve
   bool print_input = false;
   bool verbose = false;
+  bool fit_nl = false; // whether to fit the G non-linearity
   int mode = MODE_PT;  // 1: PocketTopo Optimize
                  // 2: Optimize2
                  // 3: OptimizeBest
@@ -108,11 +129,18 @@ int main( int argc, char ** argv )
       max_it = atoi( argv[ac+1]);
       if ( max_it < 200 ) max_it = 200;
       ac += 2;
-#ifdef EXPERIMENTAL
+    } else if ( strncmp(argv[ac],"-j", 2) == 0 ) {
+      threads = atoi( argv[ac+1] );
+      if ( threads < 1 ) threads = 1;
+      ac += 2;
     } else if ( strncmp(argv[ac],"-m", 2) == 0 ) {
       mode = atoi( argv[ac+1] );
       if ( mode < MODE_PT || mode >= MODE_MAX ) mode = MODE_PT;
       ac += 2;
+    } else if ( strncmp(argv[ac],"-n", 2) == 0 ) {
+      fit_nl = true;
+      ac ++;
+#ifdef EXPERIMENTAL
     } else if ( strncmp(argv[ac],"-d", 2) == 0 ) {
       delta = atof( argv[ac+1] );
       if ( delta < 0.001 ) delta = 0.5;
@@ -148,9 +176,9 @@ int main( int argc, char ** argv )
       fprintf(stderr, "Calibration coeff file \"%s\"\n", out_file );
     }
     fprintf(stderr, "Max nr. iterations %d \n", max_it );
-    #ifdef EXPERIMENTAL
-      fprintf(stderr, "Optimization mode: nr. %d\n", mode );
-    #endif
+    fprintf(stderr, "Nr. threads %d \n", threads );
+    fprintf(stderr, "Optimization mode: nr. %d\n", mode );
+    fprintf(stderr, "Vector kernels: %s\n", calib_kernel() );
   }
 
   FILE * fp = fopen( in_file, "r" );
@@ -160,6 +188,7 @@ int main( int argc, char ** argv )
   }
 
   Calibration calib;
+  calib.SetThreads( threads );
   int16_t gx, gy, gz, mx, my, mz;
   int grp;
   int ignore;
@@ -174,17 +203,16 @@ int main( int argc, char ** argv )
       fprintf(stderr, "Input file format: calib-coeff\n");
     }
     int gx0, gy0, gz0, mx0, my0, mz0;
-    // skip coeffs;
-    for (int k=1; k<6; ++k ) fgets(line, 256, fp);
-    // skip one more line
-    fgets(line, 256, fp);
+    // skip coeffs (six lines, seven with the G non-linearity) up to the data
+    while ( fgets(line, 256, fp) && strncmp( line, "Calibration input", 17 ) != 0 ) ;
     // printf("reading after: %s\n", line);
     while ( fgets(line, 255, fp ) ) {
       // fprintf(stderr, line );
       char rem[32];
       if ( line[0] == '#' ) continue;
-      sscanf( line, "G: %d %d %d M: %d %d %d %s %d %d",
-          &gx0, &gy0, &gz0, &mx0, &my0, &mz0, rem, &grp, &ignore);
+      // the coefficients in decimal follow the data
+      if ( sscanf( line, "G: %d %d %d M: %d %d %d %31s %d %d",
+          &gx0, &gy0, &gz0, &mx0, &my0, &mz0, rem, &grp, &ignore) != 9 ) continue;
       gx = (int16_t)( gx0  );
       gy = (int16_t)( gy0  );
       gz = (int16_t)( gz0  );
@@ -292,6 +320,36 @@ int main( int argc, char ** argv )
     break;
 #endif
 #endif // EXPERIMENTAL
+  case MODE_AA:
+    {
+      double delta_pt = delta;
+      double error_pt;
+      unsigned int iter_pt = calib.Optimize( delta_pt, error_pt, max_it );
+      fprintf(stdout, "Mode %d: iterations %d delta %.4f max error %.4f\n",
+        MODE_PT, iter_pt, delta_pt, error_pt );
+      iter = calib.OptimizeAccelerated( delta, error, max_it );
+      fprintf(stdout, "Mode %d: iterations %d delta %.4f max error %.4f (fallbacks %d)\n",
+        MODE_AA, iter, delta, error, calib.GetFallbacks() );
+    }
+    break;
+  case MODE_LM:
+    {
+      double delta_pt = delta;
+      double error_pt;
+      double t0 = elapsed_msec();
+      unsigned int iter_pt = calib.Optimize( delta_pt, error_pt, max_it );
+      double t1 = elapsed_msec();
+      fprintf(stdout, "Mode %d: iterations %d delta %.4f max error %.4f time %.2f ms\n",
+        MODE_PT, iter_pt, delta_pt, error_pt, t1 - t0 );
+      iter = calib.OptimizeLM( delta, error, max_it, fit_nl );
+      double t2 = elapsed_msec();
+      fprintf(stdout, "Mode %d: iterations %d delta %.4f max error %.4f time %.2f ms\n",
+        MODE_LM, iter, delta, error, t2 - t1 );
+      if ( calib.GetLMFallbacks() > 0 ) {
+        fprintf(stdout, "Mode %d: degenerate fit, result of mode %d\n", MODE_LM, MODE_PT );
+      }
+    }
+    break;
   default:
     fprintf(stderr, "Unexpected calibration mode %d\n", mode );
     break;
@@ -0,0 +1,171 @@
+/** @file calib_online.cpp
+ *
+ * @author marco corvi
+ * @date oct 2026
+ *
+ * @brief calibrate while the calibration shots are taken
+ *
+ * The DistoX must be in calibration mode (see tlx_toggle_calib). The
+ * shots are taken in groups of four, at the same direction with different
+ * rolls. After each group the coefficients are computed again and the
+ * error and the dip angle are printed: the calibration can be stopped
+ * (CTRL-C) as soon as they are good enough.
+ * --------------------------------------------------------
+ *  Copyright This sowftare is distributed under GPL-3.0 or later
+ *  See the file COPYING.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+
+#include "../basic/defaults.h"
+#include "Protocol.h"
+#include "CalibOnline.h"
+
+#define ONLINE_SHOTS 56        /* shots of the calibration procedure */
+#define ONLINE_POLL  1000000UL /* read timeout [usec], to check for a stop */
+
+static volatile sig_atomic_t running = 1;
+
+static void
+on_signal( int )
+{
+  running = 0;
+}
+
+static void
+print_solve( const CalibOnline & online, bool solved, bool verbose )
+{
+  unsigned int n = online.Size();
+  if ( solved ) {
+    fprintf(stdout, "shot %2d group %2d: iterations %3d delta %.4f max error %.4f dip %.2f%s\n",
+      n, online.Groups(), online.Iterations(), online.Delta(), online.Error(), online.Dip(),
+      online.Valid() ? "" : " (not valid)" );
+  } else if ( verbose ) {
+    fprintf(stdout, "shot %2d group %2d\n", n, online.Groups() );
+  }
+  fflush( stdout );
+}
+
+void usage()
+{
+  fprintf(stderr, "Usage: calib_online [options] [output_file]\n");
+  fprintf(stderr, "Options:\n");
+  fprintf(stderr, "  -d device     RFCOMM serial device [%s]\n", DEFAULT_DEVICE );
+  fprintf(stderr, "  -n shots      number of shots [default %d]\n", ONLINE_SHOTS );
+  fprintf(stderr, "  -i max_iter   max nr. iterations of each solve [default 200]\n");
+  fprintf(stderr, "  -v            verbose\n");
+  fprintf(stderr, "  -h            print usage\n");
+  fprintf(stderr, "The coefficients are computed after each group of %d shots,\n", ONLINE_GROUP );
+  fprintf(stderr, "from the %d-th shot on. CTRL-C stops the calibration.\n", ONLINE_MIN );
+  fprintf(stderr, "The calibration coefficients and data are written to the output_file\n");
+  fprintf(stderr, "if specified (the input of tlx_calib).\n");
+}
+
+int main( int argc, char ** argv )
+{
+  const char * device = DEFAULT_DEVICE;
+  const char * out_file = NULL;
+  unsigned int shots  = ONLINE_SHOTS;
+  unsigned int max_it = 200;
+  bool verbose = false;
+
+  int ac = 1;
+  while ( ac < argc ) {
+    if ( strcmp( argv[ac], "-d" ) == 0 && ac+1 < argc ) {
+      device = argv[ac+1];
+      ac += 2;
+    } else if ( strcmp( argv[ac], "-n" ) == 0 && ac+1 < argc ) {
+      shots = atoi( argv[ac+1] );
+      if ( shots < ONLINE_MIN ) shots = ONLINE_MIN;
+      ac += 2;
+    } else if ( strcmp( argv[ac], "-i" ) == 0 && ac+1 < argc ) {
+      max_it = atoi( argv[ac+1] );
+      if ( max_it < 2 ) max_it = 2;
+      ac += 2;
+    } else if ( strcmp( argv[ac], "-v" ) == 0 ) {
+      verbose = true;
+      ac ++;
+    } else if ( strcmp( argv[ac], "-h" ) == 0 ) {
+      usage();
+      return 0;
+    } else {
+      break;
+    }
+  }
+  if ( ac < argc ) {
+    out_file = argv[ac];
+  }
+
+  Protocol proto( device, false );
+  proto.SetTimeout( ONLINE_POLL );
+  proto.Open();
+  if ( ! proto.IsOpen() ) {
+    fprintf(stderr, "ERROR: failed to open protocol [device %s]\n", device );
+    return 1;
+  }
+  if ( verbose ) {
+    fprintf(stderr, "Calibration on %s: %d shots\n", device, shots );
+  }
+
+  signal( SIGINT,  on_signal );
+  signal( SIGTERM, on_signal );
+
+  CalibOnline online( max_it );
+  unsigned char g[8];
+  unsigned char m[8];
+  unsigned int orphans    = 0; // orphan packets already counted as lost shots
+  unsigned int duplicates = 0;
+  while ( running && online.Size() < shots ) {
+    unsigned int np = 0;
+    ProtoError err = proto.ReadDataBulk( &np );
+    if ( err != PROTO_OK && err != PROTO_TIMEOUT ) {
+      fprintf(stderr, "ERROR: Read failed: %s\n", ProtoErrorStr( err ) );
+      break;
+    }
+    while ( online.Size() < shots ) {
+      bool has_pair = proto.NextCalib( g, m );
+      // an orphan packet is a shot whose other packet was lost: the shot
+      // keeps its place, so that the next shots stay in their groups
+      while ( orphans < proto.Orphans() && online.Size() < shots ) {
+        ++ orphans;
+        fprintf(stderr, "WARNING: shot %d lost (unpaired packet)\n", online.Size() + 1 );
+        print_solve( online, online.AddLost(), verbose );
+      }
+      if ( duplicates < proto.Duplicates() ) {
+        duplicates = proto.Duplicates();
+        if ( verbose ) {
+          fprintf(stderr, "Dropped %u retransmitted packets\n", duplicates );
+        }
+      }
+      if ( ! has_pair ) break;
+      if ( online.Size() < shots ) {
+        print_solve( online, online.Add( g, m ), verbose );
+      }
+    }
+  }
+  proto.Close();
+
+  if ( proto.Orphans() > 0 ) {
+    fprintf(stderr, "Dropped %u unpaired packets (%u lost shots)\n", proto.Orphans(), online.Lost() );
+  }
+  if ( ! online.Solved() ) {
+    fprintf(stderr, "Too few shots to calibrate: %d (at least %d)\n", online.Size(), ONLINE_MIN );
+    return 1;
+  }
+  if ( ! online.Valid() ) {
+    fprintf(stderr, "WARNING: the last solve is not valid (degenerate coefficients)\n");
+  }
+  fprintf(stdout, "Shots       %d\n", online.Size() );
+  fprintf(stdout, "Delta       %.4f\n", online.Delta() );
+  fprintf(stdout, "Max error   %.4f\n", online.Error() );
+  fprintf(stderr, "M dip angle %.2f\n", online.Dip() );
+  if ( verbose ) {
+    online.GetCalibration().PrintCoeffs();
+  }
+  if ( out_file != NULL ) {
+    online.GetCalibration().PrintCalibrationFile( out_file );
+  }
+  return 0;
+}
@@ -0,0 +1,269 @@
+/** @file DeviceMemoryImage.cpp
+ *
+ * @author marco corvi
+ * @date oct 2026
+ *
+ * @brief local cache of the DistoX memory (0x38/0x39 address space)
+ * --------------------------------------------------------
+ *  Copyright This sowftare is distributed under GPL-3.0 or later
+ *  See the file COPYING.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "DeviceMemoryImage.h"
+
+DeviceMemoryImage::DeviceMemoryImage( Serial * s, unsigned int w )
+  : pipeline( s, w )
+  , image( NULL )
+  , mapped( false )
+  , max_age( DMI_DEFAULT_AGE )
+  , n_hit( 0 )
+  , n_miss( 0 )
+{ }
+
+DeviceMemoryImage::~DeviceMemoryImage()
+{
+  Close();
+}
+
+bool
+DeviceMemoryImage::Open( const char * filename )
+{
+  Close();
+  if ( filename == NULL ) {
+    image = new DeviceMemoryFile;
+    memset( image, 0, sizeof(DeviceMemoryFile) );
+    memcpy( image->magic, DMI_MAGIC, 8 );
+    mapped = false;
+    return true;
+  }
+  int fd = open( filename, O_RDWR | O_CREAT, 0644 );
+  if ( fd < 0 ) {
+    fprintf(stderr, "ERROR: cannot open memory image %s: %s\n", filename, strerror( errno ) );
+    return false;
+  }
+  struct stat st;
+  bool fresh = ( fstat( fd, &st ) == 0 && st.st_size == 0 );
+  if ( ! fresh && st.st_size != (off_t)sizeof(DeviceMemoryFile) ) {
+    fprintf(stderr, "WARNING: memory image %s has the wrong size: starting anew\n", filename );
+    fresh = true;
+  }
+  // ftruncate leaves holes: the pages that are never touched take no space
+  if ( fresh && ( ftruncate( fd, 0 ) != 0 || ftruncate( fd, sizeof(DeviceMemoryFile) ) != 0 ) ) {
+    fprintf(stderr, "ERROR: cannot size memory image %s: %s\n", filename, strerror( errno ) );
+    close( fd );
+    return false;
+  }
+  void * ptr = mmap( NULL, sizeof(DeviceMemoryFile), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+  close( fd );
+  if ( ptr == MAP_FAILED ) {
+    fprintf(stderr, "ERROR: cannot map memory image %s: %s\n", filename, strerror( errno ) );
+    return false;
+  }
+  image  = (DeviceMemoryFile *)ptr;
+  mapped = true;
+  if ( fresh ) {
+    memcpy( image->magic, DMI_MAGIC, 8 );
+  } else if ( memcmp( image->magic, DMI_MAGIC, 8 ) != 0 ) {
+    fprintf(stderr, "WARNING: %s is not a memory image: starting anew\n", filename );
+    memset( image, 0, sizeof(DeviceMemoryFile) );
+    memcpy( image->magic, DMI_MAGIC, 8 );
+  }
+  // the device memory may have been used since the run that left them
+  unsigned int nd = DropDirty();
+  if ( nd > 0 ) {
+    fprintf(stderr, "WARNING: memory image %s: dropped %u words not written by a previous run\n", filename, nd );
+  }
+  return true;
+}
+
+void
+DeviceMemoryImage::Close()
+{
+  if ( image == NULL ) return;
+  DropDirty();
+  if ( mapped ) {
+    munmap( image, sizeof(DeviceMemoryFile) );
+  } else {
+    delete image;
+  }
+  image  = NULL;
+  mapped = false;
+}
+
+bool
+DeviceMemoryImage::OpenFor( const char * dir, const char * device )
+{
+  if ( dir != NULL ) {
+    char filename[512];
+    FileName( filename, sizeof(filename), dir, device );
+    if ( Open( filename ) ) return true;
+  }
+  Open( );
+  return false;
+}
+
+void
+DeviceMemoryImage::FileName( char * buf, size_t size, const char * dir, const char * device )
+{
+  const char * base = strrchr( device, '/' );
+  base = ( base != NULL )? base + 1 : device;
+  snprintf( buf, size, "%s/%s%s", dir, base, DMI_FILE_EXT );
+}
+
+unsigned int
+DeviceMemoryImage::DropDirty()
+{
+  unsigned int nd = 0;
+  for ( unsigned int b=0; b<DMI_WORDS/8; ++b ) {
+    if ( image->dirty[b] == 0 ) continue;
+    for ( unsigned int w=8*b; w<8*b+8; ++w ) if ( IsDirty( w ) ) ++ nd;
+    image->valid[b] &= ~ image->dirty[b];
+    image->dirty[b] = 0;
+  }
+  return nd;
+}
+
+bool
+DeviceMemoryImage::IsStale( unsigned int w, unsigned long now ) const
+{
+  if ( ! IsValid( w ) ) return true;
+  // a dirty word is the local content until it gets old (the write is then dropped)
+  return now >= image->time[w] + max_age;
+}
+
+unsigned int
+DeviceMemoryImage::Read( unsigned long addr, unsigned long end,
+                         unsigned char * data, unsigned char * ok )
+{
+  if ( image == NULL || end <= addr ) return 0;
+  if ( end > DMI_SIZE ) end = DMI_SIZE;
+  addr &= ~3UL;
+  unsigned int w0 = addr / 4;
+  unsigned int n  = ( end - addr + 3 ) / 4;
+  unsigned long now = (unsigned long)time( NULL );
+
+  // collect the words to read from the device
+  unsigned long * miss = new unsigned long[ n ];
+  unsigned int nm = 0;
+  for ( unsigned int k=0; k<n; ++k ) {
+    if ( IsStale( w0+k, now ) ) miss[ nm++ ] = 4 * (unsigned long)(w0+k);
+  }
+  n_hit += n - nm;
+  if ( nm > 0 ) {
+    unsigned char * buf = new unsigned char[ 4*nm ];
+    unsigned char * got = new unsigned char[ nm ];
+    pipeline.ReadWords( miss, nm, buf, got );
+    for ( unsigned int j=0; j<nm; ++j ) {
+      unsigned int w = miss[j] / 4;
+      if ( got[j] ) {
+        memcpy( image->mem + 4*w, buf + 4*j, 4 );
+        image->time[w] = (uint32_t)now;
+        SetValid( w, true );
+        SetDirty( w, false );
+        ++ n_miss;
+      } else {
+        SetValid( w, false );
+        SetDirty( w, false );
+      }
+    }
+    delete[] buf;
+    delete[] got;
+  }
+  delete[] miss;
+
+  unsigned int cnt = 0;
+  for ( unsigned int k=0; k<n; ++k ) {
+    bool v = IsValid( w0+k );
+    if ( data ) memcpy( data + 4*k, image->mem + 4*(w0+k), 4 );
+    if ( ok ) ok[k] = v ? 1 : 0;
+    if ( v ) ++ cnt;
+  }
+  return cnt;
+}
+
+void
+DeviceMemoryImage::Write( unsigned long addr, const unsigned char * word )
+{
+  if ( image == NULL || addr >= DMI_SIZE ) return;
+  unsigned int w = addr / 4;
+  memcpy( image->mem + 4*w, word, 4 );
+  image->time[w] = (uint32_t)time( NULL );
+  SetValid( w, true );
+  SetDirty( w, true );
+}
+
+unsigned int
+DeviceMemoryImage::Update( unsigned long addr, unsigned long end, const unsigned char * want )
+{
+  if ( image == NULL || end <= addr ) return 0;
+  if ( end > DMI_SIZE ) end = DMI_SIZE;
+  addr &= ~3UL;
+  unsigned int w0 = addr / 4;
+  unsigned int n  = ( end - addr + 3 ) / 4;
+  unsigned int cnt = 0;
+  for ( unsigned int k=0; k<n; ++k ) {
+    unsigned int w = w0 + k;
+    if ( IsValid( w ) && memcmp( image->mem + 4*w, want + 4*k, 4 ) == 0 ) continue;
+    Write( 4 * (unsigned long)w, want + 4*k );
+    ++ cnt;
+  }
+  return cnt;
+}
+
+unsigned int
+DeviceMemoryImage::Flush( unsigned long a0, unsigned long end )
+{
+  if ( image == NULL || end <= a0 ) return 0;
+  if ( end > DMI_SIZE ) end = DMI_SIZE;
+  unsigned int w0 = a0 / 4;
+  unsigned int w1 = ( end + 3 ) / 4;
+  unsigned int nd = 0;
+  for ( unsigned int w=w0; w<w1; ++w ) if ( IsDirty( w ) ) ++ nd;
+  if ( nd == 0 ) return 0;
+  unsigned long * addr = new unsigned long[ nd ];
+  unsigned char * data = new unsigned char[ 4*nd ];
+  unsigned char * ok   = new unsigned char[ nd ];
+  unsigned int j = 0;
+  for ( unsigned int w=w0; w<w1 && j<nd; ++w ) {
+    if ( ! IsDirty( w ) ) continue;
+    addr[j] = 4 * (unsigned long)w;
+    memcpy( data + 4*j, image->mem + 4*w, 4 );
+    ++ j;
+  }
+  pipeline.WriteWords( addr, nd, data, ok );
+  unsigned long now = (unsigned long)time( NULL );
+  unsigned int left = 0;
+  for ( j=0; j<nd; ++j ) {
+    unsigned int w = addr[j] / 4;
+    if ( ok[j] ) {
+      SetDirty( w, false );
+      image->time[w] = (uint32_t)now; // the write reply echoes the device content
+    } else {
+      ++ left;
+    }
+  }
+  delete[] addr;
+  delete[] data;
+  delete[] ok;
+  return left;
+}
+
+void
+DeviceMemoryImage::Invalidate( unsigned long addr, unsigned long end )
+{
+  if ( image == NULL ) return;
+  if ( end > DMI_SIZE ) end = DMI_SIZE;
+  for ( unsigned long a = addr & ~3UL; a < end; a += 4 ) {
+    if ( ! IsDirty( a/4 ) ) SetValid( a/4, false );
+  }
+}
@@ -0,0 +1,174 @@
+/** @file DeviceMemoryImage.h
+ *
+ * @author marco corvi
+ * @date oct 2026
+ *
+ * @brief local cache of the DistoX memory (0x38/0x39 address space)
+ *
+ * The image keeps a copy of the 64 KiB device address space with, for
+ * each 4-byte word, whether it is valid, when it was read, and whether
+ * it has been modified locally and must still be written to the device.
+ * Reads go over the link (pipelined, see MemoryPipeline) only for the
+ * words that are missing or older than the max age; writes are kept
+ * dirty until Flush().
+ *
+ * The image can be persisted in a memory-mapped file, one per device:
+ * the file is sparse, only the pages of the address space that have
+ * been touched take disk space, and a later run of any memory tool
+ * starts from what the previous ones have read. The writes that have
+ * not been flushed are not kept from one run to the next: Open() and
+ * Close() drop them, and those words are read again from the device.
+ * --------------------------------------------------------
+ *  Copyright This sowftare is distributed under GPL-3.0 or later
+ *  See the file COPYING.
+ */
+#ifndef DEVICE_MEMORY_IMAGE_H
+#define DEVICE_MEMORY_IMAGE_H
+
+#include <stdint.h>
+
+#include "Serial.h"
+#include "MemoryPipeline.h"
+
+#define DMI_MAGIC        "DXMEM001"
+#define DMI_SIZE         0x10000            /* bytes of the address space */
+#define DMI_WORDS        ( DMI_SIZE / 4 )
+#define DMI_DEFAULT_AGE  60                 /* max age of a cached word [sec] */
+#define DMI_FILE_EXT     ".dxmem"
+
+/** layout of the image file
+ */
+struct DeviceMemoryFile
+{
+  char magic[8];                      //!< DMI_MAGIC
+  uint8_t  valid[ DMI_WORDS / 8 ];    //!< one bit per word: the word has been read or written
+  uint8_t  dirty[ DMI_WORDS / 8 ];    //!< one bit per word: the word must be written to the device
+  uint32_t time[ DMI_WORDS ];         //!< time the word was read [sec, unix time]
+  uint8_t  mem[ DMI_SIZE ];           //!< memory content
+};
+
+class DeviceMemoryImage
+{
+  private:
+    MemoryPipeline pipeline;  //!< link to the device
+    DeviceMemoryFile * image; //!< cache (mapped file or heap)
+    bool mapped;              //!< whether the image is a mapped file
+    unsigned long max_age;    //!< max age of a cached word [sec]
+    unsigned int n_hit;       //!< number of words served from the cache
+    unsigned int n_miss;      //!< number of words read from the device
+
+  public:
+    /** cstr
+     * @param s   serial line (communication channel)
+     * @param w   number of outstanding requests
+     */
+    DeviceMemoryImage( Serial * s, unsigned int w = PIPELINE_DEFAULT_WINDOW );
+
+    /** dstr
+     */
+    ~DeviceMemoryImage();
+
+    /** open the image
+     * @param filename  image file, created if it does not exist (NULL: in memory only)
+     * @return true if successful
+     */
+    bool Open( const char * filename = NULL );
+
+    /** open the image file of a device in a cache directory
+     * @param dir     cache directory (NULL: in memory only)
+     * @param device  device name (the last component is used)
+     * @return true if the image file is used, false if the image is in memory only
+     * @note if the image file cannot be opened the image is in memory
+     */
+    bool OpenFor( const char * dir, const char * device );
+
+    /** close the image: the dirty words are dropped (and invalid)
+     */
+    void Close();
+
+    /** make the name of the image file of a device
+     * @param buf     output buffer
+     * @param size    size of the buffer
+     * @param dir     cache directory
+     * @param device  device name (the last component is used)
+     */
+    static void FileName( char * buf, size_t size, const char * dir, const char * device );
+
+    /** set the max age of the cached words
+     * @param sec  max age [sec], 0 to always read from the device
+     */
+    void SetMaxAge( unsigned long sec ) { max_age = sec; }
+
+    /** set the reply timeout of the link
+     * @param usec   timeout [usec]
+     */
+    void SetTimeout( unsigned long usec ) { pipeline.SetTimeout( usec ); }
+
+    /** read a memory range: the missing and stale words are read from the device
+     * @param addr   start address
+     * @param end    end address (excluded)
+     * @param data   output array (4*ceil((end-addr)/4) bytes, can be NULL)
+     * @param ok     output array of flags, one per word (can be NULL)
+     * @return the number of words that are available
+     */
+    unsigned int Read( unsigned long addr, unsigned long end,
+                       unsigned char * data = NULL, unsigned char * ok = NULL );
+
+    /** write a word in the image, to be written to the device on Flush()
+     * @param addr   address (multiple of 4)
+     * @param word   4 bytes
+     * @note a dirty word older than the max age is read again, and the write dropped
+     */
+    void Write( unsigned long addr, const unsigned char * word );
+
+    /** write the words of a memory range that differ from the image [no device access]
+     * @param addr   start address
+     * @param end    end address (excluded)
+     * @param want   desired content (4*ceil((end-addr)/4) bytes)
+     * @return the number of words that have been marked dirty
+     * @note the range should be Read() first: the words that are not valid are always written
+     */
+    unsigned int Update( unsigned long addr, unsigned long end, const unsigned char * want );
+
+    /** write the dirty words of a range to the device
+     * @param addr   start address
+     * @param end    end address (excluded)
+     * @return the number of words of the range that are still dirty (0 if all have been written)
+     */
+    unsigned int Flush( unsigned long addr = 0, unsigned long end = DMI_SIZE );
+
+    /** forget the cached words of a range (the dirty ones are kept)
+     * @param addr   start address
+     * @param end    end address (excluded)
+     */
+    void Invalidate( unsigned long addr, unsigned long end );
+
+    /** get a word of the image [no device access]
+     * @param addr   address
+     * @return pointer to the 4 bytes of the word
+     */
+    const unsigned char * Word( unsigned long addr ) const { return image->mem + ( addr & ~3UL & ( DMI_SIZE - 1 ) ); }
+
+    unsigned int Hits()   const { return n_hit; }
+    unsigned int Misses() const { return n_miss; }
+    unsigned int Lost()   const { return pipeline.Lost(); }
+
+  private:
+    bool IsValid( unsigned int w ) const { return image->valid[ w/8 ] & ( 1 << (w%8) ); }
+    bool IsDirty( unsigned int w ) const { return image->dirty[ w/8 ] & ( 1 << (w%8) ); }
+    void SetValid( unsigned int w, bool v ) { if ( v ) image->valid[ w/8 ] |= 1 << (w%8); else image->valid[ w/8 ] &= ~( 1 << (w%8) ); }
+    void SetDirty( unsigned int w, bool d ) { if ( d ) image->dirty[ w/8 ] |= 1 << (w%8); else image->dirty[ w/8 ] &= ~( 1 << (w%8) ); }
+
+    /** check if a word must be read from the device
+     * @param w    word index
+     * @param now  current time [sec]
+     */
+    bool IsStale( unsigned int w, unsigned long now ) const;
+
+    /** drop the dirty words: they are marked invalid
+     * @return the number of dropped words
+     */
+    unsigned int DropDirty();
+};
+
+#endif // DEVICE_MEMORY_IMAGE_H
@@ -15,6 +15,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
 #ifdef WIN32
   #define int16_t  signed short
   #define uint16_t unsigned short
@@ -24,6 +25,8 @@
 
 #include "Protocol.h"
 #include "Factors.h"
+#include "MemoryLayout.h"
+#include "ShotBatch.h"
 
 // size of calib coeffs [bytes]
 //   linear uses 48, last four 0xff
@@ -33,6 +36,12 @@
 #define MAX_ADDRESS_A3    0x8000
 #define MAX_ADDRESS_X310    1064
 
+// threaded download: notification batch [packets] and interval [msec],
+// and how often the reader waiting for room checks for a stop [usec]
+#define DISTOX_BATCH_SIZE     64
+#define DISTOX_BATCH_INTERVAL 200
+#define DISTOX_QUEUE_WAIT     1000000UL
+
 #define CALIB_BIT_X1 0x08 // DistoX1
 #define CALIB_BIT_X2 0x20
 
@@ -44,10 +53,10 @@
 #define FIRMWARE_ADDRESS_X2 0xe000 // DistoX2
 
 // specific to DistoX2
-#define SEGMENT_2_ADDR_X2( s ) ( ( (s)/56 ) * 1024 + ( (s)%56 ) * 18 )
-#define PACKET_2_ADDR_X2( p ) ( SEGMENT_2_ADDR( p/2 ) )
+#define SEGMENT_2_ADDR_X2( s ) ( index2addr_x310( s ) )
+#define PACKET_2_ADDR_X2( p ) ( SEGMENT_2_ADDR_X2( (p)/2 ) )
 #define PACKET_2_NUMBER_X2( p ) ( (p)%2 )
-int INDEX_2_ADDR_X2( int i ) { int a =0; while ( i>=56) { i-=56, a+=0x400; } return a+18*i; }
+inline int INDEX_2_ADDR_X2( int i ) { return (int)index2addr_x310( i ); }
 
 #define MASK_DIST_UNIT    0x0007 // distance unit mask
 #define BIT_ANGLE_UNIT    0x0008 // angle unit
@@ -93,14 +102,14 @@ int INDEX_2_ADDR_X2( int i ) { int a =0; while ( i>=56) { i-=56, a+=0x400; } ret
 #define COEFF2AMZY( c ) ( C_2_D( c, 44) / FM )
 #define COEFF2AMZZ( c ) ( C_2_D( c, 46) / FM )
 
-double COEFF2NL( unsigned char c )
+inline double COEFF2NL( unsigned char c )
 {
   int c0 = 1 + (int)c;
   if ( c0 > 128 ) c0 -= 256;
   return c0 / FN;
 }
 
-unsigned char double2NL( double x ) 
+inline unsigned char double2NL( double x )
 {
   x *= FN;
   int v = ( (x>=0)? (int)(x+0.5) : -(int)(-x+0.5 ) ) - 1;
@@ -146,6 +155,46 @@ class DistoXListener
     virtual void distoxDone() = 0;
 };
 
+/** calibration G-M pair
+ */
+struct DistoXCalib
+{
+  int16_t gx, gy, gz; //!< G components
+  int16_t mx, my, mz; //!< M components
+};
+
+/** listener that takes the downloaded data a batch at a time
+ *
+ * The DistoX decodes the packets on its queues and passes the shots and
+ * the calibration pairs of each batch in one call, instead of one
+ * notification per packet that the listener must follow with one
+ * nextMeasurement/nextCalibration call per shot.
+ */
+class DistoXBatchListener
+{
+  public:
+    /** dstr
+     * for the virtual table
+     */
+    virtual ~DistoXBatchListener() {}
+
+    /** reset callback
+     */
+    virtual void distoxReset() = 0;
+
+    /** batch received callback
+     * @param shots  decoded shots of the batch
+     * @param calib  calibration pairs of the batch
+     * @param nc     number of calibration pairs
+     * @note the data are valid only during the call
+     */
+    virtual void distoxBatch( const ShotBatch & shots, const DistoXCalib * calib, unsigned int nc ) = 0;
+
+    /** "done" callback
+     */
+    virtual void distoxDone() = 0;
+};
+
 enum DistoXModel {
 	A3 = 1,
 	X310 = 2
@@ -157,6 +206,13 @@ class DistoX
     DistoXModel mModel;          //!< DistoX model
     Protocol    mProto;          //!< DistoX communication protocol
     DistoXListener * mListener;  //!< listener for notification
+    DistoXBatchListener * mBatchListener; //!< listener for batch notification
+    size_t mCount;               //!< number of packets read in the current download
+    int mNumber;                 //!< number of data to download by the reader thread
+    int mStop;                   //!< whether the download has been stopped
+    ShotBatch mShots;            //!< shots of the current batch
+    DistoXCalib * mCalib;        //!< calibration pairs of the current batch
+    unsigned int mCalibSize;     //!< size of the calibration array
 
   public:
     /** cstr
@@ -167,74 +223,144 @@ class DistoX
       : mModel( model )
       , mProto( device, log )
       , mListener( NULL )
+      , mBatchListener( NULL )
+      , mCount( 0 )
+      , mNumber( 0 )
+      , mStop( 0 )
+      , mShots( DISTOX_BATCH_SIZE )
+      , mCalib( NULL )
+      , mCalibSize( 0 )
     { }
 
+    /** dstr
+     */
+    ~DistoX()
+    {
+      delete[] mCalib;
+    }
+
     /** set the listener
      * @param listener  distoX listener
+     * @note the listener and the batch listener take the data off the same
+     *       queues: setting one unsets the other
      */
     void setListener( DistoXListener * listener )
     {
       mListener = listener;
+      if ( listener != NULL ) mBatchListener = NULL;
+    }
+
+    /** set the batch listener
+     * @param listener  distoX batch listener
+     * @note setting the batch listener unsets the listener
+     *
+     * download() and downloadThreaded() notify it every batch packets,
+     * downloadThreaded() also every interval msec, and both at the end of
+     * the download.
+     */
+    void setBatchListener( DistoXBatchListener * listener )
+    {
+      mBatchListener = listener;
+      if ( listener != NULL ) mListener = NULL;
     }
 
     /** download the data
-     * @param number   number of data to download [0: infinity]
+     * @param number   number of data to download [0: infinity, -1: ask the DistoX]
+     * @param batch    number of packets per batch notification
      */
-    bool download( int number = 0 )
+    bool download( int number = 0, unsigned int batch = DISTOX_BATCH_SIZE )
     {
       // fprintf(stderr, "***** DistoX::download(%d)\n", number);
       if ( ! mProto.Open() ) {
         fprintf(stderr, "ERROR: failed to open protocol \n");
         return false;
       }
+      if ( batch == 0 ) batch = 1;
+      // the batch listener drains the queues before a bulk read could overflow them
+      if ( batch > PROTO_QUEUE_SIZE - PROTO_RECV_PACKETS ) batch = PROTO_QUEUE_SIZE - PROTO_RECV_PACKETS;
+      mCount = 0;
+      mStop  = 0;
+      notifyReset();
+      readPackets( number, batch );
+      notifyBatch();
+      if ( mListener ) {
+        mListener->distoxDone();
+      }
+      if ( mBatchListener ) {
+        mBatchListener->distoxDone();
+      }
 
-      ProtoError err = PROTO_OK;
-      size_t cnt = 0;
-      bool ask = ( number == -1 ); // whether to ask distox the number of data
-      // fprintf( stderr, "***** ask number: %s\n", ask? "true" : "false" );
-      if ( ask ) {
-        number = mProto.ReadDataNumber();
-        // fprintf(stderr, "***** number %d\n", number );
-      } else {
-        if ( number == 0 ) { // infinity
-          number = -1;
-        }
+      // close the connection with the device
+      mProto.Close();
+      return true;
+    }
+
+    /** download the data with a reader thread
+     * The reader thread only reads and acknowledges the packets, and puts them
+     * on the protocol queues. The calling thread decodes: it notifies the listener
+     * every batch packets, or at least every interval msec while packets come in,
+     * and the listener takes the shots with nextMeasurementX1/X2 and nextCalibration,
+     * while a batch listener gets them already decoded.
+     * The reader reads and acknowledges the packets only when there is room
+     * for them on the queues, and waits for it as long as it takes,
+     * so the listener should drain the queues at each notification
+     * (or stop the download, see stopDownload).
+     * @param number   number of data to download [0: infinity, -1: ask the DistoX]
+     * @param batch    number of packets per notification
+     * @param interval max time between notifications [msec]
+     */
+    bool downloadThreaded( int number = 0, unsigned int batch = DISTOX_BATCH_SIZE,
+                           unsigned long interval = DISTOX_BATCH_INTERVAL )
+    {
+      if ( ! mProto.Open() ) {
+        fprintf(stderr, "ERROR: failed to open protocol \n");
+        return false;
       }
-      for ( int retry=0; ; ++retry) {
-        while ( number != 0 && ( err = mProto.ReadData() ) == PROTO_OK ) {
-          cnt ++;
-          number --;
+      if ( batch == 0 ) batch = 1;
+      mCount  = 0;
+      mNumber = number;
+      mStop   = 0;
+      notifyReset();
+      mProto.ReopenQueues();
+      pthread_t reader;
+      if ( pthread_create( &reader, NULL, readerThread, this ) != 0 ) {
+        fprintf(stderr, "ERROR: failed to start the reader thread\n");
+        mProto.Close();
+        return false;
+      }
+      size_t done = 0;
+      for ( ; ; ) {
+        unsigned int sz = mProto.DataSize();
+        mProto.WaitData( sz + batch, interval * 1000 );
+        bool closed = mProto.QueuesClosed(); // before the count: the count is final if closed
+        size_t cnt = __atomic_load_n( &mCount, __ATOMIC_ACQUIRE );
+        if ( cnt > done ) {
+          done = cnt;
           if ( mListener ) {
             mListener->distoxDownload( cnt );
           }
-          if ( number == 0 ) break;
-        }
-        if ( err == PROTO_TIMEOUT ) { // read timeout
-          // fprintf(stderr, "timeout: retry n. %d\n", retry );
-          if ( retry < 0 ) continue;
-        }
-        if ( err != PROTO_OK ) {
-          fprintf(stderr, "ERROR: Read failed: %s\n", ProtoErrorStr(err) );
         }
-        if ( ask ) {
-          number = mProto.ReadDataNumber();
-          // fprintf(stderr, "number %d\n", number );
-          if ( number > 0 ) {
-            -- retry;
-            continue;
-          } 
-        }
-        break;
+        notifyBatch();
+        if ( closed ) break;
       }
+      pthread_join( reader, NULL );
       if ( mListener ) {
         mListener->distoxDone();
       }
+      if ( mBatchListener ) {
+        mBatchListener->distoxDone();
+      }
 
       // close the connection with the device
       mProto.Close();
       return true;
     }
 
+    /** stop the download: the reader does not read any more packets,
+     * the ones on the queues are still notified
+     * @note it can be called by a listener callback, or by another thread
+     */
+    void stopDownload() { __atomic_store_n( &mStop, 1, __ATOMIC_RELEASE ); }
 
     /** accessor: get the number of calibration data
      * @return the number of calibration packet
@@ -289,6 +415,47 @@ class DistoX
       return true;
     }
 
+    /** get the measurement data on the queue at once, DistoX1
+     * @param batch  shot batch: the shots are appended
+     * @param max    max number of shots (0: all)
+     * @return the number of shots that have been appended
+     */
+    unsigned int nextMeasurementsX1( ShotBatch & batch, unsigned int max = 0 )
+    {
+      unsigned char pkts[ DISTOX_BATCH_SIZE ][8];
+      unsigned int cnt = 0;
+      for ( ; ; ) {
+        unsigned int n = 0;
+        while ( n < DISTOX_BATCH_SIZE && ( max == 0 || cnt + n < max ) && mProto.DataSize() > 0 ) {
+          if ( mProto.NextData( pkts[n] ) ) ++ n;
+        }
+        if ( n == 0 ) break;
+        decodeBatchX1( pkts, n, batch );
+        cnt += n;
+      }
+      return cnt;
+    }
+
+    /** get the measurement data on the queue at once, DistoX2
+     * @param batch  shot batch: the shots are appended
+     * @param max    max number of shots (0: all)
+     * @return the number of shots that have been appended
+     */
+    unsigned int nextMeasurementsX2( ShotBatch & batch, unsigned int max = 0 )
+    {
+      unsigned char pkts[ 2*DISTOX_BATCH_SIZE ][8];
+      unsigned int cnt = 0;
+      for ( ; ; ) {
+        unsigned int n = 0;
+        while ( n < DISTOX_BATCH_SIZE && ( max == 0 || cnt + n < max )
+             && mProto.NextData( pkts[2*n], pkts[2*n+1] ) ) ++ n;
+        if ( n == 0 ) break;
+        decodeBatch( pkts, n, batch );
+        cnt += n;
+      }
+      return cnt;
+    }
+
     /** get the next calibration data
      * @param ...
      * @return true if successful
@@ -317,7 +484,7 @@ class DistoX
       if ( ! mProto.Open() ) return ret;
       unsigned char mode = 0x00;
       for (int k = 0; k<3; ++k ) {
-        if ( mProto.Read8000( &mode ) ) {
+        if ( mProto.Read8000X1( &mode ) ) {
           ret = mode;
         }
       }
@@ -334,7 +501,7 @@ class DistoX
       if ( ! mProto.Open() ) return ret;
       unsigned char mode = 0x00;
       for (int k = 0; k<3; ++k ) {
-        if ( mProto.Read8000( &mode ) ) {
+        if ( mProto.Read8000X1( &mode ) ) {
           break;
         }
       }
@@ -352,7 +519,7 @@ class DistoX
           } else {
             mProto.SendCommandByte( 0x31 );
           }
-          if ( mProto.Read8000( &mode1 ) && mode1 != mode ) {
+          if ( mProto.Read8000X1( &mode1 ) && mode1 != mode ) {
             break;
           }
         }
@@ -384,14 +551,14 @@ class DistoX
       unsigned char mode = 0x00;
       // for (int k = 0; k<3; ++k ) 
       {
-        if ( mProto.Read8000( &mode ) ) {
+        if ( mProto.Read8000X1( &mode ) ) {
           bool calib = ( mode & STATUS_CALIB ) != 0;
           if ( calib != on) {
             unsigned char mode1 = 0x00;
             unsigned char mode2 = mode ^ STATUS_CALIB; // expected mode: toggle calib bit
             for (int k = 0; k<3; ++k ) {
               mProto.SendCommandByte( on ? 0x31 : 0x30 ); // start|stop calib
-              if ( mProto.Read8000( &mode1 ) && mode1 == mode2 ) {
+              if ( mProto.Read8000X1( &mode1 ) && mode1 == mode2 ) {
                 ret = ( ( mode1 & STATUS_CALIB ) != 0 )? 1 : 0;
                 break;
               }
@@ -416,7 +583,7 @@ class DistoX
       unsigned char mode = 0x00;
       // for (int k = 0; k<3; ++k )
       {
-        if ( mProto.Read8000( &mode ) ) {
+        if ( mProto.Read8000X1( &mode ) ) {
           // fprintf(stderr, "mode %02x \n", mode );
           bool silent = ( mode & STATUS_SILENT ) == 0; 
           if ( silent != on) {
@@ -424,7 +591,7 @@ class DistoX
             unsigned char mode2 = mode ^ STATUS_SILENT;
             for (int k = 0; k<3; ++k ) {
               mProto.SendCommandByte( on ? 0x33 : 0x32 ); // start|stop silent
-              if ( mProto.Read8000( &mode1 ) && mode1 == mode2 ) {
+              if ( mProto.Read8000X1( &mode1 ) && mode1 == mode2 ) {
                 ret = ( ( mode1 & STATUS_SILENT ) != 0 )? 1 : 0;
                 break;
               }
@@ -510,6 +677,129 @@ class DistoX
         COEFF2AMZX( buf ), COEFF2AMZY( buf ), COEFF2AMZZ( buf ) ); 
     }
 
+  private:
+    /** notify the listeners that a download starts
+     */
+    void notifyReset()
+    {
+      if ( mListener ) {
+        mListener->distoxReset();
+      }
+      if ( mBatchListener ) {
+        mBatchListener->distoxReset();
+      }
+    }
+
+    /** decode the data on the queues and pass them to the batch listener
+     */
+    void notifyBatch()
+    {
+      if ( mBatchListener == NULL ) return;
+      mShots.Clear();
+      if ( mModel == X310 ) {
+        nextMeasurementsX2( mShots );
+      } else {
+        nextMeasurementsX1( mShots );
+      }
+      unsigned int nc = 0;
+      for ( ; ; ) {
+        if ( nc == mCalibSize ) { // grow the calibration array
+          DistoXCalib * calib = new DistoXCalib[ mCalibSize + DISTOX_BATCH_SIZE ];
+          if ( mCalib ) memcpy( calib, mCalib, nc * sizeof(DistoXCalib) );
+          delete[] mCalib;
+          mCalib = calib;
+          mCalibSize += DISTOX_BATCH_SIZE;
+        }
+        DistoXCalib & c = mCalib[nc];
+        if ( ! nextCalibration( c.gx, c.gy, c.gz, c.mx, c.my, c.mz ) ) break;
+        ++ nc;
+      }
+      if ( mShots.size > 0 || nc > 0 ) {
+        mBatchListener->distoxBatch( mShots, mCalib, nc );
+      }
+    }
+
+    /** read the data packets and put them on the protocol queues
+     * @param number   number of data to read [0: infinity, -1: ask the DistoX]
+     * @param batch    number of packets per batch notification,
+     *                 0: no notification, wait for room on the queues before each read
+     */
+    void readPackets( int number, unsigned int batch )
+    {
+      bool notify = ( batch > 0 );
+      ProtoError err = PROTO_OK;
+      bool ask = ( number == -1 ); // whether to ask distox the number of data
+      // fprintf( stderr, "***** ask number: %s\n", ask? "true" : "false" );
+      if ( ask ) {
+        number = mProto.ReadDataNumberX1();
+        // fprintf(stderr, "***** number %d\n", number );
+      } else {
+        if ( number == 0 ) { // infinity
+          number = -1;
+        }
+      }
+      for ( int retry=0; ; ++retry) {
+        while ( number != 0 && ! stopped() ) {
+          if ( ! notify && ! waitRoom() ) break;
+          unsigned int np = 0;
+          if ( ( err = mProto.ReadDataBulk( &np ) ) != PROTO_OK ) break;
+          size_t cnt = __atomic_add_fetch( &mCount, np, __ATOMIC_RELEASE );
+          if ( number > 0 ) {
+            number = ( (unsigned int)number > np )? number - np : 0;
+          }
+          if ( notify && mListener ) {
+            mListener->distoxDownload( cnt );
+          }
+          if ( notify && mProto.DataSize() + mProto.CalibSize() >= batch ) {
+            notifyBatch();
+          }
+        }
+        if ( err == PROTO_TIMEOUT ) { // read timeout
+          // fprintf(stderr, "timeout: retry n. %d\n", retry );
+          if ( retry < 0 ) continue;
+        }
+        if ( err != PROTO_OK ) {
+          fprintf(stderr, "ERROR: Read failed: %s\n", ProtoErrorStr(err) );
+        }
+        if ( ask && ! stopped() ) {
+          number = mProto.ReadDataNumberX1();
+          // fprintf(stderr, "number %d\n", number );
+          if ( number > 0 ) {
+            -- retry;
+            continue;
+          } 
+        }
+        break;
+      }
+    }
+
+    /** check if the download has been stopped
+     */
+    bool stopped() const { return __atomic_load_n( &mStop, __ATOMIC_ACQUIRE ) != 0; }
+
+    /** wait until a bulk read fits on the queues [reader]:
+     * the packets are not read, and not acknowledged, before there is room
+     * @return true if there is room, false if the download has been stopped
+     */
+    bool waitRoom()
+    {
+      while ( ! mProto.WaitRoom( DISTOX_QUEUE_WAIT ) ) {
+        if ( stopped() || mProto.QueuesClosed() ) return false;
+      }
+      return true;
+    }
+
+    /** reader thread of downloadThreaded()
+     * @param arg   the DistoX
+     */
+    static void * readerThread( void * arg )
+    {
+      DistoX * distox = (DistoX *)arg;
+      distox->readPackets( distox->mNumber, 0 );
+      distox->mProto.CloseQueues();
+      return NULL;
+    }
+
 };
 
 #endif
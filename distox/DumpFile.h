@@ -0,0 +1,226 @@
+/** @file DumpFile.h
+ *
+ * @author marco corvi
+ * @date oct 2026
+ *
+ * @brief binary memory dump container (.dxm)
+ *
+ * A .dxm file is a 32-byte header followed by the raw bytes of a range
+ * of the device memory, as read with 0x38 requests:
+ *
+ *    0  magic "DXM1"
+ *    4  version (1)
+ *    5  model: DUMP_MODEL_A3 or DUMP_MODEL_X310
+ *    6  firmware (16 bits, 0 if unknown)
+ *    8  start address (32 bits)
+ *   12  number of bytes (32 bits)
+ *   16  capture time (64 bits, unix time)
+ *   24  reserved (0)
+ *
+ * Numbers are little endian, as in the device. The converters map the
+ * file and walk the packets in place: A3 memory is a sequence of 8-byte
+ * packets, X310 memory a sequence of 18-byte records, 56 per 1 KiB
+ * block (@see MemoryLayout.h).
+ *
+ * The header is plain C: it is used by dump2data.c too.
+ * --------------------------------------------------------
+ *  Copyright This sowftare is distributed under GPL-3.0 or later
+ *  See the file COPYING.
+ */
+#ifndef DUMP_FILE_H
+#define DUMP_FILE_H
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "MemoryLayout.h"
+
+#define DUMP_MAGIC        "DXM1"
+#define DUMP_VERSION      1
+#define DUMP_HEADER_SIZE  32
+#define DUMP_FILE_EXT     ".dxm"
+
+#define DUMP_MODEL_A3     1
+#define DUMP_MODEL_X310   2
+
+/** header of a dump
+ */
+struct DumpHeader
+{
+  char     magic[4];  //!< DUMP_MAGIC
+  uint8_t  version;   //!< DUMP_VERSION
+  uint8_t  model;     //!< DUMP_MODEL_A3 or DUMP_MODEL_X310
+  uint16_t firmware;  //!< firmware version (0 if unknown)
+  uint32_t addr;      //!< start address
+  uint32_t size;      //!< number of bytes
+  int64_t  time;      //!< capture time [sec, unix time]
+  uint8_t  reserved[8];
+};
+
+/** mapped dump
+ */
+struct DumpMap
+{
+  struct DumpHeader header;
+  const unsigned char * data; //!< memory bytes (header.size)
+  void * base;                //!< mapped file
+  size_t length;              //!< mapped length
+};
+
+/** fill a dump header
+ * @param h        header [output]
+ * @param model    device model
+ * @param firmware firmware version (0 if unknown)
+ * @param addr     start address
+ * @param size     number of bytes
+ */
+static inline void
+dump_header( struct DumpHeader * h, int model, unsigned int firmware, unsigned long addr, unsigned long size )
+{
+  memset( h, 0, sizeof(struct DumpHeader) );
+  memcpy( h->magic, DUMP_MAGIC, 4 );
+  h->version  = DUMP_VERSION;
+  h->model    = (uint8_t)model;
+  h->firmware = (uint16_t)firmware;
+  h->addr     = (uint32_t)addr;
+  h->size     = (uint32_t)size;
+  h->time     = (int64_t)time( NULL );
+}
+
+/** write a dump file
+ * @param filename  file name
+ * @param h         header
+ * @param data      memory bytes (h->size)
+ * @return 0 on success, -1 on error
+ */
+static inline int
+dump_write( const char * filename, const struct DumpHeader * h, const unsigned char * data )
+{
+  unsigned char hdr[ DUMP_HEADER_SIZE ];
+  FILE * fp = fopen( filename, "wb" );
+  if ( fp == NULL ) return -1;
+  memset( hdr, 0, DUMP_HEADER_SIZE );
+  memcpy( hdr, h->magic, 4 );
+  hdr[4] = h->version;
+  hdr[5] = h->model;
+  hdr[6] = h->firmware & 0xff;
+  hdr[7] = ( h->firmware >> 8 ) & 0xff;
+  for ( int k=0; k<4; ++k ) hdr[ 8+k] = ( h->addr >> (8*k) ) & 0xff;
+  for ( int k=0; k<4; ++k ) hdr[12+k] = ( h->size >> (8*k) ) & 0xff;
+  for ( int k=0; k<8; ++k ) hdr[16+k] = ( (uint64_t)h->time >> (8*k) ) & 0xff;
+  int ret = ( fwrite( hdr, 1, DUMP_HEADER_SIZE, fp ) == DUMP_HEADER_SIZE
+           && fwrite( data, 1, h->size, fp ) == h->size )? 0 : -1;
+  if ( fclose( fp ) != 0 ) ret = -1;
+  return ret;
+}
+
+/** map a dump file
+ * @param filename  file name
+ * @param m         mapped dump [output]
+ * @return 0 on success, 1 if the file is not a dump (eg, a text dump), -1 on error
+ */
+static inline int
+dump_map( const char * filename, struct DumpMap * m )
+{
+  struct stat st;
+  memset( m, 0, sizeof(struct DumpMap) );
+  int fd = open( filename, O_RDONLY );
+  if ( fd < 0 ) return -1;
+  if ( fstat( fd, &st ) != 0 ) {
+    close( fd );
+    return -1;
+  }
+  if ( st.st_size < DUMP_HEADER_SIZE ) {
+    close( fd );
+    return 1;
+  }
+  void * base = mmap( NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+  close( fd );
+  if ( base == MAP_FAILED ) return -1;
+  const unsigned char * hdr = (const unsigned char *)base;
+  if ( memcmp( hdr, DUMP_MAGIC, 4 ) != 0 ) {
+    munmap( base, st.st_size );
+    return 1;
+  }
+  memcpy( m->header.magic, hdr, 4 );
+  m->header.version  = hdr[4];
+  m->header.model    = hdr[5];
+  m->header.firmware = (uint16_t)( hdr[6] | ( hdr[7] << 8 ) );
+  m->header.addr = 0;
+  m->header.size = 0;
+  m->header.time = 0;
+  for ( int k=3; k>=0; --k ) m->header.addr = ( m->header.addr << 8 ) | hdr[ 8+k];
+  for ( int k=3; k>=0; --k ) m->header.size = ( m->header.size << 8 ) | hdr[12+k];
+  for ( int k=7; k>=0; --k ) m->header.time = (int64_t)( ( (uint64_t)m->header.time << 8 ) | hdr[16+k] );
+  if ( (size_t)st.st_size - DUMP_HEADER_SIZE < m->header.size ) { // truncated file
+    m->header.size = (uint32_t)( st.st_size - DUMP_HEADER_SIZE );
+  }
+  m->data   = hdr + DUMP_HEADER_SIZE;
+  m->base   = base;
+  m->length = st.st_size;
+  return 0;
+}
+
+/** first record of the dump, X310
+ * @param m  mapped dump
+ */
+static inline unsigned int
+dump_first_record_x310( const struct DumpMap * m )
+{
+  unsigned int r = addr2index_x310( m->header.addr );
+  if ( index2addr_x310( r ) < m->header.addr ) ++ r;
+  return r;
+}
+
+/** number of 8-byte packets in the dump
+ * @param m  mapped dump
+ * @note an X310 record has two packets, the data (or G) and the vector (or M)
+ */
+static inline unsigned int
+dump_packets( const struct DumpMap * m )
+{
+  if ( m->header.model != DUMP_MODEL_X310 ) return m->header.size / MEMORY_PACKET_SIZE_A3;
+  unsigned int r0 = dump_first_record_x310( m );
+  unsigned int r1 = addr2index_x310( m->header.addr + m->header.size );
+  return ( r1 > r0 )? 2 * ( r1 - r0 ) : 0;
+}
+
+/** get a packet of the dump [no copy]
+ * @param m     mapped dump
+ * @param k     packet index (less than dump_packets())
+ * @param addr  device address of the packet [output, can be NULL]
+ * @return pointer to the eight bytes of the packet
+ */
+static inline const unsigned char *
+dump_packet( const struct DumpMap * m, unsigned int k, unsigned long * addr )
+{
+  unsigned long a;
+  if ( m->header.model == DUMP_MODEL_X310 ) {
+    a = index2addr_x310( dump_first_record_x310( m ) + k/2 ) + 8 * (k%2);
+  } else {
+    a = m->header.addr + (unsigned long)k * MEMORY_PACKET_SIZE_A3;
+  }
+  if ( addr != NULL ) *addr = a;
+  return m->data + ( a - m->header.addr );
+}
+
+/** unmap a dump file
+ * @param m  mapped dump
+ */
+static inline void
+dump_unmap( struct DumpMap * m )
+{
+  if ( m->base != NULL ) munmap( m->base, m->length );
+  m->base = NULL;
+  m->data = NULL;
+}
+
+#endif // DUMP_FILE_H
@@ -0,0 +1,190 @@
+/** @file FlashPipeline.cpp
+ *
+ * @author marco corvi
+ * @date oct 2026
+ *
+ * @brief pipelined flash page reads (0x3a requests) over a serial channel
+ * --------------------------------------------------------
+ *  Copyright This sowftare is distributed under GPL-3.0 or later
+ *  See the file COPYING.
+ */
+#include <stdio.h>
+#include <string.h>
+
+#include "FlashPipeline.h"
+
+FlashPipeline::FlashPipeline( Serial * s, unsigned int w )
+  : serial( s )
+  , window( FLASH_DEFAULT_WINDOW )
+  , timeout( FLASH_DEFAULT_TIMEOUT )
+  , n_sent( 0 )
+  , n_lost( 0 )
+  , n_stale( 0 )
+{
+  SetWindow( w );
+}
+
+void
+FlashPipeline::SetWindow( unsigned int w )
+{
+  if ( w < 1 ) w = 1;
+  if ( w > FLASH_MAX_WINDOW ) w = FLASH_MAX_WINDOW;
+  window = w;
+}
+
+ssize_t
+FlashPipeline::ReadHeader( unsigned char * buf, unsigned char type, unsigned long long deadline )
+{
+  size_t nr = 0;
+  SerialStatus st = serial->Read( buf, 8, deadline, &nr );
+  // resync on the reply type byte
+  while ( st == SERIAL_OK && buf[0] != type ) {
+    int k = 1;
+    while ( k < 8 && buf[k] != type ) ++k;
+    memmove( buf, buf+k, 8-k );
+    st = serial->Read( buf+8-k, k, deadline, &nr );
+  }
+  if ( st == SERIAL_TIMEOUT ) return 0;
+  return ( st == SERIAL_OK )? 8 : -1;
+}
+
+unsigned int
+FlashPipeline::ReadPages( const unsigned int * page, unsigned int n,
+                          unsigned char * data, unsigned char * ok )
+{
+  if ( n == 0 ) return 0;
+  unsigned char * done  = ( ok != NULL )? ok : new unsigned char[ n ];
+  unsigned char * tries = new unsigned char[ n ];
+  unsigned int  * retry = new unsigned int[ n ]; // queue of lost indices
+  unsigned int fifo[ FLASH_MAX_WINDOW ];         // outstanding indices, in request order
+  unsigned char req[ 3 * FLASH_MAX_WINDOW ];
+  unsigned char buf[8];
+  memset( done, 0, n );
+  memset( tries, 0, n );
+
+  unsigned int f0 = 0, nf = 0; // fifo head and size
+  unsigned int r0 = 0, nr = 0; // retry queue head and size
+  unsigned int next = 0;       // next index never requested
+  unsigned int cnt  = 0;       // number of pages read
+  bool failed = false;
+
+  while ( cnt < n && ! failed ) {
+    // fill the window: lost pages first, then new ones
+    size_t nreq = 0;
+    while ( nf < window && ( nr > 0 || next < n ) ) {
+      unsigned int k;
+      if ( nr > 0 ) {
+        k = retry[ r0 ];
+        r0 = ( r0 + 1 ) % n;
+        -- nr;
+      } else {
+        k = next ++;
+      }
+      fifo[ (f0 + nf) % FLASH_MAX_WINDOW ] = k;
+      ++ nf;
+      req[ nreq++ ] = 0x3a;
+      req[ nreq++ ] = (unsigned char)( page[k] & 0xff );      // bits 8..15 of address
+      req[ nreq++ ] = (unsigned char)( (page[k]>>8) & 0xff ); // bits 16..23 of address
+    }
+    if ( nreq > 0 ) {
+      if ( serial->Write( req, nreq, Serial::Deadline( timeout ), NULL ) != SERIAL_OK ) {
+        fprintf(stderr, "ERROR: FlashPipeline write failed\n");
+        break;
+      }
+      n_sent += nreq / 3;
+    }
+
+    unsigned long long deadline = Serial::Deadline( timeout );
+    ssize_t ret = ReadHeader( buf, 0x3a, deadline );
+    unsigned int nlost = 0; // number of outstanding requests that have been lost
+    if ( ret < 0 ) {
+      fprintf(stderr, "ERROR: FlashPipeline read failed\n");
+      break;
+    } else if ( ret == 0 ) { // timeout: every outstanding reply is lost
+      nlost = nf;
+    } else {
+      unsigned long reply_page = ((unsigned long)(buf[2]))<<8 | buf[1];
+      unsigned int j = 0;
+      for ( ; j < nf; ++j ) {
+        if ( page[ fifo[ (f0 + j) % FLASH_MAX_WINDOW ] ] == reply_page ) break;
+      }
+      if ( j == nf ) { // reply to a request already given up as lost: drop its page
+        unsigned char skip[ FLASH_PAGE_SIZE ];
+        serial->Read( skip, FLASH_PAGE_SIZE, deadline, NULL );
+        ++ n_stale;
+        continue;
+      }
+      unsigned int k = fifo[ (f0 + j) % FLASH_MAX_WINDOW ];
+      size_t nb = 0;
+      SerialStatus st = serial->Read( data + FLASH_PAGE_SIZE * k, FLASH_PAGE_SIZE, deadline, &nb );
+      if ( st == SERIAL_ERROR ) {
+        fprintf(stderr, "ERROR: FlashPipeline read failed\n");
+        break;
+      }
+      if ( st == SERIAL_OK ) {
+        nlost = j;
+      } else { // a truncated page: the rest of the stream is out of step
+        nlost = nf;
+        ret = 0;
+      }
+    }
+    for ( unsigned int i = 0; i < nlost; ++i ) {
+      unsigned int k = fifo[ f0 ];
+      f0 = ( f0 + 1 ) % FLASH_MAX_WINDOW;
+      -- nf;
+      ++ n_lost;
+      if ( ++ tries[k] > FLASH_MAX_RETRY ) {
+        fprintf(stderr, "ERROR: FlashPipeline no reply at page %02x\n", page[k] );
+        failed = true;
+      } else {
+        retry[ (r0 + nr) % n ] = k;
+        ++ nr;
+      }
+    }
+    if ( ret > 0 ) { // the reply is now at the head of the fifo
+      unsigned int k = fifo[ f0 ];
+      f0 = ( f0 + 1 ) % FLASH_MAX_WINDOW;
+      -- nf;
+      done[k] = 1;
+      ++ cnt;
+    }
+  }
+
+  if ( done != ok ) delete[] done;
+  delete[] tries;
+  delete[] retry;
+  return cnt;
+}
+
+bool
+FlashPipeline::WritePage( unsigned int page, const unsigned char * data )
+{
+  unsigned char req[ 3 + FLASH_PAGE_SIZE ];
+  unsigned char buf[8];
+  req[0] = 0x3b;
+  req[1] = (unsigned char)( page & 0xff );
+  req[2] = (unsigned char)( (page>>8) & 0xff );
+  memcpy( req + 3, data, FLASH_PAGE_SIZE );
+  for ( int t = 0; t <= FLASH_MAX_RETRY; ++t ) {
+    ++ n_sent;
+    if ( serial->Write( req, sizeof(req), Serial::Deadline( timeout ), NULL ) != SERIAL_OK ) {
+      fprintf(stderr, "ERROR: FlashPipeline write failed at page %02x\n", page );
+      return false;
+    }
+    unsigned long long deadline = Serial::Deadline( timeout );
+    ssize_t ret;
+    while ( ( ret = ReadHeader( buf, 0x3b, deadline ) ) > 0 ) {
+      unsigned long reply_page = ((unsigned long)(buf[2]))<<8 | buf[1];
+      if ( reply_page == page ) return true;
+      ++ n_stale; // reply to an earlier attempt
+    }
+    if ( ret < 0 ) {
+      fprintf(stderr, "ERROR: FlashPipeline read failed at page %02x\n", page );
+      return false;
+    }
+    ++ n_lost;
+  }
+  fprintf(stderr, "ERROR: FlashPipeline no reply at page %02x\n", page );
+  return false;
+}
+
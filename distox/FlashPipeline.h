@@ -0,0 +1,92 @@
+/** @file FlashPipeline.h
+ *
+ * @author marco corvi
+ * @date oct 2026
+ *
+ * @brief pipelined flash page reads (0x3a requests) over a serial channel
+ *
+ * The bootloader answers a 0x3a request with an 8-byte header, that
+ * echoes the page address in bytes 1-2, followed by the 256 bytes of the
+ * page. As in MemoryPipeline a window of requests is kept in flight and
+ * the replies, which come in order, are matched by the echoed address:
+ * the requests sent before the one that is answered have been lost and
+ * are re-issued. Page writes (0x3b) are not pipelined, the bootloader
+ * must finish programming a page before it takes the next one.
+ *
+ * @note the device must be in "bootloader mode"
+ * --------------------------------------------------------
+ *  Copyright This sowftare is distributed under GPL-3.0 or later
+ *  See the file COPYING.
+ */
+#ifndef FLASH_PIPELINE_H
+#define FLASH_PIPELINE_H
+
+#include "Serial.h"
+
+#define FLASH_PAGE_SIZE       256
+#define FLASH_MAX_WINDOW       16 /* max number of page requests in flight */
+#define FLASH_DEFAULT_WINDOW    4
+#define FLASH_MAX_RETRY         4 /* max re-issues of a page */
+#define FLASH_DEFAULT_TIMEOUT 2000000UL /* wait for a reply [usec] */
+
+class FlashPipeline
+{
+  private:
+    Serial * serial;
+    unsigned int window;   //!< number of outstanding requests
+    unsigned long timeout; //!< max wait for the next reply [usec]
+    unsigned int n_sent;   //!< number of requests sent
+    unsigned int n_lost;   //!< number of requests whose reply was lost
+    unsigned int n_stale;  //!< number of unexpected replies
+
+  public:
+    /** cstr
+     * @param s   serial line (communication channel)
+     * @param w   number of outstanding requests [1 = no pipelining]
+     */
+    FlashPipeline( Serial * s, unsigned int w = FLASH_DEFAULT_WINDOW );
+
+    /** set the number of outstanding requests
+     * @param w   window size (clamped to 1 .. FLASH_MAX_WINDOW)
+     */
+    void SetWindow( unsigned int w );
+
+    /** set the max wait for the next reply
+     * @param usec   timeout [usec]
+     */
+    void SetTimeout( unsigned long usec ) { timeout = usec; }
+
+    unsigned int Window() const { return window; }
+    unsigned int Sent()   const { return n_sent; }
+    unsigned int Lost()   const { return n_lost; }
+    unsigned int Stale()  const { return n_stale; }
+
+    /** read flash pages
+     * @param page   array of page addresses (flash address divided by 256)
+     * @param n      number of pages
+     * @param data   output array (256*n bytes): data[256*k..] is the content of page[k]
+     * @param ok     output array (n flags, can be NULL): ok[k] is 1 if page[k] has been read
+     * @return the number of pages that have been read
+     */
+    unsigned int ReadPages( const unsigned int * page, unsigned int n,
+                            unsigned char * data, unsigned char * ok = NULL );
+
+    /** write a flash page and wait for the reply
+     * @param page   page address (flash address divided by 256)
+     * @param data   256 bytes of the page
+     * @return true if the bootloader acknowledged the page
+     */
+    bool WritePage( unsigned int page, const unsigned char * data );
+
+  private:
+    /** read the 8-byte header of a reply, skipping stray bytes before the type byte
+     * @param buf   8-byte header [output]
+     * @param type  expected reply type byte
+     * @param deadline absolute deadline [usec]
+     * @return 8 on success, 0 on timeout, negative on error
+     */
+    ssize_t ReadHeader( unsigned char * buf, unsigned char type, unsigned long long deadline );
+
+};
+
+#endif // FLASH_PIPELINE_H
@@ -0,0 +1,166 @@
+/** @file MemoryLayout.h
+ *
+ * @author marco corvi
+ * @date oct 2026
+ *
+ * @brief layout of the data memory of the DistoX (A3) and of the DistoX2 (X310)
+ *
+ * A3: the data queue is a ring of 8-byte packets in 0x0000-0x8000,
+ *     packet i is at address 8*i.
+ * X310: the memory holds 18-byte records (two 8-byte packets and two
+ *     spare bytes), 56 records in each 1 KiB block: the first 1008 bytes
+ *     of the block are contiguous records, the last 16 are unused.
+ *
+ * The span iterator turns a range of record indices into the list of
+ * contiguous 4-byte aligned address ranges that cover them, one per
+ * block on the X310, so that a range of records is read as a few long
+ * sweeps of 0x38 requests instead of one fragment per record.
+ *
+ * The address mappings are constexpr in C++, and static inline functions
+ * for plain C (dump2data.c reaches them through DumpFile.h); the span
+ * iterator is C++ only.
+ * --------------------------------------------------------
+ *  Copyright This sowftare is distributed under GPL-3.0 or later
+ *  See the file COPYING.
+ */
+#ifndef MEMORY_LAYOUT_H
+#define MEMORY_LAYOUT_H
+
+#define MEMORY_PACKET_SIZE_A3      8
+#define MEMORY_SIZE_A3             0x8000
+#define MEMORY_RECORDS_A3          ( MEMORY_SIZE_A3 / MEMORY_PACKET_SIZE_A3 )
+
+#define MEMORY_BLOCK_SIZE_X310     0x400
+#define MEMORY_RECORD_SIZE_X310    18
+#define MEMORY_BLOCK_RECORDS_X310  56
+#define MEMORY_RECORDS_X310        1064
+
+#ifdef __cplusplus
+  #define MEMORY_MAP static constexpr
+#else
+  #define MEMORY_MAP static inline
+#endif
+
+/** address of a record, A3
+ * @param index  packet index
+ */
+MEMORY_MAP unsigned long index2addr_a3( unsigned int index )
+{
+  return (unsigned long)index * MEMORY_PACKET_SIZE_A3;
+}
+
+/** index of the record at an address, A3
+ * @param addr   address (inside the packet)
+ */
+MEMORY_MAP unsigned int addr2index_a3( unsigned long addr )
+{
+  return (unsigned int)( addr / MEMORY_PACKET_SIZE_A3 );
+}
+
+/** address of a record, X310
+ * @param index  record index
+ */
+MEMORY_MAP unsigned long index2addr_x310( unsigned int index )
+{
+  return (unsigned long)( index / MEMORY_BLOCK_RECORDS_X310 ) * MEMORY_BLOCK_SIZE_X310
+       + ( index % MEMORY_BLOCK_RECORDS_X310 ) * MEMORY_RECORD_SIZE_X310;
+}
+
+/** index of the record at an address, X310
+ * @param addr   address (inside the record)
+ * @note the unused tail of a block maps to the first record of the next block
+ */
+MEMORY_MAP unsigned int addr2index_x310( unsigned long addr )
+{
+  return (unsigned int)( addr / MEMORY_BLOCK_SIZE_X310 ) * MEMORY_BLOCK_RECORDS_X310
+       + ( ( addr % MEMORY_BLOCK_SIZE_X310 ) / MEMORY_RECORD_SIZE_X310 < MEMORY_BLOCK_RECORDS_X310
+           ? (unsigned int)( ( addr % MEMORY_BLOCK_SIZE_X310 ) / MEMORY_RECORD_SIZE_X310 )
+           : MEMORY_BLOCK_RECORDS_X310 );
+}
+
+#ifdef __cplusplus
+
+static_assert( MEMORY_BLOCK_RECORDS_X310 * MEMORY_RECORD_SIZE_X310 <= MEMORY_BLOCK_SIZE_X310,
+               "X310 records must fit in a block" );
+static_assert( addr2index_x310( index2addr_x310( MEMORY_RECORDS_X310 - 1 ) ) == MEMORY_RECORDS_X310 - 1,
+               "X310 address mapping must invert the index mapping" );
+static_assert( addr2index_x310( MEMORY_BLOCK_SIZE_X310 - 1 ) == MEMORY_BLOCK_RECORDS_X310,
+               "the unused tail of a X310 block must map to the next block" );
+
+/** contiguous address range covering a run of records
+ */
+struct MemorySpan
+{
+  unsigned long addr;  //!< start address (multiple of 4)
+  unsigned long end;   //!< end address (excluded, multiple of 4)
+  unsigned int first;  //!< first record index
+  unsigned int last;   //!< last record index (excluded)
+
+  /** offset of a record in the span
+   * @param index  record index (first <= index < last)
+   * @param x310   X310 layout
+   */
+  unsigned long Offset( unsigned int index, bool x310 ) const
+  {
+    return ( x310 ? index2addr_x310( index ) : index2addr_a3( index ) ) - addr;
+  }
+
+  /** number of 4-byte words of the span
+   */
+  unsigned int Words() const { return (unsigned int)( ( end - addr ) / 4 ); }
+};
+
+/** iterator over the spans of a range of records
+ *
+ *    MemorySpanIterator it( first, last, x310 );
+ *    MemorySpan span;
+ *    while ( it.Next( span ) ) { ... }
+ */
+class MemorySpanIterator
+{
+  private:
+    unsigned int next;  //!< next record index
+    unsigned int last;  //!< last record index (excluded)
+    bool x310;          //!< X310 layout
+
+  public:
+    /** cstr
+     * @param f  first record index
+     * @param l  last record index (excluded)
+     * @param x  whether the layout is X310 (otherwise A3)
+     */
+    MemorySpanIterator( unsigned int f, unsigned int l, bool x )
+      : next( f )
+      , last( l )
+      , x310( x )
+    {
+      unsigned int max = x310 ? MEMORY_RECORDS_X310 : MEMORY_RECORDS_A3;
+      if ( last > max ) last = max;
+    }
+
+    /** get the next span
+     * @param span  next span [output]
+     * @return false if there are no more spans
+     */
+    bool Next( MemorySpan & span )
+    {
+      if ( next >= last ) return false;
+      span.first = next;
+      if ( x310 ) {
+        unsigned int block_end = ( next / MEMORY_BLOCK_RECORDS_X310 + 1 ) * MEMORY_BLOCK_RECORDS_X310;
+        span.last = ( last < block_end )? last : block_end;
+        span.addr = index2addr_x310( span.first ) & ~3UL;
+        span.end  = ( index2addr_x310( span.last - 1 ) + MEMORY_RECORD_SIZE_X310 + 3 ) & ~3UL;
+      } else {
+        span.last = last;
+        span.addr = index2addr_a3( span.first );
+        span.end  = index2addr_a3( span.last );
+      }
+      next = span.last;
+      return true;
+    }
+};
+
+#endif // __cplusplus
+
+#endif // MEMORY_LAYOUT_H
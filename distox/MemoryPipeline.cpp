@@ -0,0 +1,227 @@
+/** @file MemoryPipeline.cpp
+ *
+ * @author marco corvi
+ * @date oct 2026
+ *
+ * @brief pipelined memory reads and writes (0x38/0x39 requests) over a serial channel
+ * --------------------------------------------------------
+ *  Copyright This sowftare is distributed under GPL-3.0 or later
+ *  See the file COPYING.
+ */
+#include <stdio.h>
+#include <string.h>
+
+#include "MemoryPipeline.h"
+
+MemoryPipeline::MemoryPipeline( Serial * s, unsigned int w )
+  : serial( s )
+  , window( PIPELINE_DEFAULT_WINDOW )
+  , timeout( PIPELINE_DEFAULT_TIMEOUT )
+  , n_sent( 0 )
+  , n_lost( 0 )
+  , n_stale( 0 )
+  , n_mismatch( 0 )
+{
+  SetWindow( w );
+}
+
+void
+MemoryPipeline::SetWindow( unsigned int w )
+{
+  if ( w < 1 ) w = 1;
+  if ( w > PIPELINE_MAX_WINDOW ) w = PIPELINE_MAX_WINDOW;
+  window = w;
+}
+
+ssize_t
+MemoryPipeline::ReadReply( unsigned char * buf, unsigned char type, unsigned long long deadline )
+{
+  size_t nr = 0;
+  SerialStatus st = serial->Read( buf, 8, deadline, &nr );
+  // resync on the reply type byte
+  while ( st == SERIAL_OK && buf[0] != type ) {
+    int k = 1;
+    while ( k < 8 && buf[k] != type ) ++k;
+    memmove( buf, buf+k, 8-k );
+    st = serial->Read( buf+8-k, k, deadline, &nr );
+  }
+  if ( st == SERIAL_TIMEOUT ) return 0;
+  return ( st == SERIAL_OK )? 8 : -1;
+}
+
+unsigned int
+MemoryPipeline::ReadWords( const unsigned long * addr, unsigned int n,
+                           unsigned char * data, unsigned char * ok )
+{
+  return Transfer( addr, n, data, NULL, ok );
+}
+
+unsigned int
+MemoryPipeline::WriteWords( const unsigned long * addr, unsigned int n,
+                            const unsigned char * data, unsigned char * ok )
+{
+  unsigned char * echo = new unsigned char[ 4*n ];
+  unsigned int cnt = Transfer( addr, n, echo, data, ok );
+  delete[] echo;
+  return cnt;
+}
+
+unsigned int
+MemoryPipeline::Transfer( const unsigned long * addr, unsigned int n,
+                          unsigned char * data, const unsigned char * wdata, unsigned char * ok )
+{
+  if ( n == 0 ) return 0;
+  unsigned char * done  = ( ok != NULL )? ok : new unsigned char[ n ];
+  unsigned char * tries = new unsigned char[ n ];
+  unsigned int  * retry = new unsigned int[ n ]; // queue of lost indices
+  unsigned int fifo[ PIPELINE_MAX_WINDOW ];      // outstanding indices, in request order
+  unsigned char req[ 7 * PIPELINE_MAX_WINDOW ];
+  unsigned char buf[8];
+  memset( done, 0, n );
+  memset( tries, 0, n );
+
+  unsigned int f0 = 0, nf = 0; // fifo head and size
+  unsigned int r0 = 0, nr = 0; // retry queue head and size
+  unsigned int next = 0;       // next index never requested
+  unsigned int cnt  = 0;       // number of words read
+  bool failed = false;
+
+  while ( cnt < n && ! failed ) {
+    // fill the window: lost addresses first, then new ones
+    size_t nreq = 0;
+    while ( nf < window && ( nr > 0 || next < n ) ) {
+      unsigned int k;
+      if ( nr > 0 ) {
+        k = retry[ r0 ];
+        r0 = ( r0 + 1 ) % n;
+        -- nr;
+      } else {
+        k = next ++;
+      }
+      fifo[ (f0 + nf) % PIPELINE_MAX_WINDOW ] = k;
+      ++ nf;
+      req[ nreq++ ] = ( wdata != NULL )? 0x39 : 0x38;
+      req[ nreq++ ] = (unsigned char)( addr[k] & 0xff );
+      req[ nreq++ ] = (unsigned char)( (addr[k]>>8) & 0xff );
+      if ( wdata != NULL ) {
+        memcpy( req + nreq, wdata + 4*k, 4 );
+        nreq += 4;
+      }
+    }
+    if ( nreq > 0 ) {
+      if ( serial->Write( req, nreq, Serial::Deadline( timeout ), NULL ) != SERIAL_OK ) {
+        fprintf(stderr, "ERROR: MemoryPipeline write failed\n");
+        break;
+      }
+      n_sent += nreq / ( ( wdata != NULL )? 7 : 3 );
+    }
+
+    ssize_t ret = ReadReply( buf, 0x38, Serial::Deadline( timeout ) );
+    unsigned int nlost = 0; // number of outstanding requests that have been lost
+    unsigned int j = nf;    // fifo position of the reply
+    if ( ret < 0 ) {
+      fprintf(stderr, "ERROR: MemoryPipeline read failed\n");
+      break;
+    } else if ( ret == 0 ) { // timeout: every outstanding reply is lost
+      nlost = nf;
+    } else {
+      unsigned long reply_addr = ((unsigned long)(buf[2]))<<8 | buf[1];
+      for ( j = 0; j < nf; ++j ) {
+        if ( addr[ fifo[ (f0 + j) % PIPELINE_MAX_WINDOW ] ] == reply_addr ) break;
+      }
+      if ( j == nf ) { // reply to a request already given up as lost
+        ++ n_stale;
+        continue;
+      }
+      nlost = j;
+    }
+    for ( unsigned int i = 0; i < nlost; ++i ) {
+      unsigned int k = fifo[ f0 ];
+      f0 = ( f0 + 1 ) % PIPELINE_MAX_WINDOW;
+      -- nf;
+      ++ n_lost;
+      if ( ++ tries[k] > PIPELINE_MAX_RETRY ) {
+        fprintf(stderr, "ERROR: MemoryPipeline no reply at addr %04lx\n", addr[k] );
+        failed = true;
+      } else {
+        retry[ (r0 + nr) % n ] = k;
+        ++ nr;
+      }
+    }
+    if ( ret > 0 ) { // the reply is now at the head of the fifo
+      unsigned int k = fifo[ f0 ];
+      f0 = ( f0 + 1 ) % PIPELINE_MAX_WINDOW;
+      -- nf;
+      memcpy( data + 4*k, buf + 3, 4 );
+      if ( wdata != NULL && memcmp( buf + 3, wdata + 4*k, 4 ) != 0 ) {
+        // the write reply echoes the memory content: the write did not take
+        ++ n_mismatch;
+        if ( ++ tries[k] > PIPELINE_MAX_RETRY ) {
+          fprintf(stderr, "ERROR: MemoryPipeline write mismatch at addr %04lx\n", addr[k] );
+          failed = true;
+        } else {
+          retry[ (r0 + nr) % n ] = k;
+          ++ nr;
+        }
+        continue;
+      }
+      done[k] = 1;
+      ++ cnt;
+    }
+  }
+
+  if ( done != ok ) delete[] done;
+  delete[] tries;
+  delete[] retry;
+  return cnt;
+}
+
+unsigned int
+MemoryPipeline::ReadRange( unsigned long addr, unsigned long end,
+                           unsigned char * data, unsigned char * ok )
+{
+  if ( end <= addr ) return 0;
+  unsigned int n = ( end - addr + 3 ) / 4;
+  unsigned long * a = new unsigned long[ n ];
+  for ( unsigned int k=0; k<n; ++k ) a[k] = addr + 4*k;
+  unsigned int cnt = ReadWords( a, n, data, ok );
+  delete[] a;
+  return cnt;
+}
+
+unsigned int
+MemoryPipeline::WriteRange( unsigned long addr, unsigned long end,
+                            const unsigned char * data, unsigned char * ok )
+{
+  if ( end <= addr ) return 0;
+  unsigned int n = ( end - addr + 3 ) / 4;
+  unsigned long * a = new unsigned long[ n ];
+  for ( unsigned int k=0; k<n; ++k ) a[k] = addr + 4*k;
+  unsigned int cnt = WriteWords( a, n, data, ok );
+  delete[] a;
+  return cnt;
+}
+
+unsigned int
+MemoryPipeline::WriteVerify( unsigned long addr, unsigned long end,
+                             const unsigned char * data )
+{
+  if ( end <= addr ) return 0;
+  unsigned int n = ( end - addr + 3 ) / 4;
+  if ( WriteRange( addr, end, data ) != n ) return 0;
+  unsigned char * back = new unsigned char[ 4*n ];
+  unsigned int cnt = 0;
+  if ( ReadRange( addr, end, back ) == n ) {
+    for ( unsigned int k=0; k<n; ++k ) {
+      if ( memcmp( back + 4*k, data + 4*k, 4 ) == 0 ) {
+        ++ cnt;
+      } else {
+        fprintf(stderr, "ERROR: MemoryPipeline verify failed at addr %04lx\n", addr + 4*k );
+        ++ n_mismatch;
+      }
+    }
+  }
+  delete[] back;
+  return cnt;
+}
+
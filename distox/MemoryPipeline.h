@@ -0,0 +1,138 @@
+/** @file MemoryPipeline.h
+ *
+ * @author marco corvi
+ * @date oct 2026
+ *
+ * @brief pipelined memory reads and writes (0x38/0x39 requests) over a serial channel
+ *
+ * Instead of waiting for the 8-byte reply of each 0x38 request before
+ * sending the next one, a window of requests is kept in flight.
+ * Replies are matched by the address echoed in bytes 1-2.
+ * The device answers in order, therefore when the reply for a request
+ * arrives the requests sent before it that are still outstanding have
+ * been lost: only those addresses are re-issued.
+ * Writes (0x39) go the same way: the device replies to each of them with
+ * a 0x38 packet that echoes the address and the memory content.
+ * --------------------------------------------------------
+ *  Copyright This sowftare is distributed under GPL-3.0 or later
+ *  See the file COPYING.
+ */
+#ifndef MEMORY_PIPELINE_H
+#define MEMORY_PIPELINE_H
+
+#include "Serial.h"
+
+#define PIPELINE_MAX_WINDOW     64 /* max number of requests in flight */
+#define PIPELINE_DEFAULT_WINDOW 16
+#define PIPELINE_MAX_RETRY       4 /* max re-issues of an address */
+#define PIPELINE_DEFAULT_TIMEOUT 1000000UL /* wait for a reply [usec] */
+
+class MemoryPipeline
+{
+  private:
+    Serial * serial;
+    unsigned int window;   //!< number of outstanding requests
+    unsigned long timeout; //!< max wait for the next reply [usec]
+    unsigned int n_sent;   //!< number of requests sent
+    unsigned int n_lost;   //!< number of requests whose reply was lost
+    unsigned int n_stale;  //!< number of unexpected replies
+    unsigned int n_mismatch; //!< number of words whose write did not take
+
+  public:
+    /** cstr
+     * @param s   serial line (communication channel)
+     * @param w   number of outstanding requests [1 = no pipelining]
+     */
+    MemoryPipeline( Serial * s, unsigned int w = PIPELINE_DEFAULT_WINDOW );
+
+    /** set the number of outstanding requests
+     * @param w   window size (clamped to 1 .. PIPELINE_MAX_WINDOW)
+     */
+    void SetWindow( unsigned int w );
+
+    /** set the max wait for the next reply: when it expires the
+     * outstanding requests are considered lost and re-issued
+     * @param usec   timeout [usec]
+     */
+    void SetTimeout( unsigned long usec ) { timeout = usec; }
+
+    unsigned int Window() const { return window; }
+    unsigned int Sent()   const { return n_sent; }
+    unsigned int Lost()   const { return n_lost; }
+    unsigned int Stale()  const { return n_stale; }
+    unsigned int Mismatch() const { return n_mismatch; }
+
+    /** read 4-byte words at a list of addresses
+     * @param addr   array of addresses
+     * @param n      number of addresses
+     * @param data   output array (4*n bytes): data[4*k..4*k+3] is the word at addr[k]
+     * @param ok     output array (n flags, can be NULL): ok[k] is 1 if addr[k] has been read
+     * @return the number of words that have been read
+     */
+    unsigned int ReadWords( const unsigned long * addr, unsigned int n,
+                            unsigned char * data, unsigned char * ok = NULL );
+
+    /** read the 4-byte words of a memory range
+     * @param addr   start address
+     * @param end    end address (excluded)
+     * @param data   output array (4*ceil((end-addr)/4) bytes)
+     * @param ok     output array of flags, one per word (can be NULL)
+     * @return the number of words that have been read
+     */
+    unsigned int ReadRange( unsigned long addr, unsigned long end,
+                            unsigned char * data, unsigned char * ok = NULL );
+
+    /** write 4-byte words at a list of addresses
+     * a word is written when the echoed reply carries the written content
+     * @param addr   array of addresses
+     * @param n      number of addresses
+     * @param data   input array (4*n bytes): data[4*k..4*k+3] is the word to write at addr[k]
+     * @param ok     output array (n flags, can be NULL): ok[k] is 1 if addr[k] has been written
+     * @return the number of words that have been written
+     */
+    unsigned int WriteWords( const unsigned long * addr, unsigned int n,
+                             const unsigned char * data, unsigned char * ok = NULL );
+
+    /** write the 4-byte words of a memory range
+     * @param addr   start address
+     * @param end    end address (excluded)
+     * @param data   input array (4*ceil((end-addr)/4) bytes)
+     * @param ok     output array of flags, one per word (can be NULL)
+     * @return the number of words that have been written
+     */
+    unsigned int WriteRange( unsigned long addr, unsigned long end,
+                             const unsigned char * data, unsigned char * ok = NULL );
+
+    /** write a memory range in one burst, then read it back in one burst
+     * @param addr   start address
+     * @param end    end address (excluded)
+     * @param data   input array (4*ceil((end-addr)/4) bytes)
+     * @return the number of words that have been verified (0 if the write failed)
+     */
+    unsigned int WriteVerify( unsigned long addr, unsigned long end,
+                              const unsigned char * data );
+
+  private:
+    /** transfer 4-byte words at a list of addresses
+     * @param addr   array of addresses
+     * @param n      number of addresses
+     * @param data   output array of the replies (4*n bytes)
+     * @param wdata  words to write (4*n bytes), NULL to read
+     * @param ok     output array of flags (can be NULL)
+     * @return the number of words that have been transferred
+     */
+    unsigned int Transfer( const unsigned long * addr, unsigned int n,
+                           unsigned char * data, const unsigned char * wdata, unsigned char * ok );
+
+    /** read an 8-byte reply, skipping stray bytes before the reply type byte
+     * @param buf   8-byte reply [output]
+     * @param type  expected reply type byte
+     * @param deadline absolute deadline [usec]
+     * @return 8 on success, 0 on timeout, negative on error
+     */
+    ssize_t ReadReply( unsigned char * buf, unsigned char type, unsigned long long deadline );
+
+};
+
+#endif // MEMORY_PIPELINE_H
+
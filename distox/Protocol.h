@@ -16,9 +16,10 @@
 #else
   #include <stdint.h>
 #endif
+#include <string.h>
 
 #include "Serial.h"
-#include "BufferQueue.h"
+#include "RingBuffer.h"
 
 enum Command {
   CALIB_START,
@@ -36,6 +37,7 @@ enum ProtoError {
   PROTO_PACKET,
   PROTO_CONNECT,
   PROTO_TIMEOUT,
+  PROTO_FULL,
   PROTO_MAX
 };
 
@@ -50,7 +52,7 @@ const char * ProtoErrorStr( ProtoError err );
 #define DATA_2_ROLL_X1( b ) ( (unsigned int)(b[7]) )
 
 // this is specific to DistoX2 : roll is 16-bit
-#define DATA_2_ROLL_X2( b1, b2 ) ( (unsigned int)(b2[7]) | ) ( (unsigned int)(b1[7] << 8 )
+#define DATA_2_ROLL_X2( b1, b2 ) ( (unsigned int)(b2[7]) | ( (unsigned int)(b1[7]) << 8 ) )
 
 #define DATA_2_ACC( b ) ( (unsigned int)(b[1]) | ( (unsigned int)(b[2]) ) << 8 )
 #define DATA_2_MAG( b ) ( (unsigned int)(b[3]) | ( (unsigned int)(b[4]) ) << 8 )
@@ -85,14 +87,37 @@ const char * ProtoErrorStr( ProtoError err );
 #define PACKET_VECTOR 0x04
 #define PACKET_REPLY  0x38
 
+// capacity of the packet queues [packets]
+//   large enough for a full device memory (0x8000 / 8 packets)
+#define PROTO_QUEUE_SIZE   8192
+#define PROTO_COMMAND_SIZE 64
+
+// size of the receive buffer of the bulk reads [bytes]
+#define PROTO_RECV_SIZE    4096
+#define PROTO_RECV_PACKETS ( PROTO_RECV_SIZE / 8 )
+
+// max time of the write of an ack [usec]: a late ack is not waited for,
+// the device sends the packet again
+#define PROTO_ACK_TIMEOUT  100000UL
+
 class Protocol
 {
   private:
     Serial serial;
-    BufferQueue< unsigned char [8] > data_queue;
-    BufferQueue< unsigned char [8] > calib_queue;
-    BufferQueue< unsigned char > command_queue;
-    unsigned char sequence_bit; // DistoX2 sequence bit
+    RingBuffer< unsigned char [8], PROTO_QUEUE_SIZE > data_queue;
+    RingBuffer< unsigned char [8], PROTO_QUEUE_SIZE > calib_queue;
+    RingBuffer< unsigned char, PROTO_COMMAND_SIZE > command_queue;
+    unsigned char pump_buf[8];  // partial packet read by Receive()
+    unsigned int  pump_len;     // number of bytes in pump_buf
+    unsigned int  n_skipped;    // bytes skipped by Receive() looking for a packet start
+    // packet streams: 0 data and vector packets, 1 G and M packets
+    unsigned char sequence_bit[2];   // sequence bit (0x80) of the last packet queued on each stream
+    bool          has_last[2];
+    unsigned char held_packet[2][8]; // packet read ahead by the pairing
+    bool          has_held[2];
+    unsigned int  n_duplicate;  // retransmitted packets dropped by Receive()
+    unsigned int  n_orphan;     // unpaired packets dropped by NextData() and NextCalib()
+    unsigned int  n_overflow;   // packets not queued (and not acknowledged): queue full
 
   public:
     /** cstr
@@ -104,18 +129,48 @@ class Protocol
     /** get the size of the data queue
      * @return the size of the data queue
      */
-    unsigned int DataSize() const { return data_queue.Size(); }
+    unsigned int DataSize() const { return data_queue.Size() + ( has_held[0] ? 1 : 0 ); }
 
     /** get the size of the calib queue
      * @return the size of the calib queue
      */
-    unsigned int CalibSize() const { return calib_queue.Size(); }
+    unsigned int CalibSize() const { return calib_queue.Size() + ( has_held[1] ? 1 : 0 ); }
 
     /** get the size of the command queue
      * @return the size of the command queue
      */
     unsigned int CommandSize() const { return command_queue.Size(); }
 
+    /** wait until there are at least n packets on the data queue [consumer]
+     * @param n     number of packets
+     * @param usec  max wait [usec]
+     * @return true if there are n packets, false on timeout or if the queues are closed
+     */
+    bool WaitData( unsigned int n, unsigned long usec ) { return data_queue.Wait( n, usec ); }
+
+    /** wait until a bulk read can be queued without dropping packets [producer]
+     * @param usec  max wait [usec]
+     * @return true if there is room for PROTO_RECV_PACKETS on both the data and the calib queue
+     */
+    bool WaitRoom( unsigned long usec )
+    {
+      return data_queue.WaitFree( PROTO_RECV_PACKETS, usec )
+          && calib_queue.WaitFree( PROTO_RECV_PACKETS, usec );
+    }
+
+    /** close the packet queues: no more packets will be read
+     */
+    void CloseQueues() { data_queue.Close(); calib_queue.Close(); }
+
+    /** reopen the packet queues
+     */
+    void ReopenQueues() { data_queue.Reopen(); calib_queue.Reopen(); }
+
+    /** check if the packet queues are closed
+     * @return true if no more packets will be read
+     */
+    bool QueuesClosed() const { return data_queue.IsClosed(); }
+
     /** check if the underlying serial line is open
      * @return true if the serial line is open
      */
@@ -133,6 +188,67 @@ class Protocol
      */
     void Close() { serial.Close(); }
 
+    #ifndef WIN32
+    /** get the file descriptor of the serial line, to wait on it
+     * @return the file descriptor (-1 if not open)
+     */
+    int Fd() const { return serial.Fd(); }
+    #endif
+
+    /** get the number of bytes skipped by Pump() and ReadDataBulk() out of packet boundaries
+     * @return the number of skipped bytes
+     */
+    unsigned int Skipped() const { return n_skipped; }
+
+    /** get the number of retransmitted packets that have been dropped
+     * @return the number of duplicate packets
+     */
+    unsigned int Duplicates() const { return n_duplicate; }
+
+    /** get the number of packets dropped because they had no partner
+     *  (data without vector, G without M, and the like)
+     * @return the number of orphan packets
+     */
+    unsigned int Orphans() const { return n_orphan; }
+
+    /** get the number of packets that did not fit on the queues:
+     *  they are not acknowledged, and the device sends them again
+     * @return the number of overflow packets
+     */
+    unsigned int Overflows() const { return n_overflow; }
+
+    /** read the bytes available on the serial line without waiting,
+     * acknowledge the complete packets and put them on the queues.
+     * A partial packet is kept for the next call.
+     * @param np   number of packets that have been queued [output, can be NULL]
+     * @return PROTO_OK, PROTO_FULL if the queues have no room,
+     *         or PROTO_READ if the line has an error or hung up
+     */
+    ProtoError Pump( unsigned int * np = NULL )
+    {
+      ProtoError err = Receive( 0, np ); // deadline already expired
+      return ( err == PROTO_TIMEOUT )? PROTO_OK : err;
+    }
+
+    /** read the data packets in bulk: wait for the first packet, then read
+     * all the bytes available with as few reads as possible,
+     * acknowledge the complete packets and put them on the queues
+     * @param np   number of packets that have been queued [output, can be NULL]
+     * @return PROTO_OK if some packets have been queued, PROTO_TIMEOUT if none
+     *         arrived within the timeout, PROTO_FULL if the queues have no room,
+     *         PROTO_READ on error
+     * @see Receive
+     */
+    ProtoError ReadDataBulk( unsigned int * np = NULL )
+    {
+      return Receive( Serial::Deadline( serial.Timeout() ), np );
+    }
+
+    /** set the timeout of each read/write on the serial line
+     * @param usec   timeout [usec, default SERIAL_DEFAULT_TIMEOUT]
+     */
+    void SetTimeout( unsigned long usec ) { serial.SetTimeout( usec ); }
+
     /** send a command
      * @param cmd command
      * @return protocol error code
@@ -194,41 +310,40 @@ class Protocol
      */
     bool NextData( unsigned char (&b)[8] ) 
     { 
-      return data_queue.Get( b ) && PACKET_TYPE( b ) == PACKET_DATA;
+      return NextPacket( 0, b ) && PACKET_TYPE( b ) == PACKET_DATA;
     }
 
     /** get the next data on the queue, DistoX2
      * @param b1   first 8 byte array
      * @param b2   second 8 byte array
      * @return true if there is a data on the queue
+     * @note a data packet is paired with the vector packet that follows it
+     *       with the other sequence bit; unpaired packets are counted as orphans
      */
     bool NextData( unsigned char (&b1)[8], unsigned char (&b2)[8] ) 
     { 
-      while ( data_queue.Size() >= 2 ) {
-        if ( ! data_queue.Get( b1 ) ) return false;
-	if ( PACKET_TYPE( b1 ) == PACKET_DATA ) {
-          if ( ! data_queue.Get( b2 ) ) return false;
-	  return PACKET_TYPE( b2 ) == PACKET_VECTOR;
-	}
-      }
-      return false;
+      return NextPair( 0, PACKET_DATA, PACKET_VECTOR, b1, b2 );
+    }
+
+    /** get many data packets from the queue at once
+     * @param b   array of 8 byte packets
+     * @param n   size of the array
+     * @return the number of packets that have been copied
+     */
+    unsigned int NextDataMany( unsigned char (*b)[8], unsigned int n )
+    {
+      return data_queue.GetMany( b, n );
     }
 
     /** get the next calib on the queue
      * @param b1  G 8 byte array
      * @param b2  M 8 byte array
      * @return true if there is a calib on the queue
+     * @note paired as the DistoX2 data, @see NextData
      */
     bool NextCalib( unsigned char (&b1)[8], unsigned char (&b2)[8]  )
     {
-      while ( calib_queue.Size() >= 2 ) {
-        if ( ! calib_queue.Get( b1 ) ) return false;
-	if ( PACKET_TYPE( b1 ) == PACKET_G ) {
-          if ( ! calib_queue.Get( b2 ) ) return false;
-	  return PACKET_TYPE( b2 ) == PACKET_M;
-	}
-      }
-      return false;
+      return NextPair( 1, PACKET_G, PACKET_M, b1, b2 );
     }
 
     /** put a command on the command queue
@@ -268,6 +383,138 @@ class Protocol
     }
 
   private:
+    /** read the available bytes, frame them in packets and queue them:
+     * data and vector packets on the data queue, G and M on the calib queue.
+     * Bytes that cannot start a packet are skipped, so a stray byte does not
+     * shift the framing; a partial packet is kept for the next call.
+     * No more bytes are read than the queues can take, and each packet is
+     * acknowledged once it is on its queue: a packet that is not read, or
+     * does not fit, is not acknowledged and the device sends it again.
+     * Retransmitted packets are acknowledged again but not queued.
+     * @param deadline  how long to wait for the first packet [usec, see Serial::Now()]
+     * @param np        number of packets that have been queued [output, can be NULL]
+     * @return PROTO_OK if some packets have been queued, PROTO_TIMEOUT if none,
+     *         PROTO_FULL if the queues have no room for a packet,
+     *         PROTO_READ if the line has an error or hung up
+     */
+    ProtoError Receive( unsigned long long deadline, unsigned int * np )
+    {
+      unsigned char buf[ PROTO_RECV_SIZE ];
+      unsigned int cnt = 0;
+      ProtoError err = PROTO_OK;
+      for ( ; ; ) {
+        size_t room = RecvRoom();
+        if ( room == 0 ) {
+          if ( cnt == 0 ) err = PROTO_FULL;
+          break;
+        }
+        size_t nr = 0;
+        // wait only for the first packet, then take what is there
+        SerialStatus st = serial.ReadSome( buf, room, ( cnt == 0 )? deadline : 0, &nr );
+        for ( size_t k = 0; k < nr; ++k ) {
+          if ( pump_len == 0 ) {
+            unsigned char type = buf[k] & 0x3f; // PACKET_TYPE
+            if ( type < PACKET_DATA || type > PACKET_VECTOR ) {
+              ++ n_skipped;
+              continue;
+            }
+          }
+          pump_buf[ pump_len ++ ] = buf[k];
+          if ( pump_len < 8 ) continue;
+          pump_len = 0;
+          unsigned char type = PACKET_TYPE( pump_buf );
+          int stream = ( type == PACKET_G || type == PACKET_M )? 1 : 0;
+          // the device sends a new packet with the other sequence bit: a packet
+          // with the bit of the last one queued is that one sent again, because
+          // its ack was lost (the G-M and data-vector pairs keep the bit of the
+          // two streams in step when the device switches between them)
+          if ( has_last[stream] && ( pump_buf[0] & 0x80 ) == sequence_bit[stream] ) {
+            Acknowledge( pump_buf[0] );
+            ++ n_duplicate;
+            continue;
+          }
+          if ( ! ( ( stream == 1 )? calib_queue.Put( pump_buf ) : data_queue.Put( pump_buf ) ) ) {
+            ++ n_overflow; // not acknowledged: the device sends it again
+            continue;
+          }
+          Acknowledge( pump_buf[0] );
+          sequence_bit[stream] = pump_buf[0] & 0x80;
+          has_last[stream] = true;
+          ++ cnt;
+        }
+        if ( st == SERIAL_ERROR ) {
+          err = PROTO_READ;
+          break;
+        }
+        if ( st == SERIAL_TIMEOUT ) {
+          if ( cnt == 0 ) err = PROTO_TIMEOUT;
+          break;
+        }
+        if ( cnt > 0 && nr < room ) break; // nothing more available
+      }
+      if ( np ) *np = cnt;
+      return err;
+    }
+
+    /** get the number of bytes that can be read without overflowing the queues
+     * (the partial packet already read takes its part of a slot)
+     * @return the number of bytes, at most PROTO_RECV_SIZE
+     */
+    size_t RecvRoom() const
+    {
+      size_t room = data_queue.Free();
+      if ( calib_queue.Free() < room ) room = calib_queue.Free();
+      room = ( room * 8 > pump_len )? room * 8 - pump_len : 0;
+      return ( room < PROTO_RECV_SIZE )? room : PROTO_RECV_SIZE;
+    }
+
+    /** get the next packet of a stream [consumer]
+     * @param stream  0 data queue, 1 calib queue
+     * @param b       8 byte array [output]
+     * @return true if there is a packet
+     */
+    bool NextPacket( int stream, unsigned char (&b)[8] )
+    {
+      if ( has_held[stream] ) {
+        memcpy( b, held_packet[stream], 8 );
+        has_held[stream] = false;
+        return true;
+      }
+      return ( stream == 1 )? calib_queue.Get( b ) : data_queue.Get( b );
+    }
+
+    /** get the next pair of packets of a stream [consumer]
+     * @param stream  0 data queue, 1 calib queue
+     * @param first   type of the first packet
+     * @param second  type of the second packet
+     * @param b1      first packet [output]
+     * @param b2      second packet [output]
+     * @return true if there is a pair
+     *
+     * The second packet must follow the first with the other sequence bit.
+     * A first packet whose partner has not arrived yet is held for the next call.
+     */
+    bool NextPair( int stream, unsigned char first, unsigned char second,
+                   unsigned char (&b1)[8], unsigned char (&b2)[8] )
+    {
+      while ( NextPacket( stream, b1 ) ) {
+        if ( PACKET_TYPE( b1 ) != first ) {
+          ++ n_orphan;
+          continue;
+        }
+        if ( ! NextPacket( stream, b2 ) ) {
+          memcpy( held_packet[stream], b1, 8 );
+          has_held[stream] = true;
+          return false;
+        }
+        if ( PACKET_TYPE( b2 ) == second && ( ( b1[0] ^ b2[0] ) & 0x80 ) != 0 ) return true;
+        ++ n_orphan; // b1 has no partner: b2 can start the next pair
+        memcpy( held_packet[stream], b2, 8 );
+        has_held[stream] = true;
+      }
+      return false;
+    }
+
     /** write a byte 
      * @param byte t byte to write
      * @return error code
@@ -280,7 +527,7 @@ class Protocol
       return PROTO_OK;
     }
 
-    /** acknowledge a data packet
+    /** acknowledge a data packet, waiting at most PROTO_ACK_TIMEOUT
      * @param byte  0-th byte of the data packet
      * @return protocol error code
      */
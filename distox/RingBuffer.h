@@ -0,0 +1,266 @@
+/** @file RingBuffer.h
+ *
+ * @author marco corvi
+ * @date oct 2026
+ *
+ * @brief lock-free single-producer single-consumer ring buffer
+ *
+ * The ring has a fixed capacity N (a power of two) and does not allocate:
+ * the items are copied in and out of a cache-line aligned array.
+ * The producer only writes "head", the consumer only writes "tail",
+ * and the two indices live on separate cache lines.
+ * Either side can block until there are items (or room) on the ring:
+ * the other side takes the wait lock only when someone is waiting,
+ * and Close() wakes the waiters when the producer is done.
+ * --------------------------------------------------------
+ *  Copyright This sowftare is distributed under GPL-3.0 or later
+ *  See the file COPYING.
+ */
+#ifndef RING_BUFFER_H
+#define RING_BUFFER_H
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#define RING_CACHE_LINE 64
+
+template< typename T, unsigned int N = 4096 >
+class RingBuffer
+{
+  static_assert( N >= 2 && ( N & (N-1) ) == 0, "RingBuffer capacity must be a power of two" );
+
+  private:
+    unsigned int head __attribute__(( aligned( RING_CACHE_LINE ) )); //!< next slot to write (producer)
+    unsigned int tail __attribute__(( aligned( RING_CACHE_LINE ) )); //!< next slot to read (consumer)
+    unsigned int n_lost;  //!< number of items dropped because the ring was full
+    int n_waiting;        //!< number of threads blocked on the ring
+    int closed;           //!< whether the producer is done
+    pthread_mutex_t wait_lock;
+    pthread_cond_t  wait_cond;
+    T items[ N ] __attribute__(( aligned( RING_CACHE_LINE ) ));
+
+  public:
+    /** cstr
+     */
+    RingBuffer( )
+      : head( 0 )
+      , tail( 0 )
+      , n_lost( 0 )
+      , n_waiting( 0 )
+      , closed( 0 )
+    {
+      pthread_condattr_t attr;
+      pthread_condattr_init( &attr );
+      pthread_condattr_setclock( &attr, CLOCK_MONOTONIC );
+      pthread_mutex_init( &wait_lock, NULL );
+      pthread_cond_init( &wait_cond, &attr );
+      pthread_condattr_destroy( &attr );
+    }
+
+    /** dstr
+     */
+    ~RingBuffer()
+    {
+      pthread_cond_destroy( &wait_cond );
+      pthread_mutex_destroy( &wait_lock );
+    }
+
+    /** get the capacity of the ring
+     * @return the max number of items on the ring
+     */
+    unsigned int Capacity() const { return N; }
+
+    /** get the number of items on the ring
+     * @return the size of the ring
+     */
+    unsigned int Size() const
+    {
+      return __atomic_load_n( &head, __ATOMIC_ACQUIRE ) - __atomic_load_n( &tail, __ATOMIC_ACQUIRE );
+    }
+
+    /** get the number of items dropped on Put() because the ring was full
+     * @return the number of lost items
+     */
+    unsigned int Lost() const { return n_lost; }
+
+    /** put an item on the ring [producer]
+     * @param t  item to put on the ring
+     * @return true if the item has been put, false if the ring is full
+     */
+    bool Put( const T & t )
+    {
+      unsigned int h = head; // only the producer writes head
+      if ( h - __atomic_load_n( &tail, __ATOMIC_ACQUIRE ) >= N ) {
+        if ( n_lost ++ == 0 ) {
+          fprintf(stderr, "ERROR: RingBuffer: full (capacity %u)\n", N );
+        }
+        return false;
+      }
+      memcpy( &items[ h & (N-1) ], &t, sizeof(T) );
+      __atomic_store_n( &head, h+1, __ATOMIC_RELEASE );
+      Wake();
+      return true;
+    }
+
+    /** get the number of free slots on the ring
+     * @return the number of items that can be put without dropping [producer]
+     */
+    unsigned int Free() const { return N - Size(); }
+
+    /** put n items on the ring with at most two block copies [producer]
+     * @param t  array of items
+     * @param n  number of items
+     * @return true if the n items have been put, false if they do not fit (none is put)
+     */
+    bool PutMany( const T * t, unsigned int n )
+    {
+      unsigned int h = head;
+      if ( n > N - ( h - __atomic_load_n( &tail, __ATOMIC_ACQUIRE ) ) ) {
+        if ( n_lost == 0 ) {
+          fprintf(stderr, "ERROR: RingBuffer: full (capacity %u)\n", N );
+        }
+        n_lost += n;
+        return false;
+      }
+      unsigned int k0 = h & (N-1);
+      unsigned int n1 = ( k0 + n <= N )? n : N - k0; // items before wrap-around
+      memcpy( &items[ k0 ], t, n1 * sizeof(T) );
+      if ( n1 < n ) {
+        memcpy( &items[ 0 ], t + n1, (n - n1) * sizeof(T) );
+      }
+      __atomic_store_n( &head, h+n, __ATOMIC_RELEASE );
+      Wake();
+      return true;
+    }
+
+    /** get an item from the ring [consumer]
+     * @param t where the item from the ring is copied
+     * @return true if an item has been copied, false if the ring is empty
+     */
+    bool Get( T & t )
+    {
+      unsigned int tl = tail; // only the consumer writes tail
+      if ( __atomic_load_n( &head, __ATOMIC_ACQUIRE ) == tl ) {
+        return false;
+      }
+      memcpy( &t, &items[ tl & (N-1) ], sizeof(T) );
+      __atomic_store_n( &tail, tl+1, __ATOMIC_RELEASE );
+      Wake();
+      return true;
+    }
+
+    /** get up to n items from the ring with at most two block copies [consumer]
+     * @param t  array where the items are copied
+     * @param n  size of the array
+     * @return the number of items that have been copied
+     */
+    unsigned int GetMany( T * t, unsigned int n )
+    {
+      unsigned int tl = tail;
+      unsigned int sz = __atomic_load_n( &head, __ATOMIC_ACQUIRE ) - tl;
+      if ( n > sz ) n = sz;
+      if ( n == 0 ) return 0;
+      unsigned int k0 = tl & (N-1);
+      unsigned int n1 = ( k0 + n <= N )? n : N - k0; // items before wrap-around
+      memcpy( t, &items[ k0 ], n1 * sizeof(T) );
+      if ( n1 < n ) {
+        memcpy( t + n1, &items[ 0 ], (n - n1) * sizeof(T) );
+      }
+      __atomic_store_n( &tail, tl+n, __ATOMIC_RELEASE );
+      Wake();
+      return n;
+    }
+
+    /** wait until there are at least n items on the ring [consumer]
+     * @param n     number of items
+     * @param usec  max wait [usec]
+     * @return true if there are n items, false on timeout or if the ring has been closed before
+     */
+    bool Wait( unsigned int n, unsigned long usec ) { return Block( n, usec, false ); }
+
+    /** wait until there is room for at least n items on the ring [producer]
+     * @param n     number of items
+     * @param usec  max wait [usec]
+     * @return true if there is room for n items, false on timeout or if the ring is closed
+     */
+    bool WaitFree( unsigned int n, unsigned long usec ) { return Block( n, usec, true ); }
+
+    /** mark the ring closed: the producer is done, and the waiters return at once
+     */
+    void Close()
+    {
+      __atomic_store_n( &closed, 1, __ATOMIC_RELEASE );
+      pthread_mutex_lock( &wait_lock );
+      pthread_cond_broadcast( &wait_cond );
+      pthread_mutex_unlock( &wait_lock );
+    }
+
+    /** reopen a closed ring, for a new producer
+     */
+    void Reopen() { __atomic_store_n( &closed, 0, __ATOMIC_RELEASE ); }
+
+    /** check if the ring has been closed
+     * @return true if the producer is done
+     */
+    bool IsClosed() const { return __atomic_load_n( &closed, __ATOMIC_ACQUIRE ) != 0; }
+
+  private:
+    /** wake the threads blocked on the ring, if any
+     * the fence orders the index store before the check of the waiters,
+     * a waiter increments n_waiting under the lock before checking the indices
+     */
+    void Wake()
+    {
+      __atomic_thread_fence( __ATOMIC_SEQ_CST );
+      if ( __atomic_load_n( &n_waiting, __ATOMIC_RELAXED ) > 0 ) {
+        pthread_mutex_lock( &wait_lock );
+        pthread_cond_broadcast( &wait_cond );
+        pthread_mutex_unlock( &wait_lock );
+      }
+    }
+
+    /** check if a wait is satisfied
+     * @param n     number of items
+     * @param room  whether to check the free slots instead of the items
+     */
+    bool Ready( unsigned int n, bool room ) const { return ( room ? Free() : Size() ) >= n; }
+
+    /** block until the ring has n items (or n free slots)
+     * @param n     number of items
+     * @param usec  max wait [usec]
+     * @param room  whether to wait for free slots instead of items
+     * @return true if the wait is satisfied
+     */
+    bool Block( unsigned int n, unsigned long usec, bool room )
+    {
+      if ( Ready( n, room ) ) return true;
+      struct timespec ts;
+      clock_gettime( CLOCK_MONOTONIC, &ts );
+      ts.tv_sec  += usec / 1000000;
+      ts.tv_nsec += ( usec % 1000000 ) * 1000;
+      if ( ts.tv_nsec >= 1000000000 ) {
+        ts.tv_nsec -= 1000000000;
+        ts.tv_sec  += 1;
+      }
+      pthread_mutex_lock( &wait_lock );
+      __atomic_add_fetch( &n_waiting, 1, __ATOMIC_SEQ_CST );
+      bool ret;
+      while ( ! ( ret = Ready( n, room ) ) && ! IsClosed() ) {
+        if ( pthread_cond_timedwait( &wait_cond, &wait_lock, &ts ) == ETIMEDOUT ) {
+          ret = Ready( n, room );
+          break;
+        }
+      }
+      __atomic_sub_fetch( &n_waiting, 1, __ATOMIC_SEQ_CST );
+      pthread_mutex_unlock( &wait_lock );
+      return ret;
+    }
+
+};
+
+
+#endif // RING_BUFFER_H
+
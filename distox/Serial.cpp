@@ -0,0 +1,271 @@
+/** @file Serial.cpp
+ *
+ * @author marco corvi
+ * @date jan 2009
+ *
+ * @brief communication over a serial channel (SPP)
+ * --------------------------------------------------------
+ *  Copyright This sowftare is distributed under GPL-3.0 or later
+ *  See the file COPYING.
+ */
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include "Serial.h"
+
+
+
+#ifdef WIN32
+  #define RESET_ERRNO _set_errno(0)
+#else
+  #define RESET_ERRNO errno = 0 
+#endif
+
+
+
+
+Serial::Serial( const char * dev, bool log )
+  : log_fp( NULL )
+  , traffic( NULL )
+  , link( NULL )
+  , m_timeout( SERIAL_DEFAULT_TIMEOUT )
+{
+  if ( log ) {
+    RESET_ERRNO;
+    log_fp = fopen( SERIAL_LOG_FILE, "a" );
+    if ( log_fp == NULL ) {
+      fprintf(stderr, 
+              "WARNING. Cannot open log file \"%s\": %s\n",
+              SERIAL_LOG_FILE, strerror( errno ) );
+    }
+    // a replay does not capture: it could be reading SERIAL_CAPTURE_FILE
+    if ( strncmp( dev, SERIAL_REPLAY_PREFIX, strlen( SERIAL_REPLAY_PREFIX ) ) != 0
+      && strncmp( dev, SERIAL_REPLAY_TIMED_PREFIX, strlen( SERIAL_REPLAY_TIMED_PREFIX ) ) != 0 ) {
+      traffic = new TrafficLog();
+      if ( ! traffic->Open( SERIAL_CAPTURE_FILE ) ) {
+        delete traffic;
+        traffic = NULL;
+      }
+    }
+  }
+  if ( log_fp ) {
+    fprintf(log_fp, "Serial::cstr connection on device %s\n", dev );
+    fflush( log_fp );
+  }
+  strncpy( m_device, dev, sizeof(m_device) - 1 );
+  m_device[ sizeof(m_device) - 1 ] = 0;
+  link = Transport::Create( m_device );
+  link->SetLog( log_fp, traffic );
+}
+
+Serial::~Serial()
+{
+  Close();
+  delete link;
+  if ( traffic != NULL ) {
+    delete traffic;
+    traffic = NULL;
+  }
+  if ( log_fp != NULL ) {
+    fclose( log_fp );
+    log_fp = NULL;
+  }
+}
+
+bool 
+Serial::Reconnect()
+{
+  if ( log_fp ) {
+    fprintf(log_fp, "Serial::Reconnect() fd %d \n", link->Fd() );
+    fflush( log_fp );
+  }
+  
+  Close();
+  return Open();
+}
+
+bool
+Serial::Open( )
+{
+  if ( log_fp ) {
+    fprintf(log_fp, "Serial::Open() device \"%s\" \n", m_device );
+    fflush( log_fp );
+  }
+  if ( IsOpen() ) {
+    if ( log_fp ) {
+      fprintf(log_fp, "ERROR: Serial::Open() the device is already open\n");
+      fflush( log_fp );
+    }
+    return false;
+  }
+
+  return link->Open();
+}
+
+void 
+Serial::Close()
+{
+  if ( log_fp ) {
+    fprintf(log_fp, "Serial::Close() fd %d \n", link->Fd() );
+    fflush( log_fp );
+  }
+  link->Close();
+}
+  
+unsigned long long
+Serial::Now()
+{
+  #ifdef WIN32
+    return (unsigned long long)GetTickCount64() * 1000;
+  #else
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+  #endif
+}
+
+SerialStatus
+Serial::Write( const unsigned char * buf, size_t n, unsigned long long deadline, size_t * nw )
+{
+  size_t cnt = 0;
+  SerialStatus status = SERIAL_OK;
+  if ( nw ) *nw = 0;
+  if ( ! IsOpen() ) {
+    if ( log_fp ) {
+      fprintf(log_fp, "ERROR: Serial::Write() device not open\n");
+      fflush( log_fp );
+    }
+    return SERIAL_ERROR;
+  }
+  if ( buf == NULL || n == 0 ) {
+    if ( log_fp ) {
+      fprintf(log_fp, "WARNING Serial::Write() empty write request\n");
+      fflush( log_fp );
+    }
+    return SERIAL_OK;
+  }
+  RESET_ERRNO;
+  status = link->Write( buf, n, deadline, &cnt );
+
+  if ( log_fp && status != SERIAL_OK ) {
+    fprintf(log_fp, "%s: Serial::Write() %s after %lu/%lu bytes: %s\n",
+            ( status == SERIAL_TIMEOUT )? "WARNING" : "ERROR",
+            ( status == SERIAL_TIMEOUT )? "timeout" : "error",
+            (unsigned long)cnt, (unsigned long)n, strerror( errno ) );
+    fflush( log_fp );
+  }
+  if ( nw ) *nw = cnt;
+  return status;
+}
+
+SerialStatus
+Serial::Read( unsigned char * buf, size_t n, unsigned long long deadline, size_t * nr )
+{
+  return ReadBytes( buf, n, deadline, nr, false );
+}
+
+SerialStatus
+Serial::ReadSome( unsigned char * buf, size_t n, unsigned long long deadline, size_t * nr )
+{
+  return ReadBytes( buf, n, deadline, nr, true );
+}
+
+SerialStatus
+Serial::ReadBytes( unsigned char * buf, size_t n, unsigned long long deadline, size_t * nr, bool some )
+{
+  size_t cnt = 0;
+  SerialStatus status = SERIAL_OK;
+  if ( nr ) *nr = 0;
+  if ( ! IsOpen() ) {
+    if ( log_fp ) {
+      fprintf(log_fp, "ERROR: Serial::Read() device not open\n");
+      fflush( log_fp );
+    }
+    return SERIAL_ERROR;
+  }
+  if ( buf == NULL || n == 0 ) {
+    if ( log_fp ) {
+      fprintf(log_fp, "WARNING: Serial::Read() empty read request\n");
+      fflush( log_fp );
+    }
+    return SERIAL_OK;
+  }
+  RESET_ERRNO;
+  status = link->Read( buf, n, deadline, &cnt, some );
+
+  if ( log_fp && status != SERIAL_OK && ! ( some && status == SERIAL_TIMEOUT ) ) { // ReadSome polls
+    fprintf(log_fp, "%s: Serial::Read() %s after %lu/%lu bytes: %s\n",
+            ( status == SERIAL_TIMEOUT )? "WARNING" : "ERROR",
+            ( status == SERIAL_TIMEOUT )? "timeout" : "error",
+            (unsigned long)cnt, (unsigned long)n, strerror( errno ) );
+    fflush( log_fp );
+  }
+  if ( nr ) *nr = cnt;
+  return status;
+}
+
+ssize_t
+Serial::Write( const unsigned char * buf, size_t n )
+{
+  size_t nw = 0;
+  if ( Write( buf, n, Deadline( m_timeout ), &nw ) == SERIAL_ERROR && nw == 0 ) {
+    return -1;
+  }
+  return nw;
+}
+
+ssize_t
+Serial::Read( unsigned char * buf, size_t n )
+{
+  size_t nr = 0;
+  switch ( Read( buf, n, Deadline( m_timeout ), &nr ) ) {
+    case SERIAL_OK:      return nr;
+    case SERIAL_TIMEOUT: return nr; // the bytes read before the timeout
+    default: break;
+  }
+  return ( nr > 0 )? (ssize_t)nr : -1;
+}
+
+
+// -----------------------------------------------------
+#ifdef TEST
+
+#ifdef WIN32
+  #define DEFAULT_DEVICE "COM1"
+#else
+  #define DEFAULT_DEVICE "/dev/rfcomm3"
+#endif
+
+int main( int argc, char ** argv )
+{
+  const char * device = DEFAULT_DEVICE;
+
+  if ( argc > 1 ) {
+    device = argv[1];
+  }
+  Serial serial( device, true );
+  printf("Connecting to Disto via device \"%s\" ...\n", device );
+  if ( serial.Open() ) {
+    printf("successfully connected!\n");
+    printf("Enter a character to continue: ");
+    getchar();
+    ssize_t nr = 0;
+    unsigned char buf[8];
+    for ( int k = 0; k<10; ++k ) {
+      nr = serial.Read( buf, 8 );
+      fprintf(stderr, "%d: read returns %ld \n", k, nr );
+    }
+    fprintf(stderr, "closing...\n");
+    serial.Close();
+  } else {
+    printf("failed to connect.\n");
+  }
+  return 0;
+}
+
+#endif
+
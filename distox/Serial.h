@@ -14,42 +14,31 @@
 #include <stdio.h>
 #include <sys/types.h>
 
-#ifdef WIN32
-  #include <windows.h>
-  typedef signed int ssize_t;
-  #define CLOSE CloseHandle
-  #define RW_TYPE DWORD
-#else
-  #include <termios.h>
-  #include <unistd.h>
-  #define INVALID_HANDLE_VALUE (-1)
-  #define CLOSE close
-  #define RW_TYPE ssize_t
-#endif
+#include "TrafficLog.h"
+#include "Transport.h"
+
+/** default timeout of a read/write [usec], as the former VTIME=0xff
+ */
+#define SERIAL_DEFAULT_TIMEOUT 25500000UL
+
+#define SERIAL_LOG_FILE     "distox.log" /* text log of the events */
+#define SERIAL_CAPTURE_FILE "distox.cap" /* binary capture of the traffic */
 
 class Serial
 {
   private:
     char m_device[128];            //!< serial device
     FILE * log_fp;                 //!< log file pointer
-    #ifdef WIN32
-      HANDLE m_fd;
-      DCB m_termios;
-      DCB m_termios_save;
-	  COMMTIMEOUTS m_timeouts;
-	  COMMTIMEOUTS m_timeouts_save;
-    #else
-      int m_fd;                      //!< serial port file descriptor
-      struct termios m_termios;      //!< port termios
-      struct termios m_termios_save; //!< saved termios
-    #endif
-
-
+    TrafficLog * traffic;          //!< traffic capture (when logging)
+    Transport * link;              //!< transport to the device
+    unsigned long m_timeout;       //!< timeout of Read/Write without deadline [usec]
 
   public:
     /** cstr
-     * @param dev  serial device
+     * @param dev  serial device, or a transport address (see Transport.h)
      * @param log  whether to do log or not [default: false=no log]
+     *             the events are logged to SERIAL_LOG_FILE,
+     *             the bytes read/written to SERIAL_CAPTURE_FILE
      */
     Serial( const char * dev, bool log = false );
 
@@ -60,7 +49,14 @@ class Serial
     /** check if the serial line is open 
      * @return true if the line is open
      */
-    bool IsOpen( ) const { return m_fd != INVALID_HANDLE_VALUE; }
+    bool IsOpen( ) const { return link->IsOpen(); }
+
+    #ifndef WIN32
+    /** get the file descriptor of the line, eg, to poll it
+     * @return the file descriptor (-1 if the line is not open or is a replay)
+     */
+    int Fd() const { return link->IsOpen() ? link->Fd() : -1; }
+    #endif
 
     /** open a serial connection in raw mode
      * @return true if successful
@@ -87,10 +83,77 @@ class Serial
     /** read from the serial port
      * @param buf buffer where to put the read data 
      * @param n   size of the buffer, ie, max number of bytes to read
-     * @return number of bytes that have been read
+     * @return number of bytes that have been read before the timeout
+     *         (0 if none), negative on error with no byte read
      */
     ssize_t Read( unsigned char * buf, size_t n );
 
+    /** get the current time of the monotonic clock
+     * @return the time [usec]
+     */
+    static unsigned long long Now();
+
+    /** get the deadline a given time from now
+     * @param usec   time from now [usec]
+     * @return the deadline [usec]
+     */
+    static unsigned long long Deadline( unsigned long usec ) { return Now() + usec; }
+
+    /** set the timeout of Read/Write without deadline
+     * @param usec   timeout [usec]
+     */
+    void SetTimeout( unsigned long usec ) { m_timeout = usec; }
+
+    /** get the timeout of Read/Write without deadline
+     * @return the timeout [usec]
+     */
+    unsigned long Timeout() const { return m_timeout; }
+
+    /** write to the serial port before a deadline
+     * @param buf      buffer with the data to write
+     * @param n        number of bytes to write
+     * @param deadline absolute deadline [usec, see Now()]
+     * @param nw       number of bytes that have been written [output, can be NULL]
+     * @return SERIAL_OK if n bytes have been written, SERIAL_TIMEOUT if the
+     *         deadline expired first, SERIAL_ERROR on error
+     */
+    SerialStatus Write( const unsigned char * buf, size_t n,
+                        unsigned long long deadline, size_t * nw );
+
+    /** read from the serial port before a deadline
+     * @param buf      buffer where to put the read data
+     * @param n        number of bytes to read
+     * @param deadline absolute deadline [usec, see Now()]
+     * @param nr       number of bytes that have been read [output, can be NULL]
+     * @return SERIAL_OK if n bytes have been read, SERIAL_TIMEOUT if the
+     *         deadline expired first, SERIAL_ERROR on error
+     */
+    SerialStatus Read( unsigned char * buf, size_t n,
+                       unsigned long long deadline, size_t * nr );
+
+    /** read the bytes available on the serial port, waiting before a deadline
+     * only if there is none: at most one read() once the bytes have arrived
+     * @param buf      buffer where to put the read data
+     * @param n        size of the buffer, ie, max number of bytes to read
+     * @param deadline absolute deadline [usec, see Now()]
+     * @param nr       number of bytes that have been read [output, can be NULL]
+     * @return SERIAL_OK if some bytes have been read, SERIAL_TIMEOUT if the
+     *         deadline expired first, SERIAL_ERROR on error
+     */
+    SerialStatus ReadSome( unsigned char * buf, size_t n,
+                           unsigned long long deadline, size_t * nr );
+
+  private:
+    /** read from the serial port before a deadline
+     * @param some     whether to return as soon as some bytes have been read
+     * @see Read
+     */
+    SerialStatus ReadBytes( unsigned char * buf, size_t n,
+                            unsigned long long deadline, size_t * nr, bool some );
+
+    Serial( const Serial & );
+    Serial & operator=( const Serial & );
+
 }; // class Serial
 
 
@@ -0,0 +1,200 @@
+/** @file ShotBatch.h
+ *
+ * @author marco corvi
+ * @date oct 2026
+ *
+ * @brief columnar store of decoded shots and batch packet decoder
+ *
+ * A ShotBatch keeps the shots as one array per quantity (structure of
+ * arrays). decodeBatch() fills it from an array of packets in two passes:
+ * the first gathers the integer fields out of the packets, the second
+ * converts whole columns with the DistoX scale factors. There are no
+ * intrinsics, the same code builds for the ARM cross targets. The column
+ * conversions are plain loops over contiguous arrays: gcc vectorizes them
+ * with -ftree-vectorize (VECFLAGS in the Makefiles of the tools that
+ * decode a batch). The gather reads strided bytes and stays scalar.
+ *
+ * The conversions give the same values as the DATA_2_* and *_DEGREES
+ * macros of Protocol.h: the clino and the dip are the signed 16-bit
+ * fields scaled by 90/0x4000.
+ * --------------------------------------------------------
+ *  Copyright This sowftare is distributed under GPL-3.0 or later
+ *  See the file COPYING.
+ */
+#ifndef SHOT_BATCH_H
+#define SHOT_BATCH_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define SHOT_BATCH_SIZE 1024 /* default capacity [shots] */
+
+class ShotBatch
+{
+  public:
+    unsigned int size;       //!< number of shots
+    unsigned int capacity;   //!< size of the arrays
+
+    // raw fields, as in the packets
+    uint32_t * raw_distance; //!< distance [mm, 17 bits]
+    uint16_t * raw_azimuth;  //!< compass
+    uint16_t * raw_clino;    //!< clino
+    uint16_t * raw_roll;     //!< roll (8 bits on the DistoX1)
+
+    // decoded values
+    double * distance;       //!< [m]
+    double * azimuth;        //!< [deg]
+    double * clino;          //!< [deg]
+    double * roll;           //!< [deg]
+    unsigned int * acc;      //!< G intensity (DistoX2, 0 otherwise)
+    unsigned int * mag;      //!< M intensity (DistoX2, 0 otherwise)
+    double * dip;            //!< magnetic dip [deg] (DistoX2, 0 otherwise)
+
+  public:
+    /** cstr
+     * @param cap   capacity [shots]
+     */
+    ShotBatch( unsigned int cap = SHOT_BATCH_SIZE )
+      : size( 0 )
+      , capacity( 0 )
+      , raw_distance( NULL )
+      , raw_azimuth( NULL )
+      , raw_clino( NULL )
+      , raw_roll( NULL )
+      , distance( NULL )
+      , azimuth( NULL )
+      , clino( NULL )
+      , roll( NULL )
+      , acc( NULL )
+      , mag( NULL )
+      , dip( NULL )
+    {
+      Reserve( cap );
+    }
+
+    ~ShotBatch() { Free(); }
+
+    /** make room for a number of shots: the shots in the batch are kept
+     * @param cap   capacity [shots]
+     */
+    void Reserve( unsigned int cap )
+    {
+      if ( cap <= capacity ) return;
+      Grow( raw_distance, cap );
+      Grow( raw_azimuth,  cap );
+      Grow( raw_clino,    cap );
+      Grow( raw_roll,     cap );
+      Grow( distance,     cap );
+      Grow( azimuth,      cap );
+      Grow( clino,        cap );
+      Grow( roll,         cap );
+      Grow( acc,          cap );
+      Grow( mag,          cap );
+      Grow( dip,          cap );
+      capacity = cap;
+    }
+
+    /** empty the batch
+     */
+    void Clear() { size = 0; }
+
+  private:
+    template< typename T > void Grow( T * & a, unsigned int cap )
+    {
+      T * b = new T[ cap ];
+      if ( a != NULL ) memcpy( b, a, size * sizeof(T) );
+      delete[] a;
+      a = b;
+    }
+
+    void Free()
+    {
+      delete[] raw_distance;
+      delete[] raw_azimuth;
+      delete[] raw_clino;
+      delete[] raw_roll;
+      delete[] distance;
+      delete[] azimuth;
+      delete[] clino;
+      delete[] roll;
+      delete[] acc;
+      delete[] mag;
+      delete[] dip;
+    }
+
+    ShotBatch( const ShotBatch & );
+    ShotBatch & operator=( const ShotBatch & );
+};
+
+/** convert the raw columns of a batch, shots [k0, size)
+ * @param batch  shot batch
+ * @param k0     first shot to convert
+ * @param x2     whether the roll is 16-bit (DistoX2)
+ */
+inline void
+decodeColumns( ShotBatch & batch, unsigned int k0, bool x2 )
+{
+  const double roll_scale = x2 ? 180.0 / 0x8000 : 180.0 / 0x0080;
+  const unsigned int n = batch.size;
+  for ( unsigned int k = k0; k < n; ++k ) batch.distance[k] = batch.raw_distance[k] / 1000.0;
+  for ( unsigned int k = k0; k < n; ++k ) batch.azimuth[k]  = batch.raw_azimuth[k] * ( 180.0 / 0x8000 );
+  for ( unsigned int k = k0; k < n; ++k ) batch.clino[k]    = (int16_t)batch.raw_clino[k] * ( 90.0 / 0x4000 );
+  for ( unsigned int k = k0; k < n; ++k ) batch.roll[k]     = batch.raw_roll[k] * roll_scale;
+}
+
+/** decode DistoX2 packet pairs and append the shots to a batch
+ * @param pkts   packets: pkts[2*k] data packet, pkts[2*k+1] vector packet of shot k
+ * @param n      number of shots (packet pairs)
+ * @param batch  shot batch [output, grows if needed]
+ * @note the packets must be paired already (@see Protocol::NextData)
+ */
+inline void
+decodeBatch( const uint8_t (*pkts)[8], unsigned int n, ShotBatch & batch )
+{
+  unsigned int k0 = batch.size;
+  if ( k0 + n > batch.capacity ) batch.Reserve( 2 * ( k0 + n ) );
+  // gather: DATA_2_DISTANCE, DATA_2_COMPASS, DATA_2_CLINO, DATA_2_ROLL_X2, DATA_2_ACC/MAG/DIP
+  for ( unsigned int k = 0; k < n; ++k ) {
+    const uint8_t * b1 = pkts[2*k];
+    const uint8_t * b2 = pkts[2*k+1];
+    unsigned int j = k0 + k;
+    batch.raw_distance[j] = ( (uint32_t)( b1[0] & 0x40 ) << 10 ) | b1[1] | ( (uint32_t)b1[2] << 8 );
+    batch.raw_azimuth[j]  = (uint16_t)( b1[3] | ( b1[4] << 8 ) );
+    batch.raw_clino[j]    = (uint16_t)( b1[5] | ( b1[6] << 8 ) );
+    batch.raw_roll[j]     = (uint16_t)( b2[7] | ( b1[7] << 8 ) );
+    batch.acc[j]          = b2[1] | ( b2[2] << 8 );
+    batch.mag[j]          = b2[3] | ( b2[4] << 8 );
+    batch.dip[j]          = (int16_t)( b2[5] | ( b2[6] << 8 ) ) * ( 90.0 / 0x4000 );
+  }
+  batch.size = k0 + n;
+  decodeColumns( batch, k0, true );
+}
+
+/** decode DistoX1 data packets and append the shots to a batch
+ * @param pkts   data packets
+ * @param n      number of packets
+ * @param batch  shot batch [output, grows if needed]
+ * @note the packets are not checked: the caller passes data packets only
+ */
+inline void
+decodeBatchX1( const uint8_t (*pkts)[8], unsigned int n, ShotBatch & batch )
+{
+  unsigned int k0 = batch.size;
+  if ( k0 + n > batch.capacity ) batch.Reserve( 2 * ( k0 + n ) );
+  // gather: DATA_2_DISTANCE, DATA_2_COMPASS, DATA_2_CLINO, DATA_2_ROLL_X1
+  for ( unsigned int k = 0; k < n; ++k ) {
+    const uint8_t * b = pkts[k];
+    unsigned int j = k0 + k;
+    batch.raw_distance[j] = ( (uint32_t)( b[0] & 0x40 ) << 10 ) | b[1] | ( (uint32_t)b[2] << 8 );
+    batch.raw_azimuth[j]  = (uint16_t)( b[3] | ( b[4] << 8 ) );
+    batch.raw_clino[j]    = (uint16_t)( b[5] | ( b[6] << 8 ) );
+    batch.raw_roll[j]     = b[7];
+    batch.acc[j]          = 0;
+    batch.mag[j]          = 0;
+    batch.dip[j]          = 0.0;
+  }
+  batch.size = k0 + n;
+  decodeColumns( batch, k0, false );
+}
+
+#endif // SHOT_BATCH_H
@@ -0,0 +1,195 @@
+/** @file TrafficLog.cpp
+ *
+ * @author marco corvi
+ * @date oct 2026
+ *
+ * @brief binary capture of the traffic on a serial channel
+ * --------------------------------------------------------
+ *  Copyright This sowftare is distributed under GPL-3.0 or later
+ *  See the file COPYING.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "TrafficLog.h"
+
+#define TRAFFIC_DRAIN_SIZE  4096     /* bytes written to the file at once */
+#define TRAFFIC_DRAIN_SLEEP 2000000  /* drain thread idle sleep [nsec] */
+#define TRAFFIC_SPLIT_WAIT  20000    /* max wait for room for the next record of a split read/write [usec] */
+
+#ifndef WIN32
+static void *
+traffic_drain( void * arg )
+{
+  ((TrafficLog *)arg)->Drain();
+  return NULL;
+}
+#endif
+
+TrafficLog::TrafficLog()
+  : fp( NULL )
+  , n_dropped( 0 )
+  , n_lost( 0 )
+  , stop( 0 )
+{ }
+
+TrafficLog::~TrafficLog()
+{
+  Close();
+}
+
+bool
+TrafficLog::Open( const char * filename )
+{
+  if ( fp != NULL ) return false;
+  fp = fopen( filename, "wb" );
+  if ( fp == NULL ) {
+    fprintf(stderr, "WARNING. Cannot open capture file \"%s\": %s\n",
+            filename, strerror( errno ) );
+    return false;
+  }
+  fwrite( TRAFFIC_MAGIC, 1, TRAFFIC_MAGIC_SIZE, fp );
+  stop = 0;
+  n_dropped = 0;
+  n_lost    = 0;
+  #ifndef WIN32
+    if ( pthread_create( &thread, NULL, traffic_drain, this ) != 0 ) {
+      fprintf(stderr, "WARNING. Cannot start capture thread\n");
+      fclose( fp );
+      fp = NULL;
+      return false;
+    }
+  #endif
+  return true;
+}
+
+void
+TrafficLog::Close()
+{
+  if ( fp == NULL ) return;
+  __atomic_store_n( &stop, 1, __ATOMIC_RELEASE );
+  #ifndef WIN32
+    pthread_join( thread, NULL );
+  #else
+    Drain();
+  #endif
+  if ( n_dropped > 0 ) {
+    fprintf(stderr, "WARNING. Capture dropped %u records (%lu bytes)\n", n_dropped, n_lost );
+  }
+  fclose( fp );
+  fp = NULL;
+}
+
+void
+TrafficLog::Record( unsigned char dir, const unsigned char * buf, size_t n )
+{
+  if ( fp == NULL ) return;
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  TrafficRecord rec;
+  rec.usec  = (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+  rec.dir   = dir;
+  rec.flags = 0;
+  bool first = true;
+  do {
+    size_t len = ( n > TRAFFIC_CHUNK_LEN )? TRAFFIC_CHUNK_LEN : n;
+    rec.len = (uint16_t)len;
+    if ( ! first ) { // a long read/write is larger than the ring: let the drain catch up
+      #ifdef WIN32
+        Drain();
+      #else
+        ring.WaitFree( sizeof(rec) + len, TRAFFIC_SPLIT_WAIT );
+      #endif
+    }
+    first = false;
+    // the producer is the only one that can shrink the free space
+    if ( ring.Free() < sizeof(rec) + len ) {
+      // the rest of the bytes is dropped; only the first drop is reported here
+      if ( n_dropped == 0 ) {
+        fprintf(stderr, "WARNING. Capture ring full: records are dropped\n");
+      }
+      n_dropped += ( n + TRAFFIC_CHUNK_LEN - 1 ) / TRAFFIC_CHUNK_LEN;
+      n_lost    += n;
+      break;
+    }
+    ring.PutMany( (const unsigned char *)&rec, sizeof(rec) );
+    ring.PutMany( buf, len );
+    buf += len;
+    n   -= len;
+  } while ( n > 0 );
+  #ifdef WIN32
+    Drain();
+  #endif
+}
+
+void
+TrafficLog::Drain()
+{
+  unsigned char buf[ TRAFFIC_DRAIN_SIZE ];
+  for ( ; ; ) {
+    unsigned int n = ring.GetMany( buf, TRAFFIC_DRAIN_SIZE );
+    if ( n > 0 ) {
+      fwrite( buf, 1, n, fp );
+      continue;
+    }
+    #ifdef WIN32
+      break;
+    #else
+      if ( __atomic_load_n( &stop, __ATOMIC_ACQUIRE ) ) {
+        // the producer has stopped before Close(): a last pass empties the ring
+        while ( ( n = ring.GetMany( buf, TRAFFIC_DRAIN_SIZE ) ) > 0 ) fwrite( buf, 1, n, fp );
+        break;
+      }
+      fflush( fp );
+      struct timespec ts = { 0, TRAFFIC_DRAIN_SLEEP };
+      nanosleep( &ts, NULL );
+    #endif
+  }
+  fflush( fp );
+}
+
+// ----------------------------------------------------------------
+
+bool
+TrafficReader::Open( const char * filename )
+{
+  char magic[ TRAFFIC_MAGIC_SIZE ];
+  Close();
+  fp = fopen( filename, "rb" );
+  if ( fp == NULL ) {
+    fprintf(stderr, "ERROR. Cannot open capture file \"%s\": %s\n",
+            filename, strerror( errno ) );
+    return false;
+  }
+  if ( fread( magic, 1, TRAFFIC_MAGIC_SIZE, fp ) != TRAFFIC_MAGIC_SIZE
+    || memcmp( magic, TRAFFIC_MAGIC, TRAFFIC_MAGIC_SIZE ) != 0 ) {
+    fprintf(stderr, "ERROR. \"%s\" is not a capture file\n", filename );
+    Close();
+    return false;
+  }
+  return true;
+}
+
+void
+TrafficReader::Close()
+{
+  if ( fp != NULL ) {
+    fclose( fp );
+    fp = NULL;
+  }
+}
+
+bool
+TrafficReader::Next( TrafficRecord & rec, unsigned char * buf )
+{
+  if ( fp == NULL ) return false;
+  if ( fread( &rec, sizeof(rec), 1, fp ) != 1 ) return false;
+  if ( fread( buf, 1, rec.len, fp ) != rec.len ) {
+    fprintf(stderr, "WARNING. Truncated capture record\n");
+    return false;
+  }
+  return true;
+}
+
@@ -0,0 +1,145 @@
+/** @file TrafficLog.h
+ *
+ * @author marco corvi
+ * @date oct 2026
+ *
+ * @brief binary capture of the traffic on a serial channel
+ *
+ * The serial line appends a timestamped record (direction, length, bytes)
+ * to a lock-free ring for each read and write: no formatting is done on
+ * the i/o path. A background thread drains the ring to the capture file.
+ * The capture file is the magic TRAFFIC_MAGIC followed by the records,
+ * each a TrafficRecord header followed by len bytes (host byte order).
+ * A read or a write longer than TRAFFIC_CHUNK_LEN is split in consecutive
+ * records, so that each fits in the ring, with a short wait for the drain
+ * between them. A record that does not fit is dropped and counted, and the
+ * drops are reported on close.
+ * Use tlx_logdump to render a capture file as hex.
+ * --------------------------------------------------------
+ *  Copyright This sowftare is distributed under GPL-3.0 or later
+ *  See the file COPYING.
+ */
+#ifndef TRAFFIC_LOG_H
+#define TRAFFIC_LOG_H
+
+#include <stdio.h>
+#include <stdint.h>
+#ifndef WIN32
+  #include <pthread.h>
+#endif
+
+#include "RingBuffer.h"
+
+#define TRAFFIC_MAGIC      "DXCAP001" /* 8 bytes, not null-terminated in the file */
+#define TRAFFIC_MAGIC_SIZE 8
+#define TRAFFIC_RING_SIZE  65536      /* bytes */
+#define TRAFFIC_MAX_LEN    65535      /* max bytes in a record */
+#define TRAFFIC_CHUNK_LEN  ( TRAFFIC_RING_SIZE / 4 ) /* max bytes in a record written by TrafficLog */
+
+#define TRAFFIC_READ  'R'  /* bytes read from the device */
+#define TRAFFIC_WRITE 'W'  /* bytes written to the device */
+
+/** capture record header
+ */
+struct TrafficRecord
+{
+  uint64_t usec;   //!< monotonic time [usec]
+  uint16_t len;    //!< number of bytes following the header
+  uint8_t  dir;    //!< TRAFFIC_READ or TRAFFIC_WRITE
+  uint8_t  flags;  //!< reserved (0)
+} __attribute__(( packed ));
+
+class TrafficLog
+{
+  private:
+    FILE * fp;                 //!< capture file
+    unsigned int n_dropped;    //!< number of records dropped because the ring was full
+    unsigned long n_lost;      //!< number of bytes in the dropped records
+    int stop;                  //!< request to the drain thread to stop
+    #ifndef WIN32
+      pthread_t thread;        //!< drain thread
+    #endif
+    RingBuffer< unsigned char, TRAFFIC_RING_SIZE > ring;
+
+  public:
+    /** cstr
+     */
+    TrafficLog();
+
+    /** dstr - close the capture file
+     */
+    ~TrafficLog();
+
+    /** open the capture file and start the drain thread
+     * @param filename   capture file (overwritten)
+     * @return true if successful
+     */
+    bool Open( const char * filename );
+
+    /** stop the drain thread, flush the ring and close the capture file
+     */
+    void Close();
+
+    /** check if the capture file is open
+     * @return true if the capture is open
+     */
+    bool IsOpen() const { return fp != NULL; }
+
+    /** get the number of dropped records
+     * @return the number of records that did not fit in the ring
+     */
+    unsigned int Dropped() const { return n_dropped; }
+
+    /** get the number of bytes in the dropped records
+     * @return the number of bytes missing from the capture
+     */
+    unsigned long DroppedBytes() const { return n_lost; }
+
+    /** append a record [single producer: the thread doing the serial i/o]
+     * @param dir   direction, TRAFFIC_READ or TRAFFIC_WRITE
+     * @param buf   bytes
+     * @param n     number of bytes
+     */
+    void Record( unsigned char dir, const unsigned char * buf, size_t n );
+
+    /** drain the ring to the capture file [drain thread]
+     */
+    void Drain();
+};
+
+/** sequential reader of a capture file
+ */
+class TrafficReader
+{
+  private:
+    FILE * fp;   //!< capture file
+
+  public:
+    /** cstr
+     */
+    TrafficReader() : fp( NULL ) { }
+
+    /** dstr
+     */
+    ~TrafficReader() { Close(); }
+
+    /** open a capture file and check the magic
+     * @param filename   capture file
+     * @return true if successful
+     */
+    bool Open( const char * filename );
+
+    /** close the capture file
+     */
+    void Close();
+
+    /** read the next record
+     * @param rec   record header [output]
+     * @param buf   record bytes [output, at least TRAFFIC_MAX_LEN bytes]
+     * @return true if a record has been read, false at the end of the file
+     */
+    bool Next( TrafficRecord & rec, unsigned char * buf );
+};
+
+#endif // TRAFFIC_LOG_H
+
@@ -0,0 +1,177 @@
+/** @file TrafficReplay.cpp
+ *
+ * @author marco corvi
+ * @date oct 2026
+ *
+ * @brief replay of a traffic capture in place of a serial device
+ * --------------------------------------------------------
+ *  Copyright This sowftare is distributed under GPL-3.0 or later
+ *  See the file COPYING.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "TrafficReplay.h"
+
+static const unsigned char replay_dir[2] = { TRAFFIC_READ, TRAFFIC_WRITE };
+
+/** sleep until a given time
+ * @param t   time [usec, see Serial::Now()]
+ */
+static void
+sleep_until( unsigned long long t )
+{
+  unsigned long long now = Serial::Now();
+  if ( t <= now ) return;
+  struct timespec ts;
+  ts.tv_sec  = ( t - now ) / 1000000;
+  ts.tv_nsec = ( ( t - now ) % 1000000 ) * 1000;
+  nanosleep( &ts, NULL );
+}
+
+TrafficReplay::TrafficReplay()
+  : timed( false )
+  , offset( 0 )
+  , n_mismatch( 0 )
+{
+  m_file[0] = 0;
+  for ( int k=0; k<2; ++k ) {
+    data[k] = NULL;
+    pos[k]  = 0;
+    rec[k].len = 0;
+  }
+}
+
+TrafficReplay::TrafficReplay( const char * filename, bool t )
+  : timed( t )
+  , offset( 0 )
+  , n_mismatch( 0 )
+{
+  strncpy( m_file, filename, sizeof(m_file) - 1 );
+  m_file[ sizeof(m_file) - 1 ] = 0;
+  for ( int k=0; k<2; ++k ) {
+    data[k] = NULL;
+    pos[k]  = 0;
+    rec[k].len = 0;
+  }
+}
+
+TrafficReplay::~TrafficReplay()
+{
+  Close();
+}
+
+bool
+TrafficReplay::Open( const char * filename, bool t )
+{
+  Close();
+  for ( int k=0; k<2; ++k ) {
+    if ( ! reader[k].Open( filename ) ) {
+      Close();
+      return false;
+    }
+    data[k] = new unsigned char[ TRAFFIC_MAX_LEN ];
+    pos[k]  = 0;
+    rec[k].len = 0;
+  }
+  timed = t;
+  n_mismatch = 0;
+  // the replay starts at the time of the first record
+  unsigned long long t0 = 0;
+  for ( int k=0; k<2; ++k ) {
+    if ( Fetch( k ) && ( t0 == 0 || rec[k].usec < t0 ) ) t0 = rec[k].usec;
+  }
+  offset = (long long)Serial::Now() - (long long)t0;
+  return true;
+}
+
+void
+TrafficReplay::Close()
+{
+  for ( int k=0; k<2; ++k ) {
+    reader[k].Close();
+    if ( data[k] != NULL ) {
+      delete[] data[k];
+      data[k] = NULL;
+    }
+  }
+  if ( n_mismatch > 0 ) {
+    fprintf(stderr, "WARNING. Replay: %lu written bytes differ from the capture\n", n_mismatch );
+    n_mismatch = 0;
+  }
+}
+
+bool
+TrafficReplay::Fetch( int k )
+{
+  while ( pos[k] >= rec[k].len ) {
+    do {
+      if ( ! reader[k].Next( rec[k], data[k] ) ) {
+        rec[k].len = 0;
+        pos[k] = 0;
+        return false;
+      }
+    } while ( rec[k].dir != replay_dir[k] );
+    pos[k] = 0;
+  }
+  return true;
+}
+
+SerialStatus
+TrafficReplay::Write( const unsigned char * buf, size_t n,
+                      unsigned long long /* deadline */, size_t * nw )
+{
+  size_t cnt = 0;
+  while ( cnt < n ) {
+    if ( ! Fetch( 1 ) ) { // written beyond the end of the capture
+      n_mismatch += n - cnt;
+      break;
+    }
+    if ( pos[1] == 0 ) { // the replies that follow are timed from this write
+      offset = (long long)Serial::Now() - (long long)rec[1].usec;
+    }
+    size_t m = rec[1].len - pos[1];
+    if ( m > n - cnt ) m = n - cnt;
+    for ( size_t j = 0; j < m; ++j ) {
+      if ( buf[cnt+j] != data[1][pos[1]+j] ) ++ n_mismatch;
+    }
+    pos[1] += m;
+    cnt    += m;
+  }
+  if ( nw ) *nw = n;
+  return SERIAL_OK;
+}
+
+SerialStatus
+TrafficReplay::Read( unsigned char * buf, size_t n,
+                     unsigned long long deadline, size_t * nr, bool some )
+{
+  size_t cnt = 0;
+  SerialStatus status = SERIAL_OK;
+  while ( cnt < n ) {
+    if ( ! Fetch( 0 ) ) { // end of the capture: the device is silent
+      if ( timed ) sleep_until( deadline );
+      status = SERIAL_TIMEOUT;
+      break;
+    }
+    if ( timed && pos[0] == 0 ) {
+      unsigned long long at = (unsigned long long)( (long long)rec[0].usec + offset );
+      if ( at > deadline ) {
+        sleep_until( deadline );
+        status = SERIAL_TIMEOUT;
+        break;
+      }
+      sleep_until( at );
+    }
+    size_t m = rec[0].len - pos[0];
+    if ( m > n - cnt ) m = n - cnt;
+    memcpy( buf + cnt, data[0] + pos[0], m );
+    pos[0] += m;
+    cnt    += m;
+    if ( some ) break;
+  }
+  if ( nr ) *nr = cnt;
+  return status;
+}
+
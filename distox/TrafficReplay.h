@@ -0,0 +1,99 @@
+/** @file TrafficReplay.h
+ *
+ * @author marco corvi
+ * @date oct 2026
+ *
+ * @brief replay of a traffic capture in place of a serial device
+ *
+ * The bytes read are served from the 'R' records of a capture file
+ * (see TrafficLog.h), the bytes written are checked against the 'W'
+ * records. At full speed the bytes are available at once; in timed mode
+ * each 'R' record becomes available at its recorded delay after the
+ * latest 'W' record written by the host, so the device latency is kept.
+ * --------------------------------------------------------
+ *  Copyright This sowftare is distributed under GPL-3.0 or later
+ *  See the file COPYING.
+ */
+#ifndef TRAFFIC_REPLAY_H
+#define TRAFFIC_REPLAY_H
+
+#include "Serial.h"
+#include "TrafficLog.h"
+#include "Transport.h"
+
+class TrafficReplay : public Transport
+{
+  private:
+    char m_file[128];           //!< capture file
+    TrafficReader reader[2];    //!< cursors on the R and W records
+    TrafficRecord rec[2];       //!< current R and W record
+    unsigned char * data[2];    //!< bytes of the current records
+    size_t pos[2];              //!< bytes of the current records already consumed
+    bool timed;                 //!< whether to keep the recorded timing
+    long long offset;           //!< replay time minus capture time [usec]
+    unsigned long n_mismatch;   //!< number of written bytes that differ from the capture
+
+  public:
+    /** cstr
+     */
+    TrafficReplay();
+
+    /** cstr, as a transport (see Transport::Create)
+     * @param filename  capture file, opened by Open()
+     * @param t         whether to keep the recorded timing
+     */
+    TrafficReplay( const char * filename, bool t );
+
+    /** dstr
+     */
+    ~TrafficReplay();
+
+    /** open a capture file
+     * @param filename  capture file
+     * @param t         whether to keep the recorded timing
+     * @return true if successful
+     */
+    bool Open( const char * filename, bool t );
+
+    /** open the capture file given to the cstr
+     * @return true if successful
+     */
+    bool Open() { return Open( m_file, timed ); }
+
+    /** close the capture file
+     */
+    void Close();
+
+    /** check if the capture file is open
+     */
+    bool IsOpen() const { return data[0] != NULL; }
+
+    /** get the number of mismatching written bytes
+     * @return the number of written bytes that differ from the capture
+     */
+    unsigned long Mismatch() const { return n_mismatch; }
+
+    /** "write" to the replayed device
+     * @see Serial::Write
+     */
+    SerialStatus Write( const unsigned char * buf, size_t n,
+                        unsigned long long deadline, size_t * nw );
+
+    /** read from the replayed device
+     * @param some   whether to return after the bytes of one record,
+     *               as Serial::ReadSome
+     * @see Serial::Read
+     */
+    SerialStatus Read( unsigned char * buf, size_t n,
+                       unsigned long long deadline, size_t * nr, bool some = false );
+
+  private:
+    /** make sure there is a current record with unconsumed bytes
+     * @param k   0: read, 1: write
+     * @return false at the end of the capture
+     */
+    bool Fetch( int k );
+};
+
+#endif // TRAFFIC_REPLAY_H
+
@@ -0,0 +1,488 @@
+/** @file Transport.cpp
+ *
+ * @author marco corvi
+ * @date oct 2026
+ *
+ * @brief byte transport under the serial channel
+ * --------------------------------------------------------
+ *  Copyright This sowftare is distributed under GPL-3.0 or later
+ *  See the file COPYING.
+ */
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>    // read write close
+#include <time.h>
+#ifndef WIN32
+  #include <poll.h>
+  #include <netdb.h>
+  #include <sys/socket.h>
+  #include <sys/un.h>
+  #include <netinet/in.h>
+  #include <netinet/tcp.h>
+#endif
+
+#include "Transport.h"
+#include "Serial.h"
+#include "TrafficReplay.h"
+
+#ifdef WIN32
+  #define SERIAL_READ_TIMEOUT 200
+  #define SERIAL_READ_TOTAL_TIMEOUT_MULTIPLIER 100
+  #define SERIAL_READ_TOTAL_TIMEOUT_CONSTANT 400
+  #define SERIAL_WRITE_TOTAL_TIMEOUT_MULTIPLIER 100
+  #define SERIAL_WRITE_TOTAL_TIMEOUT_CONSTANT 400
+  #define RESET_ERRNO _set_errno(0)
+#else
+  #define RESET_ERRNO errno = 0
+#endif
+
+/** check the prefix of a device name
+ */
+static bool
+has_prefix( const char * device, const char * prefix )
+{
+  return strncmp( device, prefix, strlen( prefix ) ) == 0;
+}
+
+Transport *
+Transport::Create( const char * device )
+{
+  bool timed = has_prefix( device, SERIAL_REPLAY_TIMED_PREFIX );
+  if ( timed || has_prefix( device, SERIAL_REPLAY_PREFIX ) ) {
+    return new TrafficReplay( strchr( device, ':' ) + 1, timed );
+  }
+  #ifndef WIN32
+    if ( has_prefix( device, SERIAL_UNIX_PREFIX )
+      || has_prefix( device, SERIAL_TCP_PREFIX )
+      || has_prefix( device, SERIAL_FD_PREFIX ) ) {
+      return new SocketTransport( device );
+    }
+  #endif
+  return new TtyTransport( device );
+}
+
+// ----------------------------------------------------------------
+// FdTransport
+
+#ifndef WIN32
+/** wait until the device is ready or the deadline expires
+ * @param fd       file descriptor
+ * @param events   POLLIN or POLLOUT
+ * @param deadline absolute deadline [usec]
+ * @return SERIAL_OK if ready, SERIAL_TIMEOUT, or SERIAL_ERROR on error/hangup
+ */
+static SerialStatus
+serial_wait( int fd, short events, unsigned long long deadline )
+{
+  for ( ; ; ) {
+    unsigned long long now = Serial::Now();
+    if ( now >= deadline ) return SERIAL_TIMEOUT;
+    unsigned long long dt = deadline - now;
+    struct timespec ts;
+    ts.tv_sec  = dt / 1000000;
+    ts.tv_nsec = ( dt % 1000000 ) * 1000;
+    struct pollfd pfd;
+    pfd.fd      = fd;
+    pfd.events  = events;
+    pfd.revents = 0;
+    RESET_ERRNO;
+    int ret = ppoll( &pfd, 1, &ts, NULL );
+    if ( ret < 0 ) {
+      if ( errno == EINTR ) continue;
+      return SERIAL_ERROR;
+    }
+    if ( ret == 0 ) return SERIAL_TIMEOUT;
+    if ( pfd.revents & events ) return SERIAL_OK;
+    return SERIAL_ERROR; // POLLERR POLLHUP POLLNVAL
+  }
+}
+#endif
+
+SerialStatus
+FdTransport::Write( const unsigned char * buf, size_t n, unsigned long long deadline, size_t * nw )
+{
+  size_t cnt = 0;
+  SerialStatus status = SERIAL_OK;
+  while ( cnt < n ) {
+    RESET_ERRNO;
+    #ifdef WIN32
+      DWORD nw0 = 0;
+      BOOL ret = WriteFile( m_fd, buf+cnt, n-cnt, &nw0, 0 );
+      if ( ! ret ) {
+        status = SERIAL_ERROR;
+        break;
+      }
+    #else
+      // a socket whose peer has gone must not raise SIGPIPE
+      ssize_t nw0 = m_socket ? send( m_fd, buf+cnt, n-cnt, MSG_NOSIGNAL )
+                             : write( m_fd, buf+cnt, n-cnt );
+      if ( nw0 < 0 ) {
+        if ( errno == EINTR ) continue;
+        if ( errno != EAGAIN && errno != EWOULDBLOCK ) {
+          status = SERIAL_ERROR;
+          break;
+        }
+        nw0 = 0;
+      }
+    #endif
+    if ( nw0 > 0 ) {
+      if ( traffic ) traffic->Record( TRAFFIC_WRITE, buf+cnt, nw0 );
+      cnt += nw0;
+      continue;
+    }
+    #ifdef WIN32
+      if ( Serial::Now() >= deadline ) status = SERIAL_TIMEOUT;
+    #else
+      status = serial_wait( m_fd, POLLOUT, deadline );
+    #endif
+    if ( status != SERIAL_OK ) break;
+  }
+  if ( nw ) *nw = cnt;
+  return status;
+}
+
+SerialStatus
+FdTransport::Read( unsigned char * buf, size_t n, unsigned long long deadline, size_t * nr, bool some )
+{
+  size_t cnt = 0;
+  SerialStatus status = SERIAL_OK;
+  while ( cnt < n ) {
+    RESET_ERRNO;
+    #ifdef WIN32
+      DWORD nr0 = 0;
+      BOOL ret = ReadFile( m_fd, buf+cnt, n-cnt, &nr0, 0 );
+      if ( ! ret ) {
+        status = SERIAL_ERROR;
+        break;
+      }
+    #else
+      // with VMIN=VTIME=0 a tty returns 0 when no byte is available,
+      // other devices return EAGAIN, and a socket returns 0 on hangup
+      ssize_t nr0 = read( m_fd, buf+cnt, n-cnt );
+      if ( nr0 < 0 ) {
+        if ( errno == EINTR ) continue;
+        if ( errno != EAGAIN && errno != EWOULDBLOCK ) {
+          status = SERIAL_ERROR;
+          break;
+        }
+        nr0 = 0;
+      } else if ( nr0 == 0 && m_socket ) {
+        status = SERIAL_ERROR;
+        break;
+      }
+    #endif
+    if ( nr0 > 0 ) {
+      if ( traffic ) traffic->Record( TRAFFIC_READ, buf+cnt, nr0 );
+      cnt += nr0;
+      if ( some ) break; // the bytes available at once
+      continue;
+    }
+    #ifdef WIN32
+      if ( Serial::Now() >= deadline ) status = SERIAL_TIMEOUT;
+    #else
+      status = serial_wait( m_fd, POLLIN, deadline );
+    #endif
+    if ( status != SERIAL_OK ) break;
+  }
+  if ( nr ) *nr = cnt;
+  return status;
+}
+
+// ----------------------------------------------------------------
+// TtyTransport
+
+TtyTransport::TtyTransport( const char * dev )
+  : FdTransport( false )
+{
+  strncpy( m_device, dev, sizeof(m_device) - 1 );
+  m_device[ sizeof(m_device) - 1 ] = 0;
+}
+
+bool
+TtyTransport::Open( )
+{
+  RESET_ERRNO;
+  #ifdef WIN32
+    m_fd = CreateFileA( m_device,
+                       GENERIC_READ | GENERIC_WRITE,
+                       0, // fdwShareMode
+                       0, // Security attr
+                       OPEN_EXISTING,
+                       FILE_FLAG_NO_BUFFERING, // not FILE_FLAG_OVERLAPPED, // synchronous
+                       0 ); // hTemplateFile
+  #else
+    // non-blocking: reads and writes wait in poll() up to their deadline
+    m_fd = open( m_device,
+                 O_RDWR | O_NONBLOCK ); // | O_NOCTTY ); // need O_NOCTTY ?
+  #endif
+
+  if ( m_fd == INVALID_HANDLE_VALUE ) {
+    if ( log_fp ) {
+      fprintf(log_fp, "ERROR: Serial::Open() failed to open device %s: %s\n",
+              m_device, strerror( errno ) );
+      fflush( log_fp );
+    }
+    return false;
+  }
+
+  RESET_ERRNO;
+  #ifdef WIN32
+    BOOL ret = GetCommState( m_fd, &m_termios_save );
+  #else
+    bool ret = tcgetattr( m_fd, &m_termios_save ) == 0;
+  #endif
+
+  if ( ! ret ) {
+    if ( log_fp ) {
+      fprintf(log_fp,
+              "ERROR: Serial::Open() failed to get term attrs: %s\n",
+              strerror( errno) );
+      fflush( log_fp );
+    }
+    CLOSE( m_fd );
+    m_fd = INVALID_HANDLE_VALUE;
+    return false;
+  }
+
+  m_termios = m_termios_save; // struct copy
+
+  RESET_ERRNO;
+  #ifdef WIN32
+    ret = GetCommTimeouts( m_fd, &m_timeouts_save );
+    if ( ! ret ) {
+      if ( log_fp ) {
+        fprintf(log_fp, "Serial: failed to get term timeouts\n");
+        fflush( log_fp );
+      }
+	  CLOSE( m_fd );
+      m_fd = INVALID_HANDLE_VALUE;
+      return false;
+    }
+    m_timeouts = m_timeouts_save;
+
+    m_timeouts.ReadTotalTimeoutMultiplier = SERIAL_READ_TOTAL_TIMEOUT_MULTIPLIER;
+    m_timeouts.ReadTotalTimeoutConstant   = SERIAL_READ_TOTAL_TIMEOUT_CONSTANT;
+    m_timeouts.WriteTotalTimeoutMultiplier = SERIAL_READ_TOTAL_TIMEOUT_CONSTANT;
+    m_timeouts.WriteTotalTimeoutConstant   = SERIAL_WRITE_TOTAL_TIMEOUT_CONSTANT;
+
+    ret = SetCommTimeouts( m_fd, &m_timeouts );
+    if ( ! ret ) {
+      SetCommTimeouts( m_fd, &m_timeouts_save );
+	  if ( log_fp ) {
+        fprintf(log_fp, "Serial: failed to get term timeouts\n");
+        fflush( log_fp );
+      }
+      CLOSE( m_fd );
+      m_fd = INVALID_HANDLE_VALUE;
+      return false;
+    }
+
+    m_termios.fParity = FALSE; // PARENB
+    m_termios.fBinary = TRUE;  // ~ICANON
+    m_termios.fInX    = FALSE; // IXON
+    m_termios.fNull   = FALSE;
+
+    ret = SetCommState( m_fd, &m_termios );
+  #else
+    m_termios.c_cc[ VMIN ]  = 0;
+    m_termios.c_cc[ VTIME ] = 0;    /* timeouts are handled with poll() */
+    // printf("m_termios.c_cc %d %d \n", m_termios.c_cc[ VMIN ], m_termios.c_cc[ VTIME ] );
+// (0, 0) non-blocking immediate read
+//        may return 0 if no byte is available
+// (N, 0) reader returns when at least N bytes have been read
+//        may block indefinitely
+// (0, T) reader returns
+//      [1, nbytes] before timeout expires
+//      [0] if timeout expires
+// (N, T) readers returns
+//      N if the byte are available/arrive
+//      [1, N-1] if the timeout expires
+//      wait indefinitely if no byte arrives/is available
+    m_termios.c_lflag &= ~( ECHO | ICANON | IEXTEN | ISIG );
+    m_termios.c_iflag &= ~( BRKINT | ICRNL | INPCK | ISTRIP | IXON );
+    m_termios.c_cflag &= ~( CSIZE | PARENB );
+    m_termios.c_cflag |= CS8;
+    m_termios.c_oflag &= ~( OPOST );
+    // ~ECHO disable echoing
+    // ~ICANON disable special char EOL, etc.
+    // ~IEXTEN disable impl. defined input processing
+    // ~ISIG do not generate signal INTR, QUIT, SUSP, or DSUSP
+    // ~BRKINT if IGNBRK is set BREAK is ignored, otherwise is null char
+    // ~ICRNL do not translate CR to NL
+    // ~INPCK do not check parity on input
+    // ~ISTRIP do not strip 8-th bit
+    // ~IXON disable XON/XOFF flow control on input
+    // ~PARENB parity not enabled
+    // ~CSIZE clear char mask
+    // CS8 set 8-bit char mask
+    // ~OPOST disable impl. defined output processing
+
+    ret = tcsetattr( m_fd, TCSANOW, &m_termios ) == 0;
+  #endif
+
+  if ( ! ret ) {
+    if ( log_fp ) {
+      fprintf(log_fp,
+              "ERROR: Serial::Open() failed to set term in raw mode: %s\n",
+              strerror( errno ) );
+      fflush( log_fp );
+    }
+    Close( );
+    return false;
+  } else {
+    if ( log_fp ) {
+      fprintf(log_fp, "Serial::Open() set term in raw mode\n");
+      fflush( log_fp );
+    }
+  }
+  return true;
+}
+
+void
+TtyTransport::Close()
+{
+  if ( m_fd != INVALID_HANDLE_VALUE ) {
+    #ifdef WIN32
+      SetCommState( m_fd, &m_termios_save );
+    #else
+      tcflush( m_fd, TCIOFLUSH );
+      tcsetattr( m_fd, TCSANOW, &m_termios_save );
+    #endif
+    CLOSE( m_fd );
+    m_fd = INVALID_HANDLE_VALUE;
+  }
+}
+
+// ----------------------------------------------------------------
+// SocketTransport
+
+#ifndef WIN32
+SocketTransport::SocketTransport( const char * address )
+  : FdTransport( true )
+  , m_inherited( -1 )
+{
+  strncpy( m_address, address, sizeof(m_address) - 1 );
+  m_address[ sizeof(m_address) - 1 ] = 0;
+  if ( has_prefix( m_address, SERIAL_FD_PREFIX ) ) {
+    m_inherited = atoi( m_address + strlen( SERIAL_FD_PREFIX ) );
+  }
+}
+
+bool
+SocketTransport::Open()
+{
+  int fd = -1;
+  if ( has_prefix( m_address, SERIAL_FD_PREFIX ) ) {
+    fd = m_inherited;
+    m_inherited = -1; // closed with the connection
+  } else if ( has_prefix( m_address, SERIAL_UNIX_PREFIX ) ) {
+    fd = ConnectUnix( m_address + strlen( SERIAL_UNIX_PREFIX ) );
+  } else {
+    fd = ConnectTcp( m_address + strlen( SERIAL_TCP_PREFIX ) );
+  }
+  if ( fd < 0 ) {
+    if ( log_fp ) {
+      fprintf(log_fp, "ERROR: Serial::Open() failed to connect %s: %s\n", m_address, strerror( errno ) );
+      fflush( log_fp );
+    }
+    return false;
+  }
+  // non-blocking: reads and writes wait in poll() up to their deadline
+  int flags = fcntl( fd, F_GETFL );
+  if ( flags < 0 || fcntl( fd, F_SETFL, flags | O_NONBLOCK ) != 0 ) {
+    if ( log_fp ) {
+      fprintf(log_fp, "ERROR: Serial::Open() %s is not a valid descriptor: %s\n", m_address, strerror( errno ) );
+      fflush( log_fp );
+    }
+    close( fd );
+    return false;
+  }
+  m_fd = fd;
+  if ( log_fp ) {
+    fprintf(log_fp, "Serial::Open() connected %s\n", m_address );
+    fflush( log_fp );
+  }
+  return true;
+}
+
+void
+SocketTransport::Close()
+{
+  if ( m_fd != INVALID_HANDLE_VALUE ) {
+    close( m_fd );
+    m_fd = INVALID_HANDLE_VALUE;
+  }
+}
+
+int
+SocketTransport::ConnectUnix( const char * path )
+{
+  struct sockaddr_un sa;
+  if ( strlen( path ) >= sizeof(sa.sun_path) ) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  int fd = socket( AF_UNIX, SOCK_STREAM, 0 );
+  if ( fd < 0 ) return -1;
+  memset( &sa, 0, sizeof(sa) );
+  sa.sun_family = AF_UNIX;
+  strcpy( sa.sun_path, path );
+  if ( connect( fd, (struct sockaddr *)&sa, sizeof(sa) ) != 0 ) {
+    int err = errno;
+    close( fd );
+    errno = err;
+    return -1;
+  }
+  return fd;
+}
+
+int
+SocketTransport::ConnectTcp( const char * address )
+{
+  char host[128];
+  const char * colon = strrchr( address, ':' );
+  if ( colon == NULL || (size_t)( colon - address ) >= sizeof(host) ) {
+    errno = EINVAL;
+    return -1;
+  }
+  memcpy( host, address, colon - address );
+  host[ colon - address ] = 0;
+
+  struct addrinfo hints;
+  struct addrinfo * res = NULL;
+  memset( &hints, 0, sizeof(hints) );
+  hints.ai_family   = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  int ret = getaddrinfo( host, colon + 1, &hints, &res );
+  if ( ret != 0 ) {
+    if ( log_fp ) {
+      fprintf(log_fp, "ERROR: Serial::Open() cannot resolve %s: %s\n", address, gai_strerror( ret ) );
+      fflush( log_fp );
+    }
+    errno = EHOSTUNREACH;
+    return -1;
+  }
+  int fd = -1;
+  for ( struct addrinfo * ai = res; ai != NULL; ai = ai->ai_next ) {
+    fd = socket( ai->ai_family, ai->ai_socktype, ai->ai_protocol );
+    if ( fd < 0 ) continue;
+    if ( connect( fd, ai->ai_addr, ai->ai_addrlen ) == 0 ) break;
+    int err = errno;
+    close( fd );
+    errno = err;
+    fd = -1;
+  }
+  freeaddrinfo( res );
+  if ( fd >= 0 ) {
+    // the packets are a few bytes: send them at once
+    int one = 1;
+    setsockopt( fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one) );
+  }
+  return fd;
+}
+#endif
@@ -0,0 +1,242 @@
+/** @file Transport.h
+ *
+ * @author marco corvi
+ * @date oct 2026
+ *
+ * @brief byte transport under the serial channel
+ *
+ * A Transport moves the bytes between the host and the device; Serial
+ * puts the timeouts, the event log and the traffic capture on top of it,
+ * so the protocol and the memory tools work the same over any of them.
+ * The transport is chosen by the device name:
+ *
+ *    /dev/rfcomm0        tty in raw mode (termios)
+ *    unix:/path          UNIX-domain stream socket
+ *    tcp:host:port       TCP connection
+ *    fd:N                inherited connected descriptor, eg, one end of a socketpair
+ *    replay:capture      replay of a traffic capture (see TrafficReplay.h)
+ *
+ * All the transports have the same semantics: a Read/Write returns
+ * SERIAL_OK once all the bytes have been transferred, SERIAL_TIMEOUT if
+ * the deadline expires first, SERIAL_ERROR on error or when the peer
+ * hangs up; a Read with "some" returns as soon as some bytes are there.
+ * --------------------------------------------------------
+ *  Copyright This sowftare is distributed under GPL-3.0 or later
+ *  See the file COPYING.
+ */
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+#include <stdio.h>
+#include <sys/types.h>
+
+#include "TrafficLog.h"
+
+#ifdef WIN32
+  #include <windows.h>
+  typedef signed int ssize_t;
+  #define CLOSE CloseHandle
+  #define RW_TYPE DWORD
+#else
+  #include <termios.h>
+  #include <unistd.h>
+  #define INVALID_HANDLE_VALUE (-1)
+  #define CLOSE close
+  #define RW_TYPE ssize_t
+#endif
+
+/** device prefixes to replay a capture file instead of opening a device,
+ * eg, "replay:distox.cap": at full speed, "replay-timed:distox.cap":
+ * with the recorded device latency
+ */
+#define SERIAL_REPLAY_PREFIX       "replay:"
+#define SERIAL_REPLAY_TIMED_PREFIX "replay-timed:"
+
+/** device prefixes of the socket transports
+ */
+#define SERIAL_UNIX_PREFIX  "unix:"  /* unix:/path */
+#define SERIAL_TCP_PREFIX   "tcp:"   /* tcp:host:port */
+#define SERIAL_FD_PREFIX    "fd:"    /* fd:N */
+
+/** completion status of a read/write with deadline
+ */
+enum SerialStatus
+{
+  SERIAL_OK = 0,   //!< all the requested bytes have been transferred
+  SERIAL_TIMEOUT,  //!< the deadline expired before the transfer completed
+  SERIAL_ERROR     //!< i/o error, hangup, or device not open
+};
+
+class Transport
+{
+  protected:
+    FILE * log_fp;           //!< event log (not owned, can be NULL)
+    TrafficLog * traffic;    //!< traffic capture (not owned, can be NULL)
+
+  public:
+    /** cstr
+     */
+    Transport()
+      : log_fp( NULL )
+      , traffic( NULL )
+    { }
+
+    /** dstr
+     */
+    virtual ~Transport() { }
+
+    /** make the transport of a device
+     * @param device  device name, with the transport prefix
+     * @return the transport (to be deleted by the caller)
+     */
+    static Transport * Create( const char * device );
+
+    /** set where to log the events and capture the traffic
+     * @param fp  event log
+     * @param t   traffic capture
+     */
+    void SetLog( FILE * fp, TrafficLog * t ) { log_fp = fp; traffic = t; }
+
+    /** open the connection with the device
+     * @return true if successful
+     */
+    virtual bool Open() = 0;
+
+    /** close the connection with the device
+     */
+    virtual void Close() = 0;
+
+    /** check if the connection is open
+     */
+    virtual bool IsOpen() const = 0;
+
+    /** get the file descriptor of the connection, eg, to poll it
+     * @return the file descriptor (-1 if there is none)
+     */
+    virtual int Fd() const { return -1; }
+
+    /** write before a deadline
+     * @param buf      buffer with the data to write
+     * @param n        number of bytes to write
+     * @param deadline absolute deadline [usec, see Serial::Now()]
+     * @param nw       number of bytes that have been written [output, can be NULL]
+     */
+    virtual SerialStatus Write( const unsigned char * buf, size_t n,
+                                unsigned long long deadline, size_t * nw ) = 0;
+
+    /** read before a deadline
+     * @param buf      buffer where to put the read data
+     * @param n        number of bytes to read
+     * @param deadline absolute deadline [usec, see Serial::Now()]
+     * @param nr       number of bytes that have been read [output, can be NULL]
+     * @param some     whether to return as soon as some bytes have been read
+     */
+    virtual SerialStatus Read( unsigned char * buf, size_t n,
+                               unsigned long long deadline, size_t * nr, bool some ) = 0;
+
+  private:
+    Transport( const Transport & );
+    Transport & operator=( const Transport & );
+};
+
+/** transport on a non-blocking descriptor: reads and writes wait in poll()
+ * up to their deadline
+ */
+class FdTransport : public Transport
+{
+  protected:
+    #ifdef WIN32
+      HANDLE m_fd;
+    #else
+      int m_fd;              //!< file descriptor
+    #endif
+    bool m_socket;           //!< whether the descriptor is a socket (read() 0 is a hangup)
+
+  public:
+    FdTransport( bool socket )
+      : m_fd( INVALID_HANDLE_VALUE )
+      , m_socket( socket )
+    { }
+
+    bool IsOpen() const { return m_fd != INVALID_HANDLE_VALUE; }
+
+    #ifndef WIN32
+    int Fd() const { return m_fd; }
+    #endif
+
+    SerialStatus Write( const unsigned char * buf, size_t n,
+                        unsigned long long deadline, size_t * nw );
+
+    SerialStatus Read( unsigned char * buf, size_t n,
+                       unsigned long long deadline, size_t * nr, bool some );
+};
+
+/** serial device (tty) in raw mode
+ */
+class TtyTransport : public FdTransport
+{
+  private:
+    char m_device[128];            //!< serial device
+    #ifdef WIN32
+      DCB m_termios;
+      DCB m_termios_save;
+      COMMTIMEOUTS m_timeouts;
+      COMMTIMEOUTS m_timeouts_save;
+    #else
+      struct termios m_termios;      //!< port termios
+      struct termios m_termios_save; //!< saved termios
+    #endif
+
+  public:
+    /** cstr
+     * @param dev  serial device
+     */
+    TtyTransport( const char * dev );
+
+    ~TtyTransport() { Close(); }
+
+    bool Open();
+
+    void Close();
+};
+
+#ifndef WIN32
+/** stream socket: UNIX-domain, TCP, or an inherited descriptor
+ */
+class SocketTransport : public FdTransport
+{
+  private:
+    char m_address[128];     //!< address, with the prefix
+    int m_inherited;         //!< inherited descriptor, until it is opened (-1: none)
+
+  public:
+    /** cstr
+     * @param address  SERIAL_UNIX_PREFIX, SERIAL_TCP_PREFIX or SERIAL_FD_PREFIX address
+     */
+    SocketTransport( const char * address );
+
+    ~SocketTransport() { Close(); }
+
+    /** connect to the address
+     * @note an inherited descriptor can be opened only once
+     */
+    bool Open();
+
+    void Close();
+
+  private:
+    /** connect a UNIX-domain socket
+     * @param path   socket path
+     * @return the socket, or -1
+     */
+    int ConnectUnix( const char * path );
+
+    /** connect a TCP socket
+     * @param address  host:port
+     * @return the socket, or -1
+     */
+    int ConnectTcp( const char * address );
+};
+#endif
+
+#endif // TRANSPORT_H
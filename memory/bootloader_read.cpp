@@ -21,9 +21,14 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>    // read write close
+#include <sys/mman.h>  // mmap
 
 #include "defaults.h"
 #include "Serial.h"
+#include "FlashPipeline.h"
+
+#define FLASH_PAGES  0x100 // pages in the flash
+#define DUMP_CHUNK   16    // pages per pipelined read, between two checkpoints
 
 
 /** write to memory 4 bytes at a time the eight bytes at given address
@@ -97,6 +102,110 @@ bootloader_read( Serial * serial, unsigned int addr, FILE * fp )
   return true;
 }
 
+/** dump the whole flash, pipelined and resumable
+ * @param serial    serial line (communication channel)
+ * @param dump_file output binary file
+ * @param window    number of page requests in flight
+ * @param fresh     whether to read again the pages already done
+ * @param verbose   whether to report the throughput of each chunk
+ *
+ * @return true if every page has been read
+ *
+ * The output file is memory-mapped and the pages are written in place.
+ * The sidecar file <dump_file>.map has one bit per page that has been
+ * saved: it is updated after the pages are synced to the output file,
+ * and an interrupted dump resumes from the pages that are missing.
+ */
+bool
+bootloader_dump( Serial * serial, const char * dump_file, unsigned int window, bool fresh, bool verbose )
+{
+  size_t size = FLASH_PAGE_SIZE * FLASH_PAGES;
+  unsigned char bitmap[ FLASH_PAGES / 8 ];
+  char map_file[512];
+  snprintf( map_file, sizeof(map_file), "%s.map", dump_file );
+
+  int fd = open( dump_file, O_RDWR | O_CREAT, 0644 );
+  if ( fd < 0 || ftruncate( fd, size ) != 0 ) {
+    fprintf(stderr, "ERROR: cannot open dump file %s: %s\n", dump_file, strerror( errno ) );
+    if ( fd >= 0 ) close( fd );
+    return false;
+  }
+  unsigned char * image = (unsigned char *)mmap( NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+  close( fd );
+  if ( image == MAP_FAILED ) {
+    fprintf(stderr, "ERROR: cannot map dump file %s: %s\n", dump_file, strerror( errno ) );
+    return false;
+  }
+  int mfd = open( map_file, O_RDWR | O_CREAT, 0644 );
+  if ( mfd < 0 ) {
+    fprintf(stderr, "ERROR: cannot open map file %s: %s\n", map_file, strerror( errno ) );
+    munmap( image, size );
+    return false;
+  }
+  memset( bitmap, 0, sizeof(bitmap) );
+  if ( ! fresh && pread( mfd, bitmap, sizeof(bitmap), 0 ) < 0 ) {
+    memset( bitmap, 0, sizeof(bitmap) );
+  }
+
+  unsigned int page[ FLASH_PAGES ];
+  unsigned int n = 0;
+  for ( unsigned int p = 0; p < FLASH_PAGES; ++p ) {
+    if ( ( bitmap[ p/8 ] & ( 1 << (p%8) ) ) == 0 ) page[ n++ ] = p;
+  }
+  if ( n == 0 ) {
+    fprintf(stderr, "dump already complete (-f to read it again)\n");
+    close( mfd );
+    munmap( image, size );
+    return true;
+  } else if ( n < FLASH_PAGES ) {
+    fprintf(stderr, "resume: %u pages already done, %u to read\n", FLASH_PAGES - n, n );
+  }
+
+  FlashPipeline pipeline( serial, window );
+  unsigned char data[ FLASH_PAGE_SIZE * DUMP_CHUNK ];
+  unsigned char ok[ DUMP_CHUNK ];
+  unsigned int cnt = 0;
+  unsigned long long t0 = Serial::Now();
+  for ( unsigned int k0 = 0; k0 < n; k0 += DUMP_CHUNK ) {
+    unsigned int nk = ( n - k0 < DUMP_CHUNK )? n - k0 : DUMP_CHUNK;
+    unsigned long long t1 = Serial::Now();
+    unsigned int nr = pipeline.ReadPages( page + k0, nk, data, ok );
+    unsigned long long dt = Serial::Now() - t1;
+    for ( unsigned int k = 0; k < nk; ++k ) {
+      if ( ! ok[k] ) continue;
+      memcpy( image + FLASH_PAGE_SIZE * page[k0+k], data + FLASH_PAGE_SIZE * k, FLASH_PAGE_SIZE );
+    }
+    // checkpoint: the pages must be on disk before they are marked done
+    msync( image, size, MS_SYNC );
+    for ( unsigned int k = 0; k < nk; ++k ) {
+      if ( ok[k] ) bitmap[ page[k0+k]/8 ] |= 1 << ( page[k0+k]%8 );
+    }
+    if ( pwrite( mfd, bitmap, sizeof(bitmap), 0 ) != (ssize_t)sizeof(bitmap) ) {
+      fprintf(stderr, "ERROR: cannot write map file %s\n", map_file );
+    }
+    cnt += nr;
+    if ( verbose ) {
+      fprintf(stderr, "pages %02x-%02x: %u/%u read, %.1f ms/page, %.0f B/s\n",
+              page[k0], page[k0+nk-1], nr, nk,
+              ( nr > 0 )? dt / 1000.0 / nr : 0.0,
+              ( dt > 0 )? nr * FLASH_PAGE_SIZE * 1.0e6 / dt : 0.0 );
+    } else {
+      fprintf(stderr, "." );
+    }
+    if ( nr < nk ) break; // the link is down: resume later
+  }
+  if ( ! verbose ) fprintf(stderr, "\n" );
+  unsigned long long dt = Serial::Now() - t0;
+  fprintf(stderr, "read %u/%u pages in %.2f s, %.0f B/s, %u requests lost\n",
+          cnt, n, dt / 1.0e6, ( dt > 0 )? cnt * FLASH_PAGE_SIZE * 1.0e6 / dt : 0.0, pipeline.Lost() );
+  if ( cnt < n ) {
+    fprintf(stderr, "dump incomplete: run again to resume\n");
+  }
+  close( mfd );
+  munmap( image, size );
+  return cnt == n;
+}
+
 void usage()
 {
   static bool printed_usage = false;
@@ -106,6 +215,9 @@ void usage()
     fprintf(stderr, "Options:\n");
     fprintf(stderr, "  -d device serial device [%s]\n", DEFAULT_DEVICE );
     fprintf(stderr, "  -D        dump the whole memory (need binary output file)\n");
+    fprintf(stderr, "            an interrupted dump resumes from the pages in file.map\n");
+    fprintf(stderr, "  -f        fresh dump: read again the pages already done\n");
+    fprintf(stderr, "  -w window number of page requests in flight [%d]\n", FLASH_DEFAULT_WINDOW );
     fprintf(stderr, "  -o file   output binary file\n");
     fprintf(stderr, "  -v        verbose\n");
     fprintf(stderr, "  -h        help\n");
@@ -126,6 +238,8 @@ int main( int argc, char ** argv )
 {
   bool verbose = false;
   bool do_dump = false;
+  bool fresh = false;
+  unsigned int window = FLASH_DEFAULT_WINDOW;
   const char * dump_file = NULL;
   const char * device = DEFAULT_DEVICE;
     
@@ -137,6 +251,12 @@ int main( int argc, char ** argv )
     } else if ( strncmp(argv[ac], "-D", 2 ) == 0 ) {
       do_dump = true;
       ++ ac;
+    } else if ( strncmp(argv[ac], "-f", 2 ) == 0 ) {
+      fresh = true;
+      ++ ac;
+    } else if ( strncmp(argv[ac], "-w", 2 ) == 0 ) {
+      window = atoi( argv[++ac] );
+      ++ ac;
     } else if ( strncmp(argv[ac], "-v", 2 ) == 0 ) {
       verbose = true;
       ++ ac;
@@ -178,18 +298,12 @@ int main( int argc, char ** argv )
   if ( dump_file == NULL ) {
     if ( bootloader_read( &serial, address, NULL ) ) {
     }
+  } else if ( do_dump ) {
+    if ( bootloader_dump( &serial, dump_file, window, fresh, verbose ) ) {
+    }
   } else {
     FILE * fp = fopen( dump_file, "w" );
-    if ( do_dump ) {
-      for ( address = 0; address < 0x0100; ++ address ) {
-        if ( verbose ) fprintf(stderr, ".");
-        if ( bootloader_read( &serial, address, fp ) ) {
-        }
-      }
-      if ( verbose ) fprintf(stderr, "\n");
-    } else {
-      if ( bootloader_read( &serial, address, fp ) ) {
-      }
+    if ( bootloader_read( &serial, address, fp ) ) {
     }
     fclose( fp );
   }
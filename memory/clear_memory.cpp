@@ -20,94 +20,39 @@
 
 #include "defaults.h"
 #include "Serial.h"
+#include "DeviceMemoryImage.h"
 
 
-/** write to memory 4 bytes at a time
+/** clear the memory: write ff ff ff ff to the words that are not cleared yet
+ * @param image device memory image
  * @param addr starting address
- * @param end  upper bound of memory to read
+ * @param end  upper bound of memory to clear
+ * @return true if the whole range is clear
+ *
+ * The range is read in one pipelined burst, and only the words that differ
+ * are written, in one pipelined batch.
  */
-void
-write_memory( Serial * serial, unsigned long addr, unsigned long end )
+bool
+write_memory( DeviceMemoryImage & image, unsigned long addr, unsigned long end )
 {
-  unsigned long reply_addr;
-  unsigned char buf[8];
-  unsigned int cnt = 0;
-  int i;
-  ssize_t nr;
   addr = addr - (addr % 8);
   end  = end  - (end % 8);
-  for ( ; addr < end; addr += 4 ) {
-    if ( ( cnt % 2 ) == 0 ) fprintf(stderr, "%04lx: ", addr);
-    buf[0] = 0x38;
-    buf[1] = (unsigned char)( addr & 0xff );
-    buf[2] = (unsigned char)( (addr>>8) & 0xff );
-    nr = serial->Write( buf, 3 ); // read data
-    nr = serial->Read( buf, 8 );
-    if ( nr > 0 ) {
-      if ( buf[0] != 0x38 ) {
-        fprintf(stderr, 
-                "read_memory() wrong reply packet at addr %04lx cnt %d\n", 
-                addr, cnt);
-        break;
-      }
-      reply_addr = ((unsigned long)(buf[2]))<<8 | buf[1];
-      if ( reply_addr != addr ) {
-        fprintf(stderr,
-                "read_memory() wrong reply addr %04lx at addr %04lx cnt %d\n",
-                reply_addr, addr, cnt);
-        break;
-      }
-      for (i=3; i<7; ++i) fprintf(stderr, "%02x ", buf[i] );
-    } else if ( nr < 0 ) {
-      perror("read_memory() error **** ");
-      break;
-    } else {
-      fprintf(stderr, "read_memory() read returns 0 bytes\n");
-      break;
-    }
-
-    /* NOW WRITE ff ff ff ff */
-
-    buf[0] = 0x39;
-    buf[1] = (unsigned char)( addr & 0xff );
-    buf[2] = (unsigned char)( (addr>>8) & 0xff );
-    buf[3] = 0xff;
-    buf[4] = 0xff;
-    buf[5] = 0xff;
-    buf[6] = 0xff;
-    nr = serial->Write( buf, 7 ); // write data
-    nr = serial->Read( buf, 8 );
-    if ( nr > 0 ) {
-      if ( buf[0] != 0x38 ) {
-        fprintf(stderr, 
-                "write() wrong reply packet at addr %04lx cnt %d\n", 
-                addr, cnt);
-        break;
-      }
-      reply_addr = ((unsigned long)(buf[2]))<<8 | buf[1];
-      if ( reply_addr != addr ) {
-        fprintf(stderr,
-                "write() wrong reply addr %04lx at addr %04lx cnt %d\n",
-                reply_addr, addr, cnt);
-        break;
-      }
-      for (i=3; i<7; ++i) fprintf(stderr, "%02x ", buf[i] );
-    } else if ( nr < 0 ) {
-      perror("write_memory() error **** ");
-      break;
-    } else {
-      fprintf(stderr, "write_memory() read returns 0 bytes\n");
-      break;
-    }
-
-    ++cnt;
-    if ( ( cnt % 2 ) == 0 ) fprintf(stderr, "\n");
-  }
+  if ( end <= addr ) return true;
+  unsigned int n = ( end - addr ) / 4;
+  unsigned char * want = new unsigned char[ 4*n ];
+  memset( want, 0xff, 4*n );
+
+  unsigned int nr = image.Read( addr, end );
+  unsigned int nw = image.Update( addr, end, want );
+  unsigned int left = image.Flush( addr, end ); // only the requested range
+  fprintf(stderr, "words %u: read %u, written %u, failed %u\n", n, nr, nw, left );
+  delete[] want;
+  return left == 0;
 }
 
 void usage()
 {
-  fprintf(stderr, "Usage: tlx_clear_memory [-d device] addr [end] \n");
+  fprintf(stderr, "Usage: tlx_clear_memory [-d device] [-C dir] addr [end] \n");
   fprintf(stderr, "writes ff ff ff ff to the memory\n");
   fprintf(stderr, "where\n");
   fprintf(stderr, "  the device is usually %s\n", DEFAULT_DEVICE );
@@ -115,6 +60,8 @@ void usage()
   fprintf(stderr, "          0x8000 - 0x8100 for internal EEPROM\n");
   fprintf(stderr, "          0xC000 - 0xC100 for RAM\n");
   fprintf(stderr, "  4 bytes are read if no end is specified \n");
+  fprintf(stderr, "  -C dir caches the device memory in dir/<device>%s\n", DMI_FILE_EXT );
+  fprintf(stderr, "only the words that are not ff ff ff ff are written\n");
 }
  
  
@@ -130,9 +77,17 @@ int main( int argc, char ** argv )
     return 0;
   }
 
-  if ( strcmp(argv[ac], "-d" ) == 0 ) {
-    device = argv[++ac];
-    ++ac;
+  const char * cache_dir = NULL;
+  while ( ac < argc - 1 && argv[ac][0] == '-' ) {
+    if ( strcmp(argv[ac], "-d" ) == 0 ) {
+      device = argv[++ac];
+      ++ac;
+    } else if ( strcmp(argv[ac], "-C" ) == 0 ) {
+      cache_dir = argv[++ac];
+      ++ac;
+    } else {
+      break;
+    }
   }
   if ( argc <= ac ) {
     usage();
@@ -146,7 +101,7 @@ int main( int argc, char ** argv )
   }
   end = addr + 4;
   
-  if ( ac <= argc ) {
+  if ( ac < argc ) {
     sscanf( argv[ac], "%lx", &end );
   }
   if ( addr < 0x8000 ) {
@@ -167,7 +122,13 @@ int main( int argc, char ** argv )
     return 1;
   }
 
-  write_memory( &serial, addr, end );
+  DeviceMemoryImage image( &serial );
+  image.OpenFor( cache_dir, device );
+  image.SetMaxAge( 0 ); // compare with the current content of the device
+
+  if ( ! write_memory( image, addr, end ) ) {
+    fprintf(stderr, "ERROR: failed to clear the memory\n");
+  }
 
   serial.Close();
   return 0;
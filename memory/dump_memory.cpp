@@ -25,114 +25,85 @@
 
 #include "defaults.h"
 #include "Serial.h"
+#include "MemoryPipeline.h"
+#include "DeviceMemoryImage.h"
+#include "DumpFile.h"
 
 
 /** reads from memory at addr C020
  *
- * @param serial serial line (communication channel)
- * @return true if memory has been changed, false otherwise
+ * @param image device memory image
+ * @return true if successful
  */
 bool
-read_queue( Serial * serial )
+read_queue( DeviceMemoryImage & image )
 {
   unsigned long addr = 0xC020;
-  unsigned long reply_addr;
-  unsigned char buf[8];
-  ssize_t nr;
+  unsigned char buf[4];
+  if ( image.Read( addr, addr+4, buf ) != 1 ) {
+    fprintf(stderr, "ERROR: read_queue() no reply at addr %04lx\n", addr );
+    return false;
+  }
+  uint16_t head = (uint16_t)(buf[0]) | ( ((uint16_t)(buf[1])) << 8 );
+  uint16_t tail = (uint16_t)(buf[2]) | ( ((uint16_t)(buf[3])) << 8 );
+  fprintf(stdout, "Head %04x Tail %04x\n", head, tail );
+  return true;
+}
 
-  {
-    buf[0] = 0x38;
-    buf[1] = (unsigned char)( addr & 0xff );
-    buf[2] = (unsigned char)( (addr>>8) & 0xff );
-    nr = serial->Write( buf, 3 ); // read data
-    nr = serial->Read( buf, 8 );
-    if ( nr > 0 ) {
-      if ( buf[0] != 0x38 ) {
-        fprintf(stderr, 
-                "ERROR: read_queue() wrong reply packet at addr %04lx\n", addr);
-        fprintf(stderr, "  %02x %02x %02x %02x %02x %02x %02x %02x \n",
-           buf[0], buf[1], buf[2], buf[3], buf[4], buf[5], buf[6], buf[7] );
-        return false;
-      }
-      reply_addr = ((unsigned long)(buf[2]))<<8 | buf[1];
-      if ( reply_addr != addr ) {
-        fprintf(stderr,
-                "ERROR: read_queue() wrong reply addr %04lx at addr %04lx\n",
-                reply_addr, addr);
-        return false;
-      }
-      // for (i=3; i<7; ++i) fprintf(stderr, "%02x ", buf[i] );
-      // for (i=0; i<4; ++i) byte[4*k+i] = buf[3+i];
-      uint16_t head = (uint16_t)(buf[3]) | ( ((uint16_t)(buf[4])) << 8 );
-      uint16_t tail = (uint16_t)(buf[5]) | ( ((uint16_t)(buf[6])) << 8 );
-      fprintf(stdout, "Head %04x Tail %04x\n", head, tail );
-    } else if ( nr < 0 ) {
-      fprintf(stderr, "ERROR: read_queue() error\n");
-      return false;
-    } else {
-      fprintf(stderr, "ERROR: read_queue() read returns 0 bytes\n");
-      return false;
-    }
-    addr += 4;
+/** write memory to a binary dump
+ * @param addr     starting address
+ * @param data     memory bytes
+ * @param size     number of bytes
+ * @param filename dump file
+ * @return true if successful
+ */
+bool
+write_dump( unsigned long addr, const unsigned char * data, unsigned long size, const char * filename )
+{
+  struct DumpHeader header;
+  dump_header( &header, DUMP_MODEL_A3, 0, addr, size );
+  if ( dump_write( filename, &header, data ) != 0 ) {
+    fprintf(stderr, "ERROR: cannot write dump file \"%s\"\n", filename );
+    return false;
   }
   return true;
 }
 
-/** reads from memory 4 bytes at a time
+/** reads from memory 4 bytes at a time, with a window of requests in flight
+ * @param image device memory image
  * @param addr starting address
  * @param end  upper bound of memory to read
+ * @param fp   output file (can be NULL)
+ * @param dumpfile binary dump file (can be NULL): the words read up to the first missing one
  */
 void
-read_memory( Serial * serial, unsigned long addr, unsigned long end,
-             FILE * fp )
+read_memory( DeviceMemoryImage & image, unsigned long addr, unsigned long end, FILE * fp, const char * dumpfile )
 {
-  unsigned long reply_addr;
-  unsigned char buf[8];
   unsigned int cnt = 0;
   int i;
-  ssize_t nr;
   addr = addr - (addr % 8);
   end  = end  - (addr % 8);
-  for ( ; addr < end; addr += 4 ) {
+  if ( end <= addr ) return;
+  unsigned int n = ( end - addr + 3 ) / 4;
+  unsigned char * data = new unsigned char[ 4*n ];
+  unsigned char * ok   = new unsigned char[ n ];
+  image.Read( addr, end, data, ok );
+  for ( ; cnt < n; addr += 4 ) {
+    if ( ! ok[cnt] ) {
+      fprintf(stderr, "read_memory() no reply at addr %04lx cnt %d\n", addr, cnt);
+      break;
+    }
     if ( ( cnt % 2 ) == 0 ) {
       if ( fp ) {
         fprintf(fp, "%04lx: ", addr);
       }
       fprintf(stdout, "%04lx: ", addr);
     }
-    buf[0] = 0x38;
-    buf[1] = (unsigned char)( addr & 0xff );
-    buf[2] = (unsigned char)( (addr>>8) & 0xff );
-    nr = serial->Write( buf, 3 );
-    nr = serial->Read( buf, 8 );
-    if ( nr > 0 ) {
-      if ( buf[0] != 0x38 ) {
-        fprintf(stderr, 
-                "read_memory() wrong reply packet at addr %04lx cnt %d\n", 
-                addr, cnt);
-        fprintf(stderr, "  %02x %02x %02x %02x %02x %02x %02x %02x \n",
-           buf[0], buf[1], buf[2], buf[3], buf[4], buf[5], buf[6], buf[7] );
-        break;
-      }
-      reply_addr = ((unsigned long)(buf[2]))<<8 | buf[1];
-      if ( reply_addr != addr ) {
-        fprintf(stderr,
-                "read_memory() wrong reply addr %04lx at addr %04lx cnt %d\n",
-                reply_addr, addr, cnt);
-        break;
-      }
-      for (i=3; i<7; ++i) {
-        if ( fp ) {
-          fprintf(fp, "%02x ", buf[i] );
-        }
-        fprintf(stdout, "%02x ", buf[i] );
+    for (i=0; i<4; ++i) {
+      if ( fp ) {
+        fprintf(fp, "%02x ", data[4*cnt+i] );
       }
-    } else if ( nr < 0 ) {
-      perror("read_memory() error **** ");
-      break;
-    } else {
-      fprintf(stderr, "read_memory() read returns 0 bytes\n");
-      break;
+      fprintf(stdout, "%02x ", data[4*cnt+i] );
     }
     ++cnt;
     if ( ( cnt % 2 ) == 0 ) {
@@ -142,6 +113,14 @@ read_memory( Serial * serial, unsigned long addr, unsigned long end,
       fprintf(stdout, "\n");
     }
   }
+  if ( image.Lost() > 0 ) {
+    fprintf(stderr, "read_memory() lost replies %u\n", image.Lost() );
+  }
+  if ( dumpfile ) {
+    write_dump( addr - 4*cnt, data, 4*cnt, dumpfile );
+  }
+  delete[] data;
+  delete[] ok;
 }
 
 void usage()
@@ -157,9 +136,17 @@ void usage()
   fprintf(stderr, "  4 bytes are read if no end is specified \n");
   fprintf(stderr, "Options:\n");
   fprintf(stderr, "  -o outfile  write output to file as well\n");
+  fprintf(stderr, "  -b file     write a binary dump (%s) as well\n", DUMP_FILE_EXT );
   fprintf(stderr, "  -d device   distox device [default %s]\n", DEFAULT_DEVICE );
+  fprintf(stderr, "              or %s<capture> to replay a capture file\n", SERIAL_REPLAY_PREFIX );
+  fprintf(stderr, "              or %s<path>, %s<host>:<port> for a socket\n", SERIAL_UNIX_PREFIX, SERIAL_TCP_PREFIX );
   fprintf(stderr, "  -q          print DistoX queue bounds and exit\n");
   fprintf(stderr, "  -n          no address bound check\n");
+  fprintf(stderr, "  -w window   number of requests in flight [default %d]\n", PIPELINE_DEFAULT_WINDOW );
+  fprintf(stderr, "  -t msec     reply timeout [default %lu]\n", PIPELINE_DEFAULT_TIMEOUT/1000 );
+  fprintf(stderr, "  -l          log to %s, capture the traffic to %s\n", SERIAL_LOG_FILE, SERIAL_CAPTURE_FILE );
+  fprintf(stderr, "  -C dir      cache the device memory in dir/<device>%s\n", DMI_FILE_EXT );
+  fprintf(stderr, "  -a sec      max age of the cached memory [default %d]\n", DMI_DEFAULT_AGE );
   fprintf(stderr, "  -v          verbose\n");
   fprintf(stderr, "  -h          this help\n");
 }
@@ -170,12 +157,18 @@ int main( int argc, char ** argv )
 {
   const char * device = DEFAULT_DEVICE ;
   char * outfile = NULL;
+  const char * dumpfile = NULL;
   FILE * fp = NULL;
   unsigned long addr = 0x0;
   unsigned long end;
   bool verbose = false;
+  bool log = false;
   bool queue = false;
   bool no_address_limit = false;
+  unsigned int window = PIPELINE_DEFAULT_WINDOW;
+  unsigned long timeout = PIPELINE_DEFAULT_TIMEOUT; // usec
+  const char * cache_dir = NULL;
+  unsigned long max_age = DMI_DEFAULT_AGE;
 
   int ac = 1;
 
@@ -187,6 +180,9 @@ int main( int argc, char ** argv )
       case 'o':
         outfile = argv[++ac];
         break;
+      case 'b':
+        dumpfile = argv[++ac];
+        break;
       case 'h':
         usage();
         break;
@@ -196,9 +192,24 @@ int main( int argc, char ** argv )
       case 'q':
         queue = true;
         break;
+      case 'l':
+        log = true;
+        break;
       case 'v':
         verbose = true;
         break;
+      case 'w':
+        window = atoi( argv[++ac] );
+        break;
+      case 't':
+        timeout = 1000UL * atoi( argv[++ac] );
+        break;
+      case 'C':
+        cache_dir = argv[++ac];
+        break;
+      case 'a':
+        max_age = atol( argv[++ac] );
+        break;
     }      
     ++ac;
   }
@@ -213,7 +224,8 @@ int main( int argc, char ** argv )
     if ( outfile ) fprintf( stderr, "  output file: %s\n", outfile );
   }
 
-  Serial serial( device );
+  Serial serial( device, log );
+  serial.SetTimeout( timeout );
   if ( ! serial.Open( ) ) {
     fprintf(stderr, "Error. Failed to open device %s\n", device );
     return 1;
@@ -221,8 +233,13 @@ int main( int argc, char ** argv )
     fprintf(stderr, "... connected to the DistoX\n");
   }
 
+  DeviceMemoryImage image( &serial, window );
+  image.SetTimeout( timeout );
+  image.SetMaxAge( max_age );
+  image.OpenFor( cache_dir, device );
+
   if ( queue ) {
-    if ( read_queue( &serial ) ) {
+    if ( read_queue( image ) ) {
     }
     serial.Close();
     return 0;
@@ -248,7 +265,7 @@ int main( int argc, char ** argv )
   }
   end = addr + 4;
   
-  if ( ac <= argc ) {
+  if ( ac < argc ) {
     sscanf( argv[ac], "%lx", &end );
   }
   if ( ! no_address_limit ) {
@@ -267,7 +284,10 @@ int main( int argc, char ** argv )
       device, addr, end );
   }
 
-  read_memory( &serial, addr, end, fp );
+  read_memory( image, addr, end, fp, dumpfile );
+  if ( verbose ) {
+    fprintf(stderr, "cache: %u words cached, %u read\n", image.Hits(), image.Misses() );
+  }
   if ( fp ) fclose( fp );
   serial.Close();
 
@@ -27,91 +27,117 @@
 
 #include "defaults.h"
 #include "Serial.h"
+#include "MemoryPipeline.h"
+#include "MemoryLayout.h"
+#include "DumpFile.h"
 
-#define DATA_PER_BLOCK 56
-#define BYTE_PER_DATA  18
+#define FIRMWARE_ADDRESS_X310 0xe000
 
-unsigned long index2addr( unsigned int index )
+/** write the memory that has been read to a binary dump
+ * @param addr     word addresses (n), followed by the firmware address
+ * @param data     word contents (n+1)
+ * @param ok       word flags (n+1)
+ * @param n        number of words
+ * @param filename dump file
+ * @return true if successful
+ * @note the unused tails of the blocks are filled with ff
+ */
+bool
+write_dump( const unsigned long * addr, const unsigned char * data, const unsigned char * ok,
+            unsigned int n, const char * filename )
 {
-  unsigned int addr = 0;
-  while ( index >= DATA_PER_BLOCK ) {
-    index -= DATA_PER_BLOCK;
-    addr += 0x400;
+  for ( unsigned int w = 0; w < n; ++w ) {
+    if ( ! ok[w] ) {
+      fprintf(stderr, "ERROR: memory not read at addr %04lx: no dump written\n", addr[w] );
+      return false;
+    }
   }
-  addr += BYTE_PER_DATA * index;
-  return addr;
-}
-
-unsigned int addr2index( unsigned long addr )
-{
-  unsigned int index = 0;
-  addr = addr - ( addr % 8 );
-  while ( addr >= 0x400 ) {
-    addr -= 0x400;
-    index += DATA_PER_BLOCK;
+  unsigned long start = addr[0];
+  unsigned long size  = addr[n-1] + 4 - start;
+  unsigned char * mem = new unsigned char[ size ];
+  memset( mem, 0xff, size );
+  for ( unsigned int w = 0; w < n; ++w ) memcpy( mem + addr[w] - start, data + 4*w, 4 );
+  unsigned int firmware = ok[n] ? ( data[4*n] | ( data[4*n+1] << 8 ) ) : 0;
+  struct DumpHeader header;
+  dump_header( &header, DUMP_MODEL_X310, firmware, start, size );
+  bool ret = ( dump_write( filename, &header, mem ) == 0 );
+  if ( ! ret ) {
+    fprintf(stderr, "ERROR: cannot write dump file \"%s\"\n", filename );
   }
-  index += (int)(addr/BYTE_PER_DATA);
-  return index;
+  delete[] mem;
+  return ret;
 }
 
-
-/** reads from memory 4 bytes at a time
- * @param addr starting address
- * @param end  upper bound of memory to read
+/** reads the records of a range of indices with a window of requests in
+ *  flight over the whole range: each 1 KiB block is read as one contiguous
+ *  span of words, instead of one (overlapping) fragment per record
+ * @param serial serial line (communication channel)
+ * @param first  first record index
+ * @param last   last record index (excluded)
+ * @param fp     output file (can be NULL)
+ * @param window number of outstanding requests
+ * @param dumpfile binary dump file (can be NULL)
  */
 void
-read_memory( Serial * serial, unsigned long addr, unsigned long end,
-             FILE * fp )
+read_memory( Serial * serial, int first, int last, FILE * fp, unsigned int window, const char * dumpfile )
 {
-  unsigned long reply_addr;
-  unsigned char buf[8];
   int i;
-  ssize_t nr;
-  // addr = addr - (addr % 8);
-  // end  = end  - (addr % 8);
-  if ( fp ) {
-    fprintf(fp, "%04lx [%4ld]: ", addr, addr);
+  if ( last <= first ) return;
+  MemorySpan span;
+  unsigned int n = 0;
+  MemorySpanIterator it( first, last, true );
+  while ( it.Next( span ) ) n += span.Words();
+
+  unsigned long * addr = new unsigned long[ n+1 ];
+  unsigned char * data = new unsigned char[ 4*(n+1) ];
+  unsigned char * ok   = new unsigned char[ n+1 ];
+  unsigned int w = 0;
+  MemorySpanIterator it1( first, last, true );
+  while ( it1.Next( span ) ) {
+    for ( unsigned long a = span.addr; a < span.end; a += 4 ) addr[w++] = a;
   }
-  fprintf(stderr, "%04lx [%4ld]: ", addr, addr);
-  for ( ; addr < end; addr += 4 ) {
-    buf[0] = 0x38;
-    buf[1] = (unsigned char)( addr & 0xff );
-    buf[2] = (unsigned char)( (addr>>8) & 0xff );
-    nr = serial->Write( buf, 3 );
-    nr = serial->Read( buf, 8 );
-    if ( nr > 0 ) {
-      if ( buf[0] != 0x38 ) {
-        fprintf(stderr, 
-                "read_memory() wrong reply packet at addr %04lx\n", addr);
-        fprintf(stderr, "  %02x %02x %02x %02x %02x %02x %02x %02x \n",
-           buf[0], buf[1], buf[2], buf[3], buf[4], buf[5], buf[6], buf[7] );
-        break;
-      }
-      reply_addr = ((unsigned long)(buf[2]))<<8 | buf[1];
-      if ( reply_addr != addr ) {
-        fprintf(stderr,
-                "read_memory() wrong reply addr %04lx at addr %04lx\n",
-                reply_addr, addr);
-        break;
+  addr[n] = FIRMWARE_ADDRESS_X310; // for the dump header
+  MemoryPipeline pipeline( serial, window );
+  pipeline.SetTimeout( serial->Timeout() );
+  pipeline.ReadWords( addr, ( dumpfile != NULL )? n+1 : n, data, ok );
+
+  w = 0; // first word of the span
+  MemorySpanIterator it2( first, last, true );
+  while ( it2.Next( span ) ) {
+    for ( unsigned int k = span.first; k < span.last; ++k ) {
+      unsigned long off = span.Offset( k, true );
+      unsigned long a   = span.addr + off;
+      if ( fp ) {
+        fprintf(fp, "%04lx [%4ld]: ", a, a);
       }
-      for (i=3; i<7; ++i) {
+      fprintf(stderr, "%04lx [%4ld]: ", a, a);
+      for ( i=0; i<MEMORY_RECORD_SIZE_X310; ++i) {
+        if ( ! ok[ w + (off+i)/4 ] ) {
+          fprintf(stderr, "read_memory() no reply at addr %04lx", ( a + i ) & ~3UL );
+          break;
+        }
         if ( fp ) {
-          fprintf(fp, "%02x ", buf[i] );
+          fprintf(fp, "%02x ", data[4*w+off+i] );
         }
-        fprintf(stderr, "%02x ", buf[i] );
+        fprintf(stderr, "%02x ", data[4*w+off+i] );
       }
-    } else if ( nr < 0 ) {
-      perror("read_memory() error **** ");
-      break;
-    } else {
-      fprintf(stderr, "read_memory() read returns 0 bytes\n");
-      break;
+      if ( fp ) {
+        fprintf(fp, "\n");
+      } 
+      fprintf(stderr, "\n");
     }
+    w += span.Words();
+  }
+  if ( pipeline.Lost() > 0 ) {
+    fprintf(stderr, "read_memory() requests %u lost replies %u\n",
+            pipeline.Sent(), pipeline.Lost() );
   }
-  if ( fp ) {
-    fprintf(fp, "\n");
-  } 
-  fprintf(stderr, "\n");
+  if ( dumpfile ) {
+    write_dump( addr, data, ok, n, dumpfile );
+  }
+  delete[] addr;
+  delete[] data;
+  delete[] ok;
 }
 
 /**
@@ -130,9 +156,15 @@ void usage()
   fprintf(stderr, "  4 bytes are read if no end is specified \n");
   fprintf(stderr, "Options:\n");
   fprintf(stderr, "  -o outfile  write output to file as well\n");
+  fprintf(stderr, "  -b file     write a binary dump (%s) as well\n", DUMP_FILE_EXT );
   fprintf(stderr, "  -d device   distox device [default %s]\n", DEFAULT_DEVICE );
+  fprintf(stderr, "              or %s<capture> to replay a capture file\n", SERIAL_REPLAY_PREFIX );
+  fprintf(stderr, "              or %s<path>, %s<host>:<port> for a socket\n", SERIAL_UNIX_PREFIX, SERIAL_TCP_PREFIX );
   // fprintf(stderr, "  -q          print DistoX queue bounds and exit\n");
   // fprintf(stderr, "  -n          no address bound check\n");
+  fprintf(stderr, "  -w window   number of requests in flight [default %d]\n", PIPELINE_DEFAULT_WINDOW );
+  fprintf(stderr, "  -t msec     reply timeout [default %lu]\n", PIPELINE_DEFAULT_TIMEOUT/1000 );
+  fprintf(stderr, "  -l          log to %s, capture the traffic to %s\n", SERIAL_LOG_FILE, SERIAL_CAPTURE_FILE );
   fprintf(stderr, "  -v          verbose\n");
   fprintf(stderr, "  -h          this help\n");
 }
@@ -143,12 +175,16 @@ int main( int argc, char ** argv )
 {
   const char * device = DEFAULT_DEVICE ;
   char * outfile = NULL;
+  const char * dumpfile = NULL;
   FILE * fp = NULL;
   int first; // start index
   int last;  // end index
   bool verbose = false;
+  bool log = false;
   // bool queue = false;
   // bool no_address_limit = false;
+  unsigned int window = PIPELINE_DEFAULT_WINDOW;
+  unsigned long timeout = PIPELINE_DEFAULT_TIMEOUT; // usec
 
   int ac = 1;
 
@@ -160,6 +196,9 @@ int main( int argc, char ** argv )
       case 'o':
         outfile = argv[++ac];
         break;
+      case 'b':
+        dumpfile = argv[++ac];
+        break;
       case 'h':
         usage();
         break;
@@ -169,9 +208,18 @@ int main( int argc, char ** argv )
       // case 'q':
       //   queue = true;
       //   break;
+      case 'l':
+        log = true;
+        break;
       case 'v':
         verbose = true;
         break;
+      case 'w':
+        window = atoi( argv[++ac] );
+        break;
+      case 't':
+        timeout = 1000UL * atoi( argv[++ac] );
+        break;
     }      
     ++ac;
   }
@@ -186,7 +234,8 @@ int main( int argc, char ** argv )
     if ( outfile ) fprintf( stderr, "  output file: %s\n", outfile );
   }
 
-  Serial serial( device );
+  Serial serial( device, log );
+  serial.SetTimeout( timeout );
   if ( ! serial.Open( ) ) {
     fprintf(stderr, "Error. Failed to open device %s\n", device );
     return 1;
@@ -214,7 +263,7 @@ int main( int argc, char ** argv )
   // if ( first >= 448 ) first = 448-1;
   last = first + 1;
   
-  if ( ac <= argc ) {
+  if ( ac < argc ) {
     sscanf( argv[ac], "%d", &last );
     if ( last < first ) last = first + 1;
   }
@@ -222,11 +271,7 @@ int main( int argc, char ** argv )
     fprintf(stderr, "Device %s range %d - %d \n", device, first, last );
   }
 
-  for ( int k=first; k < last; ++k ) {
-    unsigned long addr = index2addr( k );
-    unsigned long end  = addr + BYTE_PER_DATA;
-    read_memory( &serial, addr, end, fp );
-  }
+  read_memory( &serial, first, last, fp, window, dumpfile );
   if ( fp ) fclose( fp );
   serial.Close();
 
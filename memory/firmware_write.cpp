@@ -24,8 +24,10 @@
 
 #include "defaults.h"
 #include "Serial.h"
+#include "FlashPipeline.h"
 
 #define DEFAULT_RFCOMM "/dev/rfcomm3"
+#define FIRST_CODE_PAGE 0x08 // pages below are the bootloader
 
 /** write to memory 4 bytes at a time the eight bytes at given address
  * @param serial serial line (communication channel)
@@ -95,6 +97,87 @@ firmware_write( Serial * serial, FILE * fp, unsigned int end_addr, bool dry_run
   return true;
 }
 
+/** write only the firmware pages that differ from those on the device
+ * @param serial serial line (communication channel)
+ * @param fp     firmware file pointer
+ * @param end_addr end-address (already divided by 256)
+ * @param dry_run  only report the pages that would be written
+ *
+ * @return true if the device has the firmware of the file
+ *
+ * The code pages are read with pipelined 0x3a requests and compared with
+ * the file; the changed pages are written and then read back in one burst.
+ */
+bool
+firmware_write_diff( Serial * serial, FILE * fp, unsigned int end_addr, bool dry_run )
+{
+  if ( fp == NULL ) {
+    fprintf(stderr, "firmware_write no input file\n");
+    return false;
+  }
+  if ( end_addr <= FIRST_CODE_PAGE ) return true;
+  unsigned int n = end_addr - FIRST_CODE_PAGE;
+  unsigned char * image   = new unsigned char[ FLASH_PAGE_SIZE * end_addr ];
+  unsigned char * current = new unsigned char[ FLASH_PAGE_SIZE * n ];
+  unsigned char * ok      = new unsigned char[ n ];
+  unsigned int  * page    = new unsigned int[ n ];
+  unsigned int  n_diff = 0;   // number of pages that differ
+  bool ret = false;
+
+  memset( image, 0, FLASH_PAGE_SIZE * end_addr );
+  if ( fread( image, 1, FLASH_PAGE_SIZE * end_addr, fp ) == 0 ) {
+    fprintf(stderr, "ERROR: cannot read the firmware file\n");
+    goto done;
+  }
+  for ( unsigned int k=0; k<n; ++k ) page[k] = FIRST_CODE_PAGE + k;
+
+  {
+    FlashPipeline pipeline( serial );
+    unsigned long long t0 = Serial::Now();
+    pipeline.ReadPages( page, n, current, ok );
+    // keep in page[] only the pages to write
+    for ( unsigned int k=0; k<n; ++k ) {
+      const unsigned char * want = image + FLASH_PAGE_SIZE * page[k];
+      if ( ok[k] && memcmp( current + FLASH_PAGE_SIZE * k, want, FLASH_PAGE_SIZE ) == 0 ) continue;
+      page[ n_diff ++ ] = page[k];
+    }
+    fprintf(stderr, "read %u pages in %.2f s: %u to write\n", n, (Serial::Now() - t0)/1.0e6, n_diff );
+    if ( dry_run ) {
+      for ( unsigned int k=0; k<n_diff; ++k ) fprintf(stderr, "0x%02x\n", page[k] );
+      ret = true;
+      goto done;
+    }
+
+    for ( unsigned int k=0; k<n_diff; ++k ) {
+      if ( ! pipeline.WritePage( page[k], image + FLASH_PAGE_SIZE * page[k] ) ) goto done;
+      fprintf(stderr, "." );
+    }
+    if ( n_diff > 0 ) fprintf(stderr, "\n" );
+
+    // verify the written pages
+    if ( pipeline.ReadPages( page, n_diff, current, ok ) != n_diff ) {
+      fprintf(stderr, "ERROR: cannot read back the written pages\n");
+      goto done;
+    }
+    ret = true;
+    for ( unsigned int k=0; k<n_diff; ++k ) {
+      if ( memcmp( current + FLASH_PAGE_SIZE * k, image + FLASH_PAGE_SIZE * page[k], FLASH_PAGE_SIZE ) != 0 ) {
+        fprintf(stderr, "ERROR: verify failed at page 0x%02x\n", page[k] );
+        ret = false;
+      }
+    }
+    fprintf(stderr, "wrote %u pages in %.2f s (%u requests lost)\n",
+            n_diff, (Serial::Now() - t0)/1.0e6, pipeline.Lost() );
+  }
+
+done:
+  delete[] image;
+  delete[] current;
+  delete[] ok;
+  delete[] page;
+  return ret;
+}
+
 void usage()
 {
   static bool printed_usage = false;
@@ -103,6 +186,7 @@ void usage()
     fprintf(stderr, "Options:\n");
     fprintf(stderr, "  -d device serial device [%s]\n", DEFAULT_RFCOMM );
     fprintf(stderr, "  -n        dry_run\n");
+    fprintf(stderr, "  -i        incremental: write only the pages that differ, and verify them\n");
     // fprintf(stderr, "  -v        verbose\n");
     fprintf(stderr, "  -h        help\n");
     fprintf(stderr, "Example: firmware_write -d /dev/rfcomm3 firmware.bin\n");
@@ -122,6 +206,7 @@ int main( int argc, char ** argv )
 {
   // bool verbose = false;
   bool dry_run = false;
+  bool incremental = false;
   const char * in_file = NULL;
   const char * device = DEFAULT_RFCOMM;
     
@@ -133,6 +218,9 @@ int main( int argc, char ** argv )
     } else if ( strncmp(argv[ac], "-n", 2 ) == 0 ) {
       dry_run = true;
       ++ ac;
+    } else if ( strncmp(argv[ac], "-i", 2 ) == 0 ) {
+      incremental = true;
+      ++ ac;
     // } else if ( strncmp(argv[ac], "-v", 2 ) == 0 ) {
     //   verbose = true;
     //   ++ ac;
@@ -165,7 +253,9 @@ int main( int argc, char ** argv )
   }
 
   FILE * fp = fopen( in_file, "r" );
-  if ( firmware_write( &serial, fp, end_addr, dry_run )  ) {
+  bool ok = incremental ? firmware_write_diff( &serial, fp, end_addr, dry_run )
+                        : firmware_write( &serial, fp, end_addr, dry_run );
+  if ( ok ) {
     fprintf(stderr, "firmware write success\n" );
   } else {
     fprintf(stderr, "firmware write fail\n" );
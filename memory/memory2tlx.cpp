@@ -15,6 +15,8 @@
 #include <string.h>
 
 #include "../distox/Protocol.h"
+#include "../distox/DumpFile.h"
+#include "../distox/ShotBatch.h"
 
 void 
 computeAverage( double * d0, double * b0, double * c0, double * r0,
@@ -90,6 +92,22 @@ int hex( char ch )
   return 0;
 }
 
+/** write a decoded data packet
+ * @param out   output file
+ * @param batch decoded packets
+ * @param k     index of the packet in the batch
+ * @param line  memory dump line of the packet
+ */
+void
+convert( FILE * out, const ShotBatch & batch, unsigned int k, const char * line )
+{
+  fprintf(out, "0x%05x 0x%04x 0x%04x 0x%02x ",
+            batch.raw_distance[k], batch.raw_azimuth[k], batch.raw_clino[k], batch.raw_roll[k] );
+  fprintf(out, "%6.2f %6.2f %6.2f %6.2f ",
+            batch.distance[k], batch.azimuth[k], batch.clino[k], batch.roll[k] );
+  fprintf(out, "%s", line );
+}
+
 int main( int argc, char ** argv ) 
 {
   // bool forward = true; 
@@ -114,7 +132,8 @@ int main( int argc, char ** argv )
   }
   if ( argc < 2 ) {
     fprintf(stderr, "Usage: data2tlx <input_file> [<output_file>]\n");
-    fprintf(stderr, "where the input_file is the output of dump_data.\n");
+    fprintf(stderr, "where the input_file is the output of dump_data,\n");
+    fprintf(stderr, "or a binary memory dump (%s).\n", DUMP_FILE_EXT );
     fprintf(stderr, "If the output_file is not specified, output is \n");
     fprintf(stderr, "written to stdout.\n");
     fprintf(stderr, "Options:\n");
@@ -123,8 +142,10 @@ int main( int argc, char ** argv )
     return 1;
   }
   FILE * out = stdout;
-  FILE * in = fopen( argv[1], "r" );
-  if ( in == NULL ) {
+  struct DumpMap dump;
+  int dump_ret = dump_map( argv[1], &dump );
+  FILE * in = ( dump_ret == 1 )? fopen( argv[1], "r" ) : NULL;
+  if ( dump_ret < 0 || ( dump_ret == 1 && in == NULL ) ) {
     fprintf(stderr, "Error: cannot open input file \"%s\"\n", argv[1] );
     return 1;
   }
@@ -141,6 +162,31 @@ int main( int argc, char ** argv )
   }
 
   char line[128];
+  if ( dump_ret == 0 ) { // binary dump: the packets are decoded at once
+    unsigned int n = dump_packets( &dump );
+    const uint8_t (*pkts)[8] = NULL;
+    uint8_t (*copy)[8] = NULL;
+    if ( dump.header.model == DUMP_MODEL_X310 ) { // the records are not contiguous
+      copy = new uint8_t[ n ][8];
+      for ( unsigned int k=0; k<n; ++k ) memcpy( copy[k], dump_packet( &dump, k, NULL ), 8 );
+      pkts = copy;
+    } else if ( n > 0 ) { // A3 packets are read in place
+      pkts = (const uint8_t (*)[8])dump_packet( &dump, 0, NULL );
+    }
+    ShotBatch batch( n );
+    decodeBatchX1( pkts, n, batch );
+    for ( unsigned int k=0; k<n; ++k ) {
+      unsigned long a;
+      const unsigned char * buf = dump_packet( &dump, k, &a );
+      sprintf( line, "%04lx: %02x %02x %02x %02x %02x %02x %02x %02x \n",
+               a, buf[0], buf[1], buf[2], buf[3], buf[4], buf[5], buf[6], buf[7] );
+      convert( out, batch, k, line );
+    }
+    delete[] copy;
+    dump_unmap( &dump );
+    if ( out != stdout ) fclose( out );
+    return 0;
+  }
 /*
   double d0[10], b0[10], c0[10], r0[10];
   double dave, bave, cave, rave;
@@ -150,28 +196,20 @@ int main( int argc, char ** argv )
 */
   // input line format
   // AAAA: XX DD DD BB BB CC CC
+  ShotBatch batch( 1 );
   while ( fgets( line, 128, in ) != NULL ) {
-    unsigned char buf[8];
+    unsigned char buf[1][8];
     memset( buf, 0, 8 );
     char * ch = line+6;
     for ( int k=0; k<8; ++k ) {
       int c1 = hex( ch[0] );
       int c2 = hex( ch[1] );
-      buf[k] = 16 * c1 + c2;
+      buf[0][k] = 16 * c1 + c2;
       ch += 3;
     }
-    unsigned int id = DATA_2_DISTANCE( buf );
-    unsigned int ib = DATA_2_COMPASS( buf );
-    unsigned int ic = DATA_2_CLINO( buf );
-    unsigned int ir = DATA_2_ROLL( buf );
-    fprintf(out, "0x%05x 0x%04x 0x%04x 0x%02x ", id, ib, ic, ir );
-    fprintf(out, "%6.2f %6.2f %6.2f %6.2f ",
-              DISTANCE_METERS( id ),
-              COMPASS_DEGREES( ib ),
-              CLINO_DEGREES( ic ),
-              ROLL_DEGREES( ir )
-    );
-    fprintf(out, "%s", line );
+    batch.Clear();
+    decodeBatchX1( buf, 1, batch );
+    convert( out, batch, 0, line );
     // fprintf(out, "\n" );
   }
 /*
@@ -22,57 +22,27 @@
 
 #include "defaults.h"
 #include "Serial.h"
+#include "DeviceMemoryImage.h"
 
 
-/** write to memory 4 bytes at a time the eight bytes at given address
- * @param serial serial line (communication channel)
- * @param addr address (should be multiple of 4)
- * @param byte eight-byte array to write at (addr,addr+4)
+/** read the data queue head/tail (4 bytes at 0xC020)
+ * @param image device memory image
  *
- * @return true if memory has been changed, false otherwise
- * @note the previous content of the memory is written in byte[]
+ * @return true if the queue bounds have been read
  */
 bool
-read_queue( Serial * serial )
+read_queue( DeviceMemoryImage & image )
 {
   unsigned long addr = 0xC020;
-  unsigned long reply_addr;
-  unsigned char buf[8];
-  ssize_t nr;
+  unsigned char buf[4];
 
-  {
-    buf[0] = 0x38;
-    buf[1] = (unsigned char)( addr & 0xff );
-    buf[2] = (unsigned char)( (addr>>8) & 0xff );
-    nr = serial->Write( buf, 3 ); // read data
-    nr = serial->Read( buf, 8 );
-    if ( nr > 0 ) {
-      if ( buf[0] != 0x38 ) {
-        fprintf(stderr, 
-                "ERROR: read() wrong reply packet at addr %04lx\n", addr);
-        return false;
-      }
-      reply_addr = ((unsigned long)(buf[2]))<<8 | buf[1];
-      if ( reply_addr != addr ) {
-        fprintf(stderr,
-                "ERROR: read() wrong reply addr %04lx at addr %04lx\n",
-                reply_addr, addr);
-        return false;
-      }
-      // for (i=3; i<7; ++i) fprintf(stderr, "%02x ", buf[i] );
-      // for (i=0; i<4; ++i) byte[4*k+i] = buf[3+i];
-      uint16_t head = (uint16_t)(buf[3]) | ( ((uint16_t)(buf[4])) << 8 );
-      uint16_t tail = (uint16_t)(buf[5]) | ( ((uint16_t)(buf[6])) << 8 );
-      printf("Head %04x Tail %04x\n", head, tail );
-    } else if ( nr < 0 ) {
-      fprintf(stderr, "ERROR: read() error\n");
-      return false;
-    } else {
-      fprintf(stderr, "ERROR: read() read returns 0 bytes\n");
-      return false;
-    }
-    addr += 4;
+  if ( image.Read( addr, addr+4, buf ) != 1 ) {
+    fprintf(stderr, "ERROR: read() no reply at addr %04lx\n", addr);
+    return false;
   }
+  uint16_t head = (uint16_t)(buf[0]) | ( ((uint16_t)(buf[1])) << 8 );
+  uint16_t tail = (uint16_t)(buf[2]) | ( ((uint16_t)(buf[3])) << 8 );
+  printf("Head %04x Tail %04x\n", head, tail );
   return true;
 }
 
@@ -83,6 +53,8 @@ void usage()
     fprintf(stderr, "Usage: read_queue [-d device] [-h]\n");
     fprintf(stderr, "Options:\n");
     fprintf(stderr, "  -d device serial device [%s]\n", DEFAULT_DEVICE );
+    fprintf(stderr, "  -C dir    cache the device memory in dir/<device>%s\n", DMI_FILE_EXT );
+    fprintf(stderr, "  -a sec    max age of the cached memory [%d]\n", DMI_DEFAULT_AGE );
     // fprintf(stderr, "  -v        verbose\n");
     fprintf(stderr, "  -h        help\n");
   }
@@ -94,12 +66,20 @@ int main( int argc, char ** argv )
 {
   // bool verbose = false;
   const char * device = DEFAULT_DEVICE;
+  const char * cache_dir = NULL;
+  unsigned long max_age = DMI_DEFAULT_AGE;
     
   int ac = 1;
   while ( ac < argc ) {
     if ( strncmp(argv[ac], "-d", 2 ) == 0 ) {
       device = argv[++ac];
       ++ac;
+    } else if ( strncmp(argv[ac], "-C", 2 ) == 0 ) {
+      cache_dir = argv[++ac];
+      ++ac;
+    } else if ( strncmp(argv[ac], "-a", 2 ) == 0 ) {
+      max_age = atol( argv[++ac] );
+      ++ac;
     // } else if ( strncmp(argv[ac], "-v", 2 ) == 0 ) {
     //   verbose = true;
     //   ++ ac;
@@ -117,7 +97,11 @@ int main( int argc, char ** argv )
     return 1;
   }
 
-  if ( read_queue( &serial ) ) {
+  DeviceMemoryImage image( &serial );
+  image.SetMaxAge( max_age );
+  image.OpenFor( cache_dir, device );
+
+  if ( read_queue( image ) ) {
   }
   serial.Close();
   return 0;
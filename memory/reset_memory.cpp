@@ -20,6 +20,7 @@
 
 #include "defaults.h"
 #include "Serial.h"
+#include "DeviceMemoryImage.h"
 
 /** DistoX memory block types
  - FREE: 00 ...
@@ -55,180 +56,102 @@ unsigned char ext_eeprom[40] = {
 };
 
 
-/** write to memory 4 bytes at a time the eight bytes at given address
- * @param serial serial line (communication channel)
- * @param addr address (should be multiple of 4)
- * @param byte eight-byte array to write at (addr,addr+4)
+/** write eight-byte blocks to memory, only the words that differ
+ * @param image device memory image
+ * @param addr address (should be multiple of 8)
+ * @param byte eight-byte array(s) to write at (addr,addr+8)
+ * @param cnt  number of blocks
+ * @param repeat whether the same eight bytes are written to every block
+ * @return true if the memory has the given content
+ *
+ * The blocks are read in one pipelined burst, then the words that differ are
+ * written in one pipelined batch.
  */
-void
-write_memory( Serial * serial, unsigned long addr, unsigned char * byte )
+bool
+write_memory( DeviceMemoryImage & image, unsigned long addr, const unsigned char * byte, int cnt, bool repeat )
 {
-  unsigned long reply_addr;
-  unsigned char buf[8];
-  int i, k;
-  ssize_t nr;
   addr = addr - (addr % 8);
-  for (k=0; k<2; ++k) {
-    buf[0] = 0x38;
-    buf[1] = (unsigned char)( addr & 0xff );
-    buf[2] = (unsigned char)( (addr>>8) & 0xff );
-    nr = serial->Write( buf, 3 ); // read data
-    nr = serial->Read( buf, 8 );
-    if ( nr > 0 ) {
-      if ( buf[0] != 0x38 ) {
-        fprintf(stderr, 
-                "ERROR: read wrong reply packet at addr %04lx cnt %d\n", 
-                addr, k);
-        break;
-      }
-      reply_addr = ((unsigned long)(buf[2]))<<8 | buf[1];
-      if ( reply_addr != addr ) {
-        fprintf(stderr,
-                "ERROR: read wrong reply addr %04lx at addr %04lx cnt %d\n",
-                reply_addr, addr, k);
-        break;
-      }
-      for (i=3; i<7; ++i) fprintf(stderr, "%02x ", buf[i] );
-    } else if ( nr < 0 ) {
-      fprintf(stderr, "ERROR: serial read error\n");
-      break;
-    } else {
-      fprintf(stderr, "ERROR: read returns 0 bytes\n");
-      break;
-    }
+  unsigned long end = addr + 8 * cnt;
+  unsigned char * want = new unsigned char[ 8 * cnt ];
+  for ( int c = 0; c < cnt; ++c ) {
+    memcpy( want + 8*c, repeat ? byte : byte + 8*c, 8 );
+  }
 
-    buf[0] = 0x39;
-    buf[1] = (unsigned char)( addr & 0xff );
-    buf[2] = (unsigned char)( (addr>>8) & 0xff );
-    buf[3] = byte[0+k*4];
-    buf[4] = byte[1+k*4];
-    buf[5] = byte[2+k*4];
-    buf[6] = byte[3+k*4];
-
-    nr = serial->Write( buf, 7 ); // write data
-    nr = serial->Read( buf, 8 );
-    if ( nr > 0 ) {
-      if ( buf[0] != 0x38 ) {
-        fprintf(stderr, 
-                "write() wrong reply packet at addr %04lx cnt %d\n", 
-                addr, k);
-        break;
-      }
-      reply_addr = ((unsigned long)(buf[2]))<<8 | buf[1];
-      if ( reply_addr != addr ) {
-        fprintf(stderr,
-                "write() wrong reply addr %04lx at addr %04lx cnt %d\n",
-                reply_addr, addr, k);
-        break;
-      }
-      for (i=3; i<7; ++i) fprintf(stderr, "%02x ", buf[i] );
-    } else if ( nr < 0 ) {
-      perror("write_memory() error **** ");
-      break;
-    } else {
-      fprintf(stderr, "write_memory() read returns 0 bytes\n");
-      break;
-    }
-    addr += 4;
+  unsigned int nr = image.Read( addr, end );
+  unsigned int nw = image.Update( addr, end, want );
+  unsigned int left = image.Flush( addr, end ); // only the requested range
+  for ( unsigned long a = addr; a < end; a += 8 ) {
+    const unsigned char * w = image.Word( a );
+    fprintf(stderr, "%04lx: ", a );
+    for ( int i=0; i<8; ++i ) fprintf(stderr, "%02x ", w[i] );
+    fprintf(stderr, "\n");
   }
-  fprintf(stderr, "\n");
+  fprintf(stderr, "words %d: read %u, written %u, failed %u\n", 2*cnt, nr, nw, left );
+  delete[] want;
+  return left == 0;
 }
 
 
 /** turn memory hot/used/calib at the given address
- * @param serial serial line (communication channel)
- * @param addr address (should be multiple of 4)
+ * @param image device memory image
+ * @param addr address (should be multiple of 8)
+ * @param cnt   number of blocks
  * @param mode  whether to turn the memory hot or used or calib
+ * @return true if the memory has been changed
+ *
+ * In calib mode the blocks are turned in pairs, 02 ... and 03 ...
  */
-void
-turn_memory( Serial * serial, unsigned long addr, int mode )
+bool
+turn_memory( DeviceMemoryImage & image, unsigned long addr, int cnt, int mode )
 {
-  unsigned long reply_addr;
-  unsigned char buf[8];
-  int i;
-  ssize_t nr;
   addr = addr - (addr % 8);
-  {
-    buf[0] = 0x38;
-    buf[1] = (unsigned char)( addr & 0xff );
-    buf[2] = (unsigned char)( (addr>>8) & 0xff );
-    nr = serial->Write( buf, 3 ); // read data
-    nr = serial->Read( buf, 8 );
-    if ( nr > 0 ) {
-      if ( buf[0] != 0x38 ) {
-        fprintf(stderr, 
-                "ERROR: read wrong reply packet at addr %04lx \n", 
-                addr);
-        return;
-      }
-      reply_addr = ((unsigned long)(buf[2]))<<8 | buf[1];
-      if ( reply_addr != addr ) {
-        fprintf(stderr,
-                "ERROR: read wrong reply addr %04lx at addr %04lx \n",
-                reply_addr, addr);
-        return;
-      }
-      fprintf(stderr, "%04lx ", addr );
-      if ( buf[3] == 0 || ( buf[3] & 0x80 ) != 0 ) fprintf(stderr, "*** ");
-      for (i=3; i<7; ++i) fprintf(stderr, "%02x ", buf[i] );
-    } else if ( nr < 0 ) {
-      fprintf(stderr, "ERROR: serial read error\n");
-      return;
-    } else {
-      fprintf(stderr, "ERROR: read returns 0 bytes\n");
-      return;
+  unsigned long end = addr + 8 * cnt;
+  unsigned char * data = new unsigned char[ 8 * cnt ];
+  unsigned char * ok   = new unsigned char[ 2 * cnt ];
+  image.Read( addr, end, data, ok );
+
+  unsigned int nw = 0;
+  for ( int c = 0; c < cnt; ++c ) {
+    unsigned char * buf = data + 8*c;
+    unsigned long a = addr + 8*c;
+    if ( ! ok[2*c] ) {
+      fprintf(stderr, "ERROR: no reply at addr %04lx \n", a );
+      continue;
     }
-
-    buf[0] = 0x39;
-    buf[1] = (unsigned char)( addr & 0xff );
-    buf[2] = (unsigned char)( (addr>>8) & 0xff );
-
-    if ( mode == 1 ) { // HOT: turn on bit 7 of the first bye
-      buf[3] |= 0x80;
-      if ( buf[3] < 0x81 || buf[3] > 0x83 ) buf[3] = 0x81;
-    } else if ( mode == 2 ) {     // USED: turn off bit 7 of the first byte
-      // buf[3] &= 0x7f;
-      // if ( buf[3] == 0 ) buf[3] = 0x01;
-      buf[3] = 0x01;
-    } else if ( mode == 3 ) {
-      buf[3] = 0x02;
-    } else if ( mode == 4 ) {
-      buf[3] = 0x03;
-    }
-    // buf[4] ... buf[6] unchanged
-
-    nr = serial->Write( buf, 7 ); // write data
-    nr = serial->Read( buf, 8 );
-    if ( nr > 0 ) {
-      if ( buf[0] != 0x38 ) {
-        fprintf(stderr, 
-                "write() wrong reply packet at addr %04lx \n", 
-                addr);
-        return;
-      }
-      reply_addr = ((unsigned long)(buf[2]))<<8 | buf[1];
-      if ( reply_addr != addr ) {
-        fprintf(stderr,
-                "write() wrong reply addr %04lx at addr %04lx \n",
-                reply_addr, addr);
-        return;
-      }
-      fprintf(stderr, " --> ");
-      for (i=3; i<7; ++i) fprintf(stderr, "%02x ", buf[i] );
-    } else if ( nr < 0 ) {
-      perror("turn_memory() error **** ");
-      return;
-    } else {
-      fprintf(stderr, "turn_memory() read returns 0 bytes\n");
-      return;
+    fprintf(stderr, "%04lx ", a );
+    if ( buf[0] == 0 || ( buf[0] & 0x80 ) != 0 ) fprintf(stderr, "*** ");
+    for (int i=0; i<4; ++i) fprintf(stderr, "%02x ", buf[i] );
+
+    int m = ( mode == 3 && ( c % 2 ) == 1 )? 4 : mode;
+    if ( m == 1 ) { // HOT: turn on bit 7 of the first bye
+      buf[0] |= 0x80;
+      if ( buf[0] < 0x81 || buf[0] > 0x83 ) buf[0] = 0x81;
+    } else if ( m == 2 ) {     // USED: turn off bit 7 of the first byte
+      // buf[0] &= 0x7f;
+      // if ( buf[0] == 0 ) buf[0] = 0x01;
+      buf[0] = 0x01;
+    } else if ( m == 3 ) {
+      buf[0] = 0x02;
+    } else if ( m == 4 ) {
+      buf[0] = 0x03;
     }
+    // buf[1] ... buf[3] unchanged
+    nw += image.Update( a, a+4, buf );
+
+    fprintf(stderr, " --> ");
+    for (int i=0; i<4; ++i) fprintf(stderr, "%02x ", buf[i] );
+    fprintf(stderr, "\n");
   }
-  fprintf(stderr, "\n");
+  unsigned int left = image.Flush( addr, end ); // only the requested range
+  fprintf(stderr, "blocks %d: written %u, failed %u\n", cnt, nw, left );
+  delete[] data;
+  delete[] ok;
+  return left == 0;
 }
 
 void usage()
 {
-  fprintf(stderr, "Usage: reset_memory [-d device] addr [end_addr] byte\n");
+  fprintf(stderr, "Usage: reset_memory [-d device] [-C dir] addr [end_addr] byte\n");
   fprintf(stderr, "where\n");
   fprintf(stderr, "  the device is usually %s\n", DEFAULT_DEVICE );
   fprintf(stderr, "  addr is 0x0000 - 0x8000 for external EEPROM\n");
@@ -243,6 +166,8 @@ void usage()
   fprintf(stderr, "                   b7 00 ff ff ff ff ff ff ff\n");
   fprintf(stderr, "     - ext_eeprom  first five bytes of external eeprom\n");
   fprintf(stderr, " The end_address is used only with byte \"clear\", \"hot\" and \"used\" \n");
+  fprintf(stderr, " -C dir caches the device memory in dir/<device>%s\n", DMI_FILE_EXT );
+  fprintf(stderr, " Only the words that differ are written\n");
 }
 
 int
@@ -282,9 +207,17 @@ int main( int argc, char ** argv )
     return 0;
   }
 
-  if ( strcmp(argv[ac], "-d" ) == 0 ) {
-    device = argv[++ac];
-    ++ac;
+  const char * cache_dir = NULL;
+  while ( ac < argc - 1 && argv[ac][0] == '-' ) {
+    if ( strcmp(argv[ac], "-d" ) == 0 ) {
+      device = argv[++ac];
+      ++ac;
+    } else if ( strcmp(argv[ac], "-C" ) == 0 ) {
+      cache_dir = argv[++ac];
+      ++ac;
+    } else {
+      break;
+    }
   }
   if ( argc <= ac ) {
     usage();
@@ -375,23 +308,14 @@ int main( int argc, char ** argv )
     return 1;
   }
 
+  DeviceMemoryImage image( &serial );
+  image.OpenFor( cache_dir, device );
+  image.SetMaxAge( 0 ); // compare with the current content of the device
+
   if ( mode == 0 ) {
-    for ( int c = 0; c<cnt; ++c ) {
-      write_memory( &serial, addr, byte );
-      addr += 8;
-      if ( byte != clear_block ) { // eeprom
-        byte += 8;
-      }
-    }
+    write_memory( image, addr, byte, cnt, byte == clear_block );
   } else { // mode == 1 (hot) or 2 (used) or 3 (calib)
-    for ( int c = 0; c<cnt; ++c ) {
-      turn_memory( &serial, addr, mode );
-      addr += 8;
-      if ( mode == 3 ) {
-        turn_memory( &serial, addr, 4 );
-        addr += 8;
-      }
-    }
+    turn_memory( image, addr, ( mode == 3 )? 2*cnt : cnt, mode );
   } 
 
   serial.Close();
@@ -20,94 +20,37 @@
 
 #include "defaults.h"
 #include "Serial.h"
+#include "DeviceMemoryImage.h"
 
 
-/** write to memory 4 bytes at a time the eight bytes at given address
- * @param serial serial line (communication channel)
- * @param addr address (should be multiple of 4)
- * @param byte eight-byte array to write at (addr,addr+4)
+/** swap the hot bit on of the data at given address
+ * @param image device memory image
+ * @param addr address (should be multiple of 8)
+ * @param word current content of the first four bytes at addr
  * @return true if memory has been changed, false otherwise
+ * @note the change is written to the device by the image Flush() of the range
  */
 bool
-swap_hotbit( Serial * serial, unsigned long addr )
+swap_hotbit( DeviceMemoryImage & image, unsigned long addr, const unsigned char * word )
 {
-  unsigned long reply_addr;
-  unsigned char buf[8];
-  int i;
-  ssize_t nr;
-  addr = addr - (addr % 8);
-  {
-    buf[0] = 0x38;
-    buf[1] = (unsigned char)( addr & 0xff );
-    buf[2] = (unsigned char)( (addr>>8) & 0xff );
-    nr = serial->Write( buf, 3 ); // read data
-    nr = serial->Read( buf, 8 );
-    if ( nr > 0 ) {
-      if ( buf[0] != 0x38 ) {
-        fprintf(stderr, 
-                "read() wrong reply packet at addr %04lx\n", addr);
-        return false;
-      }
-      reply_addr = ((unsigned long)(buf[2]))<<8 | buf[1];
-      if ( reply_addr != addr ) {
-        fprintf(stderr,
-                "read() wrong reply addr %04lx at addr %04lx\n",
-                reply_addr, addr);
-        return false;
-      }
-      // for (i=3; i<7; ++i) fprintf(stderr, "%02x ", buf[i] );
-    } else if ( nr < 0 ) {
-      perror("read() error **** ");
-      return false;
-    } else {
-      fprintf(stderr, "read() read returns 0 bytes\n");
-      return false;
-    }
-
-    buf[0] = 0x39;
-    // buf[1] = (unsigned char)( addr & 0xff );
-    // buf[2] = (unsigned char)( (addr>>8) & 0xff );
-    if ( buf[3] == 0x00 ) {
-      fprintf(stderr, "WARNING: refusing to change address 0x%04lx\n", addr );
-      return false;
-    }  
-    buf[3] |= 0x80; // RESET HOT BIT
-
-    nr = serial->Write( buf, 7 ); // write data
-    nr = serial->Read( buf, 8 );
-    if ( nr > 0 ) {
-      if ( buf[0] != 0x38 ) {
-        fprintf(stderr, 
-                "ERROR: write() wrong reply packet at addr %04lx\n", addr);
-        return false;
-      }
-      reply_addr = ((unsigned long)(buf[2]))<<8 | buf[1];
-      if ( reply_addr != addr ) {
-        fprintf(stderr,
-                "ERROR: write() wrong reply addr %04lx at addr %04lx\n",
-                reply_addr, addr);
-        return false;
-      }
-      fprintf(stdout, "%04lx: ", addr );
-      for (i=3; i<7; ++i) fprintf(stdout, "%02x ", buf[i] );
-      fprintf(stdout, "\n");
-    } else if ( nr < 0 ) {
-      fprintf(stderr, "ERROR: write() error");
-      return false;
-    } else {
-      fprintf(stderr, "WARNING: write() read returns 0 bytes\n");
-      return false;
-    }
-  }
+  unsigned char buf[4];
+  memcpy( buf, word, 4 );
+  if ( buf[0] == 0x00 ) {
+    fprintf(stderr, "WARNING: refusing to change address 0x%04lx\n", addr );
+    return false;
+  }  
+  buf[0] |= 0x80; // RESET HOT BIT
+  image.Write( addr, buf );
   return true;
 }
 
 void usage()
 {
-  fprintf(stderr, "Usage: tlx_set_memory [-d device] start_addr end_addr\n");
+  fprintf(stderr, "Usage: tlx_set_memory [-d device] [-C dir] start_addr end_addr\n");
   fprintf(stderr, "where\n");
   fprintf(stderr, "  the device is usually %s\n", DEFAULT_DEVICE );
   fprintf(stderr, "  addr is 0x0000 - 0x8000 for external EEPROM\n");
+  fprintf(stderr, "  -C dir caches the device memory in dir/<device>%s\n", DMI_FILE_EXT );
 }
  
  
@@ -123,9 +66,17 @@ int main( int argc, char ** argv )
     return 0;
   }
 
-  if ( strcmp(argv[ac], "-d" ) == 0 ) {
-    device = argv[++ac];
-    ++ac;
+  const char * cache_dir = NULL;
+  while ( ac < argc - 1 && argv[ac][0] == '-' ) {
+    if ( strcmp(argv[ac], "-d" ) == 0 ) {
+      device = argv[++ac];
+      ++ac;
+    } else if ( strcmp(argv[ac], "-C" ) == 0 ) {
+      cache_dir = argv[++ac];
+      ++ac;
+    } else {
+      break;
+    }
   }
   if ( argc <= ac ) {
     usage();
@@ -162,10 +113,33 @@ int main( int argc, char ** argv )
     return 1;
   }
 
-  while ( addr < end ) {
-    if ( ! swap_hotbit( &serial, addr ) ) break;
-    addr += 8;
+  DeviceMemoryImage image( &serial );
+  image.OpenFor( cache_dir, device );
+
+  // the memory is read in one pipelined burst, then the changed words are written back in one
+  image.SetMaxAge( 0 );
+  unsigned int n = ( end - addr + 3 ) / 4;
+  unsigned char * data = new unsigned char[ 4*n ];
+  unsigned char * ok   = new unsigned char[ n ];
+  image.Read( addr, end, data, ok );
+  unsigned long a = addr;
+  for ( unsigned int k = 0; a < end; a += 8, k += 2 ) {
+    if ( ! ok[k] ) {
+      fprintf(stderr, "read() no reply at addr %04lx\n", a );
+      break;
+    }
+    if ( ! swap_hotbit( image, a, data + 4*k ) ) break;
+  }
+  if ( image.Flush( addr, end ) > 0 ) {
+    fprintf(stderr, "ERROR: failed to write the memory\n");
+  } else {
+    for ( ; addr < a; addr += 8 ) {
+      const unsigned char * w = image.Word( addr );
+      fprintf(stdout, "%04lx: %02x %02x %02x %02x \n", addr, w[0], w[1], w[2], w[3] );
+    }
   }
+  delete[] data;
+  delete[] ok;
 
   serial.Close();
   return 0;